@@ -0,0 +1,403 @@
+//
+// Copyright (C) 2015-2016 Zireael (zireael dot nk at gmail dot com)
+//  Distributed under the Boost Software License, Version 1.0.
+//       (See accompanying file LICENSE.md or copy at
+//           http://www.boost.org/LICENSE_1_0.txt)
+//
+
+/*
+  Times every stage of encoding & decoding on synthetic containers and payloads
+  and writes the results as JSON, see README.md. Stages are timed through
+  PNGFile's stage events, so what's measured is exactly what production code runs.
+*/
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <png.h>
+#include "pngwrapper.h"
+#include "helpers.h"
+#include "pngstegoversion.h"
+
+using namespace PNGStego;
+
+typedef std::chrono::steady_clock Clock;
+
+/** What a container is encoded as */
+enum class ContainerFormat {
+	Gray,
+	RGB,
+	RGBA,
+	Palette
+};
+
+struct Options {
+	std::vector<ContainerFormat> formats;
+	std::vector<double> megapixels;
+	std::vector<uint64_t> payloadSizes;
+	std::vector<bool> compressible; // payload kinds
+	size_t repetitions;
+	std::string output;
+};
+
+/** Every sample of one stage in one case */
+struct Series {
+	std::string stage, format, payload;
+	double megapixels;
+	uint64_t payloadBytes;
+	uint64_t inputBytes, outputBytes; // of the last sample
+	std::vector<uint64_t> samples;   // nanoseconds
+};
+
+const char* formatName(ContainerFormat format) {
+	switch (format) {
+	case ContainerFormat::Gray:    return "gray";
+	case ContainerFormat::RGB:     return "rgb";
+	case ContainerFormat::RGBA:    return "rgba";
+	case ContainerFormat::Palette: return "palette";
+	}
+	return "unknown";
+}
+
+std::vector<std::string> split(const std::string &list) {
+	std::vector<std::string> items;
+	std::stringstream stream(list);
+	std::string item;
+	while (std::getline(stream, item, ','))
+		if (!item.empty())
+			items.push_back(item);
+	return items;
+}
+
+/** Parses sizes like "64", "1K", "16M" into bytes */
+uint64_t parseSize(const std::string &size) {
+	char *end = nullptr;
+	uint64_t value = std::strtoull(size.c_str(), &end, 10);
+	switch (*end) {
+	case 'K': case 'k': return value << 10;
+	case 'M': case 'm': return value << 20;
+	case 'G': case 'g': return value << 30;
+	case '\0':          return value;
+	}
+	throw std::invalid_argument("Invalid size: " + size);
+}
+
+std::string sizeName(uint64_t bytes) {
+	if (bytes >= (1 << 20) && bytes % (1 << 20) == 0)
+		return std::to_string(bytes >> 20) + "MiB";
+	if (bytes >= (1 << 10) && bytes % (1 << 10) == 0)
+		return std::to_string(bytes >> 10) + "KiB";
+	return std::to_string(bytes) + "B";
+}
+
+void writeToVector(png_structp pngPointer, png_bytep data, png_size_t length) {
+	std::vector<uint8_t> *buffer = reinterpret_cast<std::vector<uint8_t>*>(png_get_io_ptr(pngPointer));
+	buffer->insert(buffer->end(), data, data + length);
+}
+
+/**
+ ** Encodes a photo-like image: smooth gradients with some noise on top,
+ ** so it compresses about as well as a real one would.
+ **/
+std::vector<uint8_t> syntheticPNG(ContainerFormat format, uint32_t width, uint32_t height, uint32_t seed) {
+	const int colorType = format == ContainerFormat::Gray    ? PNG_COLOR_TYPE_GRAY :
+	                      format == ContainerFormat::RGBA    ? PNG_COLOR_TYPE_RGB_ALPHA :
+	                      format == ContainerFormat::Palette ? PNG_COLOR_TYPE_PALETTE : PNG_COLOR_TYPE_RGB;
+	const int channels = format == ContainerFormat::RGB ? 3 : format == ContainerFormat::RGBA ? 4 : 1;
+
+	png_structp pngPointer = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+	png_infop infoPointer = pngPointer ? png_create_info_struct(pngPointer) : nullptr;
+	if (!infoPointer) {
+		png_destroy_write_struct(&pngPointer, nullptr);
+		throw std::runtime_error("Cannot allocate memory");
+	}
+	// Everything that needs destroying is created before setjmp(), longjmp() would skip it otherwise
+	std::vector<uint8_t> encoded;
+	std::vector<uint8_t> row(static_cast<size_t>(width) * channels);
+	std::mt19937 gen(seed);
+	std::uniform_int_distribution<int> noise(-6, 6);
+	if (setjmp(png_jmpbuf(pngPointer))) {
+		png_destroy_write_struct(&pngPointer, &infoPointer);
+		throw std::runtime_error("Cannot encode a synthetic image");
+	}
+	png_set_write_fn(pngPointer, &encoded, writeToVector, nullptr);
+	png_set_IHDR(pngPointer, infoPointer, width, height, 8, colorType,
+	             PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+	if (format == ContainerFormat::Palette) {
+		png_color palette[256];
+		for (int i = 0; i < 256; ++i) {
+			palette[i].red = static_cast<png_byte>(i);
+			palette[i].green = static_cast<png_byte>(255 - i);
+			palette[i].blue = static_cast<png_byte>(i * 7);
+		}
+		png_set_PLTE(pngPointer, infoPointer, palette, 256);
+	}
+	png_write_info(pngPointer, infoPointer);
+
+	for (uint32_t y = 0; y < height; ++y) {
+		for (uint32_t x = 0; x < width; ++x) {
+			for (int c = 0; c < channels; ++c) {
+				int base = static_cast<int>((x * (c + 1) * 255ULL) / width + (y * 255ULL) / height) / 2;
+				row[static_cast<size_t>(x) * channels + c] = static_cast<uint8_t>(std::min(255, std::max(0, base + noise(gen))));
+			}
+			if (format == ContainerFormat::RGBA)
+				row[static_cast<size_t>(x) * channels + 3] = 255;
+		}
+		png_write_row(pngPointer, row.data());
+	}
+	png_write_end(pngPointer, infoPointer);
+	png_destroy_write_struct(&pngPointer, &infoPointer);
+	return encoded;
+}
+
+/** Either random bytes or text made of a small vocabulary, which bzip2 squeezes several times */
+std::vector<uint8_t> syntheticPayload(uint64_t size, bool compressible, uint32_t seed) {
+	std::mt19937 gen(seed);
+	std::vector<uint8_t> payload;
+	payload.reserve(static_cast<size_t>(size));
+	if (!compressible) {
+		std::uniform_int_distribution<int> byte(0, 255);
+		while (payload.size() < size)
+			payload.push_back(static_cast<uint8_t>(byte(gen)));
+		return payload;
+	}
+	static const char *words[] = { "steganography ", "container ", "payload ", "pixel ", "the ", "of ", "least ",
+	                               "significant ", "bit ", "image ", "key ", "salt ", "and ", "encrypted ", "data\n" };
+	std::uniform_int_distribution<size_t> word(0, sizeof(words) / sizeof(words[0]) - 1);
+	while (payload.size() < size) {
+		const char *next = words[word(gen)];
+		payload.insert(payload.end(), next, next + std::strlen(next));
+	}
+	payload.resize(static_cast<size_t>(size));
+	return payload;
+}
+
+/** Returns the given percentile of sorted samples, linearly interpolated */
+uint64_t percentile(const std::vector<uint64_t> &sorted, double p) {
+	if (sorted.empty())
+		return 0;
+	double rank = p / 100 * (sorted.size() - 1);
+	size_t lower = static_cast<size_t>(rank);
+	size_t upper = std::min(lower + 1, sorted.size() - 1);
+	return static_cast<uint64_t>(sorted[lower] + (rank - lower) * (static_cast<double>(sorted[upper]) - sorted[lower]));
+}
+
+std::string escape(const std::string &value) {
+	std::string escaped;
+	for (char c : value) {
+		if (c == '"' || c == '\\')
+			escaped += '\\';
+		escaped += c;
+	}
+	return escaped;
+}
+
+void writeJSON(std::ostream &out, const Options &options, const std::vector<Series> &results,
+               const std::vector<std::string> &skipped) {
+	out << "{\n  \"version\": \"" << version.string << "\",\n"
+	    << "  \"timestamp\": " << std::time(nullptr) << ",\n"
+	    << "  \"repetitions\": " << options.repetitions << ",\n"
+	    << "  \"unit\": \"ns\",\n"
+	    << "  \"results\": [";
+	for (size_t k = 0; k < results.size(); ++k) {
+		const Series &series = results[k];
+		std::vector<uint64_t> sorted = series.samples;
+		std::sort(sorted.begin(), sorted.end());
+		double mean = 0;
+		for (uint64_t sample : sorted)
+			mean += static_cast<double>(sample) / sorted.size();
+		std::ostringstream id;
+		id << series.stage << "/" << series.format << "/" << series.megapixels << "MP";
+		if (series.payloadBytes)
+			id << "/" << series.payload << "/" << sizeName(series.payloadBytes);
+
+		out << (k ? "," : "") << "\n    {\"id\": \"" << escape(id.str()) << "\", \"stage\": \"" << series.stage
+		    << "\", \"format\": \"" << series.format << "\", \"megapixels\": " << series.megapixels
+		    << ", \"payload\": \"" << series.payload << "\", \"payload_bytes\": " << series.payloadBytes
+		    << ",\n     \"input_bytes\": " << series.inputBytes << ", \"output_bytes\": " << series.outputBytes
+		    << ", \"min\": " << sorted.front() << ", \"median\": " << percentile(sorted, 50)
+		    << ", \"p90\": " << percentile(sorted, 90) << ", \"p99\": " << percentile(sorted, 99)
+		    << ", \"max\": " << sorted.back() << ", \"mean\": " << static_cast<uint64_t>(mean)
+		    << ",\n     \"samples\": [";
+		for (size_t s = 0; s < series.samples.size(); ++s)
+			out << (s ? ", " : "") << series.samples[s];
+		out << "]}";
+	}
+	out << "\n  ],\n  \"skipped\": [";
+	for (size_t k = 0; k < skipped.size(); ++k)
+		out << (k ? "," : "") << "\n    \"" << escape(skipped[k]) << "\"";
+	out << "\n  ]\n}\n";
+}
+
+Options parseOptions(int argc, char **argv) {
+	// Small enough to finish in a few minutes, --full covers 1-100 MP and payloads up to 64 MiB
+	Options options;
+	options.formats = { ContainerFormat::Gray, ContainerFormat::RGB, ContainerFormat::RGBA, ContainerFormat::Palette };
+	options.megapixels = { 1 };
+	options.payloadSizes = { 1 << 10, 16 << 10 };
+	options.compressible = { true, false };
+	options.repetitions = 3;
+	options.output = "bench-results.json";
+
+	for (int i = 1; i < argc; ++i) {
+		std::string option = argv[i];
+		std::string value = option.substr(option.find('=') + 1);
+		if (option == "--full") {
+			options.megapixels = { 1, 10, 100 };
+			options.payloadSizes = { 1 << 10, 64 << 10, 1 << 20, 16 << 20, 64 << 20 };
+		}
+		else if (option.compare(0, 10, "--formats=") == 0) {
+			options.formats.clear();
+			for (const std::string &name : split(value)) {
+				if (name == "gray")         options.formats.push_back(ContainerFormat::Gray);
+				else if (name == "rgb")     options.formats.push_back(ContainerFormat::RGB);
+				else if (name == "rgba")    options.formats.push_back(ContainerFormat::RGBA);
+				else if (name == "palette") options.formats.push_back(ContainerFormat::Palette);
+				else throw std::invalid_argument("Unknown format: " + name);
+			}
+		}
+		else if (option.compare(0, 13, "--megapixels=") == 0) {
+			options.megapixels.clear();
+			for (const std::string &size : split(value))
+				options.megapixels.push_back(std::strtod(size.c_str(), nullptr));
+		}
+		else if (option.compare(0, 11, "--payloads=") == 0) {
+			options.payloadSizes.clear();
+			for (const std::string &size : split(value))
+				options.payloadSizes.push_back(parseSize(size));
+		}
+		else if (option.compare(0, 8, "--kinds=") == 0) {
+			options.compressible.clear();
+			for (const std::string &kind : split(value)) {
+				if (kind != "compressible" && kind != "random")
+					throw std::invalid_argument("Unknown payload kind: " + kind);
+				options.compressible.push_back(kind == "compressible");
+			}
+		}
+		else if (option.compare(0, 14, "--repetitions=") == 0)
+			options.repetitions = std::max<size_t>(std::strtoul(value.c_str(), nullptr, 10), 1);
+		else if (option.compare(0, 9, "--output=") == 0)
+			options.output = value;
+		else
+			throw std::invalid_argument("Unknown option: " + option);
+	}
+	return options;
+}
+
+int main(int argc, char **argv) {
+	Options options;
+	try {
+		options = parseOptions(argc, argv);
+	}
+	catch (const std::exception &e) {
+		std::cerr << e.what() << "\nUsage: " << baseFilename(argv[0]) << " [--full] [--formats=gray,rgb,rgba,palette]"
+		             " [--megapixels=1,10] [--payloads=1K,1M] [--kinds=compressible,random] [--repetitions=N] [--output=file]\n";
+		return 1;
+	}
+
+	const std::string key = "BenchmarkKeyNotReally";
+	std::vector<Series> results;
+	std::vector<std::string> skipped;
+	// Series are keyed by everything that identifies them, samples of all repetitions go into the same one
+	std::map<std::string, size_t> index;
+	auto record = [&](const std::string &stage, ContainerFormat format, double megapixels, bool compressible,
+	                  uint64_t payloadBytes, uint64_t nanoseconds, uint64_t inputBytes, uint64_t outputBytes) {
+		std::string payload = payloadBytes ? (compressible ? "compressible" : "random") : "";
+		std::ostringstream id;
+		id << stage << "/" << formatName(format) << "/" << megapixels << "/" << payload << "/" << payloadBytes;
+		auto found = index.find(id.str());
+		if (found == index.end()) {
+			Series series = { stage, formatName(format), payload, megapixels, payloadBytes, 0, 0, {} };
+			found = index.emplace(id.str(), results.size()).first;
+			results.push_back(series);
+		}
+		Series &series = results[found->second];
+		series.samples.push_back(nanoseconds);
+		series.inputBytes = inputBytes;
+		series.outputBytes = outputBytes;
+	};
+	auto elapsed = [](Clock::time_point start, Clock::time_point end) {
+		return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+	};
+
+	for (ContainerFormat format : options.formats) {
+		for (double megapixels : options.megapixels) {
+			uint64_t pixels = static_cast<uint64_t>(megapixels * 1000000);
+			uint32_t width = static_cast<uint32_t>(std::sqrt(pixels * 4.0 / 3.0));
+			uint32_t height = static_cast<uint32_t>(std::max<uint64_t>(pixels / std::max(width, 1U), 1));
+			std::cerr << "Generating a " << width << "x" << height << " " << formatName(format) << " container...\n";
+			const std::vector<uint8_t> container = syntheticPNG(format, std::max(width, 1U), height, width ^ height);
+
+			// Stages of the container alone, no payload
+			for (size_t rep = 0; rep < options.repetitions; ++rep) {
+				PNGFile image;
+				image.setEventFn([&](const StageEvent &event) {
+					if (event.finished)
+						record(stageName(event.stage), format, megapixels, false, 0,
+						       elapsed(event.start, event.end), event.inputBytes, event.outputBytes);
+				});
+				image.load(container);
+				Clock::time_point start = Clock::now();
+				uint64_t capacity = image.capacity(static_cast<uint32_t>(rep));
+				record("capacity", format, megapixels, false, 0, elapsed(start, Clock::now()), 0, capacity);
+				image.save();
+			}
+
+			for (bool compressible : options.compressible) {
+				for (uint64_t payloadSize : options.payloadSizes) {
+					std::ostringstream name;
+					name << formatName(format) << "/" << megapixels << "MP/" << (compressible ? "compressible" : "random")
+					     << "/" << sizeName(payloadSize);
+					std::cerr << "Running " << name.str() << "...\n";
+					const std::vector<uint8_t> payload = syntheticPayload(payloadSize, compressible, static_cast<uint32_t>(payloadSize));
+
+					for (size_t rep = 0; rep < options.repetitions; ++rep) {
+						PNGFile image;
+						image.load(container);
+						// Loading & saving have been measured already, the rest depends on the payload
+						image.setEventFn([&](const StageEvent &event) {
+							if (event.finished && event.stage != Stage::Load && event.stage != Stage::Save)
+								record(stageName(event.stage), format, megapixels, compressible, payloadSize,
+								       elapsed(event.start, event.end), event.inputBytes, event.outputBytes);
+						});
+						try {
+							image.encode(payload, "bin", key);
+						}
+						catch (const CapacityError&) {
+							skipped.push_back(name.str() + ": the payload doesn't fit");
+							std::cerr << "Skipped, the payload doesn't fit.\n";
+							break;
+						}
+						std::vector<uint8_t> extracted;
+						std::string extension;
+						image.decode(extracted, extension, key);
+						if (extracted != payload) {
+							std::cerr << "Extracted data doesn't match the payload!\n";
+							return 1;
+						}
+					}
+				}
+			}
+		}
+	}
+
+	std::ofstream file(options.output.c_str(), std::ios::out | std::ios::trunc);
+	if (!file) {
+		std::cerr << "Cannot open " << options.output << std::endl;
+		return 1;
+	}
+	writeJSON(file, options, results, skipped);
+	std::cerr << results.size() << " series written to " << options.output << std::endl;
+	return 0;
+}
\ No newline at end of file
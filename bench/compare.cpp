@@ -0,0 +1,252 @@
+//
+// Copyright (C) 2015-2016 Zireael (zireael dot nk at gmail dot com)
+//  Distributed under the Boost Software License, Version 1.0.
+//       (See accompanying file LICENSE.md or copy at
+//           http://www.boost.org/LICENSE_1_0.txt)
+//
+
+/*
+  Compares two files written by the benchmark suite, series by series, see README.md.
+  A series has regressed when its median got slower by more than the threshold
+  and by more than the samples' spread (median absolute deviation) can explain.
+  Exits with 1 if anything has regressed, 2 if the files can't be compared.
+*/
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/json_parser.hpp>
+
+struct Options {
+	std::string baseline, candidate;
+	double threshold; // percent
+	double noise;     // how many scaled MADs a change has to exceed
+	std::set<std::string> stages; // empty means all
+	bool quiet;
+};
+
+struct Series {
+	std::string stage;
+	std::vector<double> samples; // nanoseconds
+	double median, mad;
+};
+
+enum class Verdict {
+	Unchanged,
+	Noise,
+	Improved,
+	Regressed
+};
+
+double median(std::vector<double> values) {
+	if (values.empty())
+		return 0;
+	std::sort(values.begin(), values.end());
+	size_t middle = values.size() / 2;
+	return values.size() % 2 ? values[middle] : (values[middle - 1] + values[middle]) / 2;
+}
+
+/** Median absolute deviation, scaled to estimate the standard deviation of normally distributed samples */
+double scaledMAD(const std::vector<double> &values, double center) {
+	std::vector<double> deviations;
+	deviations.reserve(values.size());
+	for (double value : values)
+		deviations.push_back(std::fabs(value - center));
+	return 1.4826 * median(deviations);
+}
+
+/** Reads the series of a result file by their ids */
+std::map<std::string, Series> readResults(const std::string &filename) {
+	boost::property_tree::ptree tree;
+	try {
+		boost::property_tree::read_json(filename, tree);
+	}
+	catch (const boost::property_tree::json_parser_error &e) {
+		throw std::runtime_error(filename + ": " + e.message());
+	}
+	if (tree.get<std::string>("unit", "ns") != "ns")
+		throw std::runtime_error(filename + ": unknown unit");
+
+	// get_child() hands back the default it's given, it has to outlive the loops
+	const boost::property_tree::ptree none;
+	std::map<std::string, Series> results;
+	for (const auto &entry : tree.get_child("results", none)) {
+		const boost::property_tree::ptree &result = entry.second;
+		Series series;
+		std::string id = result.get<std::string>("id", "");
+		series.stage = result.get<std::string>("stage", "");
+		for (const auto &sample : result.get_child("samples", none))
+			series.samples.push_back(sample.second.get_value<double>());
+		// Files without raw samples still have the median
+		if (series.samples.empty())
+			series.samples.push_back(result.get<double>("median", 0));
+		if (id.empty() || series.stage.empty())
+			throw std::runtime_error(filename + ": a result without an id or a stage");
+		series.median = median(series.samples);
+		series.mad = scaledMAD(series.samples, series.median);
+		results[id] = series;
+	}
+	if (results.empty())
+		throw std::runtime_error(filename + ": no results");
+	return results;
+}
+
+Verdict judge(const Series &before, const Series &after, const Options &options, double &delta) {
+	delta = before.median > 0 ? (after.median - before.median) / before.median * 100 : 0;
+	double change = std::fabs(after.median - before.median);
+	double spread = std::sqrt(before.mad * before.mad + after.mad * after.mad);
+	if (change == 0)
+		return Verdict::Unchanged;
+	if (change <= options.noise * spread || std::fabs(delta) <= options.threshold)
+		return Verdict::Noise;
+	return delta > 0 ? Verdict::Regressed : Verdict::Improved;
+}
+
+/** Formats nanoseconds with a unit that keeps the number short */
+std::string duration(double nanoseconds) {
+	static const char *units[] = { "ns", "us", "ms", "s" };
+	size_t unit = 0;
+	while (nanoseconds >= 1000 && unit < 3) {
+		nanoseconds /= 1000;
+		++unit;
+	}
+	char buffer[32];
+	snprintf(buffer, sizeof(buffer), "%.1f %s", nanoseconds, units[unit]);
+	return buffer;
+}
+
+std::vector<std::string> split(const std::string &list) {
+	std::vector<std::string> items;
+	size_t start = 0;
+	while (start <= list.size()) {
+		size_t end = std::min(list.find(',', start), list.size());
+		if (end > start)
+			items.push_back(list.substr(start, end - start));
+		start = end + 1;
+	}
+	return items;
+}
+
+Options parseOptions(int argc, char **argv) {
+	Options options;
+	options.threshold = 5;
+	options.noise = 3;
+	options.quiet = false;
+
+	std::vector<std::string> files;
+	for (int i = 1; i < argc; ++i) {
+		std::string option = argv[i];
+		std::string value = option.substr(option.find('=') + 1);
+		if (option.compare(0, 12, "--threshold=") == 0)
+			options.threshold = std::strtod(value.c_str(), nullptr);
+		else if (option.compare(0, 8, "--noise=") == 0)
+			options.noise = std::strtod(value.c_str(), nullptr);
+		else if (option.compare(0, 9, "--stages=") == 0) {
+			for (const std::string &stage : split(value))
+				options.stages.insert(stage);
+		}
+		else if (option == "--quiet")
+			options.quiet = true;
+		else if (option.compare(0, 2, "--") == 0)
+			throw std::invalid_argument("Unknown option: " + option);
+		else
+			files.push_back(option);
+	}
+	if (files.size() != 2)
+		throw std::invalid_argument("Expected a baseline and a candidate");
+	if (options.threshold < 0 || options.noise < 0)
+		throw std::invalid_argument("Thresholds can't be negative");
+	options.baseline = files[0];
+	options.candidate = files[1];
+	return options;
+}
+
+int main(int argc, char **argv) {
+	Options options;
+	std::map<std::string, Series> baseline, candidate;
+	try {
+		options = parseOptions(argc, argv);
+		baseline = readResults(options.baseline);
+		candidate = readResults(options.candidate);
+	}
+	catch (const std::exception &e) {
+		std::cerr << e.what() << "\nUsage: compare <baseline.json> <candidate.json> [--threshold=percent]"
+		             " [--noise=MADs] [--stages=save,kdf-key] [--quiet]\n";
+		return 2;
+	}
+
+	// Per stage: the log of median ratios summed up for the geometric mean, and what's happened to the series
+	struct StageSummary {
+		double logRatios = 0;
+		size_t compared = 0, regressed = 0, improved = 0;
+	};
+	std::map<std::string, StageSummary> stages;
+	static const char *verdicts[] = { "", "~", "faster", "SLOWER" };
+
+	// Quietly, only regressed series and their count get printed
+	if (!options.quiet)
+		printf("%-48s %12s %12s %9s  %s\n", "series", "baseline", "candidate", "delta", "");
+	for (const auto &entry : baseline) {
+		const std::string &id = entry.first;
+		const Series &before = entry.second;
+		if (!options.stages.empty() && !options.stages.count(before.stage))
+			continue;
+		auto found = candidate.find(id);
+		if (found == candidate.end()) {
+			if (!options.quiet)
+				printf("%-48s %12s %12s %9s  %s\n", id.c_str(), duration(before.median).c_str(), "-", "", "missing");
+			continue;
+		}
+		const Series &after = found->second;
+		double delta;
+		Verdict verdict = judge(before, after, options, delta);
+
+		StageSummary &summary = stages[before.stage];
+		if (before.median > 0 && after.median > 0) {
+			summary.logRatios += std::log(after.median / before.median);
+			++summary.compared;
+		}
+		summary.regressed += verdict == Verdict::Regressed;
+		summary.improved += verdict == Verdict::Improved;
+
+		if (!options.quiet || verdict == Verdict::Regressed)
+			printf("%-48s %12s %12s %+8.1f%%  %s\n", id.c_str(), duration(before.median).c_str(),
+			       duration(after.median).c_str(), delta, verdicts[static_cast<int>(verdict)]);
+	}
+	if (!options.quiet) {
+		for (const auto &entry : candidate) {
+			if (!baseline.count(entry.first) && (options.stages.empty() || options.stages.count(entry.second.stage)))
+				printf("%-48s %12s %12s %9s  %s\n", entry.first.c_str(), "-", duration(entry.second.median).c_str(), "", "new");
+		}
+	}
+
+	size_t regressed = 0;
+	if (!options.quiet)
+		printf("\n%-16s %9s %9s %9s %9s\n", "stage", "series", "geomean", "slower", "faster");
+	for (const auto &entry : stages) {
+		const StageSummary &summary = entry.second;
+		double geomean = summary.compared ? (std::exp(summary.logRatios / summary.compared) - 1) * 100 : 0;
+		if (!options.quiet)
+			printf("%-16s %9zu %+8.1f%% %9zu %9zu\n", entry.first.c_str(), summary.compared, geomean,
+			       summary.regressed, summary.improved);
+		regressed += summary.regressed;
+	}
+
+	if (regressed) {
+		printf(options.quiet ? "%zu series regressed by more than %g%%.\n" : "\n%zu series regressed by more than %g%%.\n",
+		       regressed, options.threshold);
+		return 1;
+	}
+	if (!options.quiet)
+		printf("\nNo regressions beyond %g%%.\n", options.threshold);
+	return 0;
+}
\ No newline at end of file
@@ -0,0 +1,91 @@
+//
+// Copyright (C) 2015-2016 Zireael (zireael dot nk at gmail dot com)
+//  Distributed under the Boost Software License, Version 1.0.
+//       (See accompanying file LICENSE.md or copy at
+//           http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef __PNGSTEGO_BATCH_H
+#define __PNGSTEGO_BATCH_H
+
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "pipeline.h"
+#include "stegoengine.h"
+
+namespace PNGStego {
+
+/** A single container/file/key triple, either from the command line or from a manifest */
+struct BatchJob {
+	size_t line;           // line of the manifest, 0 if it came from the command line
+	std::string container;
+	std::string file;      // the file to embed or the file to extract into
+	std::string key;
+};
+
+/** Options that apply to every job */
+struct JobOptions {
+	bool inPlace;          // embed right into bitmap containers instead of their copies
+	uint64_t memoryBudget; // see PNGFile::setMemoryBudget()
+	EmbeddingProfile profile; // see PNGFile::setEmbeddingProfile()
+};
+
+/**
+ ** Reads a manifest, one job per line. A line is either tab-separated
+ ** "container<TAB>file<TAB>key" or a JSON object {"container": ..., "file": ..., "key": ...}.
+ ** Empty lines and lines starting with '#' are skipped.
+ **/
+std::vector<BatchJob> readManifest(std::istream &stream);
+
+/**
+ ** Embeds the job's file into its container, the result goes to "<container> (copy)"
+ ** (or the container itself if it's a bitmap and options.inPlace is set).
+ ** Wipes the job's key once it's no longer needed. Returns the filename of the result.
+ **/
+std::string encodeJob(BatchJob &job, const JobOptions &options,
+                      const std::function<void(const std::string&)> &outputFn = nullptr);
+
+/** Extracts data from the job's container into its file. Wipes the job's key once it's no longer needed. */
+void decodeJob(BatchJob &job, const JobOptions &options,
+               const std::function<void(const std::string&)> &outputFn = nullptr);
+
+/**
+ ** Runs 'fn' for every job on the given number of threads (all cores if it's 0).
+ ** A failed job doesn't stop the others. 'report' gets called once a job is done,
+ ** with an empty string on success or the reason of the failure otherwise;
+ ** calls to it never overlap. Returns the number of failed jobs.
+ **/
+size_t runBatch(std::vector<BatchJob> &jobs, size_t threads, const std::function<void(BatchJob&)> &fn,
+                const std::function<void(const BatchJob&, const std::string&)> &report);
+
+/** Limits of every stage of a batch: reading files, decoding containers, embedding/extracting and writing the results */
+struct PipelineLimits {
+	StageLimits read, decode, crypto, write;
+};
+
+/**
+ ** Returns limits with the given number of threads for CPU-bound stages (decoding & crypto),
+ ** for I/O-bound ones (reading & writing) and the given depth of every stage's queue.
+ ** Zeros mean all cores, 2 threads and as many queued jobs as the stage has threads, respectively.
+ **/
+PipelineLimits pipelineLimits(size_t threads, size_t ioThreads = 0, size_t queueDepth = 0);
+
+/**
+ ** Same as runBatch() with encodeJob(), except that jobs go through a pipeline:
+ ** while some are embedding, the next ones are being read & decoded and the previous ones written.
+ **/
+size_t encodeBatch(std::vector<BatchJob> &jobs, const JobOptions &options, const PipelineLimits &limits,
+                   const std::function<void(const BatchJob&, const std::string&)> &report);
+
+/**
+ ** Same as runBatch() with decodeJob(), except that jobs go through a pipeline:
+ ** while some are extracting, the next ones are being read & decoded and the previous ones written.
+ **/
+size_t decodeBatch(std::vector<BatchJob> &jobs, const JobOptions &options, const PipelineLimits &limits,
+                   const std::function<void(const BatchJob&, const std::string&)> &report);
+
+} // namespace PNGStego
+#endif
\ No newline at end of file
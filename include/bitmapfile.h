@@ -0,0 +1,123 @@
+//
+// Copyright (C) 2015-2016 Zireael (zireael dot nk at gmail dot com)
+//  Distributed under the Boost Software License, Version 1.0.
+//       (See accompanying file LICENSE.md or copy at
+//           http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef __PNGSTEGO_BITMAP_FILE_H
+#define __PNGSTEGO_BITMAP_FILE_H
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <memory>
+#include "mappedfile.h"
+#include "pixelstore.h"
+#include "stegoengine.h"
+
+namespace PNGStego {
+
+/**
+ ** Pixels of an uncompressed image, right where they are in a mapped file.
+ ** Rows may be padded and samples may be in any order, such as BGR.
+ **/
+class MappedBitmapStore : public PixelStore {
+public:
+	/**
+	 ** 'offsets' are positions of red, green, blue and alpha samples within a pixel,
+	 ** a pixel takes 'pixelStride' bytes and a row takes 'rowStride' bytes.
+	 **/
+	MappedBitmapStore(uint8_t *data, uint32_t width, uint32_t height, size_t rowStride,
+	                  size_t pixelStride, PixelFormat format, const size_t offsets[4]) noexcept;
+
+	uint64_t size() const noexcept override;
+	PixelFormat format() const noexcept override;
+	/** The run ends at the end of the row the pixel is in */
+	ChannelRun channel(uint64_t pixel, Channel channel) override;
+	/** Throws, a mapped file can't be copied */
+	std::unique_ptr<PixelStore> clone() const override;
+	void read(uint64_t offset, uint8_t *destination, size_t length) override;
+
+private:
+	uint8_t *data;
+	uint32_t width, height;
+	size_t rowStride, pixelStride;
+	PixelFormat pixelFormat;
+	size_t offsets[4];
+};
+
+/**
+ ** An uncompressed 24/32-bit BMP or binary PPM/PGM image used as a container.
+ ** The file is mapped into memory and LSBs are flipped right there:
+ ** nothing gets decoded or re-encoded, only pages the walk touches
+ ** are read and only the modified ones are written back.
+ ** Embedding therefore modifies the given file itself.
+ **/
+class BitmapFile {
+public:
+	/** Creates an empty object, it's necessary to open a file to work with it */
+	BitmapFile();
+	/** Maps a file with the given filename, read-only unless 'writable' is set */
+	BitmapFile(const std::string &filename, bool writable = true);
+	BitmapFile(const BitmapFile &other) = delete;
+	BitmapFile& operator=(const BitmapFile &other) = delete;
+
+	/** Returns whether a file with the given filename looks like a BMP, PPM or PGM image */
+	static bool isBitmap(const std::string &filename);
+
+	/** Maps a file with the given filename, read-only unless 'writable' is set */
+	void open(const std::string &filename, bool writable = true);
+	/** Writes modified pages back to the file and waits for it to finish */
+	void flush();
+
+	/** Returns the image's width */
+	uint32_t getWidth() const;
+	/** Returns the image's height */
+	uint32_t getHeight() const;
+	/** Returns the layout of the image's pixels */
+	PixelFormat getFormat() const;
+
+	/** Sets a function that gets called each time decode/encode do something */
+	void setOutputFn(const std::function<void(const std::string&)> &fn);
+	/** Sets a function that gets called each time decode/encode do something */
+	void setOutputFn(std::function<void(const std::string&)> &&fn);
+	/** Sets a function that gets called as each stage of encode/decode starts and finishes, replaces the one set by setOutputFn() */
+	void setEventFn(const EventFn &fn);
+
+	/** Chooses how densely further encodes pack data into pixels (see EmbeddingProfile), decodes read it from the header */
+	void setEmbeddingProfile(EmbeddingProfile profile);
+	/** Returns capacity of the image with the given seed, in bytes */
+	uint64_t capacity(uint32_t seed) const noexcept;
+	/** Embeds data from a file with the given filename into the image, using the given key */
+	void encode(const std::string &filename, const std::string &key);
+	/** Embeds data from a given vector and string using the given key */
+	void encode(const std::vector<uint8_t> &data, const std::string &extension, const std::string &key);
+	/**
+	 ** Extracts data from the image using the given key and saves it
+	 ** into a file with the given filename.
+	 ** In case of file I/O failure if the 3rd parameter is not nullptr, puts data there.
+	 **/
+	void decode(std::string filename, const std::string &key, std::vector<uint8_t> *backup = nullptr) const;
+	/** Extracts data from the image using the given key, puts it into the 1st and 2nd parameters. */
+	void decode(std::vector<uint8_t> &data, std::string &extension, const std::string &key) const;
+
+	/**
+	 ** !!! DO NOT CALL THIS UNLESS YOU ABSOLUTELY SURE YOU KNOW WHAT YOU DO !!!
+	 ** This function replaces a PRNG for IV & salt
+	 ** It exists purely for testing & debugging.
+	 ** By default PRNG used *IS* cryptographically secure.
+	 **/
+	void setCSPRNG(const std::function<void(uint8_t *, size_t)> &fn);
+private:
+	uint32_t width, height;
+	std::unique_ptr<MappedFile> file;
+	std::unique_ptr<MappedBitmapStore> store;
+	StegoEngine engine;
+
+	void parseBMP();
+	void parsePNM();
+};
+
+} // namespace PNGStego
+#endif
\ No newline at end of file
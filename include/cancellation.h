@@ -0,0 +1,63 @@
+//
+// Copyright (C) 2015-2016 Zireael (zireael dot nk at gmail dot com)
+//  Distributed under the Boost Software License, Version 1.0.
+//       (See accompanying file LICENSE.md or copy at
+//           http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef __PNGSTEGO_CANCELLATION_H
+#define __PNGSTEGO_CANCELLATION_H
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <stdexcept>
+
+namespace PNGStego {
+
+/** Thrown by work that's been cancelled or has run past its deadline */
+class Cancelled : public std::runtime_error {
+public:
+	using std::runtime_error::runtime_error;
+};
+
+/**
+ ** Tells long-running work to give up: key derivation, compression, ciphers and bit loops
+ ** check it every so often and throw Cancelled, wiping whatever they were holding.
+ ** Copies share their state, so the caller keeps one and cancels what the work got.
+ **/
+class CancellationToken {
+public:
+	typedef std::chrono::steady_clock Clock;
+
+	/** Creates a token that's only cancelled by cancel() */
+	CancellationToken();
+	/** Creates a token that's cancelled once the deadline passes */
+	explicit CancellationToken(Clock::time_point deadline);
+	/** Creates a token that's cancelled once the timeout's expired, counting from now */
+	explicit CancellationToken(Clock::duration timeout);
+
+	/** Returns a token that's never cancelled, the default for everything that takes one */
+	static const CancellationToken& none() noexcept;
+
+	/** Cancels the work, safe to call from any thread */
+	void cancel() const noexcept;
+	/** Returns whether cancel() has been called or the deadline has passed */
+	bool isCancelled() const noexcept;
+	/** Throws Cancelled if isCancelled() */
+	void check() const;
+
+private:
+	struct State {
+		std::atomic<bool> cancelled;
+		bool hasDeadline;
+		Clock::time_point deadline;
+	};
+	std::shared_ptr<State> state; // nullptr for none()
+
+	struct Never { };
+	explicit CancellationToken(Never) noexcept;
+};
+
+} // namespace PNGStego
+#endif
\ No newline at end of file
@@ -0,0 +1,78 @@
+//
+// Copyright (C) 2015-2016 Zireael (zireael dot nk at gmail dot com)
+//  Distributed under the Boost Software License, Version 1.0.
+//       (See accompanying file LICENSE.md or copy at
+//           http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef __PNGSTEGO_COLOR_REDUCER_H
+#define __PNGSTEGO_COLOR_REDUCER_H
+
+#include <array>
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include "pixelview.h"
+
+const size_t PALETTE_SIZE = 256;         // colors a PNG palette holds at most
+const size_t PALETTE_TABLE_SLOTS = 1024; // slots of the hash table colors get looked up in, a power of two
+
+namespace PNGStego {
+
+/** Ways pixels can be written more narrowly than they're kept, without losing any of them */
+enum class ColorReduction : uint8_t {
+	None,    // as they're kept
+	Opaque,  // every pixel's opaque, alpha is left out
+	Palette, // at most 256 colors, written as indices into a palette (with a tRNS chunk if some aren't opaque)
+	LowGray  // gray samples that were expanded from 1, 2 or 4 bits and still fit into them
+};
+
+/**
+ ** Finds the narrowest PNG color type that holds an image's pixels as they are, in a single pass over its rows,
+ ** then converts rows into it. Reductions never change the layout a decoder sees once the file's loaded
+ ** and expanded again: color images stay color images and gray ones stay gray, since the salt and IV
+ ** are placed differently in each.
+ ** Scanning stops paying attention to what's already been ruled out, and scan() says when nothing is left.
+ **/
+class ColorReducer {
+public:
+	ColorReducer(PixelFormat format, size_t sampleBytes) noexcept;
+
+	/** Looks at a row of interleaved pixels, returns false once further rows can't make a difference */
+	bool scan(const uint8_t *row, size_t count) noexcept;
+	/** Settles on a reduction once every row's been scanned, puts colors that aren't opaque first in the palette */
+	ColorReduction finish();
+
+	/** Returns the PNG color type to write, only valid after finish() */
+	int colorType() const noexcept;
+	/** Returns the bit depth to write, indices and samples narrower than 8 bits have to be packed by libpng */
+	int bitDepth() const noexcept;
+	/** Returns RGB triplets of the palette */
+	const std::vector<uint8_t>& palette() const noexcept;
+	/** Returns alpha of palette entries up to the last one that isn't opaque, empty if they all are */
+	const std::vector<uint8_t>& transparency() const noexcept;
+	/** Returns the number of bytes convert() writes for 'count' pixels */
+	size_t rowBytes(size_t count) const noexcept;
+	/** Converts a scanned row into what gets written, one byte per index or narrow sample */
+	void convert(const uint8_t *row, size_t count, uint8_t *output) const noexcept;
+
+private:
+	PixelFormat format;
+	size_t sampleBytes;
+	ColorReduction reduction;
+	bool opaque, paletteFits;
+	int grayBits; // fewest bits every gray sample seen so far fits into
+	std::array<uint32_t, PALETTE_TABLE_SLOTS> keys;    // colors as 0xRRGGBBAA
+	std::array<int16_t, PALETTE_TABLE_SLOTS> entries; // their palette entries, -1 for empty slots
+	std::vector<uint32_t> colors;                     // in order of appearance
+	std::array<uint8_t, PALETTE_SIZE> remap;          // order of appearance to palette entry
+	std::vector<uint8_t> rgb, alphas;
+
+	/** Returns the slot the color is or would be in */
+	size_t slot(uint32_t color) const noexcept;
+	/** Returns the color of an 8-bit color pixel as 0xRRGGBBAA */
+	uint32_t pack(const uint8_t *pixel) const noexcept;
+};
+
+} // namespace PNGStego
+#endif
\ No newline at end of file
@@ -10,21 +10,46 @@
 
 #include <vector>
 #include <cstdint>
+#include <initializer_list>
+#include "cancellation.h"
+#include "payloadbuffer.h"
+
+const size_t COMPRESSION_CHUNK_BYTES = 1 << 20; // bytes (de)compression goes through between checks of a cancellation token
 
 namespace PNGStego {
 namespace bzip2 {
 
+/** Bytes somebody else owns */
+struct ByteRange {
+	const uint8_t *data;
+	size_t size;
+};
+
+/** Returns the most bytes compressing 'size' bytes may take, as bzip2's documentation puts it */
+size_t compressBound(size_t size) noexcept;
+
+/**
+ ** Compresses the pieces as a single stream, one after another, appending it to the output.
+ ** The output gets room for compressBound() of them up front, so it's never moved while it's written.
+ **/
+void compress(std::initializer_list<ByteRange> pieces, PayloadBuffer &output,
+              const CancellationToken &token = CancellationToken::none());
+
+/** Decompresses data, appending it to the output */
+void decompress(const uint8_t *data, size_t size, PayloadBuffer &output,
+                const CancellationToken &token = CancellationToken::none());
+
 /** Uses bzip2 to compress given data */
-std::vector<char> compress(const std::vector<char> &source);
+std::vector<char> compress(const std::vector<char> &source, const CancellationToken &token = CancellationToken::none());
 
 /** Uses bzip2 to decompress given data */
-std::vector<char> decompress(const std::vector<char> &source);
+std::vector<char> decompress(const std::vector<char> &source, const CancellationToken &token = CancellationToken::none());
 
 /** Uses bzip2 to compress given data */
-std::vector<uint8_t> compress(const std::vector<uint8_t> &source);
+std::vector<uint8_t> compress(const std::vector<uint8_t> &source, const CancellationToken &token = CancellationToken::none());
 
 /** Uses bzip2 to decompress given data */
-std::vector<uint8_t> decompress(const std::vector<uint8_t> &source);
+std::vector<uint8_t> decompress(const std::vector<uint8_t> &source, const CancellationToken &token = CancellationToken::none());
 
 } // namespace bzip2
 } // namespace PNGStego
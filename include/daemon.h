@@ -0,0 +1,102 @@
+//
+// Copyright (C) 2015-2016 Zireael (zireael dot nk at gmail dot com)
+//  Distributed under the Boost Software License, Version 1.0.
+//       (See accompanying file LICENSE.md or copy at
+//           http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef __PNGSTEGO_DAEMON_H
+#define __PNGSTEGO_DAEMON_H
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include "batch.h"
+
+const unsigned DAEMON_IDLE_TIMEOUT_MS = 10000; // how long a connection may wait for its next request by default
+
+namespace PNGStego {
+
+/** What a daemon gets asked to do */
+enum class DaemonOp : uint8_t {
+	Encode = 1, // embed 'file' into 'container', same as pngstego
+	Decode = 2, // extract data from 'container' into 'file', same as pngdestego
+	Probe = 3   // describe 'container'
+};
+
+/** A single request, filenames had better be absolute since the daemon has its own working directory */
+struct DaemonRequest {
+	DaemonOp op;
+	bool inPlace;
+	std::string container;
+	std::string file;
+	std::string key;
+	bool useProfile;          // embed with 'profile' rather than the daemon's own profile
+	EmbeddingProfile profile;
+};
+
+/** A daemon's reply */
+struct DaemonReply {
+	bool ok;
+	std::string message; // the output's filename, the container's description or the reason of the failure
+};
+
+/**
+ ** Serves requests on a Unix domain socket, so every request doesn't have to pay for starting a process.
+ ** Each message is a frame: its length as a 32-bit little-endian number, then the body.
+ ** A request's body is the protocol version, the operation, flags and then the container's filename,
+ ** the file's name and the key, each of them prefixed by its length the same way.
+ ** Flags: bit 0 is 'in place', bit 1 says bits 2-3 hold the embedding profile to use instead of the daemon's.
+ ** A reply's body is the protocol version, the status (0 on success) and the message, prefixed by its length.
+ ** A connection may carry any number of requests, one after another. A worker serves one connection at a time,
+ ** so connections that stay idle for too long get closed, or idle clients could keep every worker to themselves.
+ ** Not available on Windows.
+ **/
+class Daemon {
+public:
+	/** Creates the socket (only accessible by the current user), replacing a stale one. Throws if anything else is at that path */
+	Daemon(const std::string &socketPath, size_t threads, const JobOptions &options);
+	Daemon(const Daemon &other) = delete;
+	Daemon& operator=(const Daemon &other) = delete;
+	/** Closes & removes the socket */
+	~Daemon();
+
+	/** Serves requests on all threads until stop() is called */
+	void serve();
+	/**
+	 ** Makes serve() return once requests being served are done, safe to call from a signal handler.
+	 ** Connections waiting for their next request are shut down.
+	 **/
+	void stop() noexcept;
+
+	/** Sets a function that gets called each time a request has been served */
+	void setOutputFn(const std::function<void(const std::string&)> &fn);
+	/** Sets how long a connection may wait for its next request, or the rest of one, before it's closed. Call before serve() */
+	void setIdleTimeout(unsigned milliseconds) noexcept;
+
+	/** Sends a request to a daemon listening on the given socket and waits for the reply */
+	static DaemonReply request(const std::string &socketPath, const DaemonRequest &request);
+
+private:
+	std::string socketPath;
+	int listener;
+	size_t threads;
+	JobOptions options;
+	std::atomic<bool> stopping;
+	unsigned idleTimeout;
+	// Connections being served, one per worker or -1; atomics rather than a mutex, since stop() runs in signal handlers
+	std::unique_ptr<std::atomic<int>[]> connections;
+	std::function<void(const std::string&)> outputFn;
+	std::mutex outputMutex;
+
+	void serveConnection(int connection);
+	/** Waits until the connection has something to read, returns false if it's stopping or the connection's been idle too long */
+	bool waitForData(int connection) const;
+	DaemonReply handle(DaemonRequest &request) const;
+};
+
+} // namespace PNGStego
+#endif
\ No newline at end of file
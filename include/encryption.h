@@ -11,20 +11,57 @@
 #include <vector>
 #include <array>
 #include <string>
+#include <algorithm>
 #include <cryptopp/whrlpool.h>
-#include <cryptopp/pwdbased.h>
+#include <cryptopp/hmac.h>
+#include "cancellation.h"
+#include "helpers.h"
+#include "payloadbuffer.h"
 
 const int TAG_SIZE = 12;
+const int KDF_CHECK_INTERVAL = 4096;       // PBKDF2 iterations between checks of a cancellation token
+const size_t CIPHER_CHUNK_BYTES = 1 << 20; // bytes ciphers go through between checks of a cancellation token
+const size_t DERIVED_KEY_BYTES = 64;       // AES-256's key followed by Serpent-256's
 
 namespace PNGStego {
 namespace Encryption {
+
+typedef std::array<byte, DERIVED_KEY_BYTES> DerivedKey;
+
+/** Generates a hash of your key using PBKDF2 with given salt, encrypt() & decrypt() use it for both ciphers */
+DerivedKey deriveKey(const std::string &key, const std::vector<byte> &salt,
+                     const CancellationToken &token = CancellationToken::none());
+
+/** Same as above, but writes the key where it's told to, e.g. into a SecureObject, so no copy's left on the stack */
+void deriveKey(const std::string &key, const std::vector<byte> &salt, DerivedKey &derived,
+               const CancellationToken &token = CancellationToken::none());
+
+/**
+ ** Encrypts the buffer in place with Serpent and then AES, using a derived key and given IV.
+ ** Each cipher appends its tag, so the buffer grows by 2 * TAG_SIZE; reserve that beforehand and nothing moves.
+ **/
+void encrypt(PayloadBuffer &buffer, const DerivedKey &key, const std::vector<byte> &iv,
+             const CancellationToken &token = CancellationToken::none());
+
+/** Decrypts the buffer in place, AES first. If a tag doesn't match the buffer gets wiped and std::runtime_error's thrown */
+void decrypt(PayloadBuffer &buffer, const DerivedKey &key, const std::vector<byte> &iv,
+             const CancellationToken &token = CancellationToken::none());
+
+/** Encrypts data stored in the given std::vector with both AES and Serpent, using a derived key and given IV */
+std::vector<uint8_t> encrypt(const std::vector<uint8_t> &source, const DerivedKey &key, const std::vector<byte> &iv,
+                             const CancellationToken &token = CancellationToken::none());
+
+/** Decrypts data stored in the given std::vector with both AES and Serpent, using a derived key and given IV */
+std::vector<uint8_t> decrypt(const std::vector<uint8_t> &source, const DerivedKey &key, const std::vector<byte> &iv,
+                             const CancellationToken &token = CancellationToken::none());
 /**
  ** Generates a hash of your key using PBKDF2 with given salt
  ** Then encrypts data stored in the given std::vector with both AES and Serpent, using that hash and given IV
  ** Returns an std::vector with encrypted data
  **/
 std::vector<uint8_t> encrypt(const std::vector<uint8_t> &source, const std::string &key,
-                             const std::vector<byte> &iv, const std::vector<byte> &salt);
+                             const std::vector<byte> &iv, const std::vector<byte> &salt,
+                             const CancellationToken &token = CancellationToken::none());
 
 /**
  ** Generates a hash of your key using PBKDF2 with given salt
@@ -32,37 +69,79 @@ std::vector<uint8_t> encrypt(const std::vector<uint8_t> &source, const std::stri
  ** Returns an std::vector with decrypted data
  **/
 std::vector<uint8_t> decrypt(const std::vector<uint8_t> &source, const std::string &key,
-                             const std::vector<byte> &iv, const std::vector<byte> &salt);
+                             const std::vector<byte> &iv, const std::vector<byte> &salt,
+                             const CancellationToken &token = CancellationToken::none());
 
 /** Encrypts data stored in the given std::vector with AES (Rijndael) using CBC mode and given key + IV. */
 std::vector<uint8_t> AESEncrypt(const std::vector<uint8_t> &source, const byte *key, size_t keylength,
-                                                                    const byte *iv,  size_t ivlength);
+                                                                    const byte *iv,  size_t ivlength,
+                                                                    const CancellationToken &token = CancellationToken::none());
 
 /** Decrypts data stored in the given std::vector with AES (Rijndael) using CBC mode and given key + IV. */
 std::vector<uint8_t> AESDecrypt(const std::vector<uint8_t> &source, const byte *key, size_t keylength,
-                                                                    const byte *iv,  size_t ivlength);
+                                                                    const byte *iv,  size_t ivlength,
+                                                                    const CancellationToken &token = CancellationToken::none());
 
 /** Encrypts data stored in the given std::vector with Serpent using CBC mode and given key + IV. */
 std::vector<uint8_t> SerpentEncrypt(const std::vector<uint8_t> &source, const byte *key, size_t keylength,
-                                                                        const byte *iv,  size_t ivlength);
+                                                                        const byte *iv,  size_t ivlength,
+                                                                        const CancellationToken &token = CancellationToken::none());
 
 /** Decrypts data stored in the given std::vector with Serpent using CBC mode and given key + IV. */
 std::vector<uint8_t> SerpentDecrypt(const std::vector<uint8_t> &source, const byte *key, size_t keylength,
-                                                                        const byte *iv,  size_t ivlength);
+                                                                        const byte *iv,  size_t ivlength,
+                                                                        const CancellationToken &token = CancellationToken::none());
 
 /**
  ** Generates a hash of your key using PBKDF2 with the given salt
  ** Uses 2nd template argument to determine iterations of Whirlpool
  ** (500 000 by default)
+ ** Checks the token every KDF_CHECK_INTERVAL iterations, so a wrong key's derivation can be abandoned
  **/
 template <size_t hashSize, int iterations = 500000>
-std::array<byte, hashSize> hashKey(const std::string &key, const std::vector<byte> &salt) {
-	std::array<byte, hashSize> derived;
+void hashKey(const std::string &key, const std::vector<byte> &salt, std::array<byte, hashSize> &derived,
+             const CancellationToken &token = CancellationToken::none()) {
+	typedef CryptoPP::HMAC<CryptoPP::Whirlpool> PRF;
+	byte block[PRF::DIGESTSIZE], mixed[PRF::DIGESTSIZE];
 
-	CryptoPP::PKCS5_PBKDF2_HMAC<CryptoPP::Whirlpool> pbkdf2;
-	pbkdf2.DeriveKey(derived.data(), derived.size(), 0, reinterpret_cast<const byte *>(key.data()),
-	                                               key.size(), salt.data(), salt.size(), iterations);
+	// Same as PKCS5_PBKDF2_HMAC, which can't be interrupted halfway
+	PRF prf(reinterpret_cast<const byte *>(key.data()), key.size());
+	try {
+		for (uint32_t index = 1, done = 0; done < hashSize; ++index) {
+			const byte counter[4] = { byte(index >> 24), byte(index >> 16), byte(index >> 8), byte(index) };
+			prf.Update(salt.data(), salt.size());
+			prf.Update(counter, sizeof(counter));
+			prf.Final(block);
+			std::copy(block, block + sizeof(block), mixed);
+			for (int i = 1; i < iterations; ++i) {
+				if (i % KDF_CHECK_INTERVAL == 0)
+					token.check();
+				prf.Update(block, sizeof(block));
+				prf.Final(block);
+				for (size_t k = 0; k < sizeof(block); ++k)
+					mixed[k] ^= block[k];
+			}
+			size_t length = std::min<size_t>(sizeof(mixed), hashSize - done);
+			std::copy(mixed, mixed + length, derived.begin() + done);
+			done += static_cast<uint32_t>(length);
+		}
+	}
+	catch (...) {
+		PNGStego::zeroMemory(block, sizeof(block));
+		PNGStego::zeroMemory(mixed, sizeof(mixed));
+		PNGStego::zeroMemory(derived.data(), derived.size());
+		throw;
+	}
+	PNGStego::zeroMemory(block, sizeof(block));
+	PNGStego::zeroMemory(mixed, sizeof(mixed));
+}
 
+/** Same as above, returns the hash */
+template <size_t hashSize, int iterations = 500000>
+std::array<byte, hashSize> hashKey(const std::string &key, const std::vector<byte> &salt,
+                                   const CancellationToken &token = CancellationToken::none()) {
+	std::array<byte, hashSize> derived;
+	hashKey<hashSize, iterations>(key, salt, derived, token);
 	return derived;
 }
 
@@ -0,0 +1,89 @@
+//
+// Copyright (C) 2015-2016 Zireael (zireael dot nk at gmail dot com)
+//  Distributed under the Boost Software License, Version 1.0.
+//       (See accompanying file LICENSE.md or copy at
+//           http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef __PNGSTEGO_EXECUTOR_H
+#define __PNGSTEGO_EXECUTOR_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace PNGStego {
+
+/**
+ ** Runs tasks somewhere else, whenever it sees fit.
+ ** Asynchronous calls only ever talk to this, so a host application
+ ** may hand them its own thread pool to share and bound CPU across everything it does.
+ **/
+class Executor {
+public:
+	virtual ~Executor() {}
+
+	/** Schedules a task, it must not throw */
+	virtual void submit(std::function<void()> task) = 0;
+};
+
+/**
+ ** A fixed number of threads, each with its own queue of tasks.
+ ** Tasks submitted from one of the pool's threads go to that thread's queue and are taken
+ ** from its back, so related work stays on a warm core; an idle thread steals from the front
+ ** of the others' queues. Tasks shouldn't wait for each other or threads may run out.
+ **/
+class WorkStealingPool : public Executor {
+public:
+	/** Starts the given number of threads, 0 means one per core */
+	explicit WorkStealingPool(size_t threads = 0);
+	WorkStealingPool(const WorkStealingPool &other) = delete;
+	WorkStealingPool& operator=(const WorkStealingPool &other) = delete;
+	/** Runs whatever's been submitted and stops the threads */
+	~WorkStealingPool();
+
+	void submit(std::function<void()> task) override;
+
+	/** Returns the number of threads */
+	size_t size() const noexcept;
+
+	/** Returns the pool asynchronous calls use unless they're given another executor, one thread per core */
+	static WorkStealingPool& shared();
+
+private:
+	struct Queue {
+		std::mutex mutex;
+		std::deque<std::function<void()>> tasks;
+	};
+	std::vector<std::unique_ptr<Queue>> queues;
+	std::vector<std::thread> threads;
+	std::mutex sleepMutex;
+	std::condition_variable wakeUp;
+	std::atomic<size_t> pending; // tasks nobody's taken yet
+	std::atomic<size_t> nextQueue;
+	bool stopping;
+
+	/** Takes a task from the thread's own queue or steals one, returns false if there's none */
+	bool take(size_t self, std::function<void()> &task);
+	void work(size_t self);
+};
+
+/** Runs a function on the executor, the future gets whatever it returns or throws */
+template <class Fn>
+auto runAsync(Executor &executor, Fn fn) -> std::future<decltype(fn())> {
+	// packaged_task can't be copied while submitted tasks have to be
+	auto task = std::make_shared<std::packaged_task<decltype(fn())()>>(std::move(fn));
+	std::future<decltype(fn())> result = task->get_future();
+	executor.submit([task]() { (*task)(); });
+	return result;
+}
+
+} // namespace PNGStego
+#endif
\ No newline at end of file
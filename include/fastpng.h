@@ -0,0 +1,69 @@
+//
+// Copyright (C) 2015-2016 Zireael (zireael dot nk at gmail dot com)
+//  Distributed under the Boost Software License, Version 1.0.
+//       (See accompanying file LICENSE.md or copy at
+//           http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef __PNGSTEGO_FAST_PNG_H
+#define __PNGSTEGO_FAST_PNG_H
+
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+#include <utility>
+#include <vector>
+#include "pixelstore.h"
+
+const size_t FAST_PNG_IDAT_BYTES = 1 << 16; // largest IDAT chunk encode() writes
+
+namespace PNGStego {
+namespace FastPNG {
+
+/** What inspect() has found in a PNG file */
+struct File {
+	uint32_t width, height;
+	int bitDepth, colorType;                              // as IHDR says
+	PixelFormat format;                                   // what pixels get expanded to
+	std::vector<uint8_t> palette;                         // 256 RGBA quadruplets with tRNS applied, palette images only
+	std::vector<std::pair<const uint8_t*, size_t>> data;  // contents of IDAT chunks
+	size_t size;                                          // bytes up to the end of IEND
+};
+
+/**
+ ** Walks through chunks of a whole PNG file, signature included, checking CRCs of the ones it uses.
+ ** Returns whether decode() can take the file: not interlaced, 8-bit gray, gray & alpha, RGB or RGBA,
+ ** or a palette of any depth. Everything else, damaged files included, is left to libpng,
+ ** which knows how to deal with it and how to complain.
+ **/
+bool inspect(const uint8_t *data, size_t size, File &file);
+
+/**
+ ** Inflates IDAT with zlib and unfilters rows (SSE2 for 3 and 4-byte pixels), expanding palettes and
+ ** splitting planar stores in the same pass; interleaved 8-bit rows are inflated right where they belong.
+ ** The store has to be made for file.format and width * height 8-bit pixels.
+ ** Returns false if the data turns out to be damaged, or anything a reader could argue about, the store's left half-filled then.
+ **/
+bool decode(const File &file, MemoryStore &store);
+
+/** What encode() writes */
+struct Image {
+	uint32_t width, height;
+	int bitDepth, colorType;                  // no more than 8 bits
+	const std::vector<uint8_t> *palette;      // RGB triplets, palette images only
+	const std::vector<uint8_t> *transparency; // tRNS of a palette, may be empty
+};
+
+/**
+ ** Writes a non-interlaced PNG file. 'row' returns samples of the given row, one byte each,
+ ** narrower ones get packed; 'write' takes the file's bytes as they're ready.
+ ** Rows get filtered and compressed the way libpng does by default: palettes and narrow samples aren't filtered,
+ ** other rows take whichever filter makes the smallest sum of absolute values, and deflate favours filtered data.
+ ** Throws std::runtime_error if zlib fails.
+ **/
+void encode(const Image &image, const std::function<const uint8_t*(uint32_t)> &row,
+            const std::function<void(const uint8_t*, size_t)> &write);
+
+} // namespace FastPNG
+} // namespace PNGStego
+#endif
\ No newline at end of file
@@ -48,6 +48,25 @@ std::string baseFilenameNoExtension(const std::string &filename) noexcept;
 /** Returns the size of a given file */
 std::ifstream::pos_type fileSize(const std::string &filename);
 
+/** Copies a file, overwriting the destination if it exists */
+void copyFile(const std::string &source, const std::string &destination);
+
+/**
+ ** Reads whole files, all of them at once through io_uring if it's built with PNGSTEGO_WITH_IO_URING and the system has it.
+ ** Files the ring can't read, or all of them if the ring fails, get read with streams.
+ ** If a file can't be read, its contents are empty and errors[i] tells why, otherwise errors[i] is empty.
+ **/
+std::vector<std::vector<uint8_t>> readFiles(const std::vector<std::string> &filenames, std::vector<std::string> &errors);
+
+/** Reads the whole file, through io_uring the same way readFiles() does */
+std::vector<uint8_t> readFile(const std::string &filename);
+
+/** Writes 'size' bytes to a file, overwriting it if it exists. Goes through io_uring the same way readFile() does */
+void writeFile(const std::string &filename, const uint8_t *data, size_t size);
+
+/** Returns the filename prefixed with the working directory, unless it's absolute already */
+std::string absolutePath(const std::string &filename);
+
 /** Converts std::string to std::vector<uint8_t> */
 std::vector<uint8_t> stringToVector(const std::string &source) noexcept;
 
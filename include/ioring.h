@@ -0,0 +1,76 @@
+//
+// Copyright (C) 2015-2016 Zireael (zireael dot nk at gmail dot com)
+//  Distributed under the Boost Software License, Version 1.0.
+//       (See accompanying file LICENSE.md or copy at
+//           http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef __PNGSTEGO_IO_RING_H
+#define __PNGSTEGO_IO_RING_H
+
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace PNGStego {
+
+/** Thrown when the ring itself fails, or can't do its fixed-buffer reads & writes on a file; streams still may */
+class IORingError : public std::runtime_error {
+public:
+	using std::runtime_error::runtime_error;
+};
+
+/**
+ ** Reads and writes whole files through Linux's io_uring, many of them at once.
+ ** Files are split into chunks that go through a pool of buffers registered with the kernel,
+ ** so there's a single syscall per batch of chunks rather than per read and the pages
+ ** don't get pinned over and over again.
+ ** Only there if built with PNGSTEGO_WITH_IO_URING, helpers' readFiles(), readFile() & writeFile() use it
+ ** whenever it works and fall back to streams otherwise.
+ ** An object may only be used by one thread at a time.
+ **/
+class IORing {
+public:
+	/** Sets up a ring with 'buffers' registered buffers, 'bufferSize' bytes each. Throws if io_uring isn't available */
+	explicit IORing(unsigned buffers = 32, size_t bufferSize = 256 * 1024);
+	IORing(const IORing &other) = delete;
+	IORing& operator=(const IORing &other) = delete;
+	~IORing();
+
+	/** Returns the calling thread's ring, or nullptr if io_uring isn't compiled in, doesn't work on this system or has failed on this thread */
+	static IORing* local() noexcept;
+
+	/**
+	 ** Reads whole files, all of them at once.
+	 ** If a file can't be read, its contents are empty and errors[i] tells why, otherwise errors[i] is empty.
+	 ** fallback[i] is set if it's the ring that couldn't read the file, rather than the file that couldn't be read.
+	 ** Throws IORingError if the ring fails altogether, it's shut down then and can't be used any more.
+	 **/
+	std::vector<std::vector<uint8_t>> readFiles(const std::vector<std::string> &filenames, std::vector<std::string> &errors,
+	                                            std::vector<bool> &fallback);
+	/** Reads a whole file, throws IORingError if the ring can't */
+	std::vector<uint8_t> readFile(const std::string &filename);
+	/** Writes a file, overwriting it if it exists. Throws IORingError if the ring can't */
+	void writeFile(const std::string &filename, const uint8_t *data, size_t size);
+
+private:
+	struct Transfer;
+	int ring;
+	unsigned entries;
+	size_t bufferSize;
+	std::vector<uint8_t*> buffers;
+	void *sqRing, *cqRing, *sqes;
+	size_t sqRingSize, cqRingSize, sqesSize;
+	uint32_t *sqHead, *sqTail, *sqMask, *sqArray;
+	uint32_t *cqHead, *cqTail, *cqMask;
+	void *cqes;
+
+	/** Unmaps everything and closes the ring */
+	void release() noexcept;
+	/** Moves every transfer's data, keeping as many chunks in flight as there are buffers */
+	void run(std::vector<Transfer> &transfers);
+};
+
+} // namespace PNGStego
+#endif
\ No newline at end of file
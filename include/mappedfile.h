@@ -0,0 +1,52 @@
+//
+// Copyright (C) 2015-2016 Zireael (zireael dot nk at gmail dot com)
+//  Distributed under the Boost Software License, Version 1.0.
+//       (See accompanying file LICENSE.md or copy at
+//           http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef __PNGSTEGO_MAPPED_FILE_H
+#define __PNGSTEGO_MAPPED_FILE_H
+
+#include <cstdint>
+#include <string>
+
+namespace PNGStego {
+
+/**
+ ** A whole file mapped into memory.
+ ** Pages are only read from disk once they're touched,
+ ** and only the modified ones get written back.
+ **/
+class MappedFile {
+public:
+	/**
+	 ** Maps a file with the given filename.
+	 ** Changes go straight into the file if it's writable,
+	 ** otherwise they stay private to the process.
+	 **/
+	MappedFile(const std::string &filename, bool writable);
+	MappedFile(const MappedFile &other) = delete;
+	MappedFile& operator=(const MappedFile &other) = delete;
+	/** Unmaps the file, modified pages get written back by the OS eventually */
+	~MappedFile();
+
+	/** Returns the first byte of the file */
+	uint8_t* data() noexcept;
+	/** Returns the file's size */
+	uint64_t size() const noexcept;
+	/** Writes modified pages back to the file and waits for it to finish */
+	void flush();
+
+private:
+	uint8_t *address;
+	uint64_t length;
+	bool writable;
+#ifdef _WIN32
+	void *file;
+	void *mapping;
+#endif
+};
+
+} // namespace PNGStego
+#endif
\ No newline at end of file
@@ -0,0 +1,174 @@
+//
+// Copyright (C) 2015-2016 Zireael (zireael dot nk at gmail dot com)
+//  Distributed under the Boost Software License, Version 1.0.
+//       (See accompanying file LICENSE.md or copy at
+//           http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef __PNGSTEGO_METRICS_H
+#define __PNGSTEGO_METRICS_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <ostream>
+#include <string>
+#include <vector>
+#include "stageevent.h"
+
+namespace PNGStego {
+
+enum class Operation : uint8_t {
+	Encode,
+	Decode
+};
+
+/** Why an encode or a decode has failed */
+enum class FailureCause : uint8_t {
+	CorruptedHeader, // nothing's been found with the key
+	Authentication,  // the header's fine but the ciphertext doesn't authenticate
+	Capacity,        // the payload doesn't fit
+	Cancelled,
+	Argument,        // an empty key, a missing file and so on
+	Memory,
+	Other
+};
+
+const size_t OPERATION_COUNT = 2;
+const size_t FAILURE_CAUSE_COUNT = 7;
+const size_t STAGE_COUNT = static_cast<size_t>(Stage::Save) + 1;
+
+/** Returns the operation's name, e.g. "encode" */
+const char* operationName(Operation operation) noexcept;
+/** Returns the cause's name, e.g. "corrupted-header" */
+const char* failureCauseName(FailureCause cause) noexcept;
+/** Tells what an exception thrown by encode/decode means */
+FailureCause classifyFailure(std::exception_ptr error) noexcept;
+
+enum class MetricsFormat {
+	Prometheus, // the text exposition format
+	JSON
+};
+
+/**
+ ** Latencies kept in buckets whose width grows with the value, like HDR histograms do:
+ ** each power of two is split into SUB_BUCKETS buckets, so any value is off by at most 1/16.
+ ** Values are nanoseconds, anything past 2^MAX_EXPONENT (about 4.9 hours) goes into the last bucket.
+ **/
+namespace Histogram {
+	const unsigned SUB_BUCKET_BITS = 4;
+	const unsigned SUB_BUCKETS = 1U << SUB_BUCKET_BITS;
+	const unsigned MAX_EXPONENT = 44;
+	const size_t BUCKETS = SUB_BUCKETS + (MAX_EXPONENT - SUB_BUCKET_BITS) * SUB_BUCKETS;
+
+	/** Returns the bucket a value goes into */
+	size_t bucket(uint64_t value) noexcept;
+	/** Returns the largest value that goes into the bucket */
+	uint64_t bucketLimit(size_t bucket) noexcept;
+}
+
+/** Numbers of one stage */
+struct StageMetrics {
+	uint64_t count;
+	uint64_t nanoseconds; // all of them together
+	uint64_t inputBytes;
+	uint64_t outputBytes;
+	std::vector<uint64_t> buckets; // Histogram::BUCKETS of them
+
+	/** Returns an upper bound of the given percentile of latencies, 0 if there are none */
+	uint64_t percentile(double p) const noexcept;
+};
+
+/** Everything the registry knows at one moment */
+struct MetricsSnapshot {
+	uint64_t operations[OPERATION_COUNT];
+	uint64_t failures[OPERATION_COUNT][FAILURE_CAUSE_COUNT];
+	StageMetrics stages[STAGE_COUNT];
+	uint64_t pixelBytes;       // decoded pixels in memory right now
+	uint64_t peakPixelBytes;   // the most there have ever been at once
+	uint64_t payloadBytes;     // payload buffers of encodes & decodes in progress
+	uint64_t peakPayloadBytes;
+	uint64_t peakWorkingBytes; // the most pixels and payloads together have ever taken
+
+	/** Returns bytes written into pixels, the header included */
+	uint64_t embeddedBytes() const noexcept;
+	/** Returns bytes read from pixels, the header included */
+	uint64_t extractedBytes() const noexcept;
+	void write(std::ostream &stream, MetricsFormat format) const;
+};
+
+/**
+ ** Process-wide numbers of everything the library does.
+ ** Recording never takes a lock: each thread gets a shard of relaxed atomic counters
+ ** (threads only share one past MAX_SHARDS of them) and snapshots add shards up.
+ ** StageTimer reports every stage here, whether there's an EventFn or not.
+ **/
+class Metrics {
+public:
+	static const size_t MAX_SHARDS = 32;
+
+	/** Returns the registry, it lives until the process exits */
+	static Metrics& global();
+
+	Metrics(const Metrics &other) = delete;
+	Metrics& operator=(const Metrics &other) = delete;
+
+	void recordOperation(Operation operation) noexcept;
+	void recordFailure(Operation operation, FailureCause cause) noexcept;
+	void recordStage(Stage stage, uint64_t nanoseconds, uint64_t inputBytes, uint64_t outputBytes) noexcept;
+	/** Keeps track of memory taken by decoded pixels */
+	void pixelsAllocated(uint64_t bytes) noexcept;
+	void pixelsReleased(uint64_t bytes) noexcept;
+	/** Keeps track of memory taken by PayloadBuffer */
+	void payloadAllocated(uint64_t bytes) noexcept;
+	void payloadReleased(uint64_t bytes) noexcept;
+
+	/** Adds shards up, numbers recorded meanwhile may or may not make it */
+	MetricsSnapshot snapshot() const;
+	/** Writes a snapshot into a file, replacing it at once so readers never see half of it */
+	void dump(const std::string &filename, MetricsFormat format) const;
+
+private:
+	struct Shard;
+
+	std::atomic<Shard*> shards[MAX_SHARDS];
+	std::atomic<size_t> nextShard;
+	// Gauges need one value for the whole process, they're only touched once per buffer
+	std::atomic<uint64_t> pixelBytes;
+	std::atomic<uint64_t> peakPixelBytes;
+	std::atomic<uint64_t> payloadBytes;
+	std::atomic<uint64_t> peakPayloadBytes;
+	std::atomic<uint64_t> workingBytes;
+	std::atomic<uint64_t> peakWorkingBytes;
+
+	Metrics() noexcept;
+	/** Returns the calling thread's shard, nullptr if there's no memory for it */
+	Shard* shard() noexcept;
+};
+
+/** Counts an encode or a decode of any container in the global registry and, if it throws, why it's failed */
+template <class Fn>
+void measured(Operation operation, Fn fn) {
+	Metrics::global().recordOperation(operation);
+	try {
+		fn();
+	}
+	catch (...) {
+		Metrics::global().recordFailure(operation, classifyFailure(std::current_exception()));
+		throw;
+	}
+}
+
+/** Returns the format a file's name asks for: JSON for ".json", Prometheus for anything else */
+MetricsFormat metricsFormatFor(const std::string &filename) noexcept;
+
+/**
+ ** Makes the process dump global metrics into the file each time it gets the signal, e.g. SIGUSR1.
+ ** Files are written by a thread of its own, not in the signal handler. Calling it again changes the file.
+ ** Returns false where signals can't be caught this way (Windows).
+ **/
+bool dumpMetricsOnSignal(int signal, const std::string &filename, MetricsFormat format);
+
+} // namespace PNGStego
+#endif
\ No newline at end of file
@@ -0,0 +1,56 @@
+//
+// Copyright (C) 2015-2016 Zireael (zireael dot nk at gmail dot com)
+//  Distributed under the Boost Software License, Version 1.0.
+//       (See accompanying file LICENSE.md or copy at
+//           http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef __PNGSTEGO_PAYLOAD_BUFFER_H
+#define __PNGSTEGO_PAYLOAD_BUFFER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace PNGStego {
+
+/**
+ ** Bytes of a payload on their way into or out of an image.
+ ** Each stage of the pipeline transforms one of these in place or writes into another one,
+ ** so an encode holds a single buffer and a decode two, sized once wherever the final size is known.
+ ** Memory comes from SecurePool, growing moves into a larger block and the old one's wiped as it goes back;
+ ** everything's wiped on release. All of it is counted in the process-wide metrics.
+ **/
+class PayloadBuffer {
+public:
+	PayloadBuffer() noexcept;
+	PayloadBuffer(const PayloadBuffer &other) = delete;
+	PayloadBuffer& operator=(const PayloadBuffer &other) = delete;
+	~PayloadBuffer();
+
+	uint8_t* data() noexcept;
+	const uint8_t* data() const noexcept;
+	size_t size() const noexcept;
+	size_t capacity() const noexcept;
+
+	/** Makes room for at least 'capacity' bytes, keeping the contents */
+	void reserve(size_t capacity);
+	/** Changes the size, bytes past the old one are left as they are. Grows at least twofold once it's out of room */
+	void resize(size_t size);
+	/** Appends bytes */
+	void append(const uint8_t *data, size_t size);
+	/** Drops the first 'count' bytes, moving the rest to the front */
+	void consume(size_t count) noexcept;
+	/** Wipes the memory and gives it back */
+	void release() noexcept;
+	/** Copies the contents into a vector of exactly their size and releases the buffer */
+	void moveTo(std::vector<uint8_t> &target);
+
+private:
+	uint8_t *memory; // a SecurePool block
+	size_t allocated;
+	size_t used;
+};
+
+} // namespace PNGStego
+#endif
\ No newline at end of file
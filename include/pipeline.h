@@ -0,0 +1,56 @@
+//
+// Copyright (C) 2015-2016 Zireael (zireael dot nk at gmail dot com)
+//  Distributed under the Boost Software License, Version 1.0.
+//       (See accompanying file LICENSE.md or copy at
+//           http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef __PNGSTEGO_PIPELINE_H
+#define __PNGSTEGO_PIPELINE_H
+
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace PNGStego {
+
+/** How many threads run a stage and how many items may wait for it */
+struct StageLimits {
+	size_t threads;
+	size_t queueDepth;
+};
+
+/**
+ ** Items go through a series of stages, each with its own threads and a bounded queue in front of it.
+ ** A stage that can't hand an item over to a full queue waits, so a slow stage holds back
+ ** the ones before it instead of letting finished items pile up in memory.
+ ** That way reading the next files, decoding them, key derivation and writing all happen at once.
+ **/
+class Pipeline {
+public:
+	/** Does a stage's work on the given item, throwing drops the item */
+	typedef std::function<void(size_t)> StageFn;
+
+	/** Adds a stage after the existing ones */
+	void addStage(const std::string &name, const StageFn &fn, const StageLimits &limits);
+
+	/**
+	 ** Runs items [0; count) through every stage, in order.
+	 ** 'report' gets called once an item's passed the last stage, with an empty string,
+	 ** or once one of the stages has thrown, with the name of the stage and the reason of the failure;
+	 ** calls to it never overlap. Returns the number of failed items.
+	 **/
+	size_t run(size_t count, const std::function<void(size_t, const std::string&)> &report);
+
+private:
+	struct Stage {
+		std::string name;
+		StageFn fn;
+		StageLimits limits;
+	};
+	std::vector<Stage> stages;
+};
+
+} // namespace PNGStego
+#endif
\ No newline at end of file
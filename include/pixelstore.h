@@ -0,0 +1,238 @@
+//
+// Copyright (C) 2015-2016 Zireael (zireael dot nk at gmail dot com)
+//  Distributed under the Boost Software License, Version 1.0.
+//       (See accompanying file LICENSE.md or copy at
+//           http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef __PNGSTEGO_PIXEL_STORE_H
+#define __PNGSTEGO_PIXEL_STORE_H
+
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+#include <vector>
+#include "pixelview.h"
+
+const uint64_t COPY_ON_WRITE_TILE_PIXELS = 1 << 16; // pixels copied at once by CopyOnWriteStore
+
+namespace PNGStego {
+
+/** A run of samples of one channel, consecutive pixels are 'stride' bytes apart */
+struct ChannelRun {
+	uint8_t *data;
+	size_t stride;
+	uint64_t count;
+};
+
+/** Something that holds pixels of an image, wherever they are kept */
+class PixelStore {
+public:
+	virtual ~PixelStore() {}
+
+	/** Returns the number of pixels */
+	virtual uint64_t size() const noexcept = 0;
+	/** Returns the layout of a pixel */
+	virtual PixelFormat format() const noexcept = 0;
+	/**
+	 ** Returns how many bytes a sample takes, 2 for 16-bit images, which are kept big-endian as in a PNG file.
+	 ** Channel runs of those point at the low byte of each sample, the high one never gets changed.
+	 **/
+	virtual size_t sampleBytes() const noexcept {
+		return 1;
+	}
+	/**
+	 ** Returns samples of the given channel starting at the given pixel.
+	 ** The run covers at least that pixel and stays valid
+	 ** until the store is asked for another one.
+	 **/
+	virtual ChannelRun channel(uint64_t pixel, Channel channel) = 0;
+	/**
+	 ** Same as channel(), but the run is only read and mustn't be written through,
+	 ** so stores that copy pixels before they may be written don't have to.
+	 **/
+	virtual ChannelRun readChannel(uint64_t pixel, Channel channel) {
+		return this->channel(pixel, channel);
+	}
+	/** Returns a deep copy of the store */
+	virtual std::unique_ptr<PixelStore> clone() const = 0;
+	/** Copies 'length' bytes of samples, interleaved as in a PNG row, starting at the given byte into 'destination' */
+	virtual void read(uint64_t offset, uint8_t *destination, size_t length) = 0;
+};
+
+/**
+ ** Samples an encode has changed along with what they were, so they can be put back.
+ ** Each one takes 8 bytes, pixels past 2^48 can't be recorded.
+ **/
+class UndoLog {
+public:
+	/** Remembers the sample's value before it gets changed */
+	void record(uint64_t pixel, Channel channel, uint8_t value) {
+		entries.push_back(pixel << 16 | static_cast<uint64_t>(channel) << 8 | value);
+	}
+
+	/** Puts every recorded sample back, the latest change first, and empties the log */
+	void restore(PixelStore &store);
+	/** Forgets recorded samples, leaving them as they are */
+	void clear() noexcept;
+	/** Returns the number of recorded changes */
+	size_t size() const noexcept;
+
+private:
+	std::vector<uint64_t> entries; // pixel << 16 | channel << 8 | old value
+};
+
+/**
+ ** Gives access to one channel of a store, pixel by pixel.
+ ** Only asks the store for a new run once a pixel is outside of the current one,
+ ** which makes walking through pixels in order cheap for any store.
+ **/
+class ChannelCursor {
+public:
+	ChannelCursor(PixelStore &store, Channel channel) noexcept
+		: store(store), channel(channel), first(0)
+	{
+		run.data = nullptr;
+		run.stride = 0;
+		run.count = 0;
+	}
+
+	/** Returns a reference to the channel's sample of the given pixel */
+	uint8_t& operator[](uint64_t pixel) {
+		// Pixels before the run wrap around and end up past its end too
+		if (pixel - first >= run.count) {
+			run = store.channel(pixel, channel);
+			first = pixel;
+		}
+		return run.data[(pixel - first) * run.stride];
+	}
+
+	/** Sets the given bit of the given pixel's sample, recording the old sample in the log if it changes and there is one */
+	void setBit(uint64_t pixel, int index, bool bit, UndoLog *log = nullptr) {
+		uint8_t &sample = (*this)[pixel];
+		if (((sample >> index) & 1) != bit) {
+			if (log)
+				log->record(pixel, channel, sample);
+			sample ^= static_cast<uint8_t>(1 << index);
+		}
+	}
+
+	/** Same as setBit() for the lowest bit */
+	void setLowBit(uint64_t pixel, bool bit, UndoLog *log = nullptr) {
+		this->setBit(pixel, 0, bit, log);
+	}
+
+private:
+	PixelStore &store;
+	Channel channel;
+	uint64_t first;
+	ChannelRun run;
+};
+
+/** Same as ChannelCursor for reading samples only, goes through PixelStore::readChannel() */
+class ChannelReader {
+public:
+	ChannelReader(PixelStore &store, Channel channel) noexcept
+		: store(store), channel(channel), first(0)
+	{
+		run.data = nullptr;
+		run.stride = 0;
+		run.count = 0;
+	}
+
+	/** Returns the channel's sample of the given pixel */
+	uint8_t operator[](uint64_t pixel) {
+		if (pixel - first >= run.count) {
+			run = store.readChannel(pixel, channel);
+			first = pixel;
+		}
+		return run.data[(pixel - first) * run.stride];
+	}
+
+private:
+	PixelStore &store;
+	Channel channel;
+	uint64_t first;
+	ChannelRun run;
+};
+
+/**
+ ** Keeps all pixels in memory, either interleaved or split into planes.
+ ** Planes of 16-bit pixels hold one byte each, high bytes of a channel come before its low bytes.
+ **/
+class MemoryStore : public PixelStore {
+public:
+	MemoryStore(uint64_t count, PixelFormat format, SampleLayout layout, size_t sampleBytes = 1);
+	MemoryStore(const MemoryStore &other);
+	MemoryStore& operator=(const MemoryStore &other) = delete;
+	~MemoryStore();
+
+	uint64_t size() const noexcept override;
+	PixelFormat format() const noexcept override;
+	size_t sampleBytes() const noexcept override;
+	ChannelRun channel(uint64_t pixel, Channel channel) override;
+	std::unique_ptr<PixelStore> clone() const override;
+	void read(uint64_t offset, uint8_t *destination, size_t length) override;
+
+	/** Returns whether samples are interleaved or split into planes */
+	SampleLayout layout() const noexcept;
+	/** Rearranges samples into the given layout */
+	void setLayout(SampleLayout layout);
+
+	/** Returns all samples */
+	std::vector<uint8_t>& samples() noexcept;
+	/** Returns all samples */
+	const std::vector<uint8_t>& samples() const noexcept;
+	/** Returns pointers to the first byte of each plane, only makes sense for planar samples */
+	std::vector<uint8_t*> planes();
+
+private:
+	uint64_t count;
+	PixelFormat pixelFormat;
+	SampleLayout sampleLayout;
+	size_t bytesPerSample;
+	std::vector<uint8_t> data;
+};
+
+/**
+ ** Pixels of a MemoryStore shared with other stores until they get written.
+ ** The image is split into tiles of COPY_ON_WRITE_TILE_PIXELS pixels and a tile's copied the first time a run of it
+ ** is asked for by channel(), since runs may be written through. The offset walk starts at the first pixel and the IV's
+ ** in the middle, so encoding a small payload copies only a few tiles; readChannel() & read() never copy any,
+ ** and they don't change the store, so any number of threads may read it at once.
+ ** The shared store mustn't change as long as it's shared.
+ **/
+class CopyOnWriteStore : public PixelStore {
+public:
+	explicit CopyOnWriteStore(std::shared_ptr<const MemoryStore> shared);
+	CopyOnWriteStore(const CopyOnWriteStore &other);
+	CopyOnWriteStore& operator=(const CopyOnWriteStore &other) = delete;
+	~CopyOnWriteStore();
+
+	uint64_t size() const noexcept override;
+	PixelFormat format() const noexcept override;
+	size_t sampleBytes() const noexcept override;
+	/** The run ends at the end of the tile the pixel is in */
+	ChannelRun channel(uint64_t pixel, Channel channel) override;
+	/** Runs of tiles that haven't been copied point into the shared store, they end at the end of the tile too */
+	ChannelRun readChannel(uint64_t pixel, Channel channel) override;
+	/** Shares the same pixels, tiles copied so far get copied again */
+	std::unique_ptr<PixelStore> clone() const override;
+	void read(uint64_t offset, uint8_t *destination, size_t length) override;
+
+	/** Returns the number of tiles that have been copied */
+	size_t copiedTiles() const noexcept;
+
+private:
+	std::shared_ptr<const MemoryStore> shared;
+	std::vector<std::vector<uint8_t>> tiles; // empty ones are still shared
+	size_t copied;
+
+	/** Returns the number of pixels in the given tile */
+	uint64_t tilePixels(size_t tile) const noexcept;
+	/** Returns the given byte of the given pixel, wherever it is */
+	uint8_t sample(uint64_t pixel, size_t index) const noexcept;
+};
+
+} // namespace PNGStego
+#endif
\ No newline at end of file
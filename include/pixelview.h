@@ -0,0 +1,137 @@
+//
+// Copyright (C) 2015-2016 Zireael (zireael dot nk at gmail dot com)
+//  Distributed under the Boost Software License, Version 1.0.
+//       (See accompanying file LICENSE.md or copy at
+//           http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef __PNGSTEGO_PIXEL_VIEW_H
+#define __PNGSTEGO_PIXEL_VIEW_H
+
+#include <cstdint>
+#include <cstddef>
+
+namespace PNGStego {
+
+/** Color channels of a pixel */
+enum class Channel : uint8_t {
+	Red,
+	Green,
+	Blue,
+	Alpha
+};
+
+/**
+ ** Layouts pixels are stored in, 8 or 16 bits per sample.
+ ** The value of each layout is the number of samples per pixel.
+ **/
+enum class PixelFormat : uint8_t {
+	Gray      = 1,
+	GrayAlpha = 2,
+	RGB       = 3,
+	RGBA      = 4
+};
+
+/** Ways samples of an image can be arranged in memory */
+enum class SampleLayout : uint8_t {
+	Interleaved, // all samples of a pixel are next to each other, as in a PNG file
+	Planar       // every channel is a separate plane of samples
+};
+
+/** Returns the number of samples (bytes) a pixel of the given layout occupies */
+inline size_t channelCount(PixelFormat format) noexcept {
+	return static_cast<size_t>(format);
+}
+
+/**
+ ** Returns the number of bytes a pixel of the given layout occupies when each sample takes 'sampleBytes' bytes.
+ ** 16-bit samples are kept big-endian, as in a PNG file.
+ **/
+inline size_t bytesPerPixel(PixelFormat format, size_t sampleBytes) noexcept {
+	return channelCount(format) * sampleBytes;
+}
+
+/** Returns whether red, green and blue are the same sample in the given layout */
+inline bool isGray(PixelFormat format) noexcept {
+	return format == PixelFormat::Gray || format == PixelFormat::GrayAlpha;
+}
+
+/**
+ ** Returns the position of the given channel's sample within an interleaved pixel.
+ ** In gray layouts red, green and blue refer to the same sample,
+ ** layouts without alpha refer to the last color sample instead.
+ **/
+inline size_t channelOffset(PixelFormat format, Channel channel) noexcept {
+	static const uint8_t offsets[5][4] = {
+		{ 0, 0, 0, 0 }, // unused
+		{ 0, 0, 0, 0 }, // Gray
+		{ 0, 0, 0, 1 }, // GrayAlpha
+		{ 0, 1, 2, 2 }, // RGB
+		{ 0, 1, 2, 3 }  // RGBA
+	};
+	return offsets[static_cast<size_t>(format)][static_cast<size_t>(channel)];
+}
+
+/**
+ ** Returns the position of the given channel's lowest byte within an interleaved pixel,
+ ** the only one of a 16-bit sample that ever gets changed.
+ **/
+inline size_t lowByteOffset(PixelFormat format, Channel channel, size_t sampleBytes) noexcept {
+	return channelOffset(format, channel) * sampleBytes + sampleBytes - 1;
+}
+
+/** Returns the channel the given sample of an interleaved pixel belongs to, the opposite of channelOffset() */
+inline Channel sampleChannel(PixelFormat format, size_t index) noexcept {
+	return isGray(format) && index == 1 ? Channel::Alpha : static_cast<Channel>(index);
+}
+
+/**
+ ** Gives access to channels of pixels stored in their native layout,
+ ** either interleaved or split into planes.
+ ** See channelOffset() for how channels map onto samples, channels of 16-bit pixels
+ ** are their low bytes (see lowByteOffset()).
+ **/
+class PixelView {
+public:
+	PixelView(uint8_t *data, size_t count, PixelFormat format,
+	          SampleLayout layout = SampleLayout::Interleaved, size_t sampleBytes = 1) noexcept
+		: data(data), count(count)
+	{
+		for (size_t k = 0; k < 4; ++k)
+			offsets[k] = lowByteOffset(format, static_cast<Channel>(k), sampleBytes);
+
+		if (layout == SampleLayout::Planar) {
+			// Byte #i of a pixel is in plane #i
+			stride = 1;
+			for (size_t &offset : offsets)
+				offset *= count;
+		}
+		else {
+			stride = bytesPerPixel(format, sampleBytes);
+		}
+	}
+
+	/** Returns the number of pixels */
+	size_t size() const noexcept {
+		return count;
+	}
+
+	/** Returns a reference to the given channel of the given pixel */
+	uint8_t& operator()(size_t pixel, Channel channel) noexcept {
+		return data[pixel * stride + offsets[static_cast<size_t>(channel)]];
+	}
+
+	/** Returns the given channel of the given pixel */
+	uint8_t operator()(size_t pixel, Channel channel) const noexcept {
+		return data[pixel * stride + offsets[static_cast<size_t>(channel)]];
+	}
+
+private:
+	uint8_t *data;
+	size_t count;
+	size_t stride;
+	size_t offsets[4];
+};
+
+} // namespace PNGStego
+#endif
\ No newline at end of file
@@ -0,0 +1,33 @@
+//
+// Copyright (C) 2015-2016 Zireael (zireael dot nk at gmail dot com)
+//  Distributed under the Boost Software License, Version 1.0.
+//       (See accompanying file LICENSE.md or copy at
+//           http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef __PNGSTEGO_PLANAR_H
+#define __PNGSTEGO_PLANAR_H
+
+#include <cstdint>
+#include <cstddef>
+
+namespace PNGStego {
+namespace Planar {
+
+/**
+ ** Splits 'count' pixels of 'channels' interleaved bytes each
+ ** into separate planes, byte #i of a pixel goes to planes[i].
+ ** Uses SSSE3 for 2 to 4 channels if the CPU supports it.
+ **/
+void deinterleave(const uint8_t *source, size_t count, size_t channels, uint8_t *const *planes) noexcept;
+
+/**
+ ** Merges 'count' pixels of 'channels' bytes each
+ ** from separate planes into interleaved samples.
+ ** Uses SSSE3 for 2 to 4 channels if the CPU supports it.
+ **/
+void interleave(const uint8_t *const *planes, size_t count, size_t channels, uint8_t *destination) noexcept;
+
+} // namespace Planar
+} // namespace PNGStego
+#endif
\ No newline at end of file
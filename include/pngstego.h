@@ -0,0 +1,112 @@
+/*
+ * Copyright (C) 2015-2016 Zireael (zireael dot nk at gmail dot com)
+ *  Distributed under the Boost Software License, Version 1.0.
+ *       (See accompanying file LICENSE.md or copy at
+ *           http://www.boost.org/LICENSE_1_0.txt)
+ */
+
+#ifndef __PNGSTEGO_C_API_H
+#define __PNGSTEGO_C_API_H
+
+/*
+  C interface of libpngstego, for programs that can't use PNGStego::PNGFile directly.
+  Nothing in here throws: every function that can fail returns a status
+  and pngstego_last_error() tells the reason.
+  Buffers the library hands out belong to the caller, who has to release them with pngstego_free().
+  Buffers the caller hands in are only read during the call and never kept.
+  An image may only be used by one thread at a time, different images don't affect each other.
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(_WIN32) && defined(PNGSTEGO_SHARED)
+#ifdef PNGSTEGO_BUILDING
+#define PNGSTEGO_API __declspec(dllexport)
+#else
+#define PNGSTEGO_API __declspec(dllimport)
+#endif
+#elif defined(__GNUC__)
+#define PNGSTEGO_API __attribute__((visibility("default")))
+#else
+#define PNGSTEGO_API
+#endif
+
+/** Bumped whenever the interface changes in an incompatible way */
+#define PNGSTEGO_API_VERSION 1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+	PNGSTEGO_OK = 0,
+	PNGSTEGO_ERROR_ARGUMENT = 1,    /* a null pointer, an unknown option, no image loaded and so on */
+	PNGSTEGO_ERROR_FORMAT = 2,      /* the data isn't a PNG image or it's corrupted */
+	PNGSTEGO_ERROR_CAPACITY = 3,    /* the payload doesn't fit into the image */
+	PNGSTEGO_ERROR_KEY = 4,         /* nothing was found with the given key */
+	PNGSTEGO_ERROR_MEMORY = 5,
+	PNGSTEGO_ERROR_INTERNAL = 6
+} pngstego_status;
+
+typedef enum {
+	PNGSTEGO_OPTION_MEMORY_BUDGET = 1, /* bytes decoded pixels may take before going into a scratch file, 0 means no limit */
+	PNGSTEGO_OPTION_PLANAR = 2         /* 1 keeps samples split into planes, 0 interleaved */
+} pngstego_option;
+
+typedef struct {
+	uint32_t width;
+	uint32_t height;
+	uint32_t channels;  /* 1 - gray, 2 - gray & alpha, 3 - RGB, 4 - RGBA */
+	uint32_t bit_depth; /* 1, 2, 4, 8 or 16 from pngstego_probe(), 8 or 16 from pngstego_get_info() */
+} pngstego_info;
+
+/** An image and its settings */
+typedef struct pngstego_image pngstego_image;
+
+/** Returns PNGSTEGO_API_VERSION the library's been built with */
+PNGSTEGO_API int pngstego_api_version(void);
+
+/** Returns the reason of the last failure on the calling thread, never null */
+PNGSTEGO_API const char* pngstego_last_error(void);
+
+/** Reads the header of a PNG image without decoding it, so palettes count as RGB whether or not they have transparency */
+PNGSTEGO_API pngstego_status pngstego_probe(const uint8_t *data, size_t size, pngstego_info *info);
+
+/** Creates an empty image, *image is null on failure */
+PNGSTEGO_API pngstego_status pngstego_create(pngstego_image **image);
+
+/** Destroys an image, null is fine */
+PNGSTEGO_API void pngstego_destroy(pngstego_image *image);
+
+/** Changes a setting, applies to further loads */
+PNGSTEGO_API pngstego_status pngstego_set_option(pngstego_image *image, pngstego_option option, uint64_t value);
+
+/** Decodes a PNG image from memory, replacing the loaded one */
+PNGSTEGO_API pngstego_status pngstego_load(pngstego_image *image, const uint8_t *data, size_t size);
+
+/** Describes the loaded image as it's been decoded: palettes with transparency are RGBA, narrow samples are brought to 8 bits */
+PNGSTEGO_API pngstego_status pngstego_get_info(const pngstego_image *image, pngstego_info *info);
+
+/** Embeds 'size' bytes of data and an extension (may be null) into the loaded image */
+PNGSTEGO_API pngstego_status pngstego_encode(pngstego_image *image, const uint8_t *data, size_t size,
+                                             const char *extension, const char *key, size_t key_size);
+
+/**
+ ** Extracts data from the loaded image. *data gets 'size' bytes and *extension a null-terminated string,
+ ** both have to be released with pngstego_free(). Pass null as 'extension' if it's of no interest.
+ **/
+PNGSTEGO_API pngstego_status pngstego_decode(const pngstego_image *image, const char *key, size_t key_size,
+                                             uint8_t **data, size_t *size, char **extension);
+
+/** Encodes the loaded image as PNG, *data gets 'size' bytes that have to be released with pngstego_free() */
+PNGSTEGO_API pngstego_status pngstego_save(pngstego_image *image, uint8_t **data, size_t *size);
+
+/** Wipes 'size' bytes of a buffer the library's handed out and releases it, null is fine */
+PNGSTEGO_API void pngstego_free(void *buffer, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
\ No newline at end of file
@@ -12,18 +12,25 @@
 #include <string>
 #include <vector>
 #include <functional>
+#include <memory>
+#include <mutex>
+#include <future>
 #include <cryptopp/serpent.h>
+#include "executor.h"
+#include "pixelstore.h"
+#include "stegoengine.h"
 
 typedef unsigned char byte;
+struct png_struct_def;
 
 namespace PNGStego {
 
 class PNGFile {
 public:
 	struct Pixel {
-		uint8_t blue;
-		uint8_t green;
 		uint8_t red;
+		uint8_t green;
+		uint8_t blue;
 		uint8_t alpha;
 
 		bool operator==(const PNGFile::Pixel &other) const {
@@ -49,6 +56,8 @@ public:
 	PNGFile(const std::string &filename);
 	/** Loads a PNG file from the given std::istream */
 	PNGFile(std::istream &stream);
+	/** Loads a PNG file from the given memory buffer */
+	PNGFile(const uint8_t *data, size_t size);
 
 	/** Swaps content between two files */
 	void swap(PNGFile &other);
@@ -64,8 +73,46 @@ public:
 	uint32_t getWidth();
 	/** Returns the image's height */
 	uint32_t getHeight();
-	/** Returns a constant reference to an internal representation of the image */
-	const std::vector<Pixel>& getPixels();
+	/** Returns the layout pixels are stored in */
+	PixelFormat getFormat() const;
+	/**
+	 ** Returns the number of bits per sample, 8 or 16. 16-bit images are kept and saved as they are,
+	 ** only the low byte of a sample is ever changed; images with fewer bits are brought to 8.
+	 **/
+	int getBitDepth() const;
+	/** Returns whether samples are interleaved or split into planes */
+	SampleLayout getSampleLayout() const;
+	/**
+	 ** Chooses whether samples are kept interleaved (default) or split into planes.
+	 ** Planes let encode/decode go through the channel they need without
+	 ** pulling the other ones into cache, which pays off for large payloads.
+	 ** Converts the loaded image if there is one and applies to further loads.
+	 ** Images kept in a scratch file are always interleaved.
+	 **/
+	void setSampleLayout(SampleLayout layout);
+	/**
+	 ** Limits how much memory decoded pixels may occupy, in bytes (0, the default, means no limit).
+	 ** Images that don't fit get loaded into a scratch file in the given directory
+	 ** (the system's temporary directory if it's empty) which is mapped in tiles.
+	 ** Applies to further loads.
+	 **/
+	void setMemoryBudget(uint64_t bytes, const std::string &scratchDirectory = "");
+	/**
+	 ** Chooses whether images get decoded and encoded by zlib and SIMD row filters of our own (the default)
+	 ** or by libpng alone. Either way the pixels are the same; libpng still takes care of what the fast path
+	 ** doesn't handle: interlaced, 16-bit and sub-8-bit gray images, scratch files, streams and damaged files.
+	 **/
+	void setFastCodec(bool enabled);
+	/** Returns whether the loaded image lives in a scratch file rather than in memory */
+	bool isTiled() const;
+	/**
+	 ** Returns a constant reference to an internal representation of the image, samples in their native layout
+	 ** (16-bit ones big-endian).
+	 ** Throws if the image is kept in a scratch file or shared with a snapshot.
+	 **/
+	const std::vector<uint8_t>& getPixels();
+	/** Returns the pixel at the given index, expanded to RGBA, 16-bit samples reduced to their high bytes */
+	Pixel getPixel(uint64_t index) const;
 
 	/** Loads a PNG file from a file with the given filename */
 	void load(const std::string &filename);
@@ -77,25 +124,78 @@ public:
 	/** Outputs a PNG file into the given std::ostream */
 	void save(std::ostream &stream);
 
+	/** Loads a PNG file from the given memory buffer, without copying it */
+	void load(const uint8_t *data, size_t size);
+	/** Loads a PNG file from the given std::vector, without copying it */
+	void load(const std::vector<uint8_t> &buffer);
+	/**
+	 ** Appends a PNG file to the given std::vector.
+	 ** Space for the whole file is reserved beforehand, based on the size of the loaded one.
+	 **/
+	void save(std::vector<uint8_t> &buffer);
+	/** Returns a PNG file as an std::vector */
+	std::vector<uint8_t> save();
+
 	/** Sets a function that gets called each time decode/encode do something */
 	void setOutputFn(const std::function<void(const std::string&)> &fn);
 	/** Sets a function that gets called each time decode/encode do something */
 	void setOutputFn(std::function<void(const std::string&)> &&fn);
+	/**
+	 ** Sets a function that gets called as each stage of load/encode/decode/save starts and finishes,
+	 ** with timestamps and byte counts. Replaces the one set by setOutputFn() and the other way round.
+	 **/
+	void setEventFn(const EventFn &fn);
 
+	/** Chooses how densely further encodes pack data into pixels (see EmbeddingProfile), decodes read it from the header */
+	void setEmbeddingProfile(EmbeddingProfile profile);
+	/**
+	 ** Makes further encodes remember every sample they change, or stops that and forgets them.
+	 ** restore() then puts the image back the way it was when recording started, in time proportional
+	 ** to the number of changed samples rather than to the image's size, so one decoded cover can take
+	 ** any number of encodes in turn without being loaded or copied again.
+	 **/
+	void recordChanges(bool enabled = true);
+	/** Undoes every change recorded since recordChanges() or the last restore() and goes on recording */
+	void restore();
+	/**
+	 ** Returns a copy of the image that shares its pixels until either of them is encoded into,
+	 ** only the tiles an encode touches get copied (see CopyOnWriteStore). The image starts sharing its
+	 ** pixels too, so both may be encoded into and saved on their own, and snapshots of a snapshot are as cheap.
+	 ** Throws if the image is kept in a scratch file.
+	 **/
+	PNGFile snapshot();
 	/** Returns capacity of the PNG file with the given seed, in bytes */
-	uint32_t capacity(uint32_t seed) const noexcept;
+	uint64_t capacity(uint32_t seed) const noexcept;
 	/** Embeds data from a file with the given filename into the PNG file, using the given key */
 	void encode(const std::string &filename, const std::string &key);
-	/** Embeds data from a given vector and string using the given key */
-	void encode(const std::vector<uint8_t> &data, const std::string &extension, const std::string &key);
+	/** Embeds data from a given vector and string using the given key, throws Cancelled once the token's cancelled */
+	void encode(const std::vector<uint8_t> &data, const std::string &extension, const std::string &key,
+	            const CancellationToken &token = CancellationToken::none());
 	/**
 	 ** Extracts data from the PNG file using the given key and saves it
 	 ** into a file with the given filename.
 	 ** In case of file I/O failure if the 3rd parameter is not nullptr, puts data there.
 	 **/
 	void decode(std::string filename, const std::string &key, std::vector<uint8_t> *backup = nullptr) const;
-	/** Extracts data from the PNG file using the given key, puts it into the 1st and 2nd parameters. */
-	void decode(std::vector<uint8_t> &data, std::string &extension, const std::string &key) const;
+	/** Extracts data from the PNG file using the given key, puts it into the 1st and 2nd parameters. Throws Cancelled once the token's cancelled */
+	void decode(std::vector<uint8_t> &data, std::string &extension, const std::string &key,
+	            const CancellationToken &token = CancellationToken::none()) const;
+
+	/**
+	 ** Same as encode(), but runs on the given executor and returns at once.
+	 ** The image mustn't be touched until the future's ready, the key gets wiped once it's been used.
+	 ** Cancelling the token makes the future throw Cancelled and gives the thread back to the executor soon after.
+	 **/
+	std::future<void> encodeAsync(std::vector<uint8_t> data, std::string extension, std::string key,
+	                              Executor &executor = WorkStealingPool::shared(),
+	                              const CancellationToken &token = CancellationToken::none());
+	/**
+	 ** Same as decode(), but runs on the given executor and returns at once.
+	 ** Any number of decodes may run on the same image at the same time,
+	 ** the image just has to outlive them and not get changed meanwhile.
+	 **/
+	std::future<Payload> decodeAsync(std::string key, Executor &executor = WorkStealingPool::shared(),
+	                                 const CancellationToken &token = CancellationToken::none()) const;
 
 	~PNGFile();
 
@@ -114,21 +214,32 @@ public:
 	**/
 	void setCSPRNG(std::function<void(uint8_t *, size_t)> &&fn);
 private:
+	typedef void (*IOFunction)(png_struct_def *, uint8_t *, size_t);
+
 	struct {
-		uint32_t width, height, BitsPerPixel;
+		uint32_t width, height;
 		int32_t BitDepth, ColorType, InterlaceType, CompressionType, FilterType, Channels;
+		PixelFormat format;
 	} params;
-	
-	std::vector<Pixel> pixels;	
-	std::vector<uint8_t> salt;
-	std::vector<byte> iv;
-	std::function<void(const std::string &)> outputFn;
-	std::function<void(uint8_t *, size_t)> CSPRNG;
-
-	void ReadIV();
-	void WriteIV();
-	void ReadSalt();
-	void WriteSalt();
+	size_t encodedSize; // size of the loaded file, 0 if unknown
+	SampleLayout layout;
+	uint64_t memoryBudget;
+	std::string scratchDirectory;
+	bool fastCodec;
+
+	std::unique_ptr<PixelStore> store;
+	std::unique_ptr<UndoLog> undoLog; // nullptr unless changes are recorded
+	StegoEngine engine;
+	// A scratch file maps one tile at a time, so decodes going through it take turns
+	mutable std::mutex tileMutex;
+
+	void readPNG(void *ioPointer, IOFunction readFn);
+	/** Decodes a whole PNG file in memory without libpng, returns false if it's up to readPNG() */
+	bool readFast(const uint8_t *data, size_t size);
+	void writePNG(void *ioPointer, IOFunction writeFn);
+
+	MemoryStore* memoryStore() const noexcept;
+	uint64_t pixelBytes() const noexcept;
 };
 
 } // namespace PNGStego
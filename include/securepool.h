@@ -0,0 +1,155 @@
+//
+// Copyright (C) 2015-2016 Zireael (zireael dot nk at gmail dot com)
+//  Distributed under the Boost Software License, Version 1.0.
+//       (See accompanying file LICENSE.md or copy at
+//           http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef __PNGSTEGO_SECURE_POOL_H
+#define __PNGSTEGO_SECURE_POOL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <new>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+const size_t SECURE_POOL_CACHE_BYTES = 64 << 20;     // wiped blocks kept around for the next job, at most
+const size_t SECURE_POOL_MAX_CACHED_BLOCK = 64 << 20; // larger blocks are given back to the system right away
+
+namespace PNGStego {
+
+/** What the pool's doing right now, and has done so far */
+struct SecurePoolStatistics {
+	uint64_t liveBytes;   // handed out and not released yet
+	uint64_t cachedBytes; // wiped and waiting for the next allocate()
+	uint64_t lockedBytes; // live and cached ones the system's agreed to keep out of swap
+	uint64_t hits;        // allocations served by a cached block
+	uint64_t misses;      // allocations that had to map a new one
+};
+
+/**
+ ** Memory for plaintext, payloads and keys.
+ ** Blocks are whole pages with an inaccessible guard page on each side, so running off either end faults
+ ** instead of reading a neighbour; they're locked into RAM when the system allows it (RLIMIT_MEMLOCK often doesn't
+ ** allow much, it's not an error) and left out of core dumps where there's a way to.
+ ** Sizes are rounded up to a power of two pages. Released blocks are wiped at once and, up to a limit,
+ ** kept for the next allocation of the same size, so jobs in a batch reuse warm memory.
+ **/
+class SecurePool {
+public:
+	/** Returns the process-wide pool, it lives until the process exits */
+	static SecurePool& global();
+
+	SecurePool(const SecurePool &other) = delete;
+	SecurePool& operator=(const SecurePool &other) = delete;
+
+	/** Returns how many bytes a block allocate(bytes) gives actually has */
+	static size_t blockSize(size_t bytes) noexcept;
+
+	/** Returns a block of at least 'bytes' bytes. Throws std::bad_alloc */
+	void* allocate(size_t bytes);
+	/** Wipes a block and takes it back, 'bytes' has to be what it's been allocated with */
+	void deallocate(void *block, size_t bytes) noexcept;
+
+	/** Changes how many bytes may be cached, dropping whatever's past the limit */
+	void setCacheLimit(size_t bytes) noexcept;
+	/** Gives every cached block back to the system */
+	void trim() noexcept;
+	SecurePoolStatistics statistics() const;
+
+private:
+	/** A cached block on its way back to the system */
+	struct Dropped {
+		void *block;
+		size_t size;
+		bool isLocked;
+	};
+
+	mutable std::mutex mutex;
+	std::map<size_t, std::vector<void*>> cache; // wiped blocks by their size
+	std::unordered_set<void*> locked;
+	size_t cacheLimit;
+	SecurePoolStatistics numbers;
+
+	SecurePool() noexcept;
+	/** Takes cached blocks out until there are at most 'limit' bytes of them, the mutex has to be held */
+	void shrinkCache(size_t limit, std::vector<Dropped> &dropped) noexcept;
+	/** Gives blocks taken out of the cache back to the system, the mutex mustn't be held */
+	void unmap(const std::vector<Dropped> &dropped) noexcept;
+	/** Maps a block with its guard pages */
+	void* map(size_t size, bool &isLocked);
+	void unmap(void *block, size_t size, bool isLocked) noexcept;
+};
+
+/** Puts standard containers into the pool, e.g. std::vector<uint8_t, SecureAllocator<uint8_t>> */
+template <class T>
+class SecureAllocator {
+public:
+	typedef T value_type;
+
+	SecureAllocator() noexcept { }
+	template <class U>
+	SecureAllocator(const SecureAllocator<U>&) noexcept { }
+
+	T* allocate(size_t n) {
+		if (n > SIZE_MAX / sizeof(T))
+			throw std::bad_alloc();
+		return static_cast<T*>(SecurePool::global().allocate(n * sizeof(T)));
+	}
+
+	void deallocate(T *p, size_t n) noexcept {
+		SecurePool::global().deallocate(p, n * sizeof(T));
+	}
+};
+
+template <class T, class U>
+bool operator==(const SecureAllocator<T>&, const SecureAllocator<U>&) noexcept {
+	return true;
+}
+
+template <class T, class U>
+bool operator!=(const SecureAllocator<T>&, const SecureAllocator<U>&) noexcept {
+	return false;
+}
+
+typedef std::vector<uint8_t, SecureAllocator<uint8_t>> SecureBytes;
+typedef std::basic_string<char, std::char_traits<char>, SecureAllocator<char>> SecureString;
+
+/** A single value of a trivially copyable type, e.g. a derived key, that lives in the pool and gets wiped with it */
+template <class T>
+class SecureObject {
+public:
+	SecureObject() : value(new (SecurePool::global().allocate(sizeof(T))) T()) { }
+	SecureObject(const SecureObject &other) = delete;
+	SecureObject& operator=(const SecureObject &other) = delete;
+
+	~SecureObject() {
+		SecurePool::global().deallocate(value, sizeof(T));
+	}
+
+	T& operator*() noexcept {
+		return *value;
+	}
+
+	const T& operator*() const noexcept {
+		return *value;
+	}
+
+	T* operator->() noexcept {
+		return value;
+	}
+
+	const T* operator->() const noexcept {
+		return value;
+	}
+
+private:
+	T *value;
+};
+
+} // namespace PNGStego
+#endif
\ No newline at end of file
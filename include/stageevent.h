@@ -0,0 +1,74 @@
+//
+// Copyright (C) 2015-2016 Zireael (zireael dot nk at gmail dot com)
+//  Distributed under the Boost Software License, Version 1.0.
+//       (See accompanying file LICENSE.md or copy at
+//           http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef __PNGSTEGO_STAGE_EVENT_H
+#define __PNGSTEGO_STAGE_EVENT_H
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <thread>
+
+namespace PNGStego {
+
+/** Steps encoding & decoding go through */
+enum class Stage : uint8_t {
+	Load,       // decoding the container
+	KDFSeed,    // deriving the seed of the offset walk
+	KDFKey,     // deriving the ciphers' key
+	Compress,
+	Encrypt,
+	Embed,      // writing bits into pixels
+	Extract,    // reading bits from pixels
+	Decrypt,
+	Decompress,
+	Write,      // writing extracted data into a file
+	Save        // encoding the container
+};
+
+/** Returns the stage's name, e.g. "kdf-seed" */
+const char* stageName(Stage stage) noexcept;
+
+/**
+ ** Reported twice per stage: once it's started and once it's finished.
+ ** Byte counts and 'end' are only filled in the latter, a stage that throws is never finished.
+ **/
+struct StageEvent {
+	typedef std::chrono::steady_clock Clock;
+
+	Stage stage;
+	bool finished;
+	Clock::time_point start;
+	Clock::time_point end;
+	uint64_t inputBytes;
+	uint64_t outputBytes;
+	std::thread::id thread;
+};
+
+typedef std::function<void(const StageEvent&)> EventFn;
+
+/** Turns events into the messages the command line tools print, e.g. "Compressing data..." */
+EventFn describeStages(const std::function<void(const std::string&)> &outputFn);
+
+/**
+ ** Reports a stage's start right away and its end once it's finished to the function, if there's one.
+ ** Finished stages go into the process-wide metrics either way.
+ **/
+class StageTimer {
+public:
+	StageTimer(const EventFn &fn, Stage stage);
+
+	void finish(uint64_t inputBytes, uint64_t outputBytes);
+
+private:
+	const EventFn &fn;
+	StageEvent event;
+};
+
+} // namespace PNGStego
+#endif
\ No newline at end of file
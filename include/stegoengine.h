@@ -0,0 +1,139 @@
+//
+// Copyright (C) 2015-2016 Zireael (zireael dot nk at gmail dot com)
+//  Distributed under the Boost Software License, Version 1.0.
+//       (See accompanying file LICENSE.md or copy at
+//           http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef __PNGSTEGO_STEGO_ENGINE_H
+#define __PNGSTEGO_STEGO_ENGINE_H
+
+#include <cstdint>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "cancellation.h"
+#include "pixelstore.h"
+#include "stageevent.h"
+
+namespace PNGStego {
+
+/** Thrown when the data doesn't fit into the container */
+class CapacityError : public std::runtime_error {
+public:
+	using std::runtime_error::runtime_error;
+};
+
+/** Thrown when nothing can be extracted with the given key: it's wrong or there's no data at all */
+class KeyError : public std::runtime_error {
+public:
+	using std::runtime_error::runtime_error;
+};
+
+/**
+ ** How densely a payload's bits are packed into the pixels the offset walk selects.
+ ** The header always takes the blue LSB of one pixel per bit; any other profile is recorded in its flags,
+ ** so extraction needs no option, while files written with Sparse can be read by any version.
+ ** Color samples holding salt or IV are left out, alpha is never touched.
+ **/
+enum class EmbeddingProfile : uint8_t {
+	Sparse = 0, // 1 bit per pixel, in the blue LSB
+	Dense  = 1, // the LSB of every color sample: 3 bits per pixel of a color image
+	Dense2 = 2  // the 2 lowest bits of every color sample: 6 bits per pixel, noisier
+};
+
+/** Returns the profile called "sparse", "dense" or "dense2", throws std::invalid_argument for anything else */
+EmbeddingProfile embeddingProfileFromName(const std::string &name);
+
+/** Data extracted from a container along with its file's extension */
+struct Payload {
+	std::vector<uint8_t> data;
+	std::string extension;
+};
+
+/**
+ ** Everything that gets embedded into LSBs of pixels: the header, IV, salt,
+ ** the offset walk and the payload itself, independent of the container's format.
+ ** Works on any PixelStore, so PNG files, bitmaps, scratch files and whatever comes next
+ ** produce the very same layout of bits. Containers only have to bring their pixels.
+ **/
+class StegoEngine {
+public:
+	/** Creates an engine that generates IV & salt with a cryptographically secure PRNG */
+	StegoEngine();
+	StegoEngine(const StegoEngine &other) = default;
+	StegoEngine(StegoEngine &&other) = default;
+	StegoEngine& operator=(const StegoEngine &other) = default;
+	StegoEngine& operator=(StegoEngine &&other) = default;
+	/** Wipes IV & salt */
+	~StegoEngine();
+
+	/** Reads IV & salt from the given pixels, containers call this once they're loaded */
+	void load(PixelStore &store);
+
+	/** Returns capacity of the given pixels with the given seed and the current profile, in bytes */
+	uint64_t capacity(const PixelStore &store, uint32_t seed) const noexcept;
+	/** Chooses how densely further embeds pack data, Sparse by default */
+	void setProfile(EmbeddingProfile profile) noexcept;
+	EmbeddingProfile getProfile() const noexcept;
+	/** Embeds data from a file with the given filename into the given pixels, using the given key */
+	void embed(PixelStore &store, const std::string &filename, const std::string &key, UndoLog *undo = nullptr);
+	/**
+	 ** Compresses, encrypts and embeds the given data and extension into the given pixels using the given key.
+	 ** Generates a new IV & salt and embeds them as well.
+	 ** Every sample that gets changed is recorded in 'undo' unless it's nullptr.
+	 ** Throws Cancelled once the token's cancelled, the pixels may've been changed by then.
+	 **/
+	void embed(PixelStore &store, const std::vector<uint8_t> &data, const std::string &extension, const std::string &key,
+	           const CancellationToken &token = CancellationToken::none(), UndoLog *undo = nullptr);
+	/**
+	 ** Extracts data from the given pixels using the given key and saves it
+	 ** into a file with the given filename, adding the extension if it's not there yet.
+	 ** In case of file I/O failure if the 4th parameter is not nullptr, puts data there.
+	 **/
+	void extract(PixelStore &store, std::string filename, const std::string &key, std::vector<uint8_t> *backup = nullptr) const;
+	/** Extracts, decrypts and decompresses data from the given pixels using the given key, throws Cancelled once the token's cancelled */
+	void extract(PixelStore &store, std::vector<uint8_t> &data, std::string &extension, const std::string &key,
+	             const CancellationToken &token = CancellationToken::none()) const;
+
+	/** Sets a function that gets called each time embed/extract do something, replaces the one set by setEventFn() */
+	void setOutputFn(const std::function<void(const std::string&)> &fn);
+	/** Sets a function that gets called each time embed/extract do something, replaces the one set by setEventFn() */
+	void setOutputFn(std::function<void(const std::string&)> &&fn);
+	/** Sets a function that gets called as each stage of embed/extract starts and finishes, replaces the one set by setOutputFn() */
+	void setEventFn(const EventFn &fn);
+	/** Returns the function set by setEventFn() or derived from the one given to setOutputFn(), containers report their own stages to it */
+	const EventFn& getEventFn() const noexcept;
+	/**
+	 ** !!! DO NOT CALL THIS UNLESS YOU ABSOLUTELY SURE YOU KNOW WHAT YOU DO !!!
+	 ** This function replaces a PRNG for IV & salt
+	 ** It exists purely for testing & debugging.
+	 ** By default PRNG used *IS* cryptographically secure.
+	 **/
+	void setCSPRNG(const std::function<void(uint8_t *, size_t)> &fn);
+	/**
+	 ** !!! DO NOT CALL THIS UNLESS YOU ABSOLUTELY SURE YOU KNOW WHAT YOU DO !!!
+	 ** This function replaces a PRNG for IV & salt
+	 ** It exists purely for testing & debugging.
+	 ** By default PRNG used *IS* cryptographically secure.
+	 **/
+	void setCSPRNG(std::function<void(uint8_t *, size_t)> &&fn);
+
+private:
+	std::vector<uint8_t> salt;
+	std::vector<uint8_t> iv;
+	EmbeddingProfile profile;
+	EventFn eventFn;
+	std::function<void(uint8_t *, size_t)> CSPRNG;
+
+	/** Returns capacity of the given pixels with the given seed for the given profile, in bytes */
+	uint64_t capacity(const PixelStore &store, uint32_t seed, EmbeddingProfile profile) const noexcept;
+	void readIV(PixelStore &store);
+	void writeIV(PixelStore &store, UndoLog *undo) const;
+	void readSalt(PixelStore &store);
+	void writeSalt(PixelStore &store, UndoLog *undo) const;
+};
+
+} // namespace PNGStego
+#endif
\ No newline at end of file
@@ -0,0 +1,77 @@
+//
+// Copyright (C) 2015-2016 Zireael (zireael dot nk at gmail dot com)
+//  Distributed under the Boost Software License, Version 1.0.
+//       (See accompanying file LICENSE.md or copy at
+//           http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef __PNGSTEGO_TILED_STORE_H
+#define __PNGSTEGO_TILED_STORE_H
+
+#include <string>
+#include <vector>
+#include "pixelstore.h"
+
+namespace PNGStego {
+
+/**
+ ** Keeps interleaved pixels in a scratch file and maps only a few tiles of it at a time,
+ ** so images far larger than RAM can be processed within a fixed memory budget.
+ ** The scratch file is deleted as soon as it's created, nothing is left behind
+ ** even if the process gets killed.
+ **/
+class TiledStore : public PixelStore {
+public:
+	/**
+	 ** Creates a store for 'count' pixels in a scratch file inside the given directory
+	 ** (the system's temporary directory if it's empty).
+	 ** No more than 'budget' bytes of it are mapped at once, though at least two tiles are.
+	 **/
+	TiledStore(uint64_t count, PixelFormat format, uint64_t budget, const std::string &directory = "", size_t sampleBytes = 1);
+	TiledStore(const TiledStore &other) = delete;
+	TiledStore& operator=(const TiledStore &other) = delete;
+	~TiledStore();
+
+	uint64_t size() const noexcept override;
+	PixelFormat format() const noexcept override;
+	size_t sampleBytes() const noexcept override;
+	/** The run ends at the end of the tile the pixel is in */
+	ChannelRun channel(uint64_t pixel, Channel channel) override;
+	std::unique_ptr<PixelStore> clone() const override;
+
+	/** Copies 'length' bytes of samples starting at the given byte into 'destination' */
+	void read(uint64_t offset, uint8_t *destination, size_t length) override;
+	/** Copies 'length' bytes of samples from 'source' starting at the given byte */
+	void write(uint64_t offset, const uint8_t *source, size_t length);
+
+private:
+	struct Tile {
+		uint64_t index;
+		uint8_t *data;
+		uint64_t lastUse;
+	};
+
+	uint64_t count;
+	PixelFormat pixelFormat;
+	size_t bytesPerSample;
+	uint64_t budget;
+	std::string directory;
+	uint64_t fileBytes;
+	uint64_t tileBytes;
+	size_t maxTiles;
+	uint64_t useCounter;
+	std::vector<Tile> tiles;
+#ifdef _WIN32
+	void *file;
+	void *mapping;
+#else
+	int file;
+#endif
+
+	/** Returns the given tile, mapping it and unmapping the least recently used one if necessary */
+	uint8_t* tile(uint64_t index);
+	void unmap(Tile &tile) noexcept;
+};
+
+} // namespace PNGStego
+#endif
\ No newline at end of file
@@ -0,0 +1,461 @@
+//
+// Copyright (C) 2015-2016 Zireael (zireael dot nk at gmail dot com)
+//  Distributed under the Boost Software License, Version 1.0.
+//       (See accompanying file LICENSE.md or copy at
+//           http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "batch.h"
+#include "bitmapfile.h"
+#include "helpers.h"
+#include "ioring.h"
+#include "pngwrapper.h"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/json_parser.hpp>
+
+#ifdef _WIN32
+#include <boost/nowide/cstdio.hpp>
+#else
+namespace boost {
+	namespace nowide {
+		using std::remove;
+	}
+}
+#endif
+
+namespace PNGStego {
+
+	std::vector<BatchJob> readManifest(std::istream &stream) {
+		std::vector<BatchJob> jobs;
+		std::string line;
+		for (size_t number = 1; std::getline(stream, line); ++number) {
+			removeLineEndings(line);
+			if (line.empty() || line[0] == '#')
+				continue;
+
+			BatchJob job;
+			job.line = number;
+			if (line[0] == '{') {
+				boost::property_tree::ptree tree;
+				try {
+					std::istringstream json(line);
+					boost::property_tree::read_json(json, tree);
+					job.container = tree.get<std::string>("container");
+					job.file = tree.get<std::string>("file");
+					job.key = tree.get<std::string>("key");
+				}
+				catch (const boost::property_tree::ptree_error&) {
+					throw std::invalid_argument("Invalid job at line " + std::to_string(number));
+				}
+			}
+			else {
+				const size_t first = line.find('\t');
+				const size_t second = first == std::string::npos ? first : line.find('\t', first + 1);
+				if (second == std::string::npos) {
+					throw std::invalid_argument("Invalid job at line " + std::to_string(number));
+				}
+				job.container = line.substr(0, first);
+				job.file = line.substr(first + 1, second - first - 1);
+				// The key is the rest of the line, tabs included
+				job.key = line.substr(second + 1);
+			}
+			zeroMemory(&line[0], line.size());
+			jobs.push_back(std::move(job));
+		}
+		return jobs;
+	}
+
+	std::string encodeJob(BatchJob &job, const JobOptions &options, const std::function<void(const std::string&)> &outputFn) {
+		if (BitmapFile::isBitmap(job.container)) {
+			// Bitmaps are modified right in the file, so unless asked otherwise that's a copy
+			std::string newfile = options.inPlace ? job.container : addToFilename(job.container, " (copy)");
+			if (!options.inPlace) {
+				if (outputFn)
+					outputFn("Copying the container to \"" + baseFilename(newfile) + "\"...");
+				copyFile(job.container, newfile);
+			}
+
+			try {
+				BitmapFile container(newfile);
+				if (outputFn)
+					container.setOutputFn(outputFn);
+				container.setEmbeddingProfile(options.profile);
+				container.encode(job.file, job.key);
+				zeroMemory(&job.key[0], job.key.size());
+				container.flush();
+			}
+			catch (...) {
+				if (!options.inPlace)
+					boost::nowide::remove(newfile.c_str());
+				throw;
+			}
+			return newfile;
+		}
+
+		PNGFile container;
+		container.setMemoryBudget(options.memoryBudget);
+		container.setEmbeddingProfile(options.profile);
+		container.load(job.container);
+		if (outputFn)
+			container.setOutputFn(outputFn);
+		container.encode(job.file, job.key);
+		std::string newfile = addToFilename(job.container, " (copy)");
+		if (outputFn)
+			outputFn("Saving the output to \"" + baseFilename(newfile) + "\"...");
+		zeroMemory(&job.key[0], job.key.size());
+
+		container.save(newfile);
+		return newfile;
+	}
+
+	void decodeJob(BatchJob &job, const JobOptions &options, const std::function<void(const std::string&)> &outputFn) {
+		if (BitmapFile::isBitmap(job.container)) {
+			BitmapFile container(job.container, false);
+			if (outputFn)
+				container.setOutputFn(outputFn);
+			container.decode(job.file, job.key);
+		}
+		else {
+			PNGFile container;
+			container.setMemoryBudget(options.memoryBudget);
+			container.load(job.container);
+			if (outputFn)
+				container.setOutputFn(outputFn);
+			container.decode(job.file, job.key);
+		}
+		zeroMemory(&job.key[0], job.key.size());
+	}
+
+	/**
+	 ** Every job is independent and takes long enough that a shared counter
+	 ** is all the scheduling they need: each worker grabs the next job until there are none left.
+	 **/
+	size_t runBatch(std::vector<BatchJob> &jobs, size_t threads, const std::function<void(BatchJob&)> &fn,
+	                const std::function<void(const BatchJob&, const std::string&)> &report)
+	{
+		if (threads == 0)
+			threads = std::max(std::thread::hardware_concurrency(), 1U);
+		threads = std::min(threads, jobs.size());
+
+		std::atomic<size_t> next(0), failed(0);
+		std::mutex reportMutex;
+		auto worker = [&]() {
+			for (size_t i = next++; i < jobs.size(); i = next++) {
+				std::string error;
+				try {
+					fn(jobs[i]);
+				}
+				catch (const std::exception &e) {
+					error = e.what();
+					if (error.empty())
+						error = "Unknown error";
+				}
+				catch (...) {
+					error = "Unknown error";
+				}
+				zeroMemory(&jobs[i].key[0], jobs[i].key.size());
+				if (!error.empty())
+					++failed;
+
+				if (report) {
+					std::lock_guard<std::mutex> lock(reportMutex);
+					report(jobs[i], error);
+				}
+			}
+		};
+
+		std::vector<std::thread> workers;
+		for (size_t k = 1; k < threads; ++k)
+			workers.emplace_back(worker);
+		worker();
+		for (auto &thread : workers)
+			thread.join();
+		return failed;
+	}
+
+	PipelineLimits pipelineLimits(size_t threads, size_t ioThreads, size_t queueDepth) {
+		if (threads == 0)
+			threads = std::max(std::thread::hardware_concurrency(), 1U);
+		if (ioThreads == 0)
+			ioThreads = 2;
+
+		PipelineLimits limits;
+		limits.read = { ioThreads, queueDepth ? queueDepth : ioThreads };
+		limits.decode = { threads, queueDepth ? queueDepth : threads };
+		limits.crypto = { threads, queueDepth ? queueDepth : threads };
+		limits.write = { ioThreads, queueDepth ? queueDepth : ioThreads };
+		return limits;
+	}
+
+	/**
+	 ** Reads files for the reading stage. With io_uring whichever job comes first
+	 ** reads files of the next few jobs along with its own, all in a single batch,
+	 ** so the kernel gets to see many requests at once instead of one file at a time.
+	 **/
+	class FileReader {
+	public:
+		typedef std::function<std::vector<std::string>(size_t)> FilesFn;
+
+		/** 'filesOf' returns filenames of the given job's files, 'ahead' is how many jobs get read at once */
+		FileReader(size_t jobs, size_t ahead, const FilesFn &filesOf)
+			: filesOf(filesOf), ahead(std::max<size_t>(ahead, 1)), claimed(jobs, false)
+		{ }
+
+		/** Returns contents of the given job's files, throws if any of them couldn't be read */
+		std::vector<std::vector<uint8_t>> read(size_t job) {
+			// Without a ring there's nothing to gain from reading ahead
+			if (!IORing::local()) {
+				std::vector<std::vector<uint8_t>> contents;
+				for (const std::string &filename : filesOf(job))
+					contents.push_back(readFile(filename));
+				return contents;
+			}
+
+			std::unique_lock<std::mutex> lock(mutex);
+			if (!claimed[job]) {
+				std::vector<size_t> batch;
+				for (size_t i = job; i < claimed.size() && batch.size() < ahead; ++i) {
+					if (!claimed[i]) {
+						claimed[i] = true;
+						batch.push_back(i);
+					}
+				}
+				lock.unlock();
+
+				std::vector<std::string> filenames;
+				std::vector<size_t> counts;
+				for (size_t i : batch) {
+					std::vector<std::string> files = filesOf(i);
+					counts.push_back(files.size());
+					filenames.insert(filenames.end(), files.begin(), files.end());
+				}
+				std::vector<std::string> errors;
+				std::vector<std::vector<uint8_t>> contents;
+				try {
+					contents = readFiles(filenames, errors);
+				}
+				catch (const std::exception &e) {
+					// Other jobs of the batch are waiting for their files, they have to fail too
+					errors.assign(filenames.size(), e.what());
+					contents.assign(filenames.size(), std::vector<uint8_t>());
+				}
+
+				lock.lock();
+				for (size_t k = 0, pos = 0; k < batch.size(); ++k) {
+					Entry &entry = ready[batch[k]];
+					for (size_t n = 0; n < counts[k]; ++n, ++pos) {
+						entry.contents.push_back(std::move(contents[pos]));
+						if (entry.error.empty())
+							entry.error = errors[pos];
+					}
+				}
+				done.notify_all();
+			}
+			done.wait(lock, [&]() { return ready.count(job) != 0; });
+			Entry entry = std::move(ready[job]);
+			ready.erase(job);
+			lock.unlock();
+
+			if (!entry.error.empty()) {
+				throw std::runtime_error(entry.error);
+			}
+			return std::move(entry.contents);
+		}
+
+	private:
+		struct Entry {
+			std::vector<std::vector<uint8_t>> contents;
+			std::string error;
+		};
+		FilesFn filesOf;
+		size_t ahead;
+		std::vector<bool> claimed;
+		std::map<size_t, Entry> ready;
+		std::mutex mutex;
+		std::condition_variable done;
+	};
+
+	/** Whatever a job's stages hand over to each other */
+	struct EncodeState {
+		bool bitmap;
+		bool copied;                  // whether the output is a copy of a bitmap made by this job
+		std::string output;
+		std::vector<uint8_t> file;    // the container's contents until it's decoded
+		std::vector<uint8_t> payload;
+		std::string extension;
+		PNGFile png;
+		std::unique_ptr<BitmapFile> mapped;
+
+		EncodeState() : bitmap(false), copied(false) { }
+		~EncodeState() {
+			zeroMemory(payload.data(), payload.size());
+		}
+	};
+
+	size_t encodeBatch(std::vector<BatchJob> &jobs, const JobOptions &options, const PipelineLimits &limits,
+	                   const std::function<void(const BatchJob&, const std::string&)> &report)
+	{
+		std::vector<std::unique_ptr<EncodeState>> states(jobs.size());
+
+		// Jobs waiting for reading & decoding are in memory anyway
+		FileReader reader(jobs.size(), limits.read.queueDepth + limits.decode.queueDepth, [&](size_t i) {
+			std::vector<std::string> files(1, jobs[i].file);
+			if (!BitmapFile::isBitmap(jobs[i].container))
+				files.push_back(jobs[i].container);
+			return files;
+		});
+
+		Pipeline pipeline;
+		pipeline.addStage("Reading", [&](size_t i) {
+			states[i].reset(new EncodeState());
+			EncodeState &state = *states[i];
+			std::vector<std::vector<uint8_t>> contents = reader.read(i);
+			state.payload = std::move(contents[0]);
+			state.extension = getExtension(jobs[i].file);
+			state.bitmap = contents.size() == 1;
+			if (state.bitmap) {
+				// Bitmaps are modified right in the file, so unless asked otherwise that's a copy
+				state.output = options.inPlace ? jobs[i].container : addToFilename(jobs[i].container, " (copy)");
+				if (!options.inPlace) {
+					copyFile(jobs[i].container, state.output);
+					state.copied = true;
+				}
+			}
+			else {
+				state.output = addToFilename(jobs[i].container, " (copy)");
+				state.file = std::move(contents[1]);
+			}
+		}, limits.read);
+		pipeline.addStage("Decoding", [&](size_t i) {
+			EncodeState &state = *states[i];
+			if (state.bitmap) {
+				state.mapped.reset(new BitmapFile(state.output));
+				state.mapped->setEmbeddingProfile(options.profile);
+			}
+			else {
+				state.png.setMemoryBudget(options.memoryBudget);
+				state.png.setEmbeddingProfile(options.profile);
+				state.png.load(state.file);
+				std::vector<uint8_t>().swap(state.file);
+			}
+		}, limits.decode);
+		pipeline.addStage("Embedding", [&](size_t i) {
+			EncodeState &state = *states[i];
+			if (state.bitmap)
+				state.mapped->encode(state.payload, state.extension, jobs[i].key);
+			else
+				state.png.encode(state.payload, state.extension, jobs[i].key);
+			zeroMemory(&jobs[i].key[0], jobs[i].key.size());
+			zeroMemory(state.payload.data(), state.payload.size());
+			std::vector<uint8_t>().swap(state.payload);
+		}, limits.crypto);
+		pipeline.addStage("Writing", [&](size_t i) {
+			EncodeState &state = *states[i];
+			if (state.bitmap)
+				state.mapped->flush();
+			else
+				state.png.save(state.output);
+		}, limits.write);
+
+		return pipeline.run(jobs.size(), [&](size_t i, const std::string &error) {
+			zeroMemory(&jobs[i].key[0], jobs[i].key.size());
+			std::unique_ptr<EncodeState> state(std::move(states[i]));
+			if (!error.empty() && state && state->copied) {
+				std::string output = state->output;
+				// The mapping has to go before the file does
+				state.reset();
+				boost::nowide::remove(output.c_str());
+			}
+			state.reset();
+			if (report)
+				report(jobs[i], error);
+		});
+	}
+
+	/** Whatever a job's stages hand over to each other */
+	struct DecodeState {
+		bool bitmap;
+		std::vector<uint8_t> file;    // the container's contents until it's decoded
+		PNGFile png;
+		std::unique_ptr<BitmapFile> mapped;
+		std::vector<uint8_t> data;
+		std::string extension;
+
+		DecodeState() : bitmap(false) { }
+		~DecodeState() {
+			zeroMemory(data.data(), data.size());
+		}
+	};
+
+	size_t decodeBatch(std::vector<BatchJob> &jobs, const JobOptions &options, const PipelineLimits &limits,
+	                   const std::function<void(const BatchJob&, const std::string&)> &report)
+	{
+		std::vector<std::unique_ptr<DecodeState>> states(jobs.size());
+
+		// Bitmaps get mapped, there's nothing to read in advance
+		FileReader reader(jobs.size(), limits.read.queueDepth + limits.decode.queueDepth, [&](size_t i) {
+			std::vector<std::string> files;
+			if (!BitmapFile::isBitmap(jobs[i].container))
+				files.push_back(jobs[i].container);
+			return files;
+		});
+
+		Pipeline pipeline;
+		pipeline.addStage("Reading", [&](size_t i) {
+			states[i].reset(new DecodeState());
+			DecodeState &state = *states[i];
+			std::vector<std::vector<uint8_t>> contents = reader.read(i);
+			state.bitmap = contents.empty();
+			if (!state.bitmap)
+				state.file = std::move(contents[0]);
+		}, limits.read);
+		pipeline.addStage("Decoding", [&](size_t i) {
+			DecodeState &state = *states[i];
+			if (state.bitmap) {
+				state.mapped.reset(new BitmapFile(jobs[i].container, false));
+			}
+			else {
+				state.png.setMemoryBudget(options.memoryBudget);
+				state.png.load(state.file);
+				std::vector<uint8_t>().swap(state.file);
+			}
+		}, limits.decode);
+		pipeline.addStage("Extracting", [&](size_t i) {
+			DecodeState &state = *states[i];
+			if (state.bitmap) {
+				state.mapped->decode(state.data, state.extension, jobs[i].key);
+				state.mapped.reset();
+			}
+			else {
+				state.png.decode(state.data, state.extension, jobs[i].key);
+				state.png = PNGFile();
+			}
+			zeroMemory(&jobs[i].key[0], jobs[i].key.size());
+		}, limits.crypto);
+		pipeline.addStage("Writing", [&](size_t i) {
+			DecodeState &state = *states[i];
+			std::string filename = jobs[i].file;
+			if (!state.extension.empty() && !endsWith(filename, "." + state.extension))
+				filename += "." + state.extension;
+			writeFile(filename, state.data.data(), state.data.size());
+		}, limits.write);
+
+		return pipeline.run(jobs.size(), [&](size_t i, const std::string &error) {
+			zeroMemory(&jobs[i].key[0], jobs[i].key.size());
+			states[i].reset();
+			if (report)
+				report(jobs[i], error);
+		});
+	}
+
+} // namespace PNGStego
\ No newline at end of file
@@ -0,0 +1,288 @@
+//
+// Copyright (C) 2015-2016 Zireael (zireael dot nk at gmail dot com)
+//  Distributed under the Boost Software License, Version 1.0.
+//       (See accompanying file LICENSE.md or copy at
+//           http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "bitmapfile.h"
+#include "bitmap.h"
+#include "helpers.h"
+#include "metrics.h"
+#include "stegoengine.h"
+#include <cstring>
+#include <cctype>
+#include <climits>
+#include <fstream>
+#include <stdexcept>
+
+#ifdef _WIN32
+#include <boost/nowide/fstream.hpp>
+#else
+namespace boost {
+	namespace nowide {
+		using std::ifstream;
+	}
+}
+#endif
+
+const uint16_t BMP_SIGNATURE = 0x4D42; // "BM"
+const int SIGNATURE_BYTES = 2;
+
+namespace PNGStego {
+
+	MappedBitmapStore::MappedBitmapStore(uint8_t *data, uint32_t width, uint32_t height, size_t rowStride,
+	                                     size_t pixelStride, PixelFormat format, const size_t offsets[4]) noexcept
+		: data(data), width(width), height(height), rowStride(rowStride), pixelStride(pixelStride), pixelFormat(format)
+	{
+		for (size_t k = 0; k < 4; ++k)
+			this->offsets[k] = offsets[k];
+	}
+
+	uint64_t MappedBitmapStore::size() const noexcept {
+		return static_cast<uint64_t>(width) * height;
+	}
+
+	PixelFormat MappedBitmapStore::format() const noexcept {
+		return pixelFormat;
+	}
+
+	ChannelRun MappedBitmapStore::channel(uint64_t pixel, Channel channel) {
+		const uint64_t row = pixel / width, column = pixel % width;
+
+		ChannelRun run;
+		run.data = data + row * rowStride + column * pixelStride + offsets[static_cast<size_t>(channel)];
+		run.stride = pixelStride;
+		run.count = width - column;
+		return run;
+	}
+
+	std::unique_ptr<PixelStore> MappedBitmapStore::clone() const {
+		throw std::logic_error("A mapped bitmap can't be copied");
+	}
+
+	void MappedBitmapStore::read(uint64_t offset, uint8_t *destination, size_t length) {
+		const size_t channels = channelCount(pixelFormat);
+		for (size_t i = 0; i < length; ++i, ++offset) {
+			const uint64_t pixel = offset / channels;
+			const Channel channel = sampleChannel(pixelFormat, static_cast<size_t>(offset % channels));
+			destination[i] = data[(pixel / width) * rowStride + (pixel % width) * pixelStride + offsets[static_cast<size_t>(channel)]];
+		}
+	}
+
+	BitmapFile::BitmapFile() : width(0), height(0), file(), store(), engine()
+	{ }
+
+	BitmapFile::BitmapFile(const std::string &filename, bool writable) : BitmapFile() {
+		this->open(filename, writable);
+	}
+
+	bool BitmapFile::isBitmap(const std::string &filename) {
+		boost::nowide::ifstream File(filename.c_str(), std::ios::in | std::ios::binary);
+		char signature[SIGNATURE_BYTES];
+		if (!File.read(signature, SIGNATURE_BYTES))
+			return false;
+		return (signature[0] == 'B' && signature[1] == 'M') ||
+		       (signature[0] == 'P' && (signature[1] == '5' || signature[1] == '6'));
+	}
+
+	void BitmapFile::open(const std::string &filename, bool writable) {
+		// The store points into the mapping, so it goes first
+		store.reset();
+		file.reset();
+		file.reset(new MappedFile(filename, writable));
+		if (file->size() < SIGNATURE_BYTES) {
+			throw std::invalid_argument("Invalid file format");
+		}
+
+		const uint8_t *data = file->data();
+		if (data[0] == 'B' && data[1] == 'M')
+			this->parseBMP();
+		else if (data[0] == 'P' && (data[1] == '5' || data[1] == '6'))
+			this->parsePNM();
+		else
+			throw std::invalid_argument("Invalid file format");
+
+		// Read cryptographic stuff
+		engine.load(*store);
+	}
+
+	void BitmapFile::flush() {
+		if (file)
+			file->flush();
+	}
+
+	/**
+	 ** Only uncompressed 24 and 32-bit images are supported, their pixels are stored as is.
+	 ** Rows are padded to 4 bytes and go bottom to top unless the height is negative,
+	 ** which doesn't matter as long as the order is always the same.
+	 **/
+	void BitmapFile::parseBMP() {
+		uint8_t *data = file->data();
+		const uint64_t size = file->size();
+
+		BITMAPFILEHEADER FileHeader;
+		BITMAPINFOHEADER InfoHeader;
+		if (size < sizeof(FileHeader) + sizeof(InfoHeader)) {
+			throw std::invalid_argument("Invalid file format");
+		}
+		memcpy(&FileHeader, data, sizeof(FileHeader));
+		memcpy(&InfoHeader, data + sizeof(FileHeader), sizeof(InfoHeader));
+
+		if (FileHeader.bfType != BMP_SIGNATURE || InfoHeader.biSize < sizeof(InfoHeader) ||
+		    InfoHeader.biWidth <= 0 || InfoHeader.biHeight == 0 || InfoHeader.biHeight == INT32_MIN) {
+			throw std::invalid_argument("Invalid file format");
+		}
+		if (InfoHeader.biCompression != BI_RGB || (InfoHeader.biBitCount != 24 && InfoHeader.biBitCount != 32)) {
+			throw std::runtime_error("Not supported BMP type");
+		}
+
+		width = static_cast<uint32_t>(InfoHeader.biWidth);
+		height = static_cast<uint32_t>(InfoHeader.biHeight < 0 ? -InfoHeader.biHeight : InfoHeader.biHeight);
+		const uint64_t RowBytes = (static_cast<uint64_t>(width) * InfoHeader.biBitCount + 31) / 32 * 4;
+		if (FileHeader.bfOffBits > size || RowBytes * height > size - FileHeader.bfOffBits) {
+			throw std::invalid_argument("The file's truncated");
+		}
+
+		// Samples go in BGR order, the 4th byte of 32-bit pixels isn't used
+		const size_t offsets[4] = { 2, 1, 0, 0 };
+		store.reset(new MappedBitmapStore(data + FileHeader.bfOffBits, width, height, static_cast<size_t>(RowBytes),
+		                                  InfoHeader.biBitCount / 8, PixelFormat::RGB, offsets));
+	}
+
+	/**
+	 ** Binary PPM (P6) and PGM (P5) with 8-bit samples.
+	 ** The header is the magic number, width, height and the maximum value,
+	 ** separated by whitespace and comments, then a single whitespace and pixels.
+	 **/
+	void BitmapFile::parsePNM() {
+		uint8_t *data = file->data();
+		const uint64_t size = file->size();
+		uint64_t pos = SIGNATURE_BYTES;
+
+		auto number = [&]() -> uint32_t {
+			for (;;) {
+				while (pos < size && isspace(data[pos]))
+					++pos;
+				if (pos < size && data[pos] == '#') {
+					while (pos < size && data[pos] != '\n')
+						++pos;
+				}
+				else {
+					break;
+				}
+			}
+			if (pos >= size || !isdigit(data[pos])) {
+				throw std::invalid_argument("Invalid file format");
+			}
+			uint64_t value = 0;
+			for (; pos < size && isdigit(data[pos]); ++pos) {
+				value = value * 10 + (data[pos] - '0');
+				if (value > UINT32_MAX)
+					throw std::invalid_argument("Invalid file format");
+			}
+			return static_cast<uint32_t>(value);
+		};
+
+		const PixelFormat format = data[1] == '6' ? PixelFormat::RGB : PixelFormat::Gray;
+		width = number();
+		height = number();
+		uint32_t maxValue = number();
+		if (width == 0 || height == 0 || maxValue == 0 || pos >= size || !isspace(data[pos])) {
+			throw std::invalid_argument("Invalid file format");
+		}
+		if (maxValue > UINT8_MAX) {
+			throw std::runtime_error("Not supported PPM type");
+		}
+		++pos;
+
+		const uint64_t RowBytes = static_cast<uint64_t>(width) * channelCount(format);
+		if (RowBytes * height > size - pos) {
+			throw std::invalid_argument("The file's truncated");
+		}
+
+		size_t offsets[4];
+		for (size_t k = 0; k < 4; ++k)
+			offsets[k] = channelOffset(format, static_cast<Channel>(k));
+		store.reset(new MappedBitmapStore(data + pos, width, height, static_cast<size_t>(RowBytes),
+		                                  channelCount(format), format, offsets));
+	}
+
+	uint32_t BitmapFile::getWidth() const {
+		return this->width;
+	}
+
+	uint32_t BitmapFile::getHeight() const {
+		return this->height;
+	}
+
+	PixelFormat BitmapFile::getFormat() const {
+		if (!store) {
+			throw std::runtime_error("No image is open");
+		}
+		return store->format();
+	}
+
+	void BitmapFile::setOutputFn(const std::function<void(const std::string&)> &fn) {
+		engine.setOutputFn(fn);
+	}
+
+	void BitmapFile::setOutputFn(std::function<void(const std::string&)> &&fn) {
+		engine.setOutputFn(std::move(fn));
+	}
+
+	void BitmapFile::setEventFn(const EventFn &fn) {
+		engine.setEventFn(fn);
+	}
+
+	void BitmapFile::setCSPRNG(const std::function<void(uint8_t *, size_t)> &fn) {
+		engine.setCSPRNG(fn);
+	}
+
+	void BitmapFile::setEmbeddingProfile(EmbeddingProfile profile) {
+		engine.setProfile(profile);
+	}
+
+	uint64_t BitmapFile::capacity(uint32_t seed) const noexcept {
+		if (!store)
+			return 0U;
+		return engine.capacity(*store, seed);
+	}
+
+	void BitmapFile::encode(const std::string &filename, const std::string &key) {
+		if (!store) {
+			throw std::runtime_error("Trying to encode data into an empty image");
+		}
+		measured(Operation::Encode, [&]() {
+			engine.embed(*store, filename, key);
+		});
+	}
+
+	void BitmapFile::encode(const std::vector<uint8_t> &data, const std::string &extension, const std::string &key) {
+		if (!store) {
+			throw std::runtime_error("Trying to encode data into an empty image");
+		}
+		measured(Operation::Encode, [&]() {
+			engine.embed(*store, data, extension, key);
+		});
+	}
+
+	void BitmapFile::decode(std::string filename, const std::string &key, std::vector<uint8_t> *backup) const {
+		if (!store) {
+			throw std::runtime_error("Trying to extract data from an empty image");
+		}
+		measured(Operation::Decode, [&]() {
+			engine.extract(*store, filename, key, backup);
+		});
+	}
+
+	void BitmapFile::decode(std::vector<uint8_t> &data, std::string &extension, const std::string &key) const {
+		if (!store) {
+			throw std::runtime_error("Trying to extract data from an empty image");
+		}
+		measured(Operation::Decode, [&]() {
+			engine.extract(*store, data, extension, key);
+		});
+	}
+
+} // namespace PNGStego
\ No newline at end of file
@@ -0,0 +1,55 @@
+//
+// Copyright (C) 2015-2016 Zireael (zireael dot nk at gmail dot com)
+//  Distributed under the Boost Software License, Version 1.0.
+//       (See accompanying file LICENSE.md or copy at
+//           http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "cancellation.h"
+
+namespace PNGStego {
+
+	CancellationToken::CancellationToken() : state(std::make_shared<State>()) {
+		state->cancelled = false;
+		state->hasDeadline = false;
+	}
+
+	CancellationToken::CancellationToken(Clock::time_point deadline) : CancellationToken() {
+		state->hasDeadline = true;
+		state->deadline = deadline;
+	}
+
+	CancellationToken::CancellationToken(Clock::duration timeout) : CancellationToken(Clock::now() + timeout)
+	{ }
+
+	CancellationToken::CancellationToken(Never) noexcept : state()
+	{ }
+
+	const CancellationToken& CancellationToken::none() noexcept {
+		static const CancellationToken never((Never()));
+		return never;
+	}
+
+	void CancellationToken::cancel() const noexcept {
+		if (state)
+			state->cancelled = true;
+	}
+
+	bool CancellationToken::isCancelled() const noexcept {
+		if (!state)
+			return false;
+		if (state->cancelled)
+			return true;
+		// Remembered, so the clock isn't read over and over once it's expired
+		if (state->hasDeadline && Clock::now() >= state->deadline)
+			state->cancelled = true;
+		return state->cancelled;
+	}
+
+	void CancellationToken::check() const {
+		if (this->isCancelled()) {
+			throw Cancelled(state->hasDeadline && Clock::now() >= state->deadline ? "The deadline has passed" : "Cancelled");
+		}
+	}
+
+} // namespace PNGStego
\ No newline at end of file
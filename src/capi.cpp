@@ -0,0 +1,266 @@
+//
+// Copyright (C) 2015-2016 Zireael (zireael dot nk at gmail dot com)
+//  Distributed under the Boost Software License, Version 1.0.
+//       (See accompanying file LICENSE.md or copy at
+//           http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef PNGSTEGO_BUILDING
+#define PNGSTEGO_BUILDING
+#endif
+
+#include "pngstego.h"
+#include "helpers.h"
+#include "pngwrapper.h"
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+struct pngstego_image {
+	PNGStego::PNGFile file;
+	pngstego_info info;
+	bool loaded;
+};
+
+namespace PNGStego {
+
+	thread_local std::string lastError;
+
+	pngstego_status fail(pngstego_status status, const char *reason) {
+		try {
+			lastError = reason;
+		}
+		catch (...) {
+			lastError.clear();
+		}
+		return status;
+	}
+
+	/**
+	 ** Runs the function, turning whatever it throws into a status.
+	 ** 'formatStatus' is what anything the parser's complained about means for the call.
+	 **/
+	template <class Fn>
+	pngstego_status guard(Fn fn, pngstego_status formatStatus = PNGSTEGO_ERROR_INTERNAL) noexcept {
+		try {
+			fn();
+			lastError.clear();
+			return PNGSTEGO_OK;
+		}
+		catch (const std::bad_alloc&) {
+			return fail(PNGSTEGO_ERROR_MEMORY, "Out of memory");
+		}
+		catch (const CapacityError &e) {
+			return fail(PNGSTEGO_ERROR_CAPACITY, e.what());
+		}
+		catch (const KeyError &e) {
+			return fail(PNGSTEGO_ERROR_KEY, e.what());
+		}
+		catch (const std::invalid_argument &e) {
+			return fail(PNGSTEGO_ERROR_ARGUMENT, e.what());
+		}
+		catch (const std::exception &e) {
+			return fail(formatStatus, e.what());
+		}
+		catch (...) {
+			return fail(PNGSTEGO_ERROR_INTERNAL, "Unknown error");
+		}
+	}
+
+	uint32_t bigEndian(const uint8_t *data) {
+		return static_cast<uint32_t>(data[0]) << 24 | data[1] << 16 | data[2] << 8 | data[3];
+	}
+
+	/** Reads IHDR, which the PNG specification requires to come right after the signature */
+	pngstego_status parseHeader(const uint8_t *data, size_t size, pngstego_info *info) {
+		static const uint8_t signature[8] = { 137, 'P', 'N', 'G', '\r', '\n', 26, '\n' };
+		if (size < 33 || memcmp(data, signature, sizeof(signature)) != 0 ||
+		    bigEndian(data + 8) != 13 || memcmp(data + 12, "IHDR", 4) != 0) {
+			return fail(PNGSTEGO_ERROR_FORMAT, "Not a PNG image");
+		}
+		uint32_t width = bigEndian(data + 16), height = bigEndian(data + 20);
+		uint8_t depth = data[24], colorType = data[25];
+		uint32_t channels;
+		switch (colorType) {
+		case 0: channels = 1; break;
+		case 2: channels = 3; break;
+		case 3: channels = 3; break; // palette gets expanded, to RGBA if there's a tRNS chunk further on
+		case 4: channels = 2; break;
+		case 6: channels = 4; break;
+		default:
+			return fail(PNGSTEGO_ERROR_FORMAT, "Unknown color type");
+		}
+		if (width == 0 || height == 0 || (depth != 1 && depth != 2 && depth != 4 && depth != 8 && depth != 16)) {
+			return fail(PNGSTEGO_ERROR_FORMAT, "Corrupted header");
+		}
+		info->width = width;
+		info->height = height;
+		info->channels = channels;
+		info->bit_depth = depth;
+		lastError.clear();
+		return PNGSTEGO_OK;
+	}
+
+	/** Copies data into a buffer the caller releases with pngstego_free() */
+	uint8_t* handOut(const uint8_t *data, size_t size) {
+		uint8_t *buffer = static_cast<uint8_t*>(std::malloc(size ? size : 1));
+		if (!buffer)
+			throw std::bad_alloc();
+		if (size)
+			memcpy(buffer, data, size);
+		return buffer;
+	}
+
+} // namespace PNGStego
+
+using namespace PNGStego;
+
+int pngstego_api_version(void) {
+	return PNGSTEGO_API_VERSION;
+}
+
+const char* pngstego_last_error(void) {
+	return lastError.c_str();
+}
+
+pngstego_status pngstego_probe(const uint8_t *data, size_t size, pngstego_info *info) {
+	if (!data || !info)
+		return fail(PNGSTEGO_ERROR_ARGUMENT, "Null pointer");
+	return parseHeader(data, size, info);
+}
+
+pngstego_status pngstego_create(pngstego_image **image) {
+	if (!image)
+		return fail(PNGSTEGO_ERROR_ARGUMENT, "Null pointer");
+	*image = nullptr;
+	return guard([image]() {
+		*image = new pngstego_image();
+	});
+}
+
+void pngstego_destroy(pngstego_image *image) {
+	delete image;
+}
+
+pngstego_status pngstego_set_option(pngstego_image *image, pngstego_option option, uint64_t value) {
+	if (!image)
+		return fail(PNGSTEGO_ERROR_ARGUMENT, "Null pointer");
+	return guard([=]() {
+		switch (option) {
+		case PNGSTEGO_OPTION_MEMORY_BUDGET:
+			image->file.setMemoryBudget(value);
+			break;
+		case PNGSTEGO_OPTION_PLANAR:
+			image->file.setSampleLayout(value ? SampleLayout::Planar : SampleLayout::Interleaved);
+			break;
+		default:
+			throw std::invalid_argument("Unknown option");
+		}
+	});
+}
+
+pngstego_status pngstego_load(pngstego_image *image, const uint8_t *data, size_t size) {
+	if (!image || !data)
+		return fail(PNGSTEGO_ERROR_ARGUMENT, "Null pointer");
+	pngstego_info info = { 0, 0, 0, 0 };
+	pngstego_status status = parseHeader(data, size, &info);
+	if (status != PNGSTEGO_OK)
+		return status;
+	image->loaded = false;
+	return guard([=]() {
+		image->file.load(data, size);
+		// The header can't tell what a palette expands to, or what depth samples are kept at; the decoded image can
+		pngstego_info loaded = info;
+		loaded.channels = static_cast<uint32_t>(channelCount(image->file.getFormat()));
+		loaded.bit_depth = static_cast<uint32_t>(image->file.getBitDepth());
+		image->info = loaded;
+		image->loaded = true;
+	}, PNGSTEGO_ERROR_FORMAT);
+}
+
+pngstego_status pngstego_get_info(const pngstego_image *image, pngstego_info *info) {
+	if (!image || !info)
+		return fail(PNGSTEGO_ERROR_ARGUMENT, "Null pointer");
+	if (!image->loaded)
+		return fail(PNGSTEGO_ERROR_ARGUMENT, "No image loaded");
+	*info = image->info;
+	lastError.clear();
+	return PNGSTEGO_OK;
+}
+
+pngstego_status pngstego_encode(pngstego_image *image, const uint8_t *data, size_t size,
+                                const char *extension, const char *key, size_t key_size) {
+	if (!image || (!data && size) || !key)
+		return fail(PNGSTEGO_ERROR_ARGUMENT, "Null pointer");
+	if (!image->loaded)
+		return fail(PNGSTEGO_ERROR_ARGUMENT, "No image loaded");
+	std::string password;
+	pngstego_status status = guard([&]() {
+		password.assign(key, key_size);
+		std::vector<uint8_t> payload(data, data + size);
+		image->file.encode(payload, extension ? extension : "", password);
+		zeroMemory(payload.data(), payload.size());
+	});
+	zeroMemory(&password[0], password.size());
+	return status;
+}
+
+pngstego_status pngstego_decode(const pngstego_image *image, const char *key, size_t key_size,
+                                uint8_t **data, size_t *size, char **extension) {
+	if (!image || !key || !data || !size)
+		return fail(PNGSTEGO_ERROR_ARGUMENT, "Null pointer");
+	*data = nullptr;
+	*size = 0;
+	if (extension)
+		*extension = nullptr;
+	if (!image->loaded)
+		return fail(PNGSTEGO_ERROR_ARGUMENT, "No image loaded");
+
+	std::string password;
+	std::vector<uint8_t> payload;
+	pngstego_status status = guard([&]() {
+		password.assign(key, key_size);
+		std::string fileExtension;
+		image->file.decode(payload, fileExtension, password);
+		uint8_t *output = handOut(payload.data(), payload.size());
+		if (extension) {
+			try {
+				*extension = reinterpret_cast<char*>(handOut(reinterpret_cast<const uint8_t*>(fileExtension.c_str()),
+				                                             fileExtension.size() + 1));
+			}
+			catch (...) {
+				pngstego_free(output, payload.size());
+				throw;
+			}
+		}
+		*data = output;
+		*size = payload.size();
+	});
+	zeroMemory(&password[0], password.size());
+	zeroMemory(payload.data(), payload.size());
+	return status;
+}
+
+pngstego_status pngstego_save(pngstego_image *image, uint8_t **data, size_t *size) {
+	if (!image || !data || !size)
+		return fail(PNGSTEGO_ERROR_ARGUMENT, "Null pointer");
+	*data = nullptr;
+	*size = 0;
+	if (!image->loaded)
+		return fail(PNGSTEGO_ERROR_ARGUMENT, "No image loaded");
+	return guard([=]() {
+		std::vector<uint8_t> encoded = image->file.save();
+		*data = handOut(encoded.data(), encoded.size());
+		*size = encoded.size();
+	});
+}
+
+void pngstego_free(void *buffer, size_t size) {
+	if (!buffer)
+		return;
+	zeroMemory(buffer, size);
+	std::free(buffer);
+}
\ No newline at end of file
@@ -0,0 +1,202 @@
+//
+// Copyright (C) 2015-2016 Zireael (zireael dot nk at gmail dot com)
+//  Distributed under the Boost Software License, Version 1.0.
+//       (See accompanying file LICENSE.md or copy at
+//           http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "colorreducer.h"
+#include <png.h>
+#include <algorithm>
+#include <cstring>
+
+namespace PNGStego {
+
+	namespace {
+		bool hasAlpha(PixelFormat format) noexcept {
+			return format == PixelFormat::GrayAlpha || format == PixelFormat::RGBA;
+		}
+
+		/** Returns the fewest bits an 8-bit gray sample fits into, libpng expands n-bit ones by repeating their bits */
+		int grayBitsOf(uint8_t value) noexcept {
+			static const std::array<uint8_t, 256> table = []() {
+				std::array<uint8_t, 256> bits;
+				for (size_t v = 0; v < bits.size(); ++v)
+					bits[v] = v % 255 == 0 ? 1 : v % 85 == 0 ? 2 : v % 17 == 0 ? 4 : 8;
+				return bits;
+			}();
+			return table[value];
+		}
+	}
+
+	ColorReducer::ColorReducer(PixelFormat format, size_t sampleBytes) noexcept
+		: format(format), sampleBytes(sampleBytes), reduction(ColorReduction::None),
+		  opaque(hasAlpha(format)), paletteFits(!isGray(format) && sampleBytes == 1),
+		  grayBits(format == PixelFormat::Gray && sampleBytes == 1 ? 1 : 8), colors(), rgb(), alphas()
+	{
+		entries.fill(-1);
+	}
+
+	bool ColorReducer::scan(const uint8_t *row, size_t count) noexcept {
+		const size_t stride = bytesPerPixel(format, sampleBytes);
+		if (opaque) {
+			const size_t alpha = channelOffset(format, Channel::Alpha) * sampleBytes;
+			for (const uint8_t *pixel = row; opaque && pixel != row + count * stride; pixel += stride)
+				opaque = pixel[alpha] == 0xFF && pixel[alpha + sampleBytes - 1] == 0xFF;
+		}
+		if (paletteFits) {
+			// Neighbours often share a color, those don't need looking up
+			uint32_t last = 0;
+			bool hasLast = false;
+			for (const uint8_t *pixel = row; pixel != row + count * stride; pixel += stride) {
+				const uint32_t color = this->pack(pixel);
+				if (hasLast && color == last)
+					continue;
+				last = color;
+				hasLast = true;
+				const size_t s = this->slot(color);
+				if (entries[s] >= 0)
+					continue;
+				if (colors.size() == PALETTE_SIZE) {
+					paletteFits = false;
+					break;
+				}
+				keys[s] = color;
+				entries[s] = static_cast<int16_t>(colors.size());
+				colors.push_back(color);
+			}
+		}
+		if (grayBits < 8) {
+			for (size_t i = 0; grayBits < 8 && i < count; ++i)
+				grayBits = std::max(grayBits, grayBitsOf(row[i]));
+		}
+		return opaque || paletteFits || grayBits < 8;
+	}
+
+	ColorReduction ColorReducer::finish() {
+		if (paletteFits && !colors.empty()) {
+			// tRNS only has to go as far as the last entry that isn't opaque
+			size_t entry = 0;
+			for (int pass = 0; pass < 2; ++pass) {
+				for (size_t i = 0; i < colors.size(); ++i) {
+					if (((colors[i] & 0xFF) == 0xFF) != (pass == 1))
+						continue;
+					remap[i] = static_cast<uint8_t>(entry++);
+					rgb.push_back(static_cast<uint8_t>(colors[i] >> 24));
+					rgb.push_back(static_cast<uint8_t>(colors[i] >> 16));
+					rgb.push_back(static_cast<uint8_t>(colors[i] >> 8));
+					if (pass == 0)
+						alphas.push_back(static_cast<uint8_t>(colors[i]));
+				}
+			}
+			reduction = ColorReduction::Palette;
+		}
+		else if (opaque) {
+			reduction = ColorReduction::Opaque;
+		}
+		else if (grayBits < 8) {
+			reduction = ColorReduction::LowGray;
+		}
+		else {
+			reduction = ColorReduction::None;
+		}
+		return reduction;
+	}
+
+	int ColorReducer::colorType() const noexcept {
+		switch (reduction) {
+		case ColorReduction::Palette:
+			return PNG_COLOR_TYPE_PALETTE;
+		case ColorReduction::Opaque:
+		case ColorReduction::LowGray:
+			return isGray(format) ? PNG_COLOR_TYPE_GRAY : PNG_COLOR_TYPE_RGB;
+		default:
+			break;
+		}
+		switch (format) {
+		case PixelFormat::Gray:      return PNG_COLOR_TYPE_GRAY;
+		case PixelFormat::GrayAlpha: return PNG_COLOR_TYPE_GRAY_ALPHA;
+		case PixelFormat::RGB:       return PNG_COLOR_TYPE_RGB;
+		default:                     return PNG_COLOR_TYPE_RGBA;
+		}
+	}
+
+	int ColorReducer::bitDepth() const noexcept {
+		if (reduction == ColorReduction::LowGray)
+			return grayBits;
+		if (reduction == ColorReduction::Palette)
+			return colors.size() <= 2 ? 1 : colors.size() <= 4 ? 2 : colors.size() <= 16 ? 4 : 8;
+		return static_cast<int>(8 * sampleBytes);
+	}
+
+	const std::vector<uint8_t>& ColorReducer::palette() const noexcept {
+		return rgb;
+	}
+
+	const std::vector<uint8_t>& ColorReducer::transparency() const noexcept {
+		return alphas;
+	}
+
+	size_t ColorReducer::rowBytes(size_t count) const noexcept {
+		switch (reduction) {
+		case ColorReduction::Palette:
+		case ColorReduction::LowGray:
+			return count;
+		case ColorReduction::Opaque:
+			return count * (channelCount(format) - 1) * sampleBytes;
+		default:
+			return count * bytesPerPixel(format, sampleBytes);
+		}
+	}
+
+	void ColorReducer::convert(const uint8_t *row, size_t count, uint8_t *output) const noexcept {
+		const size_t stride = bytesPerPixel(format, sampleBytes);
+		switch (reduction) {
+		case ColorReduction::Palette: {
+			uint32_t last = 0;
+			uint8_t index = 0;
+			for (size_t i = 0; i < count; ++i, row += stride) {
+				const uint32_t color = this->pack(row);
+				if (i == 0 || color != last) {
+					last = color;
+					index = remap[static_cast<size_t>(entries[this->slot(color)])];
+				}
+				output[i] = index;
+			}
+			break;
+		}
+
+		case ColorReduction::Opaque: {
+			// Alpha's the last sample of a pixel
+			const size_t color = stride - sampleBytes;
+			for (size_t i = 0; i < count; ++i, row += stride, output += color)
+				memcpy(output, row, color);
+			break;
+		}
+
+		case ColorReduction::LowGray:
+			for (size_t i = 0; i < count; ++i)
+				output[i] = static_cast<uint8_t>(row[i] >> (8 - grayBits));
+			break;
+
+		default:
+			memcpy(output, row, count * stride);
+			break;
+		}
+	}
+
+	size_t ColorReducer::slot(uint32_t color) const noexcept {
+		// No more than a quarter of the slots ever get taken, so probing ends soon
+		size_t s = static_cast<size_t>((color * 2654435761U) >> 22) & (PALETTE_TABLE_SLOTS - 1);
+		while (entries[s] >= 0 && keys[s] != color)
+			s = (s + 1) & (PALETTE_TABLE_SLOTS - 1);
+		return s;
+	}
+
+	uint32_t ColorReducer::pack(const uint8_t *pixel) const noexcept {
+		const uint32_t alpha = format == PixelFormat::RGBA ? pixel[3] : 0xFF;
+		return static_cast<uint32_t>(pixel[0]) << 24 | static_cast<uint32_t>(pixel[1]) << 16 |
+		       static_cast<uint32_t>(pixel[2]) << 8 | alpha;
+	}
+
+} // namespace PNGStego
\ No newline at end of file
@@ -6,49 +6,169 @@
 //
 
 #include "compression.h"
+#include "helpers.h"
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <bzlib.h>
 
-#ifdef _MSC_VER
-#pragma warning(push)
-#pragma warning(disable:4244)
-#endif
-
-#include <boost/iostreams/filter/bzip2.hpp>
-#include <boost/iostreams/filtering_streambuf.hpp>
-#include <boost/iostreams/copy.hpp>
-
-#ifdef _MSC_VER
-#pragma warning(pop)
-#endif
+const int BZIP2_BLOCK_SIZE = 9;   // 900k blocks, same as boost::iostreams used to write
+const int BZIP2_WORK_FACTOR = 30;
+const size_t DECOMPRESSION_MIN_BYTES = 64 << 10; // room a decompressed payload gets before it has to grow
 
 namespace PNGStego {
 namespace bzip2 {
 
-	std::vector<char> compress(const std::vector<char> &source) {
-		std::vector<char> compressed;
-		boost::iostreams::filtering_streambuf< boost::iostreams::output > out;
-		out.push(boost::iostreams::bzip2_compressor());
-		out.push(std::back_inserter(compressed));
-		boost::iostreams::copy(boost::make_iterator_range(source), out);
-		return compressed;
+	/** Owns a bzip2 stream, ends it whichever way the function's left (helper struct) */
+	struct Stream {
+		bz_stream state;
+		bool compressing;
+
+		explicit Stream(bool compressing) : compressing(compressing) {
+			memset(&state, 0, sizeof(state));
+			int result = compressing ? BZ2_bzCompressInit(&state, BZIP2_BLOCK_SIZE, 0, BZIP2_WORK_FACTOR)
+			                         : BZ2_bzDecompressInit(&state, 0, 0);
+			if (result == BZ_MEM_ERROR)
+				throw std::bad_alloc();
+			if (result != BZ_OK)
+				throw std::runtime_error("Cannot initialize bzip2");
+		}
+
+		~Stream() {
+			if (compressing)
+				BZ2_bzCompressEnd(&state);
+			else
+				BZ2_bzDecompressEnd(&state);
+		}
+
+		/** Points the stream's output at the free part of the buffer, at most 'limit' bytes of it */
+		void setOutput(PayloadBuffer &buffer, size_t written, size_t limit) {
+			state.next_out = reinterpret_cast<char*>(buffer.data() + written);
+			state.avail_out = static_cast<unsigned int>(std::min<size_t>(std::min(buffer.size() - written, limit), UINT_MAX));
+		}
+	};
+
+	size_t compressBound(size_t size) noexcept {
+		return size + size / 100 + 601;
+	}
+
+	void compress(std::initializer_list<ByteRange> pieces, PayloadBuffer &output, const CancellationToken &token) {
+		size_t total = 0;
+		for (const ByteRange &piece : pieces)
+			total += piece.size;
+		const size_t start = output.size();
+		output.reserve(start + compressBound(total));
+		// bzip2 writes straight into the buffer, it's cut down to what's been written afterwards
+		output.resize(output.capacity());
+		size_t written = start;
+
+		try {
+			Stream stream(true);
+			auto run = [&](int action) {
+				// The bound's never supposed to be passed, but running out of room mustn't loop forever
+				if (written == output.size())
+					output.resize(output.size() + 1);
+				output.resize(output.capacity());
+				stream.setOutput(output, written, SIZE_MAX);
+				unsigned int room = stream.state.avail_out;
+				int result = BZ2_bzCompress(&stream.state, action);
+				written += room - stream.state.avail_out;
+				return result;
+			};
+
+			for (const ByteRange &piece : pieces) {
+				for (size_t pos = 0; pos < piece.size; pos += COMPRESSION_CHUNK_BYTES) {
+					token.check();
+					stream.state.next_in = const_cast<char*>(reinterpret_cast<const char*>(piece.data + pos));
+					stream.state.avail_in = static_cast<unsigned int>(std::min(COMPRESSION_CHUNK_BYTES, piece.size - pos));
+					while (stream.state.avail_in) {
+						if (run(BZ_RUN) != BZ_RUN_OK)
+							throw std::runtime_error("Compression failed");
+					}
+				}
+			}
+			token.check();
+			int result;
+			while ((result = run(BZ_FINISH)) == BZ_FINISH_OK) { }
+			if (result != BZ_STREAM_END)
+				throw std::runtime_error("Compression failed");
+		}
+		catch (...) {
+			PNGStego::zeroMemory(output.data() + start, output.size() - start);
+			output.resize(start);
+			throw;
+		}
+		output.resize(written);
+	}
+
+	void decompress(const uint8_t *data, size_t size, PayloadBuffer &output, const CancellationToken &token) {
+		const size_t start = output.size();
+		output.reserve(start + std::max(size * 2, DECOMPRESSION_MIN_BYTES));
+		output.resize(output.capacity());
+		size_t written = start;
+
+		try {
+			Stream stream(false);
+			size_t consumed = 0;
+			while (true) {
+				token.check();
+				if (!stream.state.avail_in && consumed < size) {
+					stream.state.next_in = const_cast<char*>(reinterpret_cast<const char*>(data + consumed));
+					stream.state.avail_in = static_cast<unsigned int>(std::min<size_t>(size - consumed, UINT_MAX));
+					consumed += stream.state.avail_in;
+				}
+				// Grows twofold whenever it's full, only ever so often is the token checked
+				if (written == output.size())
+					output.resize(output.size() + 1);
+				output.resize(output.capacity());
+				stream.setOutput(output, written, COMPRESSION_CHUNK_BYTES);
+				unsigned int room = stream.state.avail_out;
+				int result = BZ2_bzDecompress(&stream.state);
+				written += room - stream.state.avail_out;
+				if (result == BZ_STREAM_END)
+					break;
+				if (result != BZ_OK || (room == stream.state.avail_out && !stream.state.avail_in && consumed == size))
+					throw std::runtime_error("The data's corrupted.");
+			}
+		}
+		catch (...) {
+			PNGStego::zeroMemory(output.data() + start, output.size() - start);
+			output.resize(start);
+			throw;
+		}
+		output.resize(written);
+	}
+
+	std::vector<uint8_t> compress(const std::vector<uint8_t> &source, const CancellationToken &token) {
+		PayloadBuffer compressed;
+		compress({ { source.data(), source.size() } }, compressed, token);
+		std::vector<uint8_t> result;
+		compressed.moveTo(result);
+		return result;
 	}
 
-	std::vector<char> decompress(const std::vector<char> &source) {
-		std::vector<char> decompressed;
-		boost::iostreams::filtering_streambuf< boost::iostreams::input > in;
-		in.push(boost::iostreams::bzip2_decompressor());
-		in.push(boost::make_iterator_range(source));
-		boost::iostreams::copy(in, std::back_inserter(decompressed));
-		return decompressed;
+	std::vector<uint8_t> decompress(const std::vector<uint8_t> &source, const CancellationToken &token) {
+		PayloadBuffer decompressed;
+		decompress(source.data(), source.size(), decompressed, token);
+		std::vector<uint8_t> result;
+		decompressed.moveTo(result);
+		return result;
 	}
 
-	std::vector<uint8_t> compress(const std::vector<uint8_t> &source) {
-		std::vector<char> temp = compress(std::vector<char>(source.begin(), source.end()));
-		return std::vector<uint8_t>(temp.begin(), temp.end());
+	std::vector<char> compress(const std::vector<char> &source, const CancellationToken &token) {
+		PayloadBuffer compressed;
+		compress({ { reinterpret_cast<const uint8_t*>(source.data()), source.size() } }, compressed, token);
+		std::vector<char> result(compressed.data(), compressed.data() + compressed.size());
+		return result;
 	}
 
-	std::vector<uint8_t> decompress(const std::vector<uint8_t> &source) {
-		std::vector<char> temp = decompress(std::vector<char>(source.begin(), source.end()));
-		return std::vector<uint8_t>(temp.begin(), temp.end());
+	std::vector<char> decompress(const std::vector<char> &source, const CancellationToken &token) {
+		PayloadBuffer decompressed;
+		decompress(reinterpret_cast<const uint8_t*>(source.data()), source.size(), decompressed, token);
+		std::vector<char> result(decompressed.data(), decompressed.data() + decompressed.size());
+		return result;
 	}
 
 } // namespace bzip2
@@ -0,0 +1,406 @@
+//
+// Copyright (C) 2015-2016 Zireael (zireael dot nk at gmail dot com)
+//  Distributed under the Boost Software License, Version 1.0.
+//       (See accompanying file LICENSE.md or copy at
+//           http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "daemon.h"
+#include "bitmapfile.h"
+#include "helpers.h"
+#include "pngwrapper.h"
+#include <stdexcept>
+
+#ifndef _WIN32
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <thread>
+#include <vector>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0 // OS X, SIGPIPE has to be ignored by the process
+#endif
+
+const uint8_t PROTOCOL_VERSION = 2;
+const uint8_t FLAG_IN_PLACE = 0x01;
+const uint8_t FLAG_PROFILE = 0x02;
+const unsigned PROFILE_SHIFT = 2; // the profile's in the two bits above the flags
+const uint8_t PROFILE_MASK = 0x03;
+const uint32_t MAX_FRAME_BYTES = 64 * 1024;
+const int POLL_INTERVAL_MS = 200; // how often a worker waiting for data looks at whether the daemon's stopping
+
+namespace PNGStego {
+
+	typedef std::function<bool(int)> WaitFn;
+
+	/** Fills the whole buffer or returns false if the other side's gone. 'wait', if set, says whether to go on reading */
+	bool receiveAll(int fd, uint8_t *data, size_t size, const WaitFn &wait) {
+		while (size) {
+			if (wait && !wait(fd))
+				return false;
+			ssize_t received = recv(fd, data, size, 0);
+			if (received < 0 && errno == EINTR)
+				continue;
+			if (received <= 0)
+				return false;
+			data += received;
+			size -= static_cast<size_t>(received);
+		}
+		return true;
+	}
+
+	bool sendAll(int fd, const uint8_t *data, size_t size) {
+		while (size) {
+			ssize_t sent = send(fd, data, size, MSG_NOSIGNAL);
+			if (sent < 0 && errno == EINTR)
+				continue;
+			if (sent <= 0)
+				return false;
+			data += sent;
+			size -= static_cast<size_t>(sent);
+		}
+		return true;
+	}
+
+	void appendNumber(std::vector<uint8_t> &frame, uint32_t value) {
+		for (int k = 0; k < 4; ++k)
+			frame.push_back(static_cast<uint8_t>(value >> (8 * k)));
+	}
+
+	void appendString(std::vector<uint8_t> &frame, const std::string &value) {
+		appendNumber(frame, static_cast<uint32_t>(value.size()));
+		frame.insert(frame.end(), value.begin(), value.end());
+	}
+
+	uint32_t parseNumber(const std::vector<uint8_t> &frame, size_t &pos) {
+		if (frame.size() - pos < 4)
+			throw std::invalid_argument("Malformed frame");
+		uint32_t value = 0;
+		for (int k = 0; k < 4; ++k)
+			value |= static_cast<uint32_t>(frame[pos++]) << (8 * k);
+		return value;
+	}
+
+	std::string parseString(const std::vector<uint8_t> &frame, size_t &pos) {
+		uint32_t size = parseNumber(frame, pos);
+		if (frame.size() - pos < size)
+			throw std::invalid_argument("Malformed frame");
+		std::string value(frame.begin() + pos, frame.begin() + pos + size);
+		pos += size;
+		return value;
+	}
+
+	/** Sends the frame's length and the frame itself */
+	bool sendFrame(int fd, const std::vector<uint8_t> &frame) {
+		std::vector<uint8_t> length;
+		appendNumber(length, static_cast<uint32_t>(frame.size()));
+		return sendAll(fd, length.data(), length.size()) && sendAll(fd, frame.data(), frame.size());
+	}
+
+	/** Receives a frame into the given buffer, keeping its capacity */
+	bool receiveFrame(int fd, std::vector<uint8_t> &frame, const WaitFn &wait = WaitFn()) {
+		uint8_t length[4];
+		if (!receiveAll(fd, length, sizeof(length), wait))
+			return false;
+		uint32_t size = length[0] | length[1] << 8 | length[2] << 16 | static_cast<uint32_t>(length[3]) << 24;
+		if (size > MAX_FRAME_BYTES)
+			return false;
+		frame.resize(size);
+		return receiveAll(fd, frame.data(), frame.size(), wait);
+	}
+
+	sockaddr_un socketAddress(const std::string &socketPath) {
+		sockaddr_un address;
+		memset(&address, 0, sizeof(address));
+		address.sun_family = AF_UNIX;
+		if (socketPath.empty() || socketPath.size() >= sizeof(address.sun_path)) {
+			throw std::invalid_argument("Invalid socket path: " + socketPath);
+		}
+		memcpy(address.sun_path, socketPath.c_str(), socketPath.size());
+		return address;
+	}
+
+	Daemon::Daemon(const std::string &socketPath, size_t threads, const JobOptions &options)
+		: socketPath(socketPath), listener(-1), threads(threads), options(options), stopping(false),
+		  idleTimeout(DAEMON_IDLE_TIMEOUT_MS), connections(), outputFn()
+	{
+		if (this->threads == 0)
+			this->threads = std::max(std::thread::hardware_concurrency(), 1U);
+		connections.reset(new std::atomic<int>[this->threads]);
+		for (size_t k = 0; k < this->threads; ++k)
+			connections[k] = -1;
+
+		sockaddr_un address = socketAddress(socketPath);
+		listener = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (listener == -1) {
+			throw std::runtime_error("Cannot create a socket");
+		}
+		// A socket left by a daemon that's not running anymore would make bind() fail, anything else there is left alone
+		struct stat info;
+		if (lstat(socketPath.c_str(), &info) == 0) {
+			if (!S_ISSOCK(info.st_mode)) {
+				close(listener);
+				throw std::runtime_error("Cannot listen on " + socketPath + ": it's not a socket");
+			}
+			int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+			const bool answered = probe != -1 && connect(probe, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0;
+			const int error = errno;
+			if (probe != -1)
+				close(probe);
+			if (answered || error != ECONNREFUSED) {
+				close(listener);
+				throw std::runtime_error("Cannot listen on " + socketPath + ": " +
+				                         (answered ? std::string("another daemon's listening on it") : strerror(error)));
+			}
+			unlink(socketPath.c_str());
+		}
+		mode_t mask = umask(0077);
+		int bound = bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address));
+		umask(mask);
+		if (bound != 0 || listen(listener, SOMAXCONN) != 0) {
+			close(listener);
+			throw std::runtime_error("Cannot listen on " + socketPath + ": " + strerror(errno));
+		}
+	}
+
+	Daemon::~Daemon() {
+		close(listener);
+		unlink(socketPath.c_str());
+	}
+
+	/**
+	 ** Every thread waits in accept() and then serves the connection it got,
+	 ** so there's no hand-over and threads stay warm between requests.
+	 **/
+	void Daemon::serve() {
+		auto worker = [this](size_t slot) {
+			while (!stopping) {
+				int connection = accept(listener, nullptr, nullptr);
+				if (connection == -1) {
+					if (errno == EINTR || errno == ECONNABORTED || errno == EMFILE || errno == ENFILE)
+						continue;
+					break;
+				}
+				connections[slot] = connection;
+				// stop() may have missed the connection if it's come in just then
+				if (!stopping)
+					this->serveConnection(connection);
+				connections[slot] = -1;
+				close(connection);
+			}
+		};
+
+		std::vector<std::thread> workers;
+		for (size_t k = 1; k < threads; ++k)
+			workers.emplace_back(worker, k);
+		worker(0);
+		for (auto &thread : workers)
+			thread.join();
+	}
+
+	void Daemon::stop() noexcept {
+		stopping = true;
+		// Wakes up threads waiting in accept() and those waiting for a request, requests being served get finished
+		shutdown(listener, SHUT_RDWR);
+		for (size_t k = 0; k < threads; ++k) {
+			const int connection = connections[k];
+			if (connection != -1)
+				shutdown(connection, SHUT_RD);
+		}
+	}
+
+	void Daemon::setOutputFn(const std::function<void(const std::string&)> &fn) {
+		outputFn = fn;
+	}
+
+	void Daemon::setIdleTimeout(unsigned milliseconds) noexcept {
+		idleTimeout = milliseconds;
+	}
+
+	bool Daemon::waitForData(int connection) const {
+		// Polling in short intervals, a signal handler's stop() doesn't interrupt poll() in other threads
+		for (unsigned waited = 0; !stopping; ) {
+			pollfd descriptor = { connection, POLLIN, 0 };
+			const int ready = poll(&descriptor, 1, POLL_INTERVAL_MS);
+			if (ready > 0)
+				return !stopping;
+			if (ready < 0 && errno != EINTR)
+				return false;
+			if (ready == 0) {
+				waited += POLL_INTERVAL_MS;
+				if (waited >= idleTimeout)
+					return false;
+			}
+		}
+		return false;
+	}
+
+	void Daemon::serveConnection(int connection) {
+		// Both buffers live as long as the connection does, keys pass through them so they get wiped
+		std::vector<uint8_t> frame, reply;
+		while (!stopping && receiveFrame(connection, frame, [this](int fd) { return this->waitForData(fd); })) {
+			DaemonRequest request;
+			DaemonReply result;
+			try {
+				size_t pos = 3;
+				if (frame.size() < pos || frame[0] != PROTOCOL_VERSION) {
+					throw std::invalid_argument("Unsupported protocol version");
+				}
+				request.op = static_cast<DaemonOp>(frame[1]);
+				request.inPlace = (frame[2] & FLAG_IN_PLACE) != 0;
+				request.useProfile = (frame[2] & FLAG_PROFILE) != 0;
+				const uint8_t profile = (frame[2] >> PROFILE_SHIFT) & PROFILE_MASK;
+				if (profile > static_cast<uint8_t>(EmbeddingProfile::Dense2)) {
+					throw std::invalid_argument("Unknown embedding profile");
+				}
+				request.profile = static_cast<EmbeddingProfile>(profile);
+				request.container = parseString(frame, pos);
+				request.file = parseString(frame, pos);
+				request.key = parseString(frame, pos);
+				zeroMemory(frame.data(), frame.size());
+				result = this->handle(request);
+			}
+			catch (const std::exception &e) {
+				result.ok = false;
+				result.message = e.what();
+			}
+			zeroMemory(frame.data(), frame.size());
+			zeroMemory(&request.key[0], request.key.size());
+
+			reply.clear();
+			reply.push_back(PROTOCOL_VERSION);
+			reply.push_back(result.ok ? 0 : 1);
+			appendString(reply, result.message);
+			if (outputFn) {
+				std::lock_guard<std::mutex> lock(outputMutex);
+				outputFn((result.ok ? "OK\t" : "FAILED\t") + request.container + (result.ok ? "" : "\t" + result.message));
+			}
+			if (!sendFrame(connection, reply))
+				break;
+		}
+		zeroMemory(frame.data(), frame.capacity());
+	}
+
+	DaemonReply Daemon::handle(DaemonRequest &request) const {
+		JobOptions jobOptions = options;
+		jobOptions.inPlace = request.inPlace;
+		if (request.useProfile)
+			jobOptions.profile = request.profile;
+		BatchJob job = { 0, request.container, request.file, request.key };
+		zeroMemory(&request.key[0], request.key.size());
+
+		DaemonReply reply = { true, std::string() };
+		switch (request.op) {
+		case DaemonOp::Encode:
+			reply.message = encodeJob(job, jobOptions);
+			break;
+		case DaemonOp::Decode:
+			decodeJob(job, jobOptions);
+			reply.message = job.file;
+			break;
+		case DaemonOp::Probe:
+			if (BitmapFile::isBitmap(job.container)) {
+				BitmapFile container(job.container, false);
+				reply.message = "bitmap " + std::to_string(container.getWidth()) + "x" + std::to_string(container.getHeight()) +
+				                " " + std::to_string(channelCount(container.getFormat()));
+			}
+			else {
+				PNGFile container;
+				container.setMemoryBudget(options.memoryBudget);
+				container.load(job.container);
+				reply.message = "png " + std::to_string(container.getWidth()) + "x" + std::to_string(container.getHeight()) +
+				                " " + std::to_string(channelCount(container.getFormat()));
+			}
+			break;
+		default:
+			zeroMemory(&job.key[0], job.key.size());
+			throw std::invalid_argument("Unknown operation");
+		}
+		zeroMemory(&job.key[0], job.key.size());
+		return reply;
+	}
+
+	DaemonReply Daemon::request(const std::string &socketPath, const DaemonRequest &request) {
+		sockaddr_un address = socketAddress(socketPath);
+		int connection = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (connection == -1) {
+			throw std::runtime_error("Cannot create a socket");
+		}
+		if (connect(connection, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+			close(connection);
+			throw std::runtime_error("Cannot connect to " + socketPath + ": " + strerror(errno));
+		}
+
+		std::vector<uint8_t> frame;
+		frame.push_back(PROTOCOL_VERSION);
+		frame.push_back(static_cast<uint8_t>(request.op));
+		uint8_t flags = request.inPlace ? FLAG_IN_PLACE : 0;
+		if (request.useProfile)
+			flags |= FLAG_PROFILE | static_cast<uint8_t>(static_cast<uint8_t>(request.profile) << PROFILE_SHIFT);
+		frame.push_back(flags);
+		appendString(frame, request.container);
+		appendString(frame, request.file);
+		appendString(frame, request.key);
+		bool sent = sendFrame(connection, frame);
+		zeroMemory(frame.data(), frame.size());
+		if (!sent || !receiveFrame(connection, frame)) {
+			close(connection);
+			throw std::runtime_error("The daemon's closed the connection");
+		}
+		close(connection);
+
+		size_t pos = 2;
+		if (frame.size() < pos || frame[0] != PROTOCOL_VERSION) {
+			throw std::runtime_error("Unsupported protocol version");
+		}
+		DaemonReply reply;
+		reply.ok = frame[1] == 0;
+		reply.message = parseString(frame, pos);
+		return reply;
+	}
+
+} // namespace PNGStego
+
+#else
+
+namespace PNGStego {
+
+	Daemon::Daemon(const std::string&, size_t, const JobOptions&) : listener(-1), threads(0), options(), stopping(false), idleTimeout(0) {
+		throw std::runtime_error("The daemon isn't supported on Windows");
+	}
+
+	Daemon::~Daemon() { }
+
+	void Daemon::serve() { }
+
+	void Daemon::stop() noexcept { }
+
+	void Daemon::setOutputFn(const std::function<void(const std::string&)> &fn) {
+		outputFn = fn;
+	}
+
+	void Daemon::setIdleTimeout(unsigned) noexcept { }
+
+	void Daemon::serveConnection(int) { }
+
+	bool Daemon::waitForData(int) const {
+		return false;
+	}
+
+	DaemonReply Daemon::handle(DaemonRequest&) const {
+		return DaemonReply();
+	}
+
+	DaemonReply Daemon::request(const std::string&, const DaemonRequest&) {
+		throw std::runtime_error("The daemon isn't supported on Windows");
+	}
+
+} // namespace PNGStego
+
+#endif
\ No newline at end of file
@@ -7,13 +7,13 @@
 
 #include <vector>
 #include <array>
+#include <stdexcept>
 
 #ifdef _MSC_VER
 #pragma warning(push)
 #pragma warning(disable:4297)
 #endif
 
-#include <cryptopp/filters.h>
 #include <cryptopp/aes.h>
 #include <cryptopp/serpent.h>
 #include <cryptopp/gcm.h>
@@ -24,106 +24,192 @@
 
 #include "encryption.h"
 #include "helpers.h"
+#include "securepool.h"
 
 namespace PNGStego {
 namespace Encryption {
 
-	std::vector<uint8_t> encrypt(const std::vector<uint8_t> &source, const std::string &key,
-	                             const std::vector<byte> &iv, const std::vector<byte> &salt) {
-		constexpr int keylength = CryptoPP::AES::MAX_KEYLENGTH + CryptoPP::Serpent::MAX_KEYLENGTH;
+	/**
+	 ** Encrypts 'size' bytes in place and writes the tag right after them.
+	 ** GCM is a stream mode, so ciphertext takes exactly the plaintext's room. The token's checked between chunks.
+	 **/
+	template <class Cipher>
+	void encryptInPlace(uint8_t *data, size_t size, const byte *key, size_t keylength, const byte *iv, size_t ivlength,
+	                    const CancellationToken &token) {
+		typename CryptoPP::GCM<Cipher>::Encryption e;
+		e.SetKeyWithIV(key, keylength, iv, ivlength);
+		for (size_t pos = 0; pos < size; pos += CIPHER_CHUNK_BYTES) {
+			token.check();
+			e.ProcessData(data + pos, data + pos, std::min(CIPHER_CHUNK_BYTES, size - pos));
+		}
+		token.check();
+		e.TruncatedFinal(data + size, TAG_SIZE);
+	}
 
-		std::array<byte, keylength> hashedKey = hashKey<keylength>(key, salt);
-		std::vector<uint8_t> encrypted;
-		encrypted = SerpentEncrypt(source, hashedKey.data() + CryptoPP::AES::MAX_KEYLENGTH,
-			                                                  CryptoPP::Serpent::MAX_KEYLENGTH, iv.data(), iv.size());
-		encrypted = AESEncrypt(encrypted, hashedKey.data(), CryptoPP::AES::MAX_KEYLENGTH, iv.data(), iv.size());
-		PNGStego::zeroMemory(hashedKey.data(), hashedKey.size());
+	/** Decrypts 'size' bytes in place, the tag's right after them. Returns whether it matches */
+	template <class Cipher>
+	bool decryptInPlace(uint8_t *data, size_t size, const byte *key, size_t keylength, const byte *iv, size_t ivlength,
+	                    const CancellationToken &token) {
+		typename CryptoPP::GCM<Cipher>::Decryption d;
+		d.SetKeyWithIV(key, keylength, iv, ivlength);
+		for (size_t pos = 0; pos < size; pos += CIPHER_CHUNK_BYTES) {
+			token.check();
+			d.ProcessData(data + pos, data + pos, std::min(CIPHER_CHUNK_BYTES, size - pos));
+		}
+		token.check();
+		return d.TruncatedVerify(data + size, TAG_SIZE);
+	}
 
+	/** Copies data into a vector with room for the tag and encrypts it there (helper function) */
+	template <class Cipher>
+	std::vector<uint8_t> encryptCopy(const std::vector<uint8_t> &source, const byte *key, size_t keylength,
+	                                 const byte *iv, size_t ivlength, const CancellationToken &token) {
+		std::vector<uint8_t> encrypted(source.size() + TAG_SIZE);
+		std::copy(source.begin(), source.end(), encrypted.begin());
+		try {
+			encryptInPlace<Cipher>(encrypted.data(), source.size(), key, keylength, iv, ivlength, token);
+		}
+		catch (...) {
+			PNGStego::zeroMemory(encrypted.data(), encrypted.size());
+			throw;
+		}
 		return encrypted;
 	}
 
-	std::vector<uint8_t> decrypt(const std::vector<uint8_t> &source, const std::string &key,
-	                             const std::vector<byte> &iv, const std::vector<byte> &salt) {
-		constexpr int keylength = CryptoPP::AES::MAX_KEYLENGTH + CryptoPP::Serpent::MAX_KEYLENGTH;
-
-		std::array<byte, keylength> hashedKey = hashKey<keylength>(key, salt);
-		std::vector<uint8_t> decrypted;
-		decrypted = AESDecrypt(source, hashedKey.data(), CryptoPP::AES::MAX_KEYLENGTH, iv.data(), iv.size());
-		decrypted = SerpentDecrypt(decrypted, hashedKey.data() + CryptoPP::AES::MAX_KEYLENGTH,
-		                                                        CryptoPP::Serpent::MAX_KEYLENGTH, iv.data(), iv.size());
-		PNGStego::zeroMemory(hashedKey.data(), hashedKey.size());
-
+	/** Copies data into a vector and decrypts it there, throws if the tag doesn't match (helper function) */
+	template <class Cipher>
+	std::vector<uint8_t> decryptCopy(const std::vector<uint8_t> &source, const byte *key, size_t keylength,
+	                                 const byte *iv, size_t ivlength, const CancellationToken &token) {
+		if (source.size() < static_cast<size_t>(TAG_SIZE))
+			throw std::runtime_error("The data's corrupted.");
+		std::vector<uint8_t> decrypted(source);
+		bool authentic;
+		try {
+			authentic = decryptInPlace<Cipher>(decrypted.data(), decrypted.size() - TAG_SIZE, key, keylength, iv, ivlength, token);
+		}
+		catch (...) {
+			PNGStego::zeroMemory(decrypted.data(), decrypted.size());
+			throw;
+		}
+		if (!authentic) {
+			PNGStego::zeroMemory(decrypted.data(), decrypted.size());
+			throw std::runtime_error("The data's corrupted.");
+		}
+		decrypted.resize(decrypted.size() - TAG_SIZE);
 		return decrypted;
 	}
 
-	std::vector<uint8_t> AESEncrypt(const std::vector<uint8_t> &source, const byte *key, size_t keylength,
-	                                                                    const byte *iv,  size_t ivlength) {
-		std::string encrypted;
-		CryptoPP::GCM< CryptoPP::AES >::Encryption e;
-		e.SetKeyWithIV(key, keylength, iv, ivlength);
-		CryptoPP::ArraySource ss(source.data(), source.size(), true,
-			new CryptoPP::AuthenticatedEncryptionFilter(e,
-				new CryptoPP::StringSink(encrypted), false, TAG_SIZE
-				) // AuthenticatedEncryptionFilter
-		); // ArraySource
+	static_assert(DERIVED_KEY_BYTES == CryptoPP::AES::MAX_KEYLENGTH + CryptoPP::Serpent::MAX_KEYLENGTH,
+	              "A derived key holds keys of both ciphers");
 
-		return PNGStego::stringToVector(encrypted);
+	DerivedKey deriveKey(const std::string &key, const std::vector<byte> &salt, const CancellationToken &token) {
+		return hashKey<DERIVED_KEY_BYTES>(key, salt, token);
 	}
 
-	std::vector<uint8_t> AESDecrypt(const std::vector<uint8_t> &source, const byte *key, size_t keylength,
-	                                                                    const byte *iv,  size_t ivlength) {
-		std::string decrypted;
-		CryptoPP::GCM< CryptoPP::AES >::Decryption d;
-		d.SetKeyWithIV(key, keylength, iv, ivlength);
+	void deriveKey(const std::string &key, const std::vector<byte> &salt, DerivedKey &derived, const CancellationToken &token) {
+		hashKey<DERIVED_KEY_BYTES>(key, salt, derived, token);
+	}
 
-		CryptoPP::AuthenticatedDecryptionFilter df(d,
-			new CryptoPP::StringSink(decrypted),
-			CryptoPP::AuthenticatedDecryptionFilter::DEFAULT_FLAGS,
-			TAG_SIZE
-		);
-		CryptoPP::ArraySource ss(source.data(), source.size(), true,
-			new CryptoPP::Redirector(df /*, PASS_EVERYTHING */)
-		); // ArraySource
+	void encrypt(PayloadBuffer &buffer, const DerivedKey &key, const std::vector<byte> &iv, const CancellationToken &token) {
+		size_t size = buffer.size();
+		buffer.resize(size + 2 * TAG_SIZE);
+		try {
+			encryptInPlace<CryptoPP::Serpent>(buffer.data(), size, key.data() + CryptoPP::AES::MAX_KEYLENGTH,
+			                                  CryptoPP::Serpent::MAX_KEYLENGTH, iv.data(), iv.size(), token);
+			encryptInPlace<CryptoPP::AES>(buffer.data(), size + TAG_SIZE, key.data(), CryptoPP::AES::MAX_KEYLENGTH,
+			                              iv.data(), iv.size(), token);
+		}
+		catch (...) {
+			PNGStego::zeroMemory(buffer.data(), buffer.size());
+			buffer.resize(0);
+			throw;
+		}
+	}
 
-		if (false == df.GetLastResult())
+	void decrypt(PayloadBuffer &buffer, const DerivedKey &key, const std::vector<byte> &iv, const CancellationToken &token) {
+		if (buffer.size() < 2 * static_cast<size_t>(TAG_SIZE))
+			throw std::runtime_error("The data's corrupted.");
+		size_t size = buffer.size() - 2 * TAG_SIZE;
+		bool authentic;
+		try {
+			authentic = decryptInPlace<CryptoPP::AES>(buffer.data(), size + TAG_SIZE, key.data(), CryptoPP::AES::MAX_KEYLENGTH,
+			                                          iv.data(), iv.size(), token) &&
+			            decryptInPlace<CryptoPP::Serpent>(buffer.data(), size, key.data() + CryptoPP::AES::MAX_KEYLENGTH,
+			                                              CryptoPP::Serpent::MAX_KEYLENGTH, iv.data(), iv.size(), token);
+		}
+		catch (...) {
+			PNGStego::zeroMemory(buffer.data(), buffer.size());
+			buffer.resize(0);
+			throw;
+		}
+		if (!authentic) {
+			PNGStego::zeroMemory(buffer.data(), buffer.size());
+			buffer.resize(0);
 			throw std::runtime_error("The data's corrupted.");
+		}
+		// Tags are left behind the end, wiped along with the rest once the buffer's released
+		buffer.resize(size);
+	}
 
-		return PNGStego::stringToVector(decrypted);
+	std::vector<uint8_t> encrypt(const std::vector<uint8_t> &source, const DerivedKey &key, const std::vector<byte> &iv,
+	                             const CancellationToken &token) {
+		PayloadBuffer buffer;
+		buffer.reserve(source.size() + 2 * TAG_SIZE);
+		buffer.append(source.data(), source.size());
+		encrypt(buffer, key, iv, token);
+		std::vector<uint8_t> encrypted;
+		buffer.moveTo(encrypted);
+		return encrypted;
 	}
 
-	std::vector<uint8_t> SerpentEncrypt(const std::vector<uint8_t> &source, const byte *key, size_t keylength,
-	                                                                        const byte *iv,  size_t ivlength) {
-		std::string encrypted;
-		CryptoPP::GCM< CryptoPP::Serpent >::Encryption e;
-		e.SetKeyWithIV(key, keylength, iv, ivlength);
-		CryptoPP::ArraySource ss(source.data(), source.size(), true,
-			new CryptoPP::AuthenticatedEncryptionFilter(e,
-				new CryptoPP::StringSink(encrypted), false, TAG_SIZE
-				) // AuthenticatedEncryptionFilter
-		); // ArraySource
+	std::vector<uint8_t> decrypt(const std::vector<uint8_t> &source, const DerivedKey &key, const std::vector<byte> &iv,
+	                             const CancellationToken &token) {
+		PayloadBuffer buffer;
+		buffer.append(source.data(), source.size());
+		decrypt(buffer, key, iv, token);
+		std::vector<uint8_t> decrypted;
+		buffer.moveTo(decrypted);
+		return decrypted;
+	}
 
-		return PNGStego::stringToVector(encrypted);
+	std::vector<uint8_t> encrypt(const std::vector<uint8_t> &source, const std::string &key,
+	                             const std::vector<byte> &iv, const std::vector<byte> &salt,
+	                             const CancellationToken &token) {
+		SecureObject<DerivedKey> hashedKey;
+		deriveKey(key, salt, *hashedKey, token);
+		return encrypt(source, *hashedKey, iv, token);
 	}
 
-	std::vector<uint8_t> SerpentDecrypt(const std::vector<uint8_t> &source, const byte *key, size_t keylength,
-	                                                                        const byte *iv,  size_t ivlength) {
-		std::string decrypted;
-		CryptoPP::GCM< CryptoPP::Serpent >::Decryption d;
-		d.SetKeyWithIV(key, keylength, iv, ivlength);
+	std::vector<uint8_t> decrypt(const std::vector<uint8_t> &source, const std::string &key,
+	                             const std::vector<byte> &iv, const std::vector<byte> &salt,
+	                             const CancellationToken &token) {
+		SecureObject<DerivedKey> hashedKey;
+		deriveKey(key, salt, *hashedKey, token);
+		return decrypt(source, *hashedKey, iv, token);
+	}
 
-		CryptoPP::AuthenticatedDecryptionFilter df(d,
-			new CryptoPP::StringSink(decrypted),
-			CryptoPP::AuthenticatedDecryptionFilter::DEFAULT_FLAGS,
-			TAG_SIZE
-		);
-		CryptoPP::ArraySource ss(source.data(), source.size(), true,
-			new CryptoPP::Redirector(df /*, PASS_EVERYTHING */)
-		); // ArraySource
+	std::vector<uint8_t> AESEncrypt(const std::vector<uint8_t> &source, const byte *key, size_t keylength,
+	                                                                    const byte *iv,  size_t ivlength,
+	                                                                    const CancellationToken &token) {
+		return encryptCopy<CryptoPP::AES>(source, key, keylength, iv, ivlength, token);
+	}
 
-		if (false == df.GetLastResult())
-			throw std::runtime_error("The data's corrupted.");
+	std::vector<uint8_t> AESDecrypt(const std::vector<uint8_t> &source, const byte *key, size_t keylength,
+	                                                                    const byte *iv,  size_t ivlength,
+	                                                                    const CancellationToken &token) {
+		return decryptCopy<CryptoPP::AES>(source, key, keylength, iv, ivlength, token);
+	}
 
-		return PNGStego::stringToVector(decrypted);
+	std::vector<uint8_t> SerpentEncrypt(const std::vector<uint8_t> &source, const byte *key, size_t keylength,
+	                                                                        const byte *iv,  size_t ivlength,
+	                                                                        const CancellationToken &token) {
+		return encryptCopy<CryptoPP::Serpent>(source, key, keylength, iv, ivlength, token);
+	}
+
+	std::vector<uint8_t> SerpentDecrypt(const std::vector<uint8_t> &source, const byte *key, size_t keylength,
+	                                                                        const byte *iv,  size_t ivlength,
+	                                                                        const CancellationToken &token) {
+		return decryptCopy<CryptoPP::Serpent>(source, key, keylength, iv, ivlength, token);
 	}
 
 } // namespace Encryption
@@ -0,0 +1,114 @@
+//
+// Copyright (C) 2015-2016 Zireael (zireael dot nk at gmail dot com)
+//  Distributed under the Boost Software License, Version 1.0.
+//       (See accompanying file LICENSE.md or copy at
+//           http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "executor.h"
+#include <algorithm>
+
+namespace PNGStego {
+
+	// The pool and the queue of the thread that's running, if it's one of a pool's threads
+	thread_local WorkStealingPool *currentPool = nullptr;
+	thread_local size_t currentQueue = 0;
+
+	WorkStealingPool::WorkStealingPool(size_t threads) : pending(0), nextQueue(0), stopping(false) {
+		if (threads == 0)
+			threads = std::max(std::thread::hardware_concurrency(), 1U);
+		for (size_t k = 0; k < threads; ++k)
+			queues.emplace_back(new Queue());
+		for (size_t k = 0; k < threads; ++k)
+			this->threads.emplace_back(&WorkStealingPool::work, this, k);
+	}
+
+	WorkStealingPool::~WorkStealingPool() {
+		{
+			std::lock_guard<std::mutex> lock(sleepMutex);
+			stopping = true;
+		}
+		wakeUp.notify_all();
+		for (auto &thread : threads)
+			thread.join();
+	}
+
+	void WorkStealingPool::submit(std::function<void()> task) {
+		size_t target = currentPool == this ? currentQueue : nextQueue++ % queues.size();
+		{
+			// Counted first so nobody can take it before that, under the lock so a thread that's about to sleep can't miss it
+			std::lock_guard<std::mutex> lock(sleepMutex);
+			++pending;
+		}
+		{
+			std::lock_guard<std::mutex> lock(queues[target]->mutex);
+			queues[target]->tasks.push_back(std::move(task));
+		}
+		wakeUp.notify_one();
+	}
+
+	size_t WorkStealingPool::size() const noexcept {
+		return threads.size();
+	}
+
+	WorkStealingPool& WorkStealingPool::shared() {
+		static WorkStealingPool pool;
+		return pool;
+	}
+
+	bool WorkStealingPool::take(size_t self, std::function<void()> &task) {
+		{
+			Queue &own = *queues[self];
+			std::lock_guard<std::mutex> lock(own.mutex);
+			if (!own.tasks.empty()) {
+				task = std::move(own.tasks.back());
+				own.tasks.pop_back();
+				return true;
+			}
+		}
+		for (size_t k = 1; k < queues.size(); ++k) {
+			Queue &victim = *queues[(self + k) % queues.size()];
+			std::lock_guard<std::mutex> lock(victim.mutex);
+			if (!victim.tasks.empty()) {
+				task = std::move(victim.tasks.front());
+				victim.tasks.pop_front();
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void WorkStealingPool::work(size_t self) {
+		currentPool = this;
+		currentQueue = self;
+		std::function<void()> task;
+		while (true) {
+			{
+				std::unique_lock<std::mutex> lock(sleepMutex);
+				wakeUp.wait(lock, [this]() { return pending > 0 || stopping; });
+				// Whatever's been submitted before the pool's destroyed still runs
+				if (pending == 0)
+					return;
+			}
+			// The task may've been counted before it's been pushed, so keep looking until it's there
+			while (!this->take(self, task)) {
+				std::unique_lock<std::mutex> lock(sleepMutex);
+				if (pending == 0)
+					break;
+				lock.unlock();
+				std::this_thread::yield();
+			}
+			if (!task)
+				continue;
+			--pending;
+			try {
+				task();
+			}
+			catch (...) {
+				// Tasks aren't supposed to throw, there's no one to tell about it anyway
+			}
+			task = nullptr;
+		}
+	}
+
+} // namespace PNGStego
\ No newline at end of file
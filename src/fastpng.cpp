@@ -0,0 +1,642 @@
+//
+// Copyright (C) 2015-2016 Zireael (zireael dot nk at gmail dot com)
+//  Distributed under the Boost Software License, Version 1.0.
+//       (See accompanying file LICENSE.md or copy at
+//           http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "fastpng.h"
+#include "planar.h"
+#include <zlib.h>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+/*
+  Unfiltering Sub, Average and Paeth rows depends on the pixel just decoded,
+  so a vector can't hold more than a pixel at a time; SSE2 still does all
+  samples of a 3 or 4-byte pixel at once. Filtering while encoding has no
+  such dependency and goes through 16 bytes at a time.
+  SSE2 is part of every x86-64 CPU, 32-bit builds use it if the compiler's told to.
+*/
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define PNGSTEGO_HAS_SSE2
+#endif
+
+namespace PNGStego {
+namespace FastPNG {
+
+	const uint8_t SIGNATURE[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+
+	const uint32_t CHUNK_IHDR = 0x49484452;
+	const uint32_t CHUNK_PLTE = 0x504C5445;
+	const uint32_t CHUNK_IDAT = 0x49444154;
+	const uint32_t CHUNK_IEND = 0x49454E44;
+	const uint32_t CHUNK_TRNS = 0x74524E53;
+
+	const int COLOR_GRAY       = 0;
+	const int COLOR_RGB        = 2;
+	const int COLOR_PALETTE    = 3;
+	const int COLOR_GRAY_ALPHA = 4;
+	const int COLOR_RGBA       = 6;
+
+	enum Filter : uint8_t {
+		FilterNone,
+		FilterSub,
+		FilterUp,
+		FilterAverage,
+		FilterPaeth,
+		FilterCount
+	};
+
+	namespace {
+		uint32_t readBE32(const uint8_t *data) noexcept {
+			return static_cast<uint32_t>(data[0]) << 24 | static_cast<uint32_t>(data[1]) << 16 |
+			       static_cast<uint32_t>(data[2]) << 8 | data[3];
+		}
+
+		void writeBE32(uint8_t *data, uint32_t value) noexcept {
+			data[0] = static_cast<uint8_t>(value >> 24);
+			data[1] = static_cast<uint8_t>(value >> 16);
+			data[2] = static_cast<uint8_t>(value >> 8);
+			data[3] = static_cast<uint8_t>(value);
+		}
+
+		/** Returns the number of samples a pixel of the given PNG color type has */
+		size_t samplesOf(int colorType) noexcept {
+			switch (colorType) {
+			case COLOR_RGB:        return 3;
+			case COLOR_GRAY_ALPHA: return 2;
+			case COLOR_RGBA:       return 4;
+			default:               return 1;
+			}
+		}
+
+		uint8_t paeth(uint8_t a, uint8_t b, uint8_t c) noexcept {
+			const int pa = std::abs(b - c), pb = std::abs(a - c), pc = std::abs(a + b - 2 * c);
+			return pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+		}
+
+		/** Feeds IDAT chunks to zlib one after another */
+		class Inflater {
+		public:
+			explicit Inflater(const File &file) : file(file), next(0), ended(false), ready(false) {
+				memset(&stream, 0, sizeof(stream));
+				ready = inflateInit(&stream) == Z_OK;
+			}
+
+			Inflater(const Inflater &other) = delete;
+			Inflater& operator=(const Inflater &other) = delete;
+
+			~Inflater() {
+				if (ready)
+					inflateEnd(&stream);
+			}
+
+			/** Inflates exactly 'length' bytes, returns false if there aren't as many or the data's damaged */
+			bool read(uint8_t *destination, size_t length) {
+				if (!ready || ended)
+					return false;
+				stream.next_out = destination;
+				stream.avail_out = static_cast<uInt>(length);
+				while (stream.avail_out) {
+					if (!stream.avail_in && next < file.data.size()) {
+						stream.next_in = const_cast<Bytef*>(file.data[next].first);
+						stream.avail_in = static_cast<uInt>(file.data[next].second);
+						++next;
+					}
+					// zlib may still have output pending once there's no input left
+					const int result = inflate(&stream, Z_NO_FLUSH);
+					if (result == Z_STREAM_END) {
+						ended = true;
+						return !stream.avail_out;
+					}
+					if (result == Z_BUF_ERROR && !stream.avail_in && next == file.data.size())
+						return false;
+					if (result != Z_OK && result != Z_BUF_ERROR)
+						return false;
+				}
+				return true;
+			}
+
+			/** Returns whether the stream ends right after what's been read, with its checksum right */
+			bool finish() {
+				if (ended)
+					return true;
+				uint8_t extra;
+				if (this->read(&extra, 1))
+					return false;
+				return ended;
+			}
+
+		private:
+			const File &file;
+			z_stream stream;
+			size_t next;
+			bool ended, ready;
+		};
+
+		/** Ends a deflate stream whichever way encode() leaves */
+		struct DeflateGuard {
+			z_stream &stream;
+			~DeflateGuard() {
+				deflateEnd(&stream);
+			}
+		};
+
+#ifdef PNGSTEGO_HAS_SSE2
+		// Pixels are put together in a register, copying 3 bytes into a 4-byte variable would go through memory
+		// and stall every load that follows a store
+		template <size_t bpp>
+		__m128i loadPixel(const uint8_t *source) noexcept {
+			uint32_t value;
+			if (bpp == 4) {
+				memcpy(&value, source, 4);
+			}
+			else {
+				uint16_t low;
+				memcpy(&low, source, 2);
+				value = static_cast<uint32_t>(low) | static_cast<uint32_t>(source[2]) << 16;
+			}
+			return _mm_cvtsi32_si128(static_cast<int>(value));
+		}
+
+		template <size_t bpp>
+		void storePixel(uint8_t *destination, __m128i pixel) noexcept {
+			const uint32_t value = static_cast<uint32_t>(_mm_cvtsi128_si32(pixel));
+			if (bpp == 4) {
+				memcpy(destination, &value, 4);
+			}
+			else {
+				const uint16_t low = static_cast<uint16_t>(value);
+				memcpy(destination, &low, 2);
+				destination[2] = static_cast<uint8_t>(value >> 16);
+			}
+		}
+
+		inline __m128i absolute16(__m128i x) noexcept {
+			return _mm_max_epi16(x, _mm_sub_epi16(_mm_setzero_si128(), x));
+		}
+
+		/** Picks a where mask's set, b elsewhere */
+		inline __m128i select(__m128i mask, __m128i a, __m128i b) noexcept {
+			return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+		}
+
+		/** Paeth predictors of 16-bit lanes, ties go to a, then b */
+		inline __m128i paeth16(__m128i a, __m128i b, __m128i c) noexcept {
+			const __m128i ba = _mm_sub_epi16(b, c), ac = _mm_sub_epi16(a, c);
+			const __m128i pa = absolute16(ba), pb = absolute16(ac), pc = absolute16(_mm_add_epi16(ba, ac));
+			const __m128i smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+			__m128i nearest = select(_mm_cmpeq_epi16(smallest, pb), b, c);
+			return select(_mm_cmpeq_epi16(smallest, pa), a, nearest);
+		}
+
+		template <size_t bpp>
+		void unfilterSSE2(uint8_t filter, uint8_t *row, const uint8_t *prior, size_t length) noexcept {
+			const __m128i zero = _mm_setzero_si128();
+			__m128i a = zero;
+			switch (filter) {
+			case FilterSub:
+				for (size_t i = 0; i < length; i += bpp) {
+					a = _mm_add_epi8(a, loadPixel<bpp>(row + i));
+					storePixel<bpp>(row + i, a);
+				}
+				break;
+
+			case FilterAverage: {
+				// pavgb rounds up, PNG rounds down
+				const __m128i one = _mm_set1_epi8(1);
+				for (size_t i = 0; i < length; i += bpp) {
+					const __m128i b = loadPixel<bpp>(prior + i);
+					__m128i average = _mm_avg_epu8(a, b);
+					average = _mm_sub_epi8(average, _mm_and_si128(_mm_xor_si128(a, b), one));
+					a = _mm_add_epi8(loadPixel<bpp>(row + i), average);
+					storePixel<bpp>(row + i, a);
+				}
+				break;
+			}
+
+			case FilterPaeth: {
+				// Samples stay in 16-bit lanes, wrapping them around is shorter than packing between pixels
+				const __m128i low = _mm_set1_epi16(0xFF);
+				__m128i c = zero;
+				for (size_t i = 0; i < length; i += bpp) {
+					const __m128i b = _mm_unpacklo_epi8(loadPixel<bpp>(prior + i), zero);
+					const __m128i x = _mm_unpacklo_epi8(loadPixel<bpp>(row + i), zero);
+					a = _mm_and_si128(_mm_add_epi16(x, paeth16(a, b, c)), low);
+					storePixel<bpp>(row + i, _mm_packus_epi16(a, zero));
+					c = b;
+				}
+				break;
+			}
+			}
+		}
+#endif
+
+		/** Undoes a row's filter in place, returns false for filters that don't exist */
+		bool unfilter(uint8_t filter, uint8_t *row, const uint8_t *prior, size_t length, size_t bpp) noexcept {
+			switch (filter) {
+			case FilterNone:
+				return true;
+
+			case FilterUp: {
+				size_t i = 0;
+#ifdef PNGSTEGO_HAS_SSE2
+				for (; i + 16 <= length; i += 16) {
+					const __m128i sum = _mm_add_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i)),
+					                                 _mm_loadu_si128(reinterpret_cast<const __m128i*>(prior + i)));
+					_mm_storeu_si128(reinterpret_cast<__m128i*>(row + i), sum);
+				}
+#endif
+				for (; i < length; ++i)
+					row[i] = static_cast<uint8_t>(row[i] + prior[i]);
+				return true;
+			}
+
+			case FilterSub:
+			case FilterAverage:
+			case FilterPaeth:
+				break;
+
+			default:
+				return false;
+			}
+
+#ifdef PNGSTEGO_HAS_SSE2
+			if (bpp == 3) {
+				unfilterSSE2<3>(filter, row, prior, length);
+				return true;
+			}
+			if (bpp == 4) {
+				unfilterSSE2<4>(filter, row, prior, length);
+				return true;
+			}
+#endif
+			const size_t first = std::min(bpp, length);
+			if (filter == FilterSub) {
+				for (size_t i = bpp; i < length; ++i)
+					row[i] = static_cast<uint8_t>(row[i] + row[i - bpp]);
+			}
+			else if (filter == FilterAverage) {
+				for (size_t i = 0; i < first; ++i)
+					row[i] = static_cast<uint8_t>(row[i] + (prior[i] >> 1));
+				for (size_t i = bpp; i < length; ++i)
+					row[i] = static_cast<uint8_t>(row[i] + ((row[i - bpp] + prior[i]) >> 1));
+			}
+			else {
+				for (size_t i = 0; i < first; ++i)
+					row[i] = static_cast<uint8_t>(row[i] + prior[i]);
+				for (size_t i = bpp; i < length; ++i)
+					row[i] = static_cast<uint8_t>(row[i] + paeth(row[i - bpp], prior[i], prior[i - bpp]));
+			}
+			return true;
+		}
+
+		/** Turns palette indices of the given depth into RGB or RGBA pixels */
+		void expandPalette(const uint8_t *indices, uint32_t width, int depth, const uint8_t *palette,
+		                   size_t channels, uint8_t *destination) noexcept {
+			const unsigned mask = (1U << depth) - 1;
+			for (uint32_t x = 0; x < width; ++x, destination += channels) {
+				const size_t bit = static_cast<size_t>(x) * depth;
+				const unsigned index = (indices[bit / 8] >> (8 - depth - bit % 8)) & mask;
+				memcpy(destination, palette + 4 * index, channels);
+			}
+		}
+
+		/** Filters a row the given way, returns the sum of the filtered bytes' distances from zero */
+		uint64_t filterRow(uint8_t filter, const uint8_t *row, const uint8_t *prior, size_t length, size_t bpp,
+		                   uint8_t *output) noexcept {
+			const size_t first = std::min(bpp, length);
+			size_t i = 0;
+			// Pixels of the first column have no left neighbour
+			for (; i < first; ++i) {
+				switch (filter) {
+				case FilterNone:
+				case FilterSub:     output[i] = row[i]; break;
+				case FilterUp:
+				case FilterPaeth:   output[i] = static_cast<uint8_t>(row[i] - prior[i]); break;
+				case FilterAverage: output[i] = static_cast<uint8_t>(row[i] - (prior[i] >> 1)); break;
+				}
+			}
+			if (filter == FilterNone) {
+				memcpy(output + i, row + i, length - i);
+				i = length;
+			}
+
+			uint64_t sum = 0;
+#ifdef PNGSTEGO_HAS_SSE2
+			const __m128i zero = _mm_setzero_si128();
+			for (; filter != FilterNone && i + 16 <= length; i += 16) {
+				const __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i));
+				const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i - bpp));
+				const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(prior + i));
+				__m128i predicted;
+				if (filter == FilterSub) {
+					predicted = a;
+				}
+				else if (filter == FilterUp) {
+					predicted = b;
+				}
+				else if (filter == FilterAverage) {
+					predicted = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1)));
+				}
+				else {
+					const __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(prior + i - bpp));
+					const __m128i low = paeth16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero), _mm_unpacklo_epi8(c, zero));
+					const __m128i high = paeth16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero), _mm_unpackhi_epi8(c, zero));
+					predicted = _mm_packus_epi16(low, high);
+				}
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(output + i), _mm_sub_epi8(x, predicted));
+			}
+#endif
+			for (; i < length; ++i) {
+				switch (filter) {
+				case FilterSub:     output[i] = static_cast<uint8_t>(row[i] - row[i - bpp]); break;
+				case FilterUp:      output[i] = static_cast<uint8_t>(row[i] - prior[i]); break;
+				case FilterAverage: output[i] = static_cast<uint8_t>(row[i] - ((row[i - bpp] + prior[i]) >> 1)); break;
+				case FilterPaeth:   output[i] = static_cast<uint8_t>(row[i] - paeth(row[i - bpp], prior[i], prior[i - bpp])); break;
+				}
+			}
+
+			// Bytes count as signed, as libpng's heuristic has them
+			i = 0;
+#ifdef PNGSTEGO_HAS_SSE2
+			__m128i sums = zero;
+			for (; i + 16 <= length; i += 16) {
+				const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(output + i));
+				sums = _mm_add_epi64(sums, _mm_sad_epu8(_mm_min_epu8(v, _mm_sub_epi8(zero, v)), zero));
+			}
+			uint64_t halves[2];
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(halves), sums);
+			sum = halves[0] + halves[1];
+#endif
+			for (; i < length; ++i)
+				sum += std::min<unsigned>(output[i], 256 - output[i]);
+			return sum;
+		}
+	}
+
+	bool inspect(const uint8_t *data, size_t size, File &file) {
+		if (size < sizeof(SIGNATURE) || memcmp(data, SIGNATURE, sizeof(SIGNATURE)))
+			return false;
+
+		file.data.clear();
+		const uint8_t *palette = nullptr, *transparency = nullptr;
+		size_t paletteBytes = 0, transparencyBytes = 0;
+		bool header = false, dataDone = false, ended = false;
+		size_t pos = sizeof(SIGNATURE);
+		while (!ended) {
+			if (size - pos < 12)
+				return false;
+			const uint32_t length = readBE32(data + pos);
+			if (length > 0x7FFFFFFF || length > size - pos - 12)
+				return false;
+			const uint8_t *type = data + pos + 4, *body = data + pos + 8;
+			const uint32_t chunk = readBE32(type);
+			const bool critical = !(type[0] & 0x20);
+			// Ancillary chunks other than tRNS get skipped, so their CRCs don't matter
+			if ((critical || chunk == CHUNK_TRNS) && crc32(crc32(0, nullptr, 0), type, length + 4) != readBE32(body + length))
+				return false;
+			if (!header && chunk != CHUNK_IHDR)
+				return false;
+			if (!file.data.empty() && chunk != CHUNK_IDAT)
+				dataDone = true;
+			pos += 12 + length;
+
+			switch (chunk) {
+			case CHUNK_IHDR:
+				if (header || length != 13)
+					return false;
+				header = true;
+				file.width = readBE32(body);
+				file.height = readBE32(body + 4);
+				file.bitDepth = body[8];
+				file.colorType = body[9];
+				// Compression, filter method and interlacing
+				if (!file.width || !file.height || file.width > 0x7FFFFFFF || file.height > 0x7FFFFFFF ||
+				    body[10] || body[11] || body[12])
+					return false;
+				break;
+
+			case CHUNK_PLTE:
+				if (palette || !file.data.empty())
+					return false;
+				palette = body;
+				paletteBytes = length;
+				break;
+
+			case CHUNK_TRNS:
+				if (transparency || !file.data.empty())
+					return false;
+				transparency = body;
+				transparencyBytes = length;
+				break;
+
+			case CHUNK_IDAT:
+				if (dataDone)
+					return false;
+				if (length)
+					file.data.push_back(std::make_pair(body, static_cast<size_t>(length)));
+				break;
+
+			case CHUNK_IEND:
+				if (file.data.empty())
+					return false;
+				file.size = pos;
+				ended = true;
+				break;
+
+			default:
+				if (critical)
+					return false;
+				break;
+			}
+		}
+
+		switch (file.colorType) {
+		case COLOR_PALETTE: {
+			if (file.bitDepth != 1 && file.bitDepth != 2 && file.bitDepth != 4 && file.bitDepth != 8)
+				return false;
+			const size_t entries = paletteBytes / 3;
+			if (!palette || paletteBytes % 3 || !entries || entries > (1U << file.bitDepth) || transparencyBytes > entries)
+				return false;
+			// Indices past the palette come out black, as libpng has them
+			file.palette.assign(4 * 256, 0);
+			for (size_t k = 0; k < 256; ++k) {
+				if (k < entries)
+					memcpy(&file.palette[4 * k], palette + 3 * k, 3);
+				file.palette[4 * k + 3] = k < transparencyBytes ? transparency[k] : 0xFF;
+			}
+			file.format = transparency ? PixelFormat::RGBA : PixelFormat::RGB;
+			return true;
+		}
+
+		case COLOR_GRAY:
+		case COLOR_GRAY_ALPHA:
+		case COLOR_RGB:
+		case COLOR_RGBA:
+			// A suggested palette is fine for color images, gray ones mustn't have any
+			if (file.bitDepth != 8 || (palette && (file.colorType == COLOR_GRAY || file.colorType == COLOR_GRAY_ALPHA)))
+				return false;
+			// tRNS of other color types is left alone, as it is by the libpng path
+			file.format = static_cast<PixelFormat>(samplesOf(file.colorType));
+			file.palette.clear();
+			return true;
+
+		default:
+			return false;
+		}
+	}
+
+	bool decode(const File &file, MemoryStore &store) {
+		const size_t bpp = std::max<size_t>(samplesOf(file.colorType) * file.bitDepth / 8, 1);
+		const size_t rowBytes = (static_cast<size_t>(file.width) * samplesOf(file.colorType) * file.bitDepth + 7) / 8;
+		const size_t channels = channelCount(file.format);
+		const size_t pixelRow = static_cast<size_t>(file.width) * channels;
+		const bool isPalette = file.colorType == COLOR_PALETTE;
+		const bool planar = store.layout() == SampleLayout::Planar;
+		// Interleaved rows that need no expanding are inflated right into the store and unfiltered there
+		const bool direct = !planar && !isPalette;
+
+		uint8_t *samples = store.samples().data();
+		std::vector<uint8_t> rows(direct ? rowBytes : 3 * rowBytes);
+		std::vector<uint8_t> expanded(isPalette && planar ? pixelRow : 0);
+		std::vector<uint8_t*> planes;
+		if (planar)
+			planes = store.planes();
+		const uint8_t *zero = rows.data(); // all zeroes, the first row's prior
+
+		Inflater inflater(file);
+		for (uint32_t y = 0; y < file.height; ++y) {
+			uint8_t filter;
+			uint8_t *row = direct ? samples + y * pixelRow : rows.data() + (1 + y % 2) * rowBytes;
+			const uint8_t *prior = !y ? zero : direct ? samples + (y - 1) * pixelRow : rows.data() + (1 + (y - 1) % 2) * rowBytes;
+			if (!inflater.read(&filter, 1) || !inflater.read(row, rowBytes) || !unfilter(filter, row, prior, rowBytes, bpp))
+				return false;
+
+			if (isPalette) {
+				uint8_t *destination = planar ? expanded.data() : samples + y * pixelRow;
+				expandPalette(row, file.width, file.bitDepth, file.palette.data(), channels, destination);
+				row = destination;
+			}
+			if (planar) {
+				uint8_t *rowPlanes[4];
+				for (size_t k = 0; k < channels; ++k)
+					rowPlanes[k] = planes[k] + static_cast<size_t>(y) * file.width;
+				Planar::deinterleave(row, file.width, channels, rowPlanes);
+			}
+		}
+		return inflater.finish();
+	}
+
+	void encode(const Image &image, const std::function<const uint8_t*(uint32_t)> &row,
+	            const std::function<void(const uint8_t*, size_t)> &write) {
+		auto writeChunk = [&](uint32_t chunk, const uint8_t *body, size_t length) {
+			uint8_t head[8], tail[4];
+			writeBE32(head, static_cast<uint32_t>(length));
+			writeBE32(head + 4, chunk);
+			uLong crc = crc32(crc32(0, nullptr, 0), head + 4, 4);
+			if (length)
+				crc = crc32(crc, body, static_cast<uInt>(length));
+			writeBE32(tail, static_cast<uint32_t>(crc));
+			write(head, sizeof(head));
+			if (length)
+				write(body, length);
+			write(tail, sizeof(tail));
+		};
+
+		write(SIGNATURE, sizeof(SIGNATURE));
+		uint8_t header[13] = { 0 };
+		writeBE32(header, image.width);
+		writeBE32(header + 4, image.height);
+		header[8] = static_cast<uint8_t>(image.bitDepth);
+		header[9] = static_cast<uint8_t>(image.colorType);
+		writeChunk(CHUNK_IHDR, header, sizeof(header));
+		if (image.colorType == COLOR_PALETTE) {
+			writeChunk(CHUNK_PLTE, image.palette->data(), image.palette->size());
+			if (image.transparency && !image.transparency->empty())
+				writeChunk(CHUNK_TRNS, image.transparency->data(), image.transparency->size());
+		}
+
+		const size_t samples = samplesOf(image.colorType);
+		const size_t bpp = std::max<size_t>(samples * image.bitDepth / 8, 1);
+		const size_t rowBytes = (static_cast<size_t>(image.width) * samples * image.bitDepth + 7) / 8;
+		// libpng doesn't filter palettes and narrow samples, filtering doesn't help them
+		const bool filtered = image.colorType != COLOR_PALETTE && image.bitDepth >= 8;
+
+		z_stream stream;
+		memset(&stream, 0, sizeof(stream));
+		if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15, 8, filtered ? Z_FILTERED : Z_DEFAULT_STRATEGY) != Z_OK)
+			throw std::runtime_error("Cannot compress the image");
+		DeflateGuard guard = { stream };
+
+		std::vector<uint8_t> compressed(FAST_PNG_IDAT_BYTES);
+		auto deflateRow = [&](const uint8_t *data, size_t length, int flush) {
+			stream.next_in = const_cast<Bytef*>(data);
+			stream.avail_in = static_cast<uInt>(length);
+			for (;;) {
+				stream.next_out = compressed.data() + (compressed.size() - stream.avail_out);
+				const int result = deflate(&stream, flush);
+				if (result != Z_OK && result != Z_STREAM_END && result != Z_BUF_ERROR)
+					throw std::runtime_error("Cannot compress the image");
+				if (!stream.avail_out) {
+					writeChunk(CHUNK_IDAT, compressed.data(), compressed.size());
+					stream.avail_out = static_cast<uInt>(compressed.size());
+					continue;
+				}
+				if (result == Z_STREAM_END || (flush == Z_NO_FLUSH && !stream.avail_in))
+					return;
+			}
+		};
+		stream.avail_out = static_cast<uInt>(compressed.size());
+
+		// [filter][1 + rowBytes], the first byte's the filter type
+		std::vector<uint8_t> candidates(FilterCount * (rowBytes + 1));
+		std::vector<uint8_t> packed(image.bitDepth < 8 ? rowBytes : 0);
+		std::vector<uint8_t> previous(filtered ? 2 * rowBytes : 0);
+		for (uint32_t y = 0; y < image.height; ++y) {
+			const uint8_t *samplesOfRow = row(y);
+			if (!packed.empty()) {
+				// Most significant bits first, the last byte's padded with zeroes
+				std::fill(packed.begin(), packed.end(), 0);
+				for (uint32_t x = 0; x < image.width; ++x) {
+					const size_t bit = static_cast<size_t>(x) * image.bitDepth;
+					packed[bit / 8] |= static_cast<uint8_t>(samplesOfRow[x] << (8 - image.bitDepth - bit % 8));
+				}
+				samplesOfRow = packed.data();
+			}
+
+			uint8_t *best = candidates.data();
+			best[0] = FilterNone;
+			if (!filtered) {
+				memcpy(best + 1, samplesOfRow, rowBytes);
+			}
+			else {
+				// Rows handed out may not last, the current one becomes the next one's prior; the first one's is all zeroes
+				uint8_t *current = previous.data() + (y % 2) * rowBytes;
+				const uint8_t *prior = previous.data() + ((y + 1) % 2) * rowBytes;
+				memcpy(current, samplesOfRow, rowBytes);
+				uint64_t smallest = UINT64_MAX;
+				for (uint8_t filter = FilterNone; filter < FilterCount; ++filter) {
+					uint8_t *candidate = candidates.data() + filter * (rowBytes + 1);
+					candidate[0] = filter;
+					const uint64_t sum = filterRow(filter, current, prior, rowBytes, bpp, candidate + 1);
+					if (sum < smallest) {
+						smallest = sum;
+						best = candidate;
+					}
+				}
+			}
+			deflateRow(best, rowBytes + 1, Z_NO_FLUSH);
+		}
+		deflateRow(nullptr, 0, Z_FINISH);
+		if (stream.avail_out != compressed.size())
+			writeChunk(CHUNK_IDAT, compressed.data(), compressed.size() - stream.avail_out);
+		writeChunk(CHUNK_IEND, nullptr, 0);
+	}
+
+} // namespace FastPNG
+} // namespace PNGStego
\ No newline at end of file
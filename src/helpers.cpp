@@ -6,18 +6,30 @@
 //
 
 #include "helpers.h"
+#include "ioring.h"
 
+#include <cstdint>
 #include <iterator>
 #include <iostream>
 #include <fstream>
 #include <vector>
 #include <string>
+#include <stdexcept>
 
 #if defined(_WIN32)
 #include <boost/nowide/convert.hpp>
+#include <boost/nowide/fstream.hpp>
 #define DIRECTORYDELIM '\\'
 #elif defined(__unix__) || defined(__APPLE__)
+#include <climits>
+#include <unistd.h>
 #define DIRECTORYDELIM '/'
+namespace boost {
+	namespace nowide {
+		using std::ifstream;
+		using std::ofstream;
+	}
+}
 #endif
 
 namespace PNGStego {
@@ -120,6 +132,127 @@ namespace PNGStego {
 #endif
 	}
 
+	void copyFile(const std::string &source, const std::string &destination)
+	{
+#ifdef _WIN32
+		if (!CopyFileW(boost::nowide::widen(source).c_str(), boost::nowide::widen(destination).c_str(), FALSE))
+			throw std::invalid_argument("Couldn't copy " + source + " to " + destination);
+#else
+		std::ifstream in(source, std::ifstream::binary);
+		if (!in)
+			throw std::invalid_argument("Couldn't open " + source);
+		std::ofstream out(destination, std::ofstream::binary | std::ofstream::trunc);
+		if (!out)
+			throw std::invalid_argument("Couldn't open " + destination);
+		out << in.rdbuf();
+		if (!out)
+			throw std::runtime_error("Couldn't copy " + source + " to " + destination);
+#endif
+	}
+
+	namespace {
+		std::vector<uint8_t> readStream(const std::string &filename)
+		{
+			boost::nowide::ifstream in(filename.c_str(), std::ios::in | std::ios::binary);
+			if (!in)
+				throw std::invalid_argument("Cannot open " + filename);
+			uint64_t size = static_cast<uint64_t>(fileSize(filename));
+			if (size > SIZE_MAX)
+				throw std::runtime_error("The file's too large");
+			std::vector<uint8_t> data(static_cast<size_t>(size));
+			if (!in.read(reinterpret_cast<char *>(data.data()), data.size()))
+				throw std::runtime_error("Couldn't read " + filename);
+			return data;
+		}
+
+		void writeStream(const std::string &filename, const uint8_t *data, size_t size)
+		{
+			boost::nowide::ofstream out(filename.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+			if (!out)
+				throw std::invalid_argument("Cannot open " + filename);
+			if (!out.write(reinterpret_cast<const char *>(data), size))
+				throw std::runtime_error("Couldn't write " + filename);
+		}
+	}
+
+	std::vector<std::vector<uint8_t>> readFiles(const std::vector<std::string> &filenames, std::vector<std::string> &errors)
+	{
+		std::vector<std::vector<uint8_t>> contents;
+		std::vector<bool> fallback(filenames.size(), true);
+#ifdef PNGSTEGO_WITH_IO_URING
+		if (IORing *ring = IORing::local()) {
+			try {
+				contents = ring->readFiles(filenames, errors, fallback);
+			}
+			catch (const IORingError&) {
+				// The ring's given up on the whole batch, streams read every file
+				fallback.assign(filenames.size(), true);
+			}
+		}
+#endif
+		contents.resize(filenames.size());
+		errors.resize(filenames.size());
+		for (size_t i = 0; i < filenames.size(); ++i) {
+			if (!fallback[i])
+				continue;
+			try {
+				contents[i] = readStream(filenames[i]);
+				errors[i].clear();
+			}
+			catch (const std::exception &e) {
+				std::vector<uint8_t>().swap(contents[i]);
+				errors[i] = e.what();
+			}
+		}
+		return contents;
+	}
+
+	std::vector<uint8_t> readFile(const std::string &filename)
+	{
+#ifdef PNGSTEGO_WITH_IO_URING
+		if (IORing *ring = IORing::local()) {
+			try {
+				return ring->readFile(filename);
+			}
+			catch (const IORingError&) { }
+		}
+#endif
+		return readStream(filename);
+	}
+
+	void writeFile(const std::string &filename, const uint8_t *data, size_t size)
+	{
+#ifdef PNGSTEGO_WITH_IO_URING
+		if (IORing *ring = IORing::local()) {
+			try {
+				ring->writeFile(filename, data, size);
+				return;
+			}
+			catch (const IORingError&) { }
+		}
+#endif
+		writeStream(filename, data, size);
+	}
+
+	std::string absolutePath(const std::string &filename)
+	{
+#ifdef _WIN32
+		std::wstring wide = boost::nowide::widen(filename);
+		DWORD size = GetFullPathNameW(wide.c_str(), 0, nullptr, nullptr);
+		std::vector<wchar_t> buffer(size + 1);
+		if (!size || !GetFullPathNameW(wide.c_str(), static_cast<DWORD>(buffer.size()), buffer.data(), nullptr))
+			throw std::runtime_error("Couldn't get the full path of " + filename);
+		return boost::nowide::narrow(buffer.data());
+#else
+		if (!filename.empty() && filename[0] == DIRECTORYDELIM)
+			return filename;
+		std::vector<char> buffer(PATH_MAX);
+		if (!getcwd(buffer.data(), buffer.size()))
+			throw std::runtime_error("Couldn't get the working directory");
+		return std::string(buffer.data()) + DIRECTORYDELIM + filename;
+#endif
+	}
+
 	void removeLineEndings(std::string &source) noexcept {
 		if (source.size() == 0) // empty string
 			return;
@@ -0,0 +1,376 @@
+//
+// Copyright (C) 2015-2016 Zireael (zireael dot nk at gmail dot com)
+//  Distributed under the Boost Software License, Version 1.0.
+//       (See accompanying file LICENSE.md or copy at
+//           http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "ioring.h"
+#include <memory>
+#include <stdexcept>
+
+#if defined(PNGSTEGO_WITH_IO_URING) && defined(__linux__)
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/*
+  liburing isn't required, the three syscalls and the rings are all there is to it.
+*/
+namespace PNGStego {
+
+	struct IORing::Transfer {
+		int fd;
+		bool write;
+		uint8_t *data;
+		uint64_t size;
+		uint64_t next;     // where the next chunk starts
+		size_t inFlight;   // chunks the kernel hasn't finished yet
+		std::string error;
+		bool unsupported;  // the error's the ring's, not the file's
+	};
+
+	namespace {
+		/** Returns whether a failed read or write is down to the ring: fixed buffers aren't supported by the file's filesystem or the kernel */
+		bool isRingError(int error) noexcept {
+			return error == EINVAL || error == EOPNOTSUPP;
+		}
+	}
+
+	IORing::IORing(unsigned buffers, size_t bufferSize)
+		: ring(-1), entries(std::max(buffers, 1U)), bufferSize(bufferSize), buffers(),
+		  sqRing(MAP_FAILED), cqRing(MAP_FAILED), sqes(MAP_FAILED), sqRingSize(0), cqRingSize(0), sqesSize(0)
+	{
+		io_uring_params params;
+		memset(&params, 0, sizeof(params));
+		ring = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+		if (ring < 0) {
+			throw IORingError("io_uring isn't available");
+		}
+
+		sqRingSize = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+		cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+		if (params.features & IORING_FEAT_SINGLE_MMAP)
+			sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+		sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+
+		sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQ_RING);
+		if (sqRing != MAP_FAILED) {
+			cqRing = (params.features & IORING_FEAT_SINGLE_MMAP) ? sqRing :
+			         mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_CQ_RING);
+			sqes = mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQES);
+		}
+
+		// A single block for all buffers, registered all at once
+		void *pool = MAP_FAILED;
+		if (cqRing != MAP_FAILED && sqes != MAP_FAILED)
+			pool = mmap(nullptr, entries * bufferSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (pool != MAP_FAILED) {
+			std::vector<iovec> vectors(entries);
+			for (unsigned k = 0; k < entries; ++k) {
+				this->buffers.push_back(static_cast<uint8_t*>(pool) + k * bufferSize);
+				vectors[k].iov_base = this->buffers.back();
+				vectors[k].iov_len = bufferSize;
+			}
+			if (syscall(__NR_io_uring_register, ring, IORING_REGISTER_BUFFERS, vectors.data(), entries) != 0) {
+				munmap(pool, entries * bufferSize);
+				this->buffers.clear();
+			}
+		}
+		if (this->buffers.empty()) {
+			this->release();
+			throw IORingError("Cannot set up io_uring");
+		}
+
+		uint8_t *sq = static_cast<uint8_t*>(sqRing), *cq = static_cast<uint8_t*>(cqRing);
+		sqHead = reinterpret_cast<uint32_t*>(sq + params.sq_off.head);
+		sqTail = reinterpret_cast<uint32_t*>(sq + params.sq_off.tail);
+		sqMask = reinterpret_cast<uint32_t*>(sq + params.sq_off.ring_mask);
+		sqArray = reinterpret_cast<uint32_t*>(sq + params.sq_off.array);
+		cqHead = reinterpret_cast<uint32_t*>(cq + params.cq_off.head);
+		cqTail = reinterpret_cast<uint32_t*>(cq + params.cq_off.tail);
+		cqMask = reinterpret_cast<uint32_t*>(cq + params.cq_off.ring_mask);
+		cqes = cq + params.cq_off.cqes;
+	}
+
+	IORing::~IORing() {
+		this->release();
+	}
+
+	void IORing::release() noexcept {
+		if (!buffers.empty())
+			munmap(buffers.front(), entries * bufferSize);
+		if (sqes != MAP_FAILED)
+			munmap(sqes, sqesSize);
+		if (cqRing != MAP_FAILED && cqRing != sqRing)
+			munmap(cqRing, cqRingSize);
+		if (sqRing != MAP_FAILED)
+			munmap(sqRing, sqRingSize);
+		if (ring >= 0)
+			close(ring);
+		buffers.clear();
+		sqes = cqRing = sqRing = MAP_FAILED;
+		ring = -1;
+	}
+
+	void IORing::run(std::vector<Transfer> &transfers) {
+		struct Chunk {
+			size_t transfer;
+			uint64_t offset;
+			size_t length;
+			size_t done;    // short reads & writes get resubmitted for the rest
+		};
+		if (ring < 0) {
+			throw IORingError("The ring's been shut down");
+		}
+		std::vector<Chunk> chunks(buffers.size());
+		std::vector<unsigned> free(buffers.size());
+		for (unsigned k = 0; k < free.size(); ++k)
+			free[k] = static_cast<unsigned>(free.size()) - 1 - k;
+
+		io_uring_sqe *sqEntries = static_cast<io_uring_sqe*>(sqes);
+		io_uring_cqe *cqEntries = static_cast<io_uring_cqe*>(cqes);
+		unsigned toSubmit = 0, inFlight = 0;
+		auto submit = [&](unsigned buffer) {
+			const Chunk &chunk = chunks[buffer];
+			const Transfer &transfer = transfers[chunk.transfer];
+			const uint32_t tail = *sqTail, index = tail & *sqMask;
+			io_uring_sqe &sqe = sqEntries[index];
+			memset(&sqe, 0, sizeof(sqe));
+			sqe.opcode = transfer.write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+			sqe.fd = transfer.fd;
+			sqe.off = chunk.offset + chunk.done;
+			sqe.addr = reinterpret_cast<uint64_t>(buffers[buffer] + chunk.done);
+			sqe.len = static_cast<uint32_t>(chunk.length - chunk.done);
+			sqe.buf_index = static_cast<uint16_t>(buffer);
+			sqe.user_data = buffer;
+			sqArray[index] = index;
+			__atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+			++toSubmit;
+		};
+
+		size_t current = 0;
+		for (;;) {
+			// Hand out chunks of files in order until buffers run out
+			while (!free.empty()) {
+				while (current < transfers.size() &&
+				       (transfers[current].next >= transfers[current].size || !transfers[current].error.empty()))
+					++current;
+				if (current == transfers.size())
+					break;
+
+				Transfer &transfer = transfers[current];
+				const unsigned buffer = free.back();
+				free.pop_back();
+				Chunk chunk = { current, transfer.next, static_cast<size_t>(std::min<uint64_t>(bufferSize, transfer.size - transfer.next)), 0 };
+				chunks[buffer] = chunk;
+				transfer.next += chunk.length;
+				++transfer.inFlight;
+				if (transfer.write)
+					memcpy(buffers[buffer], transfer.data + chunk.offset, chunk.length);
+				submit(buffer);
+			}
+			if (toSubmit == 0 && inFlight == 0)
+				break;
+
+			int submitted = static_cast<int>(syscall(__NR_io_uring_enter, ring, toSubmit, 1, IORING_ENTER_GETEVENTS, nullptr, 0));
+			if (submitted < 0) {
+				if (errno == EINTR)
+					continue;
+				/*
+				  Chunks may still be in flight and entries queued but not submitted, so the ring can't be used again:
+				  its next call would submit them against descriptors that may have been reused by then.
+				  Closing it cancels whatever the kernel hasn't done yet.
+				*/
+				const std::string error = strerror(errno);
+				this->release();
+				throw IORingError("io_uring_enter failed: " + error);
+			}
+			toSubmit -= submitted;
+			inFlight += submitted;
+
+			uint32_t head = *cqHead;
+			const uint32_t tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+			for (; head != tail; ++head) {
+				const io_uring_cqe &cqe = cqEntries[head & *cqMask];
+				const unsigned buffer = static_cast<unsigned>(cqe.user_data);
+				Chunk &chunk = chunks[buffer];
+				Transfer &transfer = transfers[chunk.transfer];
+				--inFlight;
+
+				if (cqe.res < 0) {
+					transfer.error = strerror(-cqe.res);
+					transfer.unsupported = isRingError(-cqe.res);
+				}
+				else if (cqe.res == 0) {
+					transfer.error = transfer.write ? "Nothing got written" : "The file's shrunk";
+				}
+				else {
+					chunk.done += static_cast<size_t>(cqe.res);
+					if (chunk.done < chunk.length) {
+						submit(buffer);
+						continue;
+					}
+					if (!transfer.write)
+						memcpy(transfer.data + chunk.offset, buffers[buffer], chunk.length);
+				}
+				--transfer.inFlight;
+				free.push_back(buffer);
+			}
+			__atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+		}
+	}
+
+	std::vector<std::vector<uint8_t>> IORing::readFiles(const std::vector<std::string> &filenames, std::vector<std::string> &errors,
+	                                                    std::vector<bool> &fallback) {
+		std::vector<std::vector<uint8_t>> contents(filenames.size());
+		std::vector<Transfer> transfers(filenames.size());
+		errors.assign(filenames.size(), std::string());
+		fallback.assign(filenames.size(), false);
+
+		for (size_t i = 0; i < filenames.size(); ++i) {
+			Transfer &transfer = transfers[i];
+			transfer.fd = open(filenames[i].c_str(), O_RDONLY | O_CLOEXEC);
+			transfer.write = false;
+			transfer.size = transfer.next = 0;
+			transfer.inFlight = 0;
+			transfer.unsupported = false;
+			struct stat info;
+			if (transfer.fd == -1) {
+				transfer.error = "Cannot open " + filenames[i];
+			}
+			else if (fstat(transfer.fd, &info) != 0 || static_cast<uint64_t>(info.st_size) > SIZE_MAX) {
+				transfer.error = "Couldn't get the file's size";
+			}
+			else {
+				contents[i].resize(static_cast<size_t>(info.st_size));
+				transfer.size = contents[i].size();
+			}
+			transfer.data = contents[i].data();
+		}
+
+		try {
+			this->run(transfers);
+		}
+		catch (...) {
+			for (auto &transfer : transfers)
+				if (transfer.fd != -1)
+					close(transfer.fd);
+			throw;
+		}
+		for (size_t i = 0; i < transfers.size(); ++i) {
+			if (transfers[i].fd != -1)
+				close(transfers[i].fd);
+			if (!transfers[i].error.empty()) {
+				errors[i] = transfers[i].error;
+				fallback[i] = transfers[i].unsupported;
+				std::vector<uint8_t>().swap(contents[i]);
+			}
+		}
+		return contents;
+	}
+
+	std::vector<uint8_t> IORing::readFile(const std::string &filename) {
+		std::vector<std::string> errors;
+		std::vector<bool> fallback;
+		std::vector<std::vector<uint8_t>> contents = this->readFiles(std::vector<std::string>(1, filename), errors, fallback);
+		if (fallback[0]) {
+			throw IORingError(errors[0]);
+		}
+		if (!errors[0].empty()) {
+			throw std::runtime_error(errors[0]);
+		}
+		return std::move(contents[0]);
+	}
+
+	void IORing::writeFile(const std::string &filename, const uint8_t *data, size_t size) {
+		std::vector<Transfer> transfers(1);
+		Transfer &transfer = transfers[0];
+		transfer.fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+		if (transfer.fd == -1) {
+			throw std::invalid_argument("Cannot open " + filename);
+		}
+		transfer.write = true;
+		transfer.data = const_cast<uint8_t*>(data);
+		transfer.size = size;
+		transfer.next = 0;
+		transfer.inFlight = 0;
+		transfer.unsupported = false;
+
+		try {
+			this->run(transfers);
+		}
+		catch (...) {
+			close(transfer.fd);
+			throw;
+		}
+		close(transfer.fd);
+		if (transfer.unsupported) {
+			throw IORingError("Couldn't write " + filename + ": " + transfer.error);
+		}
+		if (!transfer.error.empty()) {
+			throw std::runtime_error("Couldn't write " + filename + ": " + transfer.error);
+		}
+	}
+
+	IORing* IORing::local() noexcept {
+		// Every thread gets its own ring, set up on the first use
+		thread_local std::unique_ptr<IORing> ring;
+		thread_local bool tried = false;
+		// A ring that's failed has been shut down, and the thread doesn't get another one
+		if (ring && ring->ring < 0)
+			ring.reset();
+		if (!tried) {
+			tried = true;
+			try {
+				ring.reset(new IORing());
+			}
+			catch (...) { }
+		}
+		return ring.get();
+	}
+
+} // namespace PNGStego
+
+#else
+
+namespace PNGStego {
+
+	struct IORing::Transfer { };
+
+	IORing::IORing(unsigned, size_t) {
+		throw IORingError("io_uring isn't available");
+	}
+
+	IORing::~IORing() { }
+
+	void IORing::release() noexcept { }
+
+	IORing* IORing::local() noexcept {
+		return nullptr;
+	}
+
+	void IORing::run(std::vector<Transfer>&) { }
+
+	std::vector<std::vector<uint8_t>> IORing::readFiles(const std::vector<std::string>&, std::vector<std::string>&, std::vector<bool>&) {
+		throw IORingError("io_uring isn't available");
+	}
+
+	std::vector<uint8_t> IORing::readFile(const std::string&) {
+		throw IORingError("io_uring isn't available");
+	}
+
+	void IORing::writeFile(const std::string&, const uint8_t*, size_t) {
+		throw IORingError("io_uring isn't available");
+	}
+
+} // namespace PNGStego
+
+#endif
\ No newline at end of file
@@ -0,0 +1,96 @@
+//
+// Copyright (C) 2015-2016 Zireael (zireael dot nk at gmail dot com)
+//  Distributed under the Boost Software License, Version 1.0.
+//       (See accompanying file LICENSE.md or copy at
+//           http://www.boost.org/LICENSE_1_0.txt)
+//
+
+// STL
+#include <iostream>
+#include <string>
+#include <clocale>
+#include <csignal>
+#include <cstdlib>
+
+#include "daemon.h"
+#include "helpers.h"
+#include "metrics.h"
+#include "pngstegoversion.h"
+
+PNGStego::Daemon *runningDaemon = nullptr;
+
+extern "C" void stopDaemon(int) {
+	if (runningDaemon)
+		runningDaemon->stop();
+}
+
+int main(int argc, char **argv) {
+	std::setlocale(LC_ALL, "");
+
+	bool silentMode = false;
+	PNGStego::JobOptions options = { false, 0, PNGStego::EmbeddingProfile::Sparse }; // no memory budget means unlimited
+	size_t threads = 0; // all cores
+	std::string metricsFile; // none means metrics aren't dumped
+	for (int i = 2; i < argc; ++i) {
+		std::string option = argv[i];
+		const std::string budgetOption = "--memory-budget=";
+		const std::string threadsOption = "--threads=";
+		const std::string metricsOption = "--metrics=";
+		const std::string profileOption = "--profile=";
+		if (option == "--silent" || option == "-s")
+			silentMode = true;
+		else if (option.compare(0, budgetOption.size(), budgetOption) == 0)
+			options.memoryBudget = std::strtoull(option.c_str() + budgetOption.size(), nullptr, 10) * 1024 * 1024;
+		else if (option.compare(0, threadsOption.size(), threadsOption) == 0)
+			threads = static_cast<size_t>(std::strtoull(option.c_str() + threadsOption.size(), nullptr, 10));
+		else if (option.compare(0, metricsOption.size(), metricsOption) == 0)
+			metricsFile = option.substr(metricsOption.size());
+		else if (option.compare(0, profileOption.size(), profileOption) == 0) {
+			try {
+				options.profile = PNGStego::embeddingProfileFromName(option.substr(profileOption.size()));
+			}
+			catch (const std::exception &e) {
+				std::cerr << "Fatal error: " << e.what() << std::endl;
+				return 1;
+			}
+		}
+	}
+
+	if (!silentMode)
+		std::cout << "PNGStego " << PNGStego::version.string << "\nCopyright (C) 2015 Zireael"
+		             "\nDistributed under Boost Software License: http://www.boost.org/LICENSE_1_0.txt\n";
+
+	if (argc < 2) {
+		std::cout << "Usage: " << PNGStego::baseFilename(argv[0]) << " [path-to-socket] [--threads=N] [--silent] [--memory-budget=MiB] [--profile=sparse|dense|dense2] [--metrics=file]\n";
+		return 1;
+	}
+
+	try {
+		PNGStego::Daemon daemon(argv[1], threads, options);
+		if (!silentMode) {
+			daemon.setOutputFn([](const std::string &event) {
+				std::cout << event << std::endl;
+			});
+			std::cout << "\nListening on " << argv[1] << std::endl;
+		}
+
+		// Clients that hang up early mustn't take the daemon down with them
+		std::signal(SIGPIPE, SIG_IGN);
+		runningDaemon = &daemon;
+		std::signal(SIGINT, stopDaemon);
+		std::signal(SIGTERM, stopDaemon);
+		// SIGUSR1 writes the numbers so far, they're written once more on the way out
+		PNGStego::MetricsFormat metricsFormat = PNGStego::metricsFormatFor(metricsFile);
+		if (!metricsFile.empty())
+			PNGStego::dumpMetricsOnSignal(SIGUSR1, metricsFile, metricsFormat);
+		daemon.serve();
+		runningDaemon = nullptr;
+		if (!metricsFile.empty())
+			PNGStego::Metrics::global().dump(metricsFile, metricsFormat);
+	}
+	catch (const std::exception &e) {
+		std::cerr << "Fatal error: " << e.what() << std::endl;
+		return 1;
+	}
+	return 0;
+}
\ No newline at end of file
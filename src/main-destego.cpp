@@ -11,6 +11,11 @@
 #include <vector>
 #include <array>
 #include <clocale>
+#include <cstdlib>
+#include <csignal>
+#include <fstream>
+#include <functional>
+#include <stdexcept>
 
 /*
   Boost::Nowide provides UTF-8 support on Windows.
@@ -27,6 +32,7 @@ namespace boost {
 		using std::cerr;
 		using std::cin;
 		using std::clog;
+		using std::ifstream;
 	}
 }
 #endif
@@ -34,7 +40,10 @@ namespace boost {
 #include "compression.h"
 #include "encryption.h"
 #include "pngwrapper.h"
+#include "batch.h"
+#include "daemon.h"
 #include "helpers.h"
+#include "metrics.h"
 #include "pngstegoversion.h"
 
 int main(int argc, char **argv) {
@@ -52,17 +61,97 @@ int main(int argc, char **argv) {
 	std::setlocale(LC_ALL, "");
 
 	bool silentMode = false;
-	if (argc > 4) {
-		silentMode = (argv[4] == std::string("--silent")
-		                || argv[4] == std::string("-s"));
+	PNGStego::JobOptions options = { false, 0, PNGStego::EmbeddingProfile::Sparse }; // no memory budget means unlimited
+	std::string manifest;
+	std::string metricsFile; // none means metrics aren't dumped
+	size_t threads = 0, ioThreads = 0, queueDepth = 0; // see PNGStego::pipelineLimits()
+	// Requests go to a running pngstegod instead, if there's one
+	const char *socketVariable = std::getenv("PNGSTEGOD_SOCKET");
+	std::string daemonSocket = socketVariable ? socketVariable : "";
+	// In batch mode jobs come from the manifest, so options start right away
+	const std::string batchOption = "--batch=";
+	const bool batchMode = argc > 1 && std::string(argv[1]).compare(0, batchOption.size(), batchOption) == 0;
+	for (int i = batchMode ? 1 : 4; i < argc; ++i) {
+		std::string option = argv[i];
+		const std::string budgetOption = "--memory-budget=";
+		const std::string threadsOption = "--threads=";
+		const std::string ioThreadsOption = "--io-threads=";
+		const std::string queueOption = "--queue-depth=";
+		const std::string daemonOption = "--daemon=";
+		const std::string metricsOption = "--metrics=";
+		if (option == "--silent" || option == "-s")
+			silentMode = true;
+		else if (option.compare(0, budgetOption.size(), budgetOption) == 0)
+			options.memoryBudget = std::strtoull(option.c_str() + budgetOption.size(), nullptr, 10) * 1024 * 1024;
+		else if (option.compare(0, batchOption.size(), batchOption) == 0)
+			manifest = option.substr(batchOption.size());
+		else if (option.compare(0, threadsOption.size(), threadsOption) == 0)
+			threads = static_cast<size_t>(std::strtoull(option.c_str() + threadsOption.size(), nullptr, 10));
+		else if (option.compare(0, ioThreadsOption.size(), ioThreadsOption) == 0)
+			ioThreads = static_cast<size_t>(std::strtoull(option.c_str() + ioThreadsOption.size(), nullptr, 10));
+		else if (option.compare(0, queueOption.size(), queueOption) == 0)
+			queueDepth = static_cast<size_t>(std::strtoull(option.c_str() + queueOption.size(), nullptr, 10));
+		else if (option.compare(0, daemonOption.size(), daemonOption) == 0)
+			daemonSocket = option.substr(daemonOption.size());
+		else if (option.compare(0, metricsOption.size(), metricsOption) == 0)
+			metricsFile = option.substr(metricsOption.size());
 	}
 
 	if (!silentMode)
 		boost::nowide::cout << "PNGStego " << PNGStego::version.string << "\nCopyright (C) 2015 Zireael"
 		            "\nDistributed under Boost Software License: http://www.boost.org/LICENSE_1_0.txt\n";
 
-	if (argc < 4) {
-		boost::nowide::cout << "Usage: " << PNGStego::baseFilename(argv[0]) << " [path-to-container] [output-file] [key] [--silent]\n";
+	if (argc < 4 && !batchMode) {
+		boost::nowide::cout << "Usage: " << PNGStego::baseFilename(argv[0]) << " [path-to-container] [output-file] [key] [--silent] [--memory-budget=MiB] [--daemon=socket]\n"
+		                       "       " << PNGStego::baseFilename(argv[0]) << " --batch=[manifest|-] [--threads=N] [--io-threads=N] [--queue-depth=N] [--silent] [--memory-budget=MiB] [--metrics=file]\n";
+	}
+
+	if (batchMode) {
+		std::vector<PNGStego::BatchJob> jobs;
+		try {
+			if (manifest == "-") {
+				jobs = PNGStego::readManifest(boost::nowide::cin);
+			}
+			else {
+				boost::nowide::ifstream File(manifest.c_str());
+				if (!File)
+					throw std::invalid_argument("Cannot open " + manifest);
+				jobs = PNGStego::readManifest(File);
+			}
+		}
+		catch (const std::exception &e) {
+			boost::nowide::cerr << "Fatal error: " << e.what() << std::endl;
+			return 1;
+		}
+
+		// Progress of jobs running side by side would be unreadable, only their results get reported
+		auto report = [silentMode](const PNGStego::BatchJob &job, const std::string &error) {
+			if (error.empty()) {
+				if (!silentMode)
+					boost::nowide::cout << "OK\t" << job.line << "\t" << job.container << std::endl;
+			}
+			else {
+				boost::nowide::cerr << "FAILED\t" << job.line << "\t" << job.container << "\t" << error << std::endl;
+			}
+		};
+		// Long batches can be looked into while they run
+		PNGStego::MetricsFormat metricsFormat = PNGStego::metricsFormatFor(metricsFile);
+#ifdef SIGUSR1
+		if (!metricsFile.empty())
+			PNGStego::dumpMetricsOnSignal(SIGUSR1, metricsFile, metricsFormat);
+#endif
+		size_t failed = PNGStego::decodeBatch(jobs, options, PNGStego::pipelineLimits(threads, ioThreads, queueDepth), report);
+		if (!silentMode)
+			boost::nowide::cout << jobs.size() - failed << " of " << jobs.size() << " jobs done." << std::endl;
+		if (!metricsFile.empty()) {
+			try {
+				PNGStego::Metrics::global().dump(metricsFile, metricsFormat);
+			}
+			catch (const std::exception &e) {
+				boost::nowide::cerr << "Couldn't dump metrics: " << e.what() << std::endl;
+			}
+		}
+		return failed == 0 ? 0 : 1;
 	}
 
 	if (!silentMode)
@@ -97,19 +186,34 @@ int main(int argc, char **argv) {
 		PNGStego::removeLineEndings(key);
 	}
 
+	PNGStego::BatchJob job = { 0, containerFilename, outputFilename, key };
+	PNGStego::zeroMemory(&key[0], key.size());
 	try {
-		PNGStego::PNGFile container(containerFilename);
+		std::function<void(const std::string&)> outputFn;
 		if (!silentMode)
-			container.setOutputFn([](const std::string &event) {
+			outputFn = [](const std::string &event) {
 				boost::nowide::cout << event << std::endl;
-			});
-		container.decode(outputFilename, key);
+			};
+		if (daemonSocket.empty()) {
+			PNGStego::decodeJob(job, options, outputFn);
+		}
+		else {
+			// The daemon has its own working directory
+			PNGStego::DaemonRequest request = { PNGStego::DaemonOp::Decode, options.inPlace,
+			                                    PNGStego::absolutePath(job.container), PNGStego::absolutePath(job.file), job.key,
+			                                    false, options.profile };
+			PNGStego::zeroMemory(&job.key[0], job.key.size());
+			PNGStego::DaemonReply reply = PNGStego::Daemon::request(daemonSocket, request);
+			PNGStego::zeroMemory(&request.key[0], request.key.size());
+			if (!reply.ok)
+				throw std::runtime_error(reply.message);
+		}
 		if (!silentMode)
 			boost::nowide::cout << "Done." << std::endl;
 	}
 	catch (const std::exception &e) {
 		boost::nowide::cerr << "Fatal error: " << e.what() << std::endl;
-		PNGStego::zeroMemory(&key[0], key.size());
+		PNGStego::zeroMemory(&job.key[0], job.key.size());
 #ifdef _WIN32
 		if (ownsConsole) {
 			boost::nowide::cerr << "Press enter to terminate the program" << std::endl;
@@ -118,7 +222,6 @@ int main(int argc, char **argv) {
 #endif
 		return 1;
 	}
-	PNGStego::zeroMemory(&key[0], key.size());
 
 #ifdef _WIN32
 	if (!silentMode && ownsConsole) {
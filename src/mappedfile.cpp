@@ -0,0 +1,105 @@
+//
+// Copyright (C) 2015-2016 Zireael (zireael dot nk at gmail dot com)
+//  Distributed under the Boost Software License, Version 1.0.
+//       (See accompanying file LICENSE.md or copy at
+//           http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "mappedfile.h"
+#include "helpers.h"
+#include <stdexcept>
+
+#ifdef _WIN32
+#include <boost/nowide/convert.hpp>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace PNGStego {
+
+	MappedFile::MappedFile(const std::string &filename, bool writable)
+		: address(nullptr), length(0), writable(writable)
+	{
+#ifdef _WIN32
+		HANDLE File = CreateFileW(boost::nowide::widen(filename).c_str(),
+		                          writable ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ, FILE_SHARE_READ,
+		                          nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (File == INVALID_HANDLE_VALUE)
+			throw std::invalid_argument("Cannot open " + filename);
+
+		LARGE_INTEGER size;
+		if (!GetFileSizeEx(File, &size) || size.QuadPart == 0) {
+			CloseHandle(File);
+			throw std::runtime_error("Cannot map " + filename);
+		}
+		length = static_cast<uint64_t>(size.QuadPart);
+
+		HANDLE Mapping = CreateFileMappingW(File, nullptr, writable ? PAGE_READWRITE : PAGE_WRITECOPY, 0, 0, nullptr);
+		if (!Mapping) {
+			CloseHandle(File);
+			throw std::runtime_error("Cannot map " + filename);
+		}
+		address = static_cast<uint8_t*>(MapViewOfFile(Mapping, writable ? FILE_MAP_WRITE : FILE_MAP_COPY, 0, 0, 0));
+		if (!address) {
+			CloseHandle(Mapping);
+			CloseHandle(File);
+			throw std::runtime_error("Cannot map " + filename);
+		}
+		file = File;
+		mapping = Mapping;
+#else
+		int File = open(filename.c_str(), writable ? O_RDWR : O_RDONLY);
+		if (File == -1)
+			throw std::invalid_argument("Cannot open " + filename);
+
+		struct stat info;
+		if (fstat(File, &info) != 0 || info.st_size <= 0 ||
+		    static_cast<uint64_t>(info.st_size) > SIZE_MAX) {
+			close(File);
+			throw std::runtime_error("Cannot map " + filename);
+		}
+		length = static_cast<uint64_t>(info.st_size);
+
+		void *Address = mmap(nullptr, static_cast<size_t>(length), PROT_READ | PROT_WRITE,
+		                     writable ? MAP_SHARED : MAP_PRIVATE, File, 0);
+		// The mapping keeps the file open by itself
+		close(File);
+		if (Address == MAP_FAILED)
+			throw std::runtime_error("Cannot map " + filename);
+		address = static_cast<uint8_t*>(Address);
+#endif
+	}
+
+	MappedFile::~MappedFile() {
+#ifdef _WIN32
+		UnmapViewOfFile(address);
+		CloseHandle(static_cast<HANDLE>(mapping));
+		CloseHandle(static_cast<HANDLE>(file));
+#else
+		munmap(address, static_cast<size_t>(length));
+#endif
+	}
+
+	uint8_t* MappedFile::data() noexcept {
+		return address;
+	}
+
+	uint64_t MappedFile::size() const noexcept {
+		return length;
+	}
+
+	void MappedFile::flush() {
+		if (!writable)
+			return;
+#ifdef _WIN32
+		if (!FlushViewOfFile(address, 0) || !FlushFileBuffers(static_cast<HANDLE>(file)))
+#else
+		if (msync(address, static_cast<size_t>(length), MS_SYNC) != 0)
+#endif
+			throw std::runtime_error("Cannot write changes back to the file");
+	}
+
+} // namespace PNGStego
\ No newline at end of file
@@ -0,0 +1,447 @@
+//
+// Copyright (C) 2015-2016 Zireael (zireael dot nk at gmail dot com)
+//  Distributed under the Boost Software License, Version 1.0.
+//       (See accompanying file LICENSE.md or copy at
+//           http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "metrics.h"
+#include "cancellation.h"
+#include "helpers.h"
+#include "stegoengine.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <iomanip>
+#include <mutex>
+#include <new>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+#ifndef _WIN32
+#include <cerrno>
+#include <csignal>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace PNGStego {
+
+	const char* operationName(Operation operation) noexcept {
+		return operation == Operation::Encode ? "encode" : "decode";
+	}
+
+	const char* failureCauseName(FailureCause cause) noexcept {
+		switch (cause) {
+		case FailureCause::CorruptedHeader: return "corrupted-header";
+		case FailureCause::Authentication:  return "authentication";
+		case FailureCause::Capacity:        return "capacity";
+		case FailureCause::Cancelled:       return "cancelled";
+		case FailureCause::Argument:        return "argument";
+		case FailureCause::Memory:          return "memory";
+		case FailureCause::Other:           return "other";
+		}
+		return "unknown";
+	}
+
+	FailureCause classifyFailure(std::exception_ptr error) noexcept {
+		try {
+			std::rethrow_exception(error);
+		}
+		catch (const Cancelled&) {
+			return FailureCause::Cancelled;
+		}
+		catch (const CapacityError&) {
+			return FailureCause::Capacity;
+		}
+		catch (const KeyError &e) {
+			// The header is checked before anything gets decrypted, anything else is the cipher's tag
+			return std::strcmp(e.what(), "Corrupted header") == 0 ? FailureCause::CorruptedHeader
+			                                                       : FailureCause::Authentication;
+		}
+		catch (const std::invalid_argument&) {
+			return FailureCause::Argument;
+		}
+		catch (const std::bad_alloc&) {
+			return FailureCause::Memory;
+		}
+		catch (...) {
+			return FailureCause::Other;
+		}
+	}
+
+	namespace Histogram {
+		size_t bucket(uint64_t value) noexcept {
+			if (value < SUB_BUCKETS)
+				return static_cast<size_t>(value);
+#if defined(__GNUC__)
+			unsigned exponent = 63 - __builtin_clzll(value);
+#else
+			unsigned exponent = 0;
+			for (uint64_t rest = value; rest >>= 1; )
+				++exponent;
+#endif
+			if (exponent >= MAX_EXPONENT)
+				return BUCKETS - 1;
+			size_t subBucket = static_cast<size_t>(value >> (exponent - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1);
+			return SUB_BUCKETS + (exponent - SUB_BUCKET_BITS) * SUB_BUCKETS + subBucket;
+		}
+
+		uint64_t bucketLimit(size_t bucket) noexcept {
+			if (bucket < SUB_BUCKETS)
+				return bucket;
+			if (bucket >= BUCKETS - 1)
+				return UINT64_MAX;
+			size_t exponent = (bucket - SUB_BUCKETS) / SUB_BUCKETS + SUB_BUCKET_BITS;
+			uint64_t subBucket = (bucket - SUB_BUCKETS) % SUB_BUCKETS;
+			return ((SUB_BUCKETS + subBucket + 1) << (exponent - SUB_BUCKET_BITS)) - 1;
+		}
+	}
+
+	uint64_t StageMetrics::percentile(double p) const noexcept {
+		uint64_t total = 0;
+		for (uint64_t bucket : buckets)
+			total += bucket;
+		if (total == 0)
+			return 0;
+		uint64_t rank = std::max<uint64_t>(static_cast<uint64_t>(p / 100 * total + 0.5), 1);
+		uint64_t seen = 0;
+		for (size_t k = 0; k < buckets.size(); ++k) {
+			seen += buckets[k];
+			if (seen >= rank)
+				return Histogram::bucketLimit(k);
+		}
+		return Histogram::bucketLimit(buckets.size() - 1);
+	}
+
+	uint64_t MetricsSnapshot::embeddedBytes() const noexcept {
+		return stages[static_cast<size_t>(Stage::Embed)].outputBytes;
+	}
+
+	uint64_t MetricsSnapshot::extractedBytes() const noexcept {
+		return stages[static_cast<size_t>(Stage::Extract)].outputBytes;
+	}
+
+	void MetricsSnapshot::write(std::ostream &stream, MetricsFormat format) const {
+		stream << std::setprecision(9);
+		if (format == MetricsFormat::JSON) {
+			stream << "{\n  \"operations\": {";
+			for (size_t op = 0; op < OPERATION_COUNT; ++op)
+				stream << (op ? ", " : "") << "\"" << operationName(static_cast<Operation>(op)) << "\": " << operations[op];
+			stream << "},\n  \"failures\": {";
+			for (size_t op = 0; op < OPERATION_COUNT; ++op) {
+				stream << (op ? "," : "") << "\n    \"" << operationName(static_cast<Operation>(op)) << "\": {";
+				for (size_t cause = 0; cause < FAILURE_CAUSE_COUNT; ++cause)
+					stream << (cause ? ", " : "") << "\"" << failureCauseName(static_cast<FailureCause>(cause)) << "\": "
+					       << failures[op][cause];
+				stream << "}";
+			}
+			stream << "\n  },\n  \"embedded_bytes\": " << embeddedBytes()
+			       << ",\n  \"extracted_bytes\": " << extractedBytes()
+			       << ",\n  \"pixel_memory_bytes\": " << pixelBytes
+			       << ",\n  \"pixel_memory_peak_bytes\": " << peakPixelBytes
+			       << ",\n  \"payload_memory_bytes\": " << payloadBytes
+			       << ",\n  \"payload_memory_peak_bytes\": " << peakPayloadBytes
+			       << ",\n  \"working_memory_peak_bytes\": " << peakWorkingBytes
+			       << ",\n  \"stages\": {";
+			for (size_t s = 0; s < STAGE_COUNT; ++s) {
+				const StageMetrics &stage = stages[s];
+				stream << (s ? "," : "") << "\n    \"" << stageName(static_cast<Stage>(s)) << "\": {\"count\": " << stage.count
+				       << ", \"sum_ns\": " << stage.nanoseconds << ", \"input_bytes\": " << stage.inputBytes
+				       << ", \"output_bytes\": " << stage.outputBytes << ", \"p50_ns\": " << stage.percentile(50)
+				       << ", \"p90_ns\": " << stage.percentile(90) << ", \"p99_ns\": " << stage.percentile(99)
+				       << ",\n      \"buckets\": [";
+				// Only the ones that have anything, as [largest value, count]
+				bool first = true;
+				for (size_t k = 0; k < stage.buckets.size(); ++k) {
+					if (!stage.buckets[k])
+						continue;
+					stream << (first ? "" : ", ") << "[" << Histogram::bucketLimit(k) << ", " << stage.buckets[k] << "]";
+					first = false;
+				}
+				stream << "]}";
+			}
+			stream << "\n  }\n}\n";
+			return;
+		}
+
+		stream << "# HELP pngstego_operations_total Encodes and decodes started.\n"
+		          "# TYPE pngstego_operations_total counter\n";
+		for (size_t op = 0; op < OPERATION_COUNT; ++op)
+			stream << "pngstego_operations_total{operation=\"" << operationName(static_cast<Operation>(op)) << "\"} "
+			       << operations[op] << "\n";
+		stream << "# HELP pngstego_failures_total Encodes and decodes that have failed, by cause.\n"
+		          "# TYPE pngstego_failures_total counter\n";
+		for (size_t op = 0; op < OPERATION_COUNT; ++op) {
+			for (size_t cause = 0; cause < FAILURE_CAUSE_COUNT; ++cause)
+				stream << "pngstego_failures_total{operation=\"" << operationName(static_cast<Operation>(op))
+				       << "\",cause=\"" << failureCauseName(static_cast<FailureCause>(cause)) << "\"} "
+				       << failures[op][cause] << "\n";
+		}
+		stream << "# HELP pngstego_embedded_bytes_total Bytes written into pixels.\n"
+		          "# TYPE pngstego_embedded_bytes_total counter\n"
+		          "pngstego_embedded_bytes_total " << embeddedBytes() << "\n"
+		          "# HELP pngstego_extracted_bytes_total Bytes read from pixels.\n"
+		          "# TYPE pngstego_extracted_bytes_total counter\n"
+		          "pngstego_extracted_bytes_total " << extractedBytes() << "\n"
+		          "# HELP pngstego_pixel_memory_bytes Memory taken by decoded pixels.\n"
+		          "# TYPE pngstego_pixel_memory_bytes gauge\n"
+		          "pngstego_pixel_memory_bytes " << pixelBytes << "\n"
+		          "# HELP pngstego_pixel_memory_peak_bytes The most memory decoded pixels have ever taken at once.\n"
+		          "# TYPE pngstego_pixel_memory_peak_bytes gauge\n"
+		          "pngstego_pixel_memory_peak_bytes " << peakPixelBytes << "\n"
+		          "# HELP pngstego_payload_memory_bytes Memory taken by payloads being encoded or decoded.\n"
+		          "# TYPE pngstego_payload_memory_bytes gauge\n"
+		          "pngstego_payload_memory_bytes " << payloadBytes << "\n"
+		          "# HELP pngstego_payload_memory_peak_bytes The most memory payloads have ever taken at once.\n"
+		          "# TYPE pngstego_payload_memory_peak_bytes gauge\n"
+		          "pngstego_payload_memory_peak_bytes " << peakPayloadBytes << "\n"
+		          "# HELP pngstego_working_memory_peak_bytes The most memory pixels and payloads together have ever taken.\n"
+		          "# TYPE pngstego_working_memory_peak_bytes gauge\n"
+		          "pngstego_working_memory_peak_bytes " << peakWorkingBytes << "\n"
+		          "# HELP pngstego_stage_duration_seconds How long each stage of loading, encoding, decoding and saving takes.\n"
+		          "# TYPE pngstego_stage_duration_seconds histogram\n";
+		for (size_t s = 0; s < STAGE_COUNT; ++s) {
+			const StageMetrics &stage = stages[s];
+			const char *name = stageName(static_cast<Stage>(s));
+			// Buckets are cumulative, the empty ones would only repeat the previous count
+			uint64_t seen = 0;
+			for (size_t k = 0; k + 1 < stage.buckets.size(); ++k) {
+				if (!stage.buckets[k])
+					continue;
+				seen += stage.buckets[k];
+				stream << "pngstego_stage_duration_seconds_bucket{stage=\"" << name << "\",le=\""
+				       << Histogram::bucketLimit(k) / 1e9 << "\"} " << seen << "\n";
+			}
+			stream << "pngstego_stage_duration_seconds_bucket{stage=\"" << name << "\",le=\"+Inf\"} " << stage.count << "\n"
+			       << "pngstego_stage_duration_seconds_sum{stage=\"" << name << "\"} " << stage.nanoseconds / 1e9 << "\n"
+			       << "pngstego_stage_duration_seconds_count{stage=\"" << name << "\"} " << stage.count << "\n";
+		}
+	}
+
+	struct Metrics::Shard {
+		struct StageCounters {
+			std::atomic<uint64_t> count, nanoseconds, inputBytes, outputBytes;
+			std::atomic<uint64_t> buckets[Histogram::BUCKETS];
+		};
+
+		std::atomic<uint64_t> operations[OPERATION_COUNT];
+		std::atomic<uint64_t> failures[OPERATION_COUNT][FAILURE_CAUSE_COUNT];
+		StageCounters stages[STAGE_COUNT];
+	};
+
+	// Slot of the calling thread's shard, assigned on its first record
+	thread_local size_t shardSlot = SIZE_MAX;
+
+	void add(std::atomic<uint64_t> &counter, uint64_t value) noexcept {
+		counter.fetch_add(value, std::memory_order_relaxed);
+	}
+
+	/** Adds to a gauge and raises its peak if it's been passed (helper function) */
+	void raise(std::atomic<uint64_t> &gauge, std::atomic<uint64_t> &peak, uint64_t bytes) noexcept {
+		uint64_t now = gauge.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+		uint64_t highest = peak.load(std::memory_order_relaxed);
+		while (now > highest && !peak.compare_exchange_weak(highest, now, std::memory_order_relaxed)) { }
+	}
+
+	Metrics::Metrics() noexcept : nextShard(0), pixelBytes(0), peakPixelBytes(0), payloadBytes(0), peakPayloadBytes(0),
+		workingBytes(0), peakWorkingBytes(0)
+	{
+		for (auto &shard : shards)
+			shard.store(nullptr, std::memory_order_relaxed);
+	}
+
+	Metrics& Metrics::global() {
+		// Never destroyed, threads may still be recording while the process exits
+		static Metrics *registry = new Metrics();
+		return *registry;
+	}
+
+	Metrics::Shard* Metrics::shard() noexcept {
+		if (shardSlot == SIZE_MAX)
+			shardSlot = nextShard.fetch_add(1, std::memory_order_relaxed) % MAX_SHARDS;
+		Shard *current = shards[shardSlot].load(std::memory_order_acquire);
+		if (current)
+			return current;
+		// Value-initialized, so every counter starts at 0. Whoever loses the race throws theirs away
+		Shard *created = new (std::nothrow) Shard();
+		if (!created)
+			return nullptr;
+		if (shards[shardSlot].compare_exchange_strong(current, created, std::memory_order_acq_rel))
+			return created;
+		delete created;
+		return current;
+	}
+
+	void Metrics::recordOperation(Operation operation) noexcept {
+		if (Shard *shard = this->shard())
+			add(shard->operations[static_cast<size_t>(operation)], 1);
+	}
+
+	void Metrics::recordFailure(Operation operation, FailureCause cause) noexcept {
+		if (Shard *shard = this->shard())
+			add(shard->failures[static_cast<size_t>(operation)][static_cast<size_t>(cause)], 1);
+	}
+
+	void Metrics::recordStage(Stage stage, uint64_t nanoseconds, uint64_t inputBytes, uint64_t outputBytes) noexcept {
+		Shard *shard = this->shard();
+		if (!shard)
+			return;
+		Shard::StageCounters &counters = shard->stages[static_cast<size_t>(stage)];
+		add(counters.count, 1);
+		add(counters.nanoseconds, nanoseconds);
+		add(counters.inputBytes, inputBytes);
+		add(counters.outputBytes, outputBytes);
+		add(counters.buckets[Histogram::bucket(nanoseconds)], 1);
+	}
+
+	void Metrics::pixelsAllocated(uint64_t bytes) noexcept {
+		raise(pixelBytes, peakPixelBytes, bytes);
+		raise(workingBytes, peakWorkingBytes, bytes);
+	}
+
+	void Metrics::pixelsReleased(uint64_t bytes) noexcept {
+		pixelBytes.fetch_sub(bytes, std::memory_order_relaxed);
+		workingBytes.fetch_sub(bytes, std::memory_order_relaxed);
+	}
+
+	void Metrics::payloadAllocated(uint64_t bytes) noexcept {
+		raise(payloadBytes, peakPayloadBytes, bytes);
+		raise(workingBytes, peakWorkingBytes, bytes);
+	}
+
+	void Metrics::payloadReleased(uint64_t bytes) noexcept {
+		payloadBytes.fetch_sub(bytes, std::memory_order_relaxed);
+		workingBytes.fetch_sub(bytes, std::memory_order_relaxed);
+	}
+
+	MetricsSnapshot Metrics::snapshot() const {
+		MetricsSnapshot result;
+		std::memset(result.operations, 0, sizeof(result.operations));
+		std::memset(result.failures, 0, sizeof(result.failures));
+		for (StageMetrics &stage : result.stages) {
+			stage.count = stage.nanoseconds = stage.inputBytes = stage.outputBytes = 0;
+			stage.buckets.assign(Histogram::BUCKETS, 0);
+		}
+		for (const auto &slot : shards) {
+			const Shard *shard = slot.load(std::memory_order_acquire);
+			if (!shard)
+				continue;
+			for (size_t op = 0; op < OPERATION_COUNT; ++op) {
+				result.operations[op] += shard->operations[op].load(std::memory_order_relaxed);
+				for (size_t cause = 0; cause < FAILURE_CAUSE_COUNT; ++cause)
+					result.failures[op][cause] += shard->failures[op][cause].load(std::memory_order_relaxed);
+			}
+			for (size_t s = 0; s < STAGE_COUNT; ++s) {
+				const Shard::StageCounters &counters = shard->stages[s];
+				StageMetrics &stage = result.stages[s];
+				stage.count += counters.count.load(std::memory_order_relaxed);
+				stage.nanoseconds += counters.nanoseconds.load(std::memory_order_relaxed);
+				stage.inputBytes += counters.inputBytes.load(std::memory_order_relaxed);
+				stage.outputBytes += counters.outputBytes.load(std::memory_order_relaxed);
+				for (size_t k = 0; k < Histogram::BUCKETS; ++k)
+					stage.buckets[k] += counters.buckets[k].load(std::memory_order_relaxed);
+			}
+		}
+		result.pixelBytes = pixelBytes.load(std::memory_order_relaxed);
+		result.peakPixelBytes = peakPixelBytes.load(std::memory_order_relaxed);
+		result.payloadBytes = payloadBytes.load(std::memory_order_relaxed);
+		result.peakPayloadBytes = peakPayloadBytes.load(std::memory_order_relaxed);
+		result.peakWorkingBytes = peakWorkingBytes.load(std::memory_order_relaxed);
+		return result;
+	}
+
+	void Metrics::dump(const std::string &filename, MetricsFormat format) const {
+		std::ostringstream text;
+		this->snapshot().write(text, format);
+		const std::string &contents = text.str();
+		const std::string temporary = filename + ".tmp";
+		writeFile(temporary, reinterpret_cast<const uint8_t*>(contents.data()), contents.size());
+#ifdef _WIN32
+		// rename() doesn't replace files on Windows
+		std::remove(filename.c_str());
+#endif
+		if (std::rename(temporary.c_str(), filename.c_str()) != 0) {
+			std::remove(temporary.c_str());
+			throw std::runtime_error("Couldn't write " + filename);
+		}
+	}
+
+	MetricsFormat metricsFormatFor(const std::string &filename) noexcept {
+		std::string extension = getExtension(filename);
+		return extension == "json" || extension == "JSON" ? MetricsFormat::JSON : MetricsFormat::Prometheus;
+	}
+
+#ifndef _WIN32
+	// The handler only pokes a pipe, a thread waiting on the other end does the writing
+	int signalPipe[2] = { -1, -1 };
+	std::mutex signalMutex;
+	std::string signalFilename;
+	MetricsFormat signalFormat = MetricsFormat::Prometheus;
+
+	extern "C" void onMetricsSignal(int) {
+		int savedErrno = errno;
+		char byte = 0;
+		ssize_t written = write(signalPipe[1], &byte, 1);
+		(void)written; // the pipe's full, a dump is coming anyway
+		errno = savedErrno;
+	}
+
+	void dumpOnRequest() {
+		char byte;
+		while (true) {
+			ssize_t got = read(signalPipe[0], &byte, 1);
+			if (got < 0 && errno == EINTR)
+				continue;
+			if (got <= 0)
+				return;
+			std::string filename;
+			MetricsFormat format;
+			{
+				std::lock_guard<std::mutex> lock(signalMutex);
+				filename = signalFilename;
+				format = signalFormat;
+			}
+			try {
+				Metrics::global().dump(filename, format);
+			}
+			catch (...) {
+				// There's no one to tell, the next signal tries again
+			}
+		}
+	}
+#endif
+
+	bool dumpMetricsOnSignal(int signal, const std::string &filename, MetricsFormat format) {
+#ifdef _WIN32
+		(void)signal;
+		(void)filename;
+		(void)format;
+		return false;
+#else
+		std::lock_guard<std::mutex> lock(signalMutex);
+		signalFilename = filename;
+		signalFormat = format;
+		if (signalPipe[0] < 0) {
+			if (pipe(signalPipe) != 0)
+				throw std::runtime_error("Couldn't create a pipe");
+			// A handler must never block, child processes have nothing to do with it
+			fcntl(signalPipe[1], F_SETFL, fcntl(signalPipe[1], F_GETFL) | O_NONBLOCK);
+			fcntl(signalPipe[0], F_SETFD, FD_CLOEXEC);
+			fcntl(signalPipe[1], F_SETFD, FD_CLOEXEC);
+			std::thread(dumpOnRequest).detach();
+		}
+
+		struct sigaction action;
+		std::memset(&action, 0, sizeof(action));
+		action.sa_handler = onMetricsSignal;
+		sigemptyset(&action.sa_mask);
+		action.sa_flags = SA_RESTART;
+		if (sigaction(signal, &action, nullptr) != 0)
+			throw std::invalid_argument("Cannot catch the signal");
+		return true;
+#endif
+	}
+
+} // namespace PNGStego
\ No newline at end of file
@@ -0,0 +1,94 @@
+//
+// Copyright (C) 2015-2016 Zireael (zireael dot nk at gmail dot com)
+//  Distributed under the Boost Software License, Version 1.0.
+//       (See accompanying file LICENSE.md or copy at
+//           http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "payloadbuffer.h"
+#include "helpers.h"
+#include "metrics.h"
+#include "securepool.h"
+#include <algorithm>
+#include <cstring>
+
+namespace PNGStego {
+
+	PayloadBuffer::PayloadBuffer() noexcept : memory(nullptr), allocated(0), used(0) { }
+
+	PayloadBuffer::~PayloadBuffer() {
+		this->release();
+	}
+
+	uint8_t* PayloadBuffer::data() noexcept {
+		return memory;
+	}
+
+	const uint8_t* PayloadBuffer::data() const noexcept {
+		return memory;
+	}
+
+	size_t PayloadBuffer::size() const noexcept {
+		return used;
+	}
+
+	size_t PayloadBuffer::capacity() const noexcept {
+		return allocated;
+	}
+
+	void PayloadBuffer::reserve(size_t capacity) {
+		if (capacity <= allocated)
+			return;
+		const size_t size = SecurePool::blockSize(capacity);
+		uint8_t *larger = static_cast<uint8_t*>(SecurePool::global().allocate(size));
+		Metrics::global().payloadAllocated(size);
+		if (used)
+			memcpy(larger, memory, used);
+		SecurePool::global().deallocate(memory, allocated);
+		Metrics::global().payloadReleased(allocated);
+		memory = larger;
+		allocated = size;
+	}
+
+	void PayloadBuffer::resize(size_t size) {
+		if (size > allocated)
+			this->reserve(std::max(size, allocated * 2));
+		used = size;
+	}
+
+	void PayloadBuffer::append(const uint8_t *data, size_t size) {
+		size_t start = used;
+		this->resize(used + size);
+		if (size)
+			memcpy(memory + start, data, size);
+	}
+
+	void PayloadBuffer::consume(size_t count) noexcept {
+		count = std::min(count, used);
+		if (!count)
+			return;
+		memmove(memory, memory + count, used - count);
+		PNGStego::zeroMemory(memory + used - count, count);
+		used -= count;
+	}
+
+	void PayloadBuffer::release() noexcept {
+		if (memory) {
+			SecurePool::global().deallocate(memory, allocated);
+			Metrics::global().payloadReleased(allocated);
+		}
+		memory = nullptr;
+		allocated = 0;
+		used = 0;
+	}
+
+	void PayloadBuffer::moveTo(std::vector<uint8_t> &target) {
+		PNGStego::zeroMemory(target.data(), target.capacity());
+		target.clear();
+		if (target.capacity() < used)
+			std::vector<uint8_t>().swap(target);
+		target.assign(memory, memory + used);
+		this->release();
+	}
+
+} // namespace PNGStego
\ No newline at end of file
@@ -0,0 +1,127 @@
+//
+// Copyright (C) 2015-2016 Zireael (zireael dot nk at gmail dot com)
+//  Distributed under the Boost Software License, Version 1.0.
+//       (See accompanying file LICENSE.md or copy at
+//           http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "pipeline.h"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+namespace PNGStego {
+
+	/** Blocks producers while it's full and consumers while it's empty, until it's closed */
+	class BoundedQueue {
+	public:
+		explicit BoundedQueue(size_t capacity) : capacity(std::max<size_t>(capacity, 1)), closed(false)
+		{ }
+
+		void push(size_t item) {
+			std::unique_lock<std::mutex> lock(mutex);
+			notFull.wait(lock, [this]() { return items.size() < capacity; });
+			items.push_back(item);
+			notEmpty.notify_one();
+		}
+
+		/** Returns false once the queue's closed and there's nothing left */
+		bool pop(size_t &item) {
+			std::unique_lock<std::mutex> lock(mutex);
+			notEmpty.wait(lock, [this]() { return !items.empty() || closed; });
+			if (items.empty())
+				return false;
+			item = items.front();
+			items.pop_front();
+			notFull.notify_one();
+			return true;
+		}
+
+		void close() {
+			std::lock_guard<std::mutex> lock(mutex);
+			closed = true;
+			notEmpty.notify_all();
+		}
+
+	private:
+		std::mutex mutex;
+		std::condition_variable notFull, notEmpty;
+		std::deque<size_t> items;
+		size_t capacity;
+		bool closed;
+	};
+
+	void Pipeline::addStage(const std::string &name, const StageFn &fn, const StageLimits &limits) {
+		Stage stage = { name, fn, limits };
+		stage.limits.threads = std::max<size_t>(stage.limits.threads, 1);
+		stages.push_back(std::move(stage));
+	}
+
+	size_t Pipeline::run(size_t count, const std::function<void(size_t, const std::string&)> &report) {
+		if (stages.empty()) {
+			throw std::logic_error("A pipeline needs at least one stage");
+		}
+
+		std::vector<std::unique_ptr<BoundedQueue>> queues;
+		std::unique_ptr<std::atomic<size_t>[]> running(new std::atomic<size_t>[stages.size()]);
+		for (size_t s = 0; s < stages.size(); ++s) {
+			queues.emplace_back(new BoundedQueue(stages[s].limits.queueDepth));
+			running[s] = stages[s].limits.threads;
+		}
+
+		std::atomic<size_t> failed(0);
+		std::mutex reportMutex;
+		auto finish = [&](size_t item, const std::string &error) {
+			if (!error.empty())
+				++failed;
+			if (report) {
+				std::lock_guard<std::mutex> lock(reportMutex);
+				report(item, error);
+			}
+		};
+
+		auto worker = [&](size_t s) {
+			size_t item;
+			while (queues[s]->pop(item)) {
+				std::string error;
+				try {
+					stages[s].fn(item);
+				}
+				catch (const std::exception &e) {
+					error = stages[s].name + ": " + (*e.what() ? e.what() : "Unknown error");
+				}
+				catch (...) {
+					error = stages[s].name + ": Unknown error";
+				}
+
+				if (!error.empty())
+					finish(item, error);
+				else if (s + 1 < stages.size())
+					queues[s + 1]->push(item);
+				else
+					finish(item, std::string());
+			}
+			// The last one to leave lets the next stage know nothing else is coming
+			if (--running[s] == 0 && s + 1 < stages.size())
+				queues[s + 1]->close();
+		};
+
+		std::vector<std::thread> threads;
+		for (size_t s = 0; s < stages.size(); ++s) {
+			for (size_t k = 0; k < stages[s].limits.threads; ++k)
+				threads.emplace_back(worker, s);
+		}
+		for (size_t item = 0; item < count; ++item)
+			queues[0]->push(item);
+		queues[0]->close();
+		for (auto &thread : threads)
+			thread.join();
+		return failed;
+	}
+
+} // namespace PNGStego
\ No newline at end of file
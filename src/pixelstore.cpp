@@ -0,0 +1,254 @@
+//
+// Copyright (C) 2015-2016 Zireael (zireael dot nk at gmail dot com)
+//  Distributed under the Boost Software License, Version 1.0.
+//       (See accompanying file LICENSE.md or copy at
+//           http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "pixelstore.h"
+#include "metrics.h"
+#include "planar.h"
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+namespace PNGStego {
+
+	MemoryStore::MemoryStore(uint64_t count, PixelFormat format, SampleLayout layout, size_t sampleBytes)
+		: count(count), pixelFormat(format), sampleLayout(layout), bytesPerSample(sampleBytes), data()
+	{
+		if (count > SIZE_MAX / bytesPerPixel(format, sampleBytes)) {
+			throw std::runtime_error("The image's too large");
+		}
+		data.resize(static_cast<size_t>(count * bytesPerPixel(format, sampleBytes)));
+		Metrics::global().pixelsAllocated(data.size());
+	}
+
+	MemoryStore::MemoryStore(const MemoryStore &other)
+		: count(other.count), pixelFormat(other.pixelFormat), sampleLayout(other.sampleLayout),
+		  bytesPerSample(other.bytesPerSample), data(other.data)
+	{
+		Metrics::global().pixelsAllocated(data.size());
+	}
+
+	MemoryStore::~MemoryStore() {
+		Metrics::global().pixelsReleased(data.size());
+	}
+
+	uint64_t MemoryStore::size() const noexcept {
+		return count;
+	}
+
+	PixelFormat MemoryStore::format() const noexcept {
+		return pixelFormat;
+	}
+
+	size_t MemoryStore::sampleBytes() const noexcept {
+		return bytesPerSample;
+	}
+
+	ChannelRun MemoryStore::channel(uint64_t pixel, Channel channel) {
+		PixelView view(data.data(), static_cast<size_t>(count), pixelFormat, sampleLayout, bytesPerSample);
+		ChannelRun run;
+		run.data = &view(static_cast<size_t>(pixel), channel);
+		run.stride = sampleLayout == SampleLayout::Planar ? 1 : bytesPerPixel(pixelFormat, bytesPerSample);
+		run.count = count - pixel;
+		return run;
+	}
+
+	std::unique_ptr<PixelStore> MemoryStore::clone() const {
+		return std::unique_ptr<PixelStore>(new MemoryStore(*this));
+	}
+
+	void MemoryStore::read(uint64_t offset, uint8_t *destination, size_t length) {
+		if (sampleLayout == SampleLayout::Interleaved) {
+			memcpy(destination, data.data() + offset, length);
+			return;
+		}
+		// Byte #k of a pixel is in plane #k
+		const size_t channels = bytesPerPixel(pixelFormat, bytesPerSample);
+		for (size_t i = 0; i < length; ++i, ++offset)
+			destination[i] = data[static_cast<size_t>((offset % channels) * count + offset / channels)];
+	}
+
+	SampleLayout MemoryStore::layout() const noexcept {
+		return sampleLayout;
+	}
+
+	void MemoryStore::setLayout(SampleLayout layout) {
+		if (layout == sampleLayout)
+			return;
+
+		size_t channels = bytesPerPixel(pixelFormat, bytesPerSample);
+		if (channels > 1) {
+			// Both copies are around for a while
+			std::vector<uint8_t> converted(data.size());
+			Metrics::global().pixelsAllocated(converted.size());
+			std::vector<uint8_t*> Planes(channels);
+			for (size_t k = 0; k < channels; ++k)
+				Planes[k] = (layout == SampleLayout::Planar ? converted.data() : data.data()) + k * count;
+
+			if (layout == SampleLayout::Planar) {
+				Planar::deinterleave(data.data(), static_cast<size_t>(count), channels, Planes.data());
+			}
+			else {
+				std::vector<const uint8_t*> Sources(Planes.begin(), Planes.end());
+				Planar::interleave(Sources.data(), static_cast<size_t>(count), channels, converted.data());
+			}
+			data.swap(converted);
+			Metrics::global().pixelsReleased(converted.size());
+		}
+		sampleLayout = layout;
+	}
+
+	std::vector<uint8_t>& MemoryStore::samples() noexcept {
+		return data;
+	}
+
+	const std::vector<uint8_t>& MemoryStore::samples() const noexcept {
+		return data;
+	}
+
+	std::vector<uint8_t*> MemoryStore::planes() {
+		std::vector<uint8_t*> result(bytesPerPixel(pixelFormat, bytesPerSample));
+		for (size_t k = 0; k < result.size(); ++k)
+			result[k] = data.data() + k * count;
+		return result;
+	}
+
+	void UndoLog::restore(PixelStore &store) {
+		ChannelCursor cursors[4] = {
+			ChannelCursor(store, Channel::Red), ChannelCursor(store, Channel::Green),
+			ChannelCursor(store, Channel::Blue), ChannelCursor(store, Channel::Alpha)
+		};
+		// Backwards, so a sample that's been changed more than once ends up as it was first
+		for (auto it = entries.rbegin(); it != entries.rend(); ++it)
+			cursors[(*it >> 8) & 0xFF][*it >> 16] = static_cast<uint8_t>(*it);
+		this->clear();
+	}
+
+	void UndoLog::clear() noexcept {
+		entries.clear();
+	}
+
+	size_t UndoLog::size() const noexcept {
+		return entries.size();
+	}
+
+	CopyOnWriteStore::CopyOnWriteStore(std::shared_ptr<const MemoryStore> shared)
+		: shared(std::move(shared)), tiles(), copied(0)
+	{
+		tiles.resize(static_cast<size_t>((this->shared->size() + COPY_ON_WRITE_TILE_PIXELS - 1) / COPY_ON_WRITE_TILE_PIXELS));
+	}
+
+	CopyOnWriteStore::CopyOnWriteStore(const CopyOnWriteStore &other)
+		: shared(other.shared), tiles(other.tiles), copied(other.copied)
+	{
+		for (const std::vector<uint8_t> &tile : tiles)
+			Metrics::global().pixelsAllocated(tile.size());
+	}
+
+	CopyOnWriteStore::~CopyOnWriteStore() {
+		for (const std::vector<uint8_t> &tile : tiles)
+			Metrics::global().pixelsReleased(tile.size());
+	}
+
+	uint64_t CopyOnWriteStore::size() const noexcept {
+		return shared->size();
+	}
+
+	PixelFormat CopyOnWriteStore::format() const noexcept {
+		return shared->format();
+	}
+
+	size_t CopyOnWriteStore::sampleBytes() const noexcept {
+		return shared->sampleBytes();
+	}
+
+	ChannelRun CopyOnWriteStore::channel(uint64_t pixel, Channel channel) {
+		const size_t index = static_cast<size_t>(pixel / COPY_ON_WRITE_TILE_PIXELS);
+		const uint64_t first = index * COPY_ON_WRITE_TILE_PIXELS;
+		const size_t pixels = static_cast<size_t>(this->tilePixels(index));
+		const size_t channels = bytesPerPixel(shared->format(), shared->sampleBytes());
+		const SampleLayout layout = shared->layout();
+		std::vector<uint8_t> &tile = tiles[index];
+		if (tile.empty()) {
+			// The tile keeps the shared store's layout, planes of a planar one are as long as the tile
+			tile.resize(pixels * channels);
+			const uint8_t *samples = shared->samples().data();
+			if (layout == SampleLayout::Planar) {
+				for (size_t k = 0; k < channels; ++k)
+					memcpy(tile.data() + k * pixels, samples + k * shared->size() + first, pixels);
+			}
+			else {
+				memcpy(tile.data(), samples + first * channels, tile.size());
+			}
+			Metrics::global().pixelsAllocated(tile.size());
+			++copied;
+		}
+		PixelView view(tile.data(), pixels, shared->format(), layout, shared->sampleBytes());
+		ChannelRun run;
+		run.data = &view(static_cast<size_t>(pixel - first), channel);
+		run.stride = layout == SampleLayout::Planar ? 1 : channels;
+		run.count = first + pixels - pixel;
+		return run;
+	}
+
+	ChannelRun CopyOnWriteStore::readChannel(uint64_t pixel, Channel channel) {
+		const size_t index = static_cast<size_t>(pixel / COPY_ON_WRITE_TILE_PIXELS);
+		if (!tiles[index].empty())
+			return this->channel(pixel, channel);
+		const uint64_t last = index * COPY_ON_WRITE_TILE_PIXELS + this->tilePixels(index);
+		const SampleLayout layout = shared->layout();
+		// The run's only read, so it may point into the shared store even though it's const
+		PixelView view(const_cast<uint8_t*>(shared->samples().data()), static_cast<size_t>(shared->size()),
+		               shared->format(), layout, shared->sampleBytes());
+		ChannelRun run;
+		run.data = &view(static_cast<size_t>(pixel), channel);
+		run.stride = layout == SampleLayout::Planar ? 1 : bytesPerPixel(shared->format(), shared->sampleBytes());
+		run.count = last - pixel;
+		return run;
+	}
+
+	std::unique_ptr<PixelStore> CopyOnWriteStore::clone() const {
+		return std::unique_ptr<PixelStore>(new CopyOnWriteStore(*this));
+	}
+
+	void CopyOnWriteStore::read(uint64_t offset, uint8_t *destination, size_t length) {
+		const size_t channels = bytesPerPixel(shared->format(), shared->sampleBytes());
+		if (shared->layout() == SampleLayout::Interleaved) {
+			const uint64_t tileBytes = COPY_ON_WRITE_TILE_PIXELS * channels;
+			while (length) {
+				const size_t index = static_cast<size_t>(offset / tileBytes);
+				const uint64_t within = offset % tileBytes;
+				const size_t part = static_cast<size_t>(std::min<uint64_t>(length, tileBytes - within));
+				const uint8_t *source = tiles[index].empty() ? shared->samples().data() + offset : tiles[index].data() + within;
+				memcpy(destination, source, part);
+				destination += part;
+				offset += part;
+				length -= part;
+			}
+			return;
+		}
+		for (size_t i = 0; i < length; ++i, ++offset)
+			destination[i] = this->sample(offset / channels, static_cast<size_t>(offset % channels));
+	}
+
+	size_t CopyOnWriteStore::copiedTiles() const noexcept {
+		return copied;
+	}
+
+	uint64_t CopyOnWriteStore::tilePixels(size_t tile) const noexcept {
+		const uint64_t first = tile * COPY_ON_WRITE_TILE_PIXELS;
+		return std::min(COPY_ON_WRITE_TILE_PIXELS, shared->size() - first);
+	}
+
+	uint8_t CopyOnWriteStore::sample(uint64_t pixel, size_t index) const noexcept {
+		// Only planar stores get here, byte #k of a pixel is in plane #k
+		const size_t tile = static_cast<size_t>(pixel / COPY_ON_WRITE_TILE_PIXELS);
+		if (tiles[tile].empty())
+			return shared->samples()[static_cast<size_t>(index * shared->size() + pixel)];
+		return tiles[tile][static_cast<size_t>(index * this->tilePixels(tile) + pixel % COPY_ON_WRITE_TILE_PIXELS)];
+	}
+
+} // namespace PNGStego
\ No newline at end of file
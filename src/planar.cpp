@@ -0,0 +1,170 @@
+//
+// Copyright (C) 2015-2016 Zireael (zireael dot nk at gmail dot com)
+//  Distributed under the Boost Software License, Version 1.0.
+//       (See accompanying file LICENSE.md or copy at
+//           http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "planar.h"
+#include <cstring>
+
+/*
+  SSSE3's pshufb lets any byte of a 16-byte block be moved anywhere,
+  which is all it takes to (de)interleave 16 pixels at a time.
+  The code is compiled for SSSE3 regardless of compiler flags
+  and only gets used if the CPU supports it.
+*/
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#include <tmmintrin.h>
+#define PNGSTEGO_HAS_SSSE3
+#define PNGSTEGO_TARGET_SSSE3 __attribute__((target("ssse3")))
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#include <tmmintrin.h>
+#define PNGSTEGO_HAS_SSSE3
+#define PNGSTEGO_TARGET_SSSE3
+#endif
+
+namespace PNGStego {
+namespace Planar {
+
+	const size_t BLOCK_PIXELS = 16;
+
+#ifdef PNGSTEGO_HAS_SSSE3
+	bool hasSSSE3() noexcept {
+#if defined(_MSC_VER)
+		int info[4];
+		__cpuid(info, 1);
+		return (info[2] & (1 << 9)) != 0;
+#else
+		return __builtin_cpu_supports("ssse3") != 0;
+#endif
+	}
+
+	/**
+	 ** pshufb masks for 2, 3 and 4 channels.
+	 ** A block of 16 pixels is N vectors either way: interleaved[i] holds bytes
+	 ** [16 * i; 16 * i + 16) of the pixels, planar[k] holds the 16 samples of channel #k.
+	 ** Every output vector is an OR of all N input vectors shuffled with their masks,
+	 ** bytes that come from other vectors are zeroed by 0x80.
+	 **/
+	struct ShuffleMasks {
+		uint8_t split[5][4][4][16];  // [channels][plane][interleaved vector][byte]
+		uint8_t merge[5][4][4][16];  // [channels][interleaved vector][plane][byte]
+
+		ShuffleMasks() noexcept {
+			memset(split, 0x80, sizeof(split));
+			memset(merge, 0x80, sizeof(merge));
+			for (size_t n = 2; n <= 4; ++n) {
+				for (size_t q = 0; q < n * BLOCK_PIXELS; ++q) {
+					size_t vector = q / 16, byte = q % 16;
+					size_t pixel = q / n, channel = q % n;
+					split[n][channel][vector][pixel] = static_cast<uint8_t>(byte);
+					merge[n][vector][channel][byte] = static_cast<uint8_t>(pixel);
+				}
+			}
+		}
+	};
+
+	const ShuffleMasks& masks() noexcept {
+		static const ShuffleMasks instance;
+		return instance;
+	}
+
+	/** Deinterleaves whole blocks of pixels, returns how many pixels it went through */
+	template <size_t N>
+	PNGSTEGO_TARGET_SSSE3
+	size_t deinterleaveSSSE3(const uint8_t *source, size_t count, uint8_t *const *planes) noexcept {
+		const ShuffleMasks &m = masks();
+		__m128i split[N][N];
+		for (size_t k = 0; k < N; ++k)
+			for (size_t i = 0; i < N; ++i)
+				split[k][i] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(m.split[N][k][i]));
+
+		size_t pos = 0;
+		for (; pos + BLOCK_PIXELS <= count; pos += BLOCK_PIXELS, source += N * BLOCK_PIXELS) {
+			__m128i in[N];
+			for (size_t i = 0; i < N; ++i)
+				in[i] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + 16 * i));
+			for (size_t k = 0; k < N; ++k) {
+				__m128i out = _mm_shuffle_epi8(in[0], split[k][0]);
+				for (size_t i = 1; i < N; ++i)
+					out = _mm_or_si128(out, _mm_shuffle_epi8(in[i], split[k][i]));
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(planes[k] + pos), out);
+			}
+		}
+		return pos;
+	}
+
+	/** Interleaves whole blocks of pixels, returns how many pixels it went through */
+	template <size_t N>
+	PNGSTEGO_TARGET_SSSE3
+	size_t interleaveSSSE3(const uint8_t *const *planes, size_t count, uint8_t *destination) noexcept {
+		const ShuffleMasks &m = masks();
+		__m128i merge[N][N];
+		for (size_t i = 0; i < N; ++i)
+			for (size_t k = 0; k < N; ++k)
+				merge[i][k] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(m.merge[N][i][k]));
+
+		size_t pos = 0;
+		for (; pos + BLOCK_PIXELS <= count; pos += BLOCK_PIXELS, destination += N * BLOCK_PIXELS) {
+			__m128i in[N];
+			for (size_t k = 0; k < N; ++k)
+				in[k] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(planes[k] + pos));
+			for (size_t i = 0; i < N; ++i) {
+				__m128i out = _mm_shuffle_epi8(in[0], merge[i][0]);
+				for (size_t k = 1; k < N; ++k)
+					out = _mm_or_si128(out, _mm_shuffle_epi8(in[k], merge[i][k]));
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(destination + 16 * i), out);
+			}
+		}
+		return pos;
+	}
+#endif
+
+	void deinterleave(const uint8_t *source, size_t count, size_t channels, uint8_t *const *planes) noexcept {
+		if (channels == 1) {
+			memcpy(planes[0], source, count);
+			return;
+		}
+
+		size_t pos = 0;
+#ifdef PNGSTEGO_HAS_SSSE3
+		static const bool useSSSE3 = hasSSSE3();
+		if (useSSSE3) {
+			switch (channels) {
+			case 2: pos = deinterleaveSSSE3<2>(source, count, planes); break;
+			case 3: pos = deinterleaveSSSE3<3>(source, count, planes); break;
+			case 4: pos = deinterleaveSSSE3<4>(source, count, planes); break;
+			}
+		}
+#endif
+		for (source += pos * channels; pos < count; ++pos)
+			for (size_t k = 0; k < channels; ++k)
+				planes[k][pos] = *source++;
+	}
+
+	void interleave(const uint8_t *const *planes, size_t count, size_t channels, uint8_t *destination) noexcept {
+		if (channels == 1) {
+			memcpy(destination, planes[0], count);
+			return;
+		}
+
+		size_t pos = 0;
+#ifdef PNGSTEGO_HAS_SSSE3
+		static const bool useSSSE3 = hasSSSE3();
+		if (useSSSE3) {
+			switch (channels) {
+			case 2: pos = interleaveSSSE3<2>(planes, count, destination); break;
+			case 3: pos = interleaveSSSE3<3>(planes, count, destination); break;
+			case 4: pos = interleaveSSSE3<4>(planes, count, destination); break;
+			}
+		}
+#endif
+		for (destination += pos * channels; pos < count; ++pos)
+			for (size_t k = 0; k < channels; ++k)
+				*destination++ = planes[k][pos];
+	}
+
+} // namespace Planar
+} // namespace PNGStego
\ No newline at end of file
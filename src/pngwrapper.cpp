@@ -5,46 +5,25 @@
 //           http://www.boost.org/LICENSE_1_0.txt)
 //
 
-#include "compression.h"
-#include "encryption.h"
+#include "colorreducer.h"
+#include "fastpng.h"
 #include "helpers.h"
+#include "ioring.h"
+#include "metrics.h"
 #include "pngwrapper.h"
+#include "stegoengine.h"
+#include "planar.h"
+#include "tiledstore.h"
 #include "pngstegoversion.h"
 #include <png.h>
 #include <climits>
+#include <cstdint>
+#include <algorithm>
 #include <fstream>
 #include <stdexcept>
+#include <new>
 #include <cstring>
 
-#ifdef _MSC_VER
-#pragma warning(push)
-#pragma warning(disable:4297)
-#endif
-/*
-  Access to:
-  /dev/random & /dev/urandom on Linux;
-  /dev/srandom & /dev/urandom on BSD;
-  CryptGenRandom() on Windows;
-  On OS X /dev/random and /dev/urandom is the same thing.
-
-  Used for generating IV and Salt.
-*/
-#include <cryptopp/osrng.h>
-#ifdef _MSC_VER
-#pragma warning(pop)
-#endif
-
-/*
-  While Mersenne Twister is a specific algorithm and C++11 standart
-  implementation, in my experience, returns the same results on Linux, Windows
-  and OS X, std::uniform_int_distribution tends to vary, thus I chose to use
-  boost::random since I need to get the same values if the same seed is used.
-  
-  Used for generating offsets.
-*/
-#include <boost/random/mersenne_twister.hpp>
-#include <boost/random/uniform_int_distribution.hpp>
-
 /*
   Boost::Nowide provides UTF-8 support on Windows
   Windows, by default, uses UTF-16 for Unicode.
@@ -65,83 +44,122 @@ namespace boost {
 }
 #endif
 
-const int PNG_MIN_OFFSET = 1;
-const int PNG_MAX_OFFSET = 3;
-const int EXTENSION_BYTES = 1; // 8 bits
-const int SIZE_BYTES = 4;      // 32 bits
-const int IV_BYTES = 12;       // 96 bits
-const int SALT_BYTES = 16;     // 128 bits
+const int PNG_SIGNATURE_BYTES = 8;
+const int PNG_OVERHEAD_BYTES = 1024; // signature, IHDR, IEND and some ancillary chunks
 
 namespace PNGStego {
 
-	/** For reading using ifstream rather than FILE* (helper function) */
+	/** For reading using istream rather than FILE* (helper function) */
 	void ReadFromStream(png_structp pngPointer, png_bytep data, png_size_t length) 
 	{
-		std::ifstream *Stream = reinterpret_cast<std::ifstream*>(png_get_io_ptr(pngPointer));
+		std::istream *Stream = reinterpret_cast<std::istream*>(png_get_io_ptr(pngPointer));
 		Stream->read(reinterpret_cast<char *>(data), length);
 	}
 
-	/** For writing using ofstream rather than FILE* (helper function) */
+	/** For writing using ostream rather than FILE* (helper function) */
 	void WriteToStream(png_structp pngPointer, png_bytep data, png_size_t length)  
 	{
-		std::ofstream *Stream = reinterpret_cast<std::ofstream*>(png_get_io_ptr(pngPointer));
+		std::ostream *Stream = reinterpret_cast<std::ostream*>(png_get_io_ptr(pngPointer));
 		Stream->write(reinterpret_cast<char *>(data), length);
 	}
 
-	PNGFile::PNGFile() : pixels(), salt(), iv(), outputFn(),
-		CSPRNG(std::bind(CryptoPP::OS_GenerateRandomBlock, true, std::placeholders::_1, std::placeholders::_2))
+	/** Position within a memory buffer that is being read (helper struct) */
+	struct MemoryReader {
+		const uint8_t *data;
+		size_t size;
+		size_t pos;
+	};
+
+	/** For reading straight from a memory buffer (helper function) */
+	void ReadFromMemory(png_structp pngPointer, png_bytep data, png_size_t length)
+	{
+		MemoryReader *Reader = reinterpret_cast<MemoryReader*>(png_get_io_ptr(pngPointer));
+		if (length > Reader->size - Reader->pos)
+			png_error(pngPointer, "Unexpected end of data");
+		memcpy(data, Reader->data + Reader->pos, length);
+		Reader->pos += length;
+	}
+
+	/** For writing straight into a growable memory buffer (helper function) */
+	void WriteToMemory(png_structp pngPointer, png_bytep data, png_size_t length)
+	{
+		std::vector<uint8_t> *Buffer = reinterpret_cast<std::vector<uint8_t>*>(png_get_io_ptr(pngPointer));
+		// Exceptions mustn't go through libpng's C frames, and png_error() jumps, so not from within the handler
+		bool grown = true;
+		try {
+			Buffer->insert(Buffer->end(), data, data + length);
+		}
+		catch (const std::bad_alloc&) {
+			grown = false;
+		}
+		if (!grown)
+			png_error(pngPointer, "Cannot allocate memory");
+	}
+
+	PNGFile::PNGFile() : encodedSize(0), layout(SampleLayout::Interleaved), memoryBudget(0), scratchDirectory(),
+		fastCodec(true), store(), undoLog(), engine()
 	{ }
 
-	PNGFile::PNGFile(const PNGFile &other) : pixels(), salt() {
-		this->pixels                 = other.pixels;
-		this->salt                   = other.salt;
-		this->iv                     = other.iv;
+	PNGFile::PNGFile(const PNGFile &other) : store(), undoLog(), engine(other.engine) {
+		this->encodedSize            = other.encodedSize;
+		this->layout                 = other.layout;
+		this->memoryBudget           = other.memoryBudget;
+		this->scratchDirectory       = other.scratchDirectory;
+		this->fastCodec              = other.fastCodec;
+		if (other.store)
+			this->store              = other.store->clone();
+		if (other.undoLog)
+			this->undoLog.reset(new UndoLog(*other.undoLog));
 
 		this->params.width           = other.params.width;
 		this->params.height          = other.params.height;
-		this->params.BitsPerPixel    = other.params.BitsPerPixel;
+		this->params.format          = other.params.format;
 		this->params.BitDepth        = other.params.BitDepth;
 		this->params.ColorType       = other.params.ColorType;
 		this->params.InterlaceType   = other.params.InterlaceType;
 		this->params.CompressionType = other.params.CompressionType;
 		this->params.FilterType      = other.params.FilterType;
 		this->params.Channels        = other.params.Channels;
-		this->outputFn               = other.outputFn;
-		this->CSPRNG                 = other.CSPRNG;
 	}
 
 	PNGFile::PNGFile(PNGFile &&other) : PNGFile() {
 			other.swap(*this);
 	}
 
-	PNGFile::PNGFile(const std::string &filename) : outputFn(),
-		CSPRNG(std::bind(CryptoPP::OS_GenerateRandomBlock, true, std::placeholders::_1, std::placeholders::_2))
+	PNGFile::PNGFile(const std::string &filename) : encodedSize(0), layout(SampleLayout::Interleaved), memoryBudget(0), fastCodec(true), engine()
 	{
 		this->load(filename);
 	}
 
-	PNGFile::PNGFile(std::istream &stream) : outputFn(),
-		CSPRNG(std::bind(CryptoPP::OS_GenerateRandomBlock, true, std::placeholders::_1, std::placeholders::_2))
+	PNGFile::PNGFile(std::istream &stream) : encodedSize(0), layout(SampleLayout::Interleaved), memoryBudget(0), fastCodec(true), engine()
 	{
 		this->load(stream);
 	}
 
+	PNGFile::PNGFile(const uint8_t *data, size_t size) : encodedSize(0), layout(SampleLayout::Interleaved), memoryBudget(0), fastCodec(true), engine()
+	{
+		this->load(data, size);
+	}
+
 	void PNGFile::swap(PNGFile &other) {
-		std::swap(this->salt,                   other.salt);
-		std::swap(this->pixels,                 other.pixels);
-		std::swap(this->iv,                     other.iv);
+		std::swap(this->encodedSize,            other.encodedSize);
+		std::swap(this->layout,                 other.layout);
+		std::swap(this->memoryBudget,           other.memoryBudget);
+		std::swap(this->scratchDirectory,       other.scratchDirectory);
+		std::swap(this->fastCodec,              other.fastCodec);
+		std::swap(this->store,                  other.store);
+		std::swap(this->undoLog,                other.undoLog);
 
 		std::swap(this->params.width,           other.params.width);
 		std::swap(this->params.height,          other.params.height);
-		std::swap(this->params.BitsPerPixel,    other.params.BitsPerPixel);
+		std::swap(this->params.format,          other.params.format);
 		std::swap(this->params.BitDepth,        other.params.BitDepth);
 		std::swap(this->params.ColorType,       other.params.ColorType);
 		std::swap(this->params.InterlaceType,   other.params.InterlaceType);
 		std::swap(this->params.CompressionType, other.params.CompressionType);
 		std::swap(this->params.FilterType,      other.params.FilterType);
 		std::swap(this->params.Channels,        other.params.Channels);
-		std::swap(this->outputFn,               other.outputFn);
-		std::swap(this->CSPRNG,                 other.CSPRNG);
+		std::swap(this->engine,                 other.engine);
 	}
 
 	PNGFile& PNGFile::operator=(const PNGFile &other) {
@@ -171,11 +189,83 @@ namespace PNGStego {
 		return this->params.height;
 	}
 
-	const std::vector<PNGFile::Pixel>& PNGFile::getPixels() {
-		return this->pixels;
+	PixelFormat PNGFile::getFormat() const {
+		return this->params.format;
+	}
+
+	int PNGFile::getBitDepth() const {
+		return this->params.BitDepth;
+	}
+
+	SampleLayout PNGFile::getSampleLayout() const {
+		return this->layout;
+	}
+
+	void PNGFile::setSampleLayout(SampleLayout layout) {
+		if (MemoryStore *memory = this->memoryStore())
+			memory->setLayout(layout);
+		this->layout = layout;
+	}
+
+	void PNGFile::setMemoryBudget(uint64_t bytes, const std::string &scratchDirectory) {
+		this->memoryBudget = bytes;
+		this->scratchDirectory = scratchDirectory;
+	}
+
+	void PNGFile::setFastCodec(bool enabled) {
+		this->fastCodec = enabled;
+	}
+
+	bool PNGFile::isTiled() const {
+		return dynamic_cast<TiledStore*>(store.get()) != nullptr;
+	}
+
+	const std::vector<uint8_t>& PNGFile::getPixels() {
+		static const std::vector<uint8_t> empty;
+		if (!store)
+			return empty;
+		MemoryStore *memory = this->memoryStore();
+		if (!memory) {
+			throw std::runtime_error(this->isTiled() ? "The image is kept in a scratch file" : "The image shares its pixels with a snapshot");
+		}
+		return memory->samples();
+	}
+
+	PNGFile::Pixel PNGFile::getPixel(uint64_t index) const {
+		if (!store || index >= store->size()) {
+			throw std::out_of_range("Pixel index is out of range");
+		}
+		const size_t SampleBytes = store->sampleBytes();
+		auto sample = [&](Channel channel) -> uint8_t {
+			if (SampleBytes == 1)
+				return *store->readChannel(index, channel).data;
+			// Channel runs point at the low byte, the high one is the closest 8-bit value
+			uint8_t high;
+			store->read(index * bytesPerPixel(params.format, SampleBytes) + channelOffset(params.format, channel) * SampleBytes, &high, 1);
+			return high;
+		};
+		Pixel result;
+		result.red   = sample(Channel::Red);
+		result.green = sample(Channel::Green);
+		result.blue  = sample(Channel::Blue);
+		result.alpha = (params.format == PixelFormat::GrayAlpha || params.format == PixelFormat::RGBA) ?
+		               sample(Channel::Alpha) : 0xFF;
+		return result;
 	}
 
 	void PNGFile::load(const std::string &filename) {
+#ifdef PNGSTEGO_WITH_IO_URING
+		// The whole file goes through the ring at once, unless memory is tight
+		if (!memoryBudget && IORing::local()) {
+			this->load(readFile(filename));
+			return;
+		}
+#endif
+		// The fast path decodes from memory, reading the whole file first costs less than libpng's reads do
+		if (!memoryBudget && fastCodec) {
+			this->load(readFile(filename));
+			return;
+		}
 		boost::nowide::ifstream File(filename.c_str(), std::ifstream::in | std::ifstream::binary);
 		if (!File) {
 			throw std::invalid_argument("Cannot open " + filename);
@@ -184,6 +274,14 @@ namespace PNGStego {
 	}
 
 	void PNGFile::save(const std::string &filename) {
+#ifdef PNGSTEGO_WITH_IO_URING
+		if (!this->isTiled() && IORing::local()) {
+			std::vector<uint8_t> buffer;
+			this->save(buffer);
+			writeFile(filename, buffer.data(), buffer.size());
+			return;
+		}
+#endif
 		boost::nowide::ofstream File(filename.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
 		if (!File) {
 			throw std::invalid_argument("Cannot open " + filename);
@@ -192,16 +290,51 @@ namespace PNGStego {
 	}
 
 	void PNGFile::load(std::istream &stream) {
-		const int signatureLength = 8;
-		uint8_t header[signatureLength];
+		uint8_t header[PNG_SIGNATURE_BYTES];
 
 		// Check the file's signature
-		stream.read(reinterpret_cast<char*>(&header), signatureLength);
-		if (png_sig_cmp(header, 0, signatureLength))
+		std::istream::pos_type start = stream.tellg();
+		stream.read(reinterpret_cast<char*>(&header), PNG_SIGNATURE_BYTES);
+		if (png_sig_cmp(header, 0, PNG_SIGNATURE_BYTES))
 		{
 			throw std::invalid_argument("Invalid file format");
 		}
 
+		StageTimer timer(engine.getEventFn(), Stage::Load);
+		this->readPNG(reinterpret_cast<void*>(&stream), ReadFromStream);
+
+		// Remember how large the file was, if the stream can tell
+		std::istream::pos_type end = stream.tellg();
+		if (start != std::istream::pos_type(-1) && end != std::istream::pos_type(-1))
+			encodedSize = static_cast<size_t>(end - start);
+		else
+			encodedSize = 0;
+		timer.finish(encodedSize, this->pixelBytes());
+	}
+
+	void PNGFile::load(const uint8_t *data, size_t size) {
+		// Check the file's signature
+		if (size < PNG_SIGNATURE_BYTES || png_sig_cmp(data, 0, PNG_SIGNATURE_BYTES))
+		{
+			throw std::invalid_argument("Invalid file format");
+		}
+
+		StageTimer timer(engine.getEventFn(), Stage::Load);
+		if (fastCodec && this->readFast(data, size)) {
+			timer.finish(encodedSize, this->pixelBytes());
+			return;
+		}
+		MemoryReader Reader = { data, size, PNG_SIGNATURE_BYTES };
+		this->readPNG(reinterpret_cast<void*>(&Reader), ReadFromMemory);
+		encodedSize = Reader.pos;
+		timer.finish(encodedSize, this->pixelBytes());
+	}
+
+	void PNGFile::load(const std::vector<uint8_t> &buffer) {
+		this->load(buffer.data(), buffer.size());
+	}
+
+	void PNGFile::readPNG(void *ioPointer, IOFunction readFn) {
 		// Initializations needed by libpng
 		png_structp PngPointer = png_create_read_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
 		if (!PngPointer)
@@ -222,8 +355,10 @@ namespace PNGStego {
 			throw std::runtime_error("Cannot set jump pointer");
 		}
 
-		png_set_sig_bytes(PngPointer, sizeof(header));
-		png_set_read_fn(PngPointer, reinterpret_cast<void*>(&stream), ReadFromStream);
+		png_set_sig_bytes(PngPointer, PNG_SIGNATURE_BYTES);
+		// libpng refuses images wider or taller than a million pixels by default
+		png_set_user_limits(PngPointer, PNG_UINT_31_MAX, PNG_UINT_31_MAX);
+		png_set_read_fn(PngPointer, ioPointer, readFn);
 
 		// Get the image's parameters
 		png_read_info(PngPointer, InfoPointer);
@@ -231,64 +366,31 @@ namespace PNGStego {
 		png_get_IHDR(PngPointer, InfoPointer, &params.width, &params.height, &params.BitDepth,
 		                         &params.ColorType, &params.InterlaceType, &params.CompressionType, &params.FilterType);
 		
-		// Convert to 32-bits if needed
-		png_set_strip_16(PngPointer);
-		png_set_packing(PngPointer);
+		/*
+		  Keep the image's own layout and depth, only bring samples of less than 8 bits to 8.
+		  16-bit samples stay big-endian, data only ever goes into their low bytes,
+		  so the high ones, and every sample that isn't changed, get saved exactly as they were.
+		*/
 		switch (params.ColorType)
 		{
 		case PNG_COLOR_TYPE_GRAY:
 		{
-			png_set_gray_to_rgb(PngPointer);
-			png_set_filler(PngPointer, 0xFF, PNG_FILLER_AFTER);
-			png_set_bgr(PngPointer);
-			params.BitsPerPixel = 24;
+			png_set_expand_gray_1_2_4_to_8(PngPointer);
 			break;
 		}
 
 		case PNG_COLOR_TYPE_PALETTE:
 		{
-			// Check whether there's a tRNS chunk
-			png_bytep transparency_vals = nullptr;
-			png_get_tRNS(PngPointer, InfoPointer, &transparency_vals, nullptr, nullptr);
-
-			// Convert to RGB
+			// Convert to RGB, or to RGBA if there's a tRNS chunk
+			png_set_packing(PngPointer);
 			png_set_palette_to_rgb(PngPointer);
-			png_set_bgr(PngPointer);
-
-			// If there was no tRNS chunk,
-			// add an alpha channel
-			if (transparency_vals != nullptr) {
-				params.BitsPerPixel = 32;
-			}
-			else {
-				png_set_filler(PngPointer, 0xFF, PNG_FILLER_AFTER);
-				params.BitsPerPixel = 24;
-			}			
 			break;
 		}
 
 		case PNG_COLOR_TYPE_RGB:
-		{
-			png_set_filler(PngPointer, 0xFF, PNG_FILLER_AFTER);
-			png_set_bgr(PngPointer);
-			params.BitsPerPixel = 24;			
-			break;
-		}
-
 		case PNG_COLOR_TYPE_GRAY_ALPHA:
-		{
-			png_set_gray_to_rgb(PngPointer);
-			png_set_bgr(PngPointer);
-			params.BitsPerPixel = 32;
-			break;
-		}
-
 		case PNG_COLOR_TYPE_RGBA:
-		{
-			png_set_bgr(PngPointer);
-			params.BitsPerPixel = 32;
 			break;
-		}
 
 		default:
 			png_destroy_read_struct(&PngPointer, &InfoPointer, nullptr);
@@ -296,39 +398,224 @@ namespace PNGStego {
 			break;
 		}
 		
+		// Interlaced images take several passes over every row
+		int passes = png_set_interlace_handling(PngPointer);
+
 		// Update the image's parameters
 		png_read_update_info(PngPointer, InfoPointer);
 		params.Channels = png_get_channels(PngPointer, InfoPointer);
 		png_get_IHDR(PngPointer, InfoPointer, &params.width, &params.height, &params.BitDepth,
 		                         &params.ColorType, &params.InterlaceType, &params.CompressionType, &params.FilterType);
+		params.format = static_cast<PixelFormat>(params.Channels);
+		const size_t SampleBytes = params.BitDepth == 16 ? 2 : 1;
+		const size_t PixelBytes = bytesPerPixel(params.format, SampleBytes);
+
+		size_t BytesPerLine = png_get_rowbytes(PngPointer, InfoPointer);
+		uint64_t PixelCount = static_cast<uint64_t>(params.width) * params.height;
+		uint64_t TotalBytes = static_cast<uint64_t>(BytesPerLine) * params.height;
 
+		store.reset();
+		if (undoLog)
+			undoLog->clear();
 		/*
-		  Instead of storing the image in a 2D-array, I store it in a 1D-array.
-		  Since png_read_image() accepts a pointer to a pointer as an argument,
-		  I need to create a temporary std::vector storing pointers
-		  to addresses of 1st pixels for each row.
+		  Everything rows get decoded into is allocated before libpng may jump back on a damaged file,
+		  a jump would skip destructors and leave the scratch file open.
 		*/
-		pixels.resize(params.width * params.height);
-		std::vector<unsigned char*> RowPointers(params.height);
-		size_t BytesPerLine = params.width << 2; // (x << 2) == (x * 4). 4 channels: RGB and Alpha.
-		unsigned char *ptr = reinterpret_cast<unsigned char*>(pixels.data());
-		for (size_t i = 0; i < params.height; ++i, ptr += BytesPerLine)
-			RowPointers[i] = ptr;
-
-		// Read pixels
-		png_read_image(PngPointer, RowPointers.data());
+		const bool OverBudget = memoryBudget && TotalBytes > memoryBudget;
+		std::vector<uint8_t> Row, Interleaved;
+		std::vector<uint8_t*> Planes;
+		std::vector<unsigned char*> RowPointers;
+		try {
+			if (OverBudget) {
+				// The image doesn't fit into the budget, so rows go into a scratch file as they're decoded
+				store.reset(new TiledStore(PixelCount, params.format, memoryBudget, scratchDirectory, SampleBytes));
+				Row.resize(BytesPerLine);
+			}
+			else {
+				if (params.height != 0 && BytesPerLine > SIZE_MAX / params.height)
+					throw std::runtime_error("The image's too large");
+				MemoryStore *Memory = new MemoryStore(PixelCount, params.format, layout, SampleBytes);
+				store.reset(Memory);
+				if (layout == SampleLayout::Planar && params.InterlaceType == PNG_INTERLACE_NONE) {
+					// Each row gets split into planes as soon as it's decoded
+					Row.resize(BytesPerLine);
+					Planes = Memory->planes();
+				}
+				else {
+					/*
+					  Instead of storing the image in a 2D-array, I store it in a 1D-array.
+					  Since png_read_image() accepts a pointer to a pointer as an argument,
+					  I need to create a temporary std::vector storing pointers
+					  to addresses of 1st pixels for each row.
+					  Interlaced images need every row at hand,
+					  so those are split into planes only once they're read.
+					*/
+					std::vector<uint8_t> &pixels = Memory->samples();
+					if (layout == SampleLayout::Planar)
+						Interleaved.resize(pixels.size());
+					RowPointers.resize(params.height);
+					unsigned char *ptr = Interleaved.empty() ? pixels.data() : Interleaved.data();
+					for (size_t i = 0; i < params.height; ++i, ptr += BytesPerLine)
+						RowPointers[i] = ptr;
+				}
+			}
+		}
+		catch (...) {
+			png_destroy_read_struct(&PngPointer, &InfoPointer, nullptr);
+			store.reset();
+			throw;
+		}
+
+		if (setjmp(png_jmpbuf(PngPointer)))
+		{
+			png_destroy_read_struct(&PngPointer, &InfoPointer, nullptr);
+			store.reset();
+			throw std::runtime_error("Cannot set jump pointer");
+		}
+
+		// Plain locals set before setjmp() may be clobbered by a jump, so the stores are reached through 'store'
+		if (OverBudget) {
+			TiledStore &Tiled = static_cast<TiledStore&>(*store);
+			// Passes of an interlaced image fill in rows that are already there, so each row is brought back before libpng gets to it
+			for (int pass = 0; pass < passes; ++pass) {
+				for (uint64_t i = 0; i < params.height; ++i) {
+					if (pass > 0)
+						Tiled.read(i * BytesPerLine, Row.data(), BytesPerLine);
+					png_read_row(PngPointer, Row.data(), nullptr);
+					Tiled.write(i * BytesPerLine, Row.data(), BytesPerLine);
+				}
+			}
+			png_read_end(PngPointer, nullptr);
+		}
+		else if (!Planes.empty()) {
+			for (size_t i = 0; i < params.height; ++i) {
+				png_read_row(PngPointer, Row.data(), nullptr);
+				Planar::deinterleave(Row.data(), params.width, PixelBytes, Planes.data());
+				for (uint8_t *&plane : Planes)
+					plane += params.width;
+			}
+			png_read_end(PngPointer, nullptr);
+		}
+		else {
+			// Read pixels
+			png_read_image(PngPointer, RowPointers.data());
+			if (!Interleaved.empty())
+				Planar::deinterleave(Interleaved.data(), Interleaved.size() / PixelBytes, PixelBytes,
+				                        static_cast<MemoryStore&>(*store).planes().data());
+		}
 		png_destroy_read_struct(&PngPointer, &InfoPointer, nullptr);
 
 		// Read cryptographic stuff
-		this->ReadIV();
-		this->ReadSalt();		
+		engine.load(*store);		
+	}
+
+	bool PNGFile::readFast(const uint8_t *data, size_t size) {
+		FastPNG::File File;
+		if (!FastPNG::inspect(data, size, File))
+			return false;
+		// Images that don't fit into the budget go into a scratch file, which is libpng's job
+		const uint64_t PixelCount = static_cast<uint64_t>(File.width) * File.height;
+		const size_t Channels = channelCount(File.format);
+		if (memoryBudget && PixelCount * Channels > memoryBudget)
+			return false;
+		if (File.width * static_cast<uint64_t>(Channels) > SIZE_MAX / File.height)
+			throw std::runtime_error("The image's too large");
+
+		store.reset();
+		if (undoLog)
+			undoLog->clear();
+		std::unique_ptr<MemoryStore> Memory(new MemoryStore(PixelCount, File.format, layout));
+		if (!FastPNG::decode(File, *Memory))
+			return false;
+		store = std::move(Memory);
+
+		params.width           = File.width;
+		params.height          = File.height;
+		params.BitDepth        = 8;
+		// Palettes are expanded, to RGBA if there's a tRNS chunk, as libpng's made to do
+		params.ColorType       = File.format == PixelFormat::RGBA ? PNG_COLOR_TYPE_RGBA :
+		                         File.format == PixelFormat::RGB ? PNG_COLOR_TYPE_RGB : File.colorType;
+		params.InterlaceType   = PNG_INTERLACE_NONE;
+		params.CompressionType = PNG_COMPRESSION_TYPE_BASE;
+		params.FilterType      = PNG_FILTER_TYPE_BASE;
+		params.Channels        = static_cast<int32_t>(Channels);
+		params.format          = File.format;
+		encodedSize            = File.size;
+
+		// Read cryptographic stuff
+		engine.load(*store);
+		return true;
 	}
 
 	void PNGFile::save(std::ostream &stream) {
-		if (pixels.empty()) {
+		StageTimer timer(engine.getEventFn(), Stage::Save);
+		std::ostream::pos_type start = stream.tellp();
+		this->writePNG(reinterpret_cast<void*>(&stream), WriteToStream);
+		std::ostream::pos_type end = stream.tellp();
+		timer.finish(this->pixelBytes(), start != std::ostream::pos_type(-1) && end != std::ostream::pos_type(-1) ?
+		                                 static_cast<uint64_t>(end - start) : 0);
+	}
+
+	void PNGFile::save(std::vector<uint8_t> &buffer) {
+		/*
+		  Reserve the whole output up front so libpng's chunks get appended
+		  without reallocations. The file the image came from is the best
+		  guess, flipped LSBs make the data a bit less compressible though.
+		*/
+		MemoryStore *memory = this->memoryStore();
+		size_t estimate = encodedSize ? encodedSize + encodedSize / 8
+		                              : memory ? memory->samples().size() / 2 : 0;
+		buffer.reserve(buffer.size() + estimate + PNG_OVERHEAD_BYTES);
+		StageTimer timer(engine.getEventFn(), Stage::Save);
+		size_t start = buffer.size();
+		this->writePNG(reinterpret_cast<void*>(&buffer), WriteToMemory);
+		timer.finish(this->pixelBytes(), buffer.size() - start);
+	}
+
+	std::vector<uint8_t> PNGFile::save() {
+		std::vector<uint8_t> buffer;
+		this->save(buffer);
+		return buffer;
+	}
+
+	void PNGFile::writePNG(void *ioPointer, IOFunction writeFn) {
+		if (!store) {
 			throw std::runtime_error("Trying to save an empty PNG");
 		}
-		
+
+		MemoryStore *Memory = this->memoryStore();
+		const size_t PixelBytes = bytesPerPixel(params.format, store->sampleBytes());
+		size_t BytesPerLine = params.width * PixelBytes;
+		std::vector<uint8_t> Row;
+		std::vector<uint8_t*> Planes;
+		if (!Memory || Memory->layout() == SampleLayout::Planar)
+			Row.resize(BytesPerLine);
+		if (Memory && Memory->layout() == SampleLayout::Planar)
+			Planes = Memory->planes();
+
+		// Returns interleaved samples of the given row, straight from memory if that's how they're kept
+		auto fetchRow = [&](uint64_t i) -> const uint8_t* {
+			if (Row.empty())
+				return Memory->samples().data() + i * BytesPerLine;
+			if (!Planes.empty()) {
+				const uint8_t *RowPlanes[8];
+				for (size_t k = 0; k < Planes.size(); ++k)
+					RowPlanes[k] = Planes[k] + i * params.width;
+				Planar::interleave(RowPlanes, params.width, PixelBytes, Row.data());
+				return Row.data();
+			}
+			// Out of the scratch file or the snapshot
+			store->read(i * BytesPerLine, Row.data(), BytesPerLine);
+			return Row.data();
+		};
+
+		// Find the narrowest color type that holds the pixels as they are, most images are ruled out within a few rows
+		ColorReducer Reducer(params.format, store->sampleBytes());
+		for (uint64_t i = 0; i < params.height && Reducer.scan(fetchRow(i), params.width); ++i) { }
+		const ColorReduction Reduction = Reducer.finish();
+
+		std::vector<uint8_t> Converted(Reduction == ColorReduction::None ? 0 : Reducer.rowBytes(params.width));
+
 		// Initializations needed by libpng
 		png_structp PngPointer = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
 		if (!PngPointer)
@@ -350,337 +637,243 @@ namespace PNGStego {
 		}
 
 		// Set PNG parameters
-		png_set_IHDR(PngPointer, InfoPointer, params.width, params.height, params.BitDepth, params.BitsPerPixel == 24 ?
-		       PNG_COLOR_TYPE_RGB : PNG_COLOR_TYPE_RGBA, params.InterlaceType, params.CompressionType, params.FilterType);
-
-		/*
-		  Instead of storing the image in a 2D-array, I store it in a 1D-array.
-		  Since png_set_rows() accepts a pointer to a pointer as an argument,
-		  I need to create a temporary std::vector storing pointers
-		  to addresses of 1st pixels for each row.
-		*/
-		std::vector<unsigned char*> RowPointers(params.height);
-		size_t BytesPerLine = params.width << 2; // (x << 2) == (x * 4). 4 channels: RGB and Alpha.
-		unsigned char *ptr = reinterpret_cast<unsigned char*>(pixels.data());
-		for (size_t i = 0; i < params.height; ++i, ptr += BytesPerLine)
-			RowPointers[i] = ptr;
-
-		// Write data to file
-		png_set_bgr(PngPointer);
-		png_set_write_fn(PngPointer, reinterpret_cast<void*>(&stream), WriteToStream, nullptr);
-		// png_set_rows() takes a pointer to a non-const data as its
-		// 3rd argument, making it not possible to declare save() as const
-		// without using const_cast on pixels.data(), I'd rather not do that.
-		png_set_rows(PngPointer, InfoPointer, RowPointers.data());
-		png_write_png(PngPointer, InfoPointer, params.BitsPerPixel == 24 ?
-		         PNG_TRANSFORM_STRIP_FILLER_AFTER : PNG_TRANSFORM_IDENTITY, NULL);
+		png_set_IHDR(PngPointer, InfoPointer, params.width, params.height, Reducer.bitDepth(),
+		             Reducer.colorType(), params.InterlaceType, params.CompressionType, params.FilterType);
+		if (Reduction == ColorReduction::Palette) {
+			const std::vector<uint8_t> &Colors = Reducer.palette();
+			png_color Palette[PALETTE_SIZE];
+			for (size_t k = 0; k < Colors.size() / 3; ++k) {
+				Palette[k].red   = Colors[3 * k];
+				Palette[k].green = Colors[3 * k + 1];
+				Palette[k].blue  = Colors[3 * k + 2];
+			}
+			png_set_PLTE(PngPointer, InfoPointer, Palette, static_cast<int>(Colors.size() / 3));
+			const std::vector<uint8_t> &Alphas = Reducer.transparency();
+			if (!Alphas.empty())
+				png_set_tRNS(PngPointer, InfoPointer, Alphas.data(), static_cast<int>(Alphas.size()), nullptr);
+		}
+		png_set_write_fn(PngPointer, ioPointer, writeFn, nullptr);
+
+		if (fastCodec && params.InterlaceType == PNG_INTERLACE_NONE && Reducer.bitDepth() <= 8) {
+			// libpng's only there to hand bytes to the write function
+			FastPNG::Image Image = { params.width, params.height, Reducer.bitDepth(), Reducer.colorType(),
+			                         &Reducer.palette(), &Reducer.transparency() };
+			try {
+				FastPNG::encode(Image, [&](uint32_t i) -> const uint8_t* {
+					const uint8_t *Samples = fetchRow(i);
+					if (Converted.empty())
+						return Samples;
+					Reducer.convert(Samples, params.width, Converted.data());
+					return Converted.data();
+				}, [&](const uint8_t *bytes, size_t length) {
+					// There are no C frames to get through here, so a buffer that can't grow throws rather than jumps
+					if (writeFn == WriteToMemory) {
+						std::vector<uint8_t> *Buffer = reinterpret_cast<std::vector<uint8_t>*>(ioPointer);
+						Buffer->insert(Buffer->end(), bytes, bytes + length);
+					}
+					else {
+						writeFn(PngPointer, const_cast<uint8_t*>(bytes), length);
+					}
+				});
+			}
+			catch (...) {
+				png_destroy_write_struct(&PngPointer, &InfoPointer);
+				throw;
+			}
+			png_destroy_write_struct(&PngPointer, &InfoPointer);
+			return;
+		}
+
+		if (Reduction == ColorReduction::None && Row.empty()) {
+			/*
+			  Instead of storing the image in a 2D-array, I store it in a 1D-array.
+			  Since png_set_rows() accepts a pointer to a pointer as an argument,
+			  I need to create a temporary std::vector storing pointers
+			  to addresses of 1st pixels for each row.
+			*/
+			std::vector<unsigned char*> RowPointers(params.height);
+			unsigned char *ptr = Memory->samples().data();
+			for (size_t i = 0; i < params.height; ++i, ptr += BytesPerLine)
+				RowPointers[i] = ptr;
+
+			// Write data to file
+			// png_set_rows() takes a pointer to a non-const data as its
+			// 3rd argument, making it not possible to declare save() as const
+			// without using const_cast on pixels.data(), I'd rather not do that.
+			png_set_rows(PngPointer, InfoPointer, RowPointers.data());
+			png_write_png(PngPointer, InfoPointer, PNG_TRANSFORM_IDENTITY, NULL);
+			png_destroy_write_struct(&PngPointer, &InfoPointer);
+			return;
+		}
+
+		// Everything else goes out a row at a time, once per interlace pass
+		png_write_info(PngPointer, InfoPointer);
+		if (Reducer.bitDepth() < 8)
+			png_set_packing(PngPointer);
+		int passes = png_set_interlace_handling(PngPointer);
+		for (int pass = 0; pass < passes; ++pass) {
+			for (uint64_t i = 0; i < params.height; ++i) {
+				const uint8_t *Samples = fetchRow(i);
+				if (!Converted.empty()) {
+					Reducer.convert(Samples, params.width, Converted.data());
+					Samples = Converted.data();
+				}
+				png_write_row(PngPointer, Samples);
+			}
+		}
+		png_write_end(PngPointer, nullptr);
 		png_destroy_write_struct(&PngPointer, &InfoPointer);
 	}
 
-	uint32_t PNGFile::capacity(uint32_t seed) const noexcept {
-		/*
-		  I kinda doubt there'd be a picture able to hold more
-		  than 0.5 GiB in near future, so uint32_t should be enough.
-		  Even if we use 4K (4096 * 3112), it's only
-		  12 746 752 pixels, and if we store information in
-		  every single one, that'd be no more than ~1.52 MiB.
-		*/
-
-		if (pixels.empty())
+	uint64_t PNGFile::capacity(uint32_t seed) const noexcept {
+		if (!store)
 			return 0U;
-
-		boost::random::mt19937 gen(seed);
-		boost::random::uniform_int_distribution<uint16_t> offset(PNG_MIN_OFFSET, PNG_MAX_OFFSET);
-		PNGStego::zeroMemory(&seed, sizeof(seed));
-
-		uint32_t capacity = 0;
-		uint32_t pos = 0;
-		uint32_t size = static_cast<uint32_t>(pixels.size());
-		while(pos < size) {
-			++capacity;
-			pos += offset(gen);
-		}
-
-		return (capacity / 8) > (SIZE_BYTES + EXTENSION_BYTES) ?
-		       (capacity / 8) - (SIZE_BYTES + EXTENSION_BYTES) : 0U;
+		return engine.capacity(*store, seed);
 	}
 
 	void PNGFile::encode(const std::string &filename, const std::string &key) {
-		boost::nowide::ifstream File(filename.c_str(), std::ios::in | std::ios::binary);
-		if (!File) {
-			throw std::invalid_argument("Cannot open " + filename);
+		if (!store) {
+			throw std::runtime_error("Trying to encode data into an empty PNG");
 		}
-		std::string extension = getExtension(filename);
-		uint32_t dataSize = static_cast<uint32_t>(fileSize(filename));
-		std::vector<uint8_t> binaryData(dataSize);
-		File.read(reinterpret_cast<char *>(binaryData.data()), dataSize);
-
-		this->encode(binaryData, extension, key);
+		measured(Operation::Encode, [&]() {
+			engine.embed(*store, filename, key, undoLog.get());
+		});
 	}
 
-	void PNGFile::encode(const std::vector<uint8_t> &data, const std::string &extension, const std::string &key) {
-		if (pixels.empty()) {
+	void PNGFile::encode(const std::vector<uint8_t> &data, const std::string &extension, const std::string &key,
+	                     const CancellationToken &token) {
+		if (!store) {
 			throw std::runtime_error("Trying to encode data into an empty PNG");
 		}
-		if (key.empty()) {
-			throw std::invalid_argument("An empty key was given");
-		}
-		if (!CSPRNG) {
-			throw std::runtime_error("CSPRNG is not set.");
-		}
-
-		uint8_t extensionSize = static_cast<uint8_t>(extension.length());
-		std::vector<uint8_t> binaryData(stringToVector(extension));
-		binaryData.resize(extensionSize + data.size());
-		std::copy(data.begin(), data.end(), binaryData.begin() + extensionSize);
-
-		iv.resize(IV_BYTES);
-		this->CSPRNG(iv.data(), iv.size());
+		measured(Operation::Encode, [&]() {
+			engine.embed(*store, data, extension, key, token, undoLog.get());
+		});
+	}
 
-		std::array<uint8_t, 4> t = PNGStego::Encryption::hashKey<4, 150000>(key, iv);
-		uint32_t offsetSeed = 0;
-		for (int i = 0; i < 4; ++i) {
-			offsetSeed <<= 8;
-			offsetSeed += t[i];
+	void PNGFile::decode(std::string filename, const std::string &key, std::vector<uint8_t> *backup) const {
+		if (!store) {
+			throw std::runtime_error("Trying to extract data from an empty PNG");
 		}
-		PNGStego::zeroMemory(t.data(), t.size());
-
-		if (outputFn)
-			outputFn("Compressing data...");
-		binaryData = PNGStego::bzip2::compress(binaryData);
-		uint32_t dataSize = static_cast<uint32_t>(binaryData.size());
-		dataSize += (TAG_SIZE * 2);
+		std::unique_lock<std::mutex> lock(tileMutex, std::defer_lock);
+		if (this->isTiled())
+			lock.lock();
+		measured(Operation::Decode, [&]() {
+			engine.extract(*store, filename, key, backup);
+		});
+	}
 
-		if (dataSize <= capacity(offsetSeed)) {
-			boost::random::mt19937 gen(offsetSeed);
-			boost::random::uniform_int_distribution<uint16_t> offset(PNG_MIN_OFFSET, PNG_MAX_OFFSET);
-			PNGStego::zeroMemory(&offsetSeed, sizeof(offsetSeed));
+	void PNGFile::decode(std::vector<uint8_t> &data, std::string &extension, const std::string &key,
+	                     const CancellationToken &token) const {
+		if (!store) {
+			throw std::runtime_error("Trying to extract data from an empty PNG");
+		}
+		std::unique_lock<std::mutex> lock(tileMutex, std::defer_lock);
+		if (this->isTiled())
+			lock.lock();
+		measured(Operation::Decode, [&]() {
+			engine.extract(*store, data, extension, key, token);
+		});
+	}
 
-			if (outputFn)
-				outputFn("Encrypting data...");
+	void PNGFile::setEmbeddingProfile(EmbeddingProfile profile) {
+		engine.setProfile(profile);
+	}
 
-			salt.resize(SALT_BYTES);
-			this->CSPRNG(salt.data(), salt.size());
-			this->WriteSalt();
-			this->WriteIV();
+	void PNGFile::recordChanges(bool enabled) {
+		if (!enabled)
+			undoLog.reset();
+		else if (!undoLog)
+			undoLog.reset(new UndoLog());
+	}
 
-			binaryData = Encryption::encrypt(binaryData, key, iv, salt);
-			dataSize = static_cast<uint32_t>(binaryData.size());
+	void PNGFile::restore() {
+		if (!store || !undoLog)
+			return;
+		undoLog->restore(*store);
+		// The IV & salt are back to what they were as well
+		engine.load(*store);
+	}
 
-			if (outputFn)
-				outputFn("Embedding data...");
-			int PixelPos = 0;
-			for (int i = 0; i < 8 * EXTENSION_BYTES; ++i) {
-				if (extensionSize & (1 << i)) {
-					pixels[PixelPos].blue |= 1;
-				}
-				else {
-					pixels[PixelPos].blue &= ~1;
-				}
-				PixelPos += offset(gen);
-			}
-			for (int i = 0; i < 8 * SIZE_BYTES; ++i) {
-				if (dataSize & (1 << i)) {
-					pixels[PixelPos].blue |= 1;
-				}
-				else {
-					pixels[PixelPos].blue &= ~1;
-				}
-				PixelPos += offset(gen);
-			}
-			for (size_t i = 0; i < dataSize * 8; ++i) {
-				if (binaryData[i / 8] & (1 << (i % 8)))
-					pixels[PixelPos].blue |= 1;
-				else
-					pixels[PixelPos].blue &= ~1;
-				PixelPos += offset(gen);
-			}
+	PNGFile PNGFile::snapshot() {
+		if (!store) {
+			throw std::runtime_error("Trying to take a snapshot of an empty PNG");
 		}
-		else {
-			throw std::runtime_error("The image can't contain data that large");
+		if (this->isTiled()) {
+			throw std::runtime_error("The image is kept in a scratch file");
 		}
+		if (MemoryStore *memory = this->memoryStore()) {
+			std::shared_ptr<PixelStore> owner(std::move(store));
+			store.reset(new CopyOnWriteStore(std::shared_ptr<const MemoryStore>(owner, memory)));
+		}
+		return PNGFile(*this);
 	}
 
-	void PNGFile::decode(std::string filename, const std::string &key, std::vector<uint8_t> *backup) const {
-		std::vector<uint8_t> binaryData;
-		std::string extension;
-		this->decode(binaryData, extension, key);
-		if (!extension.empty())
-			extension = std::string(".") + extension;
-		if (!PNGStego::endsWith(filename, extension) && !extension.empty())
-			filename += extension;
-		boost::nowide::ofstream File(filename.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
-		if (!File) {
-			if (backup) {
-				std::swap(*backup, binaryData);
+	std::future<void> PNGFile::encodeAsync(std::vector<uint8_t> data, std::string extension, std::string key,
+	                                       Executor &executor, const CancellationToken &token) {
+		auto payload = std::make_shared<Payload>();
+		payload->data = std::move(data);
+		payload->extension = std::move(extension);
+		auto password = std::make_shared<std::string>(std::move(key));
+		return runAsync(executor, [this, payload, password, token]() {
+			try {
+				this->encode(payload->data, payload->extension, *password, token);
 			}
-			PNGStego::zeroMemory(binaryData.data(), binaryData.capacity());
-			throw std::invalid_argument("Cannot open " + filename);
-		}
-		if (outputFn)
-			outputFn("Writing data...");
-		File.write(reinterpret_cast<char *>(binaryData.data()), binaryData.size());
-		PNGStego::zeroMemory(binaryData.data(), binaryData.capacity());
+			catch (...) {
+				PNGStego::zeroMemory(&(*password)[0], password->size());
+				PNGStego::zeroMemory(payload->data.data(), payload->data.size());
+				throw;
+			}
+			PNGStego::zeroMemory(&(*password)[0], password->size());
+			PNGStego::zeroMemory(payload->data.data(), payload->data.size());
+		});
 	}
 
-	void PNGFile::decode(std::vector<uint8_t> &data, std::string &extension, const std::string &key) const {
-		if (pixels.empty()) {
-			throw std::runtime_error("Trying to extract data from an empty PNG");
-		}
-		if (key.empty()) {
-			throw std::runtime_error("An empty key was given");
-		}
-
-		uint32_t dataSize = 0;
-		uint8_t extensionSize = 0;
-		
-		std::array<uint8_t, 4> t = PNGStego::Encryption::hashKey<4, 150000>(key, iv);
-		uint32_t offsetSeed = 0;
-		for (int i = 0; i < 4; ++i) {
-			offsetSeed <<= 8;
-			offsetSeed += t[i];
-		}
-		PNGStego::zeroMemory(t.data(), t.size());
-
-		boost::random::mt19937 gen(offsetSeed);
-		boost::random::uniform_int_distribution<uint16_t> offset(PNG_MIN_OFFSET, PNG_MAX_OFFSET);
-		PNGStego::zeroMemory(&offsetSeed, sizeof(offsetSeed));
-	
-		int PixelPos = 0;
-		for (int i = 0; i < 8 * EXTENSION_BYTES; ++i) {
-			extensionSize |= ((pixels[PixelPos].blue & 1) << i);
-			PixelPos += offset(gen);
-		}
-		for (int i = 0; i < 8 * SIZE_BYTES; ++i) {
-			dataSize |= ((pixels[PixelPos].blue & 1) << i);
-			PixelPos += offset(gen);
-		}
-
-		if (dataSize <= capacity(offsetSeed)) {
-
-			std::vector<uint8_t> binaryData(dataSize);
-			if (outputFn)
-				outputFn("Extracting data...");
-			for (size_t i = 0; i < dataSize * 8; ++i) {
-				if (pixels[PixelPos].blue & 1)
-					binaryData[i / 8] |= (1 << (i % 8));
-				else
-					binaryData[i / 8] &= ~(1 << (i % 8));
-				PixelPos += offset(gen);
-			}
-			if (outputFn)
-				outputFn("Decrypting data...");
-			binaryData = Encryption::decrypt(binaryData, key, iv, salt);
-			if (outputFn)
-				outputFn("Decompressing data...");
-			binaryData = PNGStego::bzip2::decompress(binaryData);
-
-			if (extensionSize) {
-				extension = std::string(binaryData.begin(), binaryData.begin() + extensionSize);
+	std::future<Payload> PNGFile::decodeAsync(std::string key, Executor &executor, const CancellationToken &token) const {
+		auto password = std::make_shared<std::string>(std::move(key));
+		return runAsync(executor, [this, password, token]() {
+			Payload payload;
+			try {
+				this->decode(payload.data, payload.extension, *password, token);
 			}
-			else {
-				extension = std::string("");
+			catch (...) {
+				PNGStego::zeroMemory(&(*password)[0], password->size());
+				throw;
 			}
-
-			data = std::vector<uint8_t>(binaryData.begin() + extensionSize, binaryData.end());
-			PNGStego::zeroMemory(binaryData.data(), binaryData.capacity());
-		}
-		else {
-			// Basically, if dataSize happens to be larger than the result of capacity()
-			// then something's not right, so we throw an exception.
-			throw std::runtime_error("Corrupted header");
-		}
+			PNGStego::zeroMemory(&(*password)[0], password->size());
+			return payload;
+		});
 	}
 
 	void PNGFile::setOutputFn(const std::function<void(const std::string&)> &fn) {
-		outputFn = fn;
+		engine.setOutputFn(fn);
 	}
 
 	void PNGFile::setOutputFn(std::function<void(const std::string&)> &&fn) {
-		outputFn = fn;
+		engine.setOutputFn(std::move(fn));
+	}
+
+	void PNGFile::setEventFn(const EventFn &fn) {
+		engine.setEventFn(fn);
 	}
 
 	void PNGFile::setCSPRNG(const std::function<void(uint8_t *, size_t)> &fn) {
-		CSPRNG = fn;
+		engine.setCSPRNG(fn);
 	}
 
 	void PNGFile::setCSPRNG(std::function<void(uint8_t *, size_t)> &&fn) {
-		CSPRNG = fn;
-	}
-
-	/**
-	 ** Reads IV
-	 ** Gets data from 8 * IV_BYTES pixels that are in the middle of the image, using LSB of the red channel.
-	 **/
-	void PNGFile::ReadIV() {
-		iv.resize(IV_BYTES);
-		size_t pos = pixels.size() / 2;
-		if (pos < (8 * IV_BYTES / 2))
-			throw std::runtime_error("The image's too small");
-		pos -= (8 * IV_BYTES / 2);
-		for (size_t i = 0; i < 8 * IV_BYTES; ++i) {
-			if (pixels[pos + i].red & 1)
-				iv[i / 8] |= (1 << (i % 8));
-			else
-				iv[i / 8] &= ~(1 << (i % 8));
-		}
-	}
-
-	/**
-	 ** Writes IV
-	 ** Writes data to (8 * IV_BYTES) pixels that are in the middle of the image, using LSB of the red channel.
-	 **/
-	void PNGFile::WriteIV() {
-		size_t bits = iv.size() * 8;
-		size_t pos = pixels.size() / 2;
-		if (pos < (bits / 2))
-			throw std::runtime_error("The image's too small");
-		pos -= (bits / 2);
-		for (size_t i = 0; i < bits; ++i) {
-			if (iv[i / 8] & (1 << (i % 8)))
-				pixels[pos + i].red |= 1;
-			else
-				pixels[pos + i].red &= ~1;
-		}
-	}
-
-	/**
-	 ** Reads IV
-	 ** Gets data from first (8 * SALT_BYTES) pixels, using LSB of the green channel.
-	 **/
-	void PNGFile::ReadSalt() {
-		salt.resize(SALT_BYTES);
-		if (pixels.size() < SALT_BYTES * 8)
-			throw std::runtime_error("The image's too small");
-		for (size_t i = 0; i < 8 * SALT_BYTES; ++i) {
-			if (pixels[i].green & 1)
-				salt[i / 8] |= (1 << (i % 8));
-			
-			else
-				salt[i / 8] &= ~(1 << (i % 8));		
-		}
-	}
-
-	/**
-	 ** Writes IV
-	 ** Writes data to first (8 * SALT_BYTES) pixels, using LSB of the green channel.
-	 **/
-	void PNGFile::WriteSalt() {
-		size_t bits = salt.size() * 8;
-		if (pixels.size() < bits)
-			throw std::runtime_error("The image's too small");
-		for (size_t i = 0; i < bits; ++i) {
-			if (salt[i / 8] & (1 << (i % 8)))
-				pixels[i].green |= 1;
-			else
-				pixels[i].green &= ~1;
-		}
-	}
-
-	PNGFile::~PNGFile() {
-		// Wipe memory
-		PNGStego::zeroMemory(iv.data(), iv.capacity());
-		PNGStego::zeroMemory(salt.data(), salt.capacity());
+		engine.setCSPRNG(std::move(fn));
 	}
 
+	/** Returns how many bytes decoded samples take */
+	uint64_t PNGFile::pixelBytes() const noexcept {
+		return store ? store->size() * bytesPerPixel(store->format(), store->sampleBytes()) : 0;
+	}
+
+	/** Returns the store if pixels are kept in memory, nullptr otherwise */
+	MemoryStore* PNGFile::memoryStore() const noexcept {
+		return dynamic_cast<MemoryStore*>(store.get());
+	}
+
+	PNGFile::~PNGFile() { }
+
 } // namespace PNGStego
\ No newline at end of file
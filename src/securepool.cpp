@@ -0,0 +1,217 @@
+//
+// Copyright (C) 2015-2016 Zireael (zireael dot nk at gmail dot com)
+//  Distributed under the Boost Software License, Version 1.0.
+//       (See accompanying file LICENSE.md or copy at
+//           http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "securepool.h"
+#include "helpers.h"
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace PNGStego {
+
+	namespace {
+		size_t pageSize() noexcept {
+			static const size_t size = []() -> size_t {
+#ifdef _WIN32
+				SYSTEM_INFO info;
+				GetSystemInfo(&info);
+				return info.dwPageSize;
+#else
+				long size = sysconf(_SC_PAGESIZE);
+				return size > 0 ? static_cast<size_t>(size) : 4096;
+#endif
+			}();
+			return size;
+		}
+	}
+
+	SecurePool::SecurePool() noexcept : cacheLimit(SECURE_POOL_CACHE_BYTES), numbers() { }
+
+	SecurePool& SecurePool::global() {
+		// Never destroyed, static containers may still free into it while the process exits
+		static SecurePool *pool = new SecurePool();
+		return *pool;
+	}
+
+	size_t SecurePool::blockSize(size_t bytes) noexcept {
+		const size_t page = pageSize();
+		if (bytes > SECURE_POOL_MAX_CACHED_BLOCK)
+			return (bytes + page - 1) / page * page;
+		size_t size = page;
+		while (size < bytes)
+			size <<= 1;
+		return size;
+	}
+
+	void* SecurePool::allocate(size_t bytes) {
+		if (bytes > SIZE_MAX - 3 * pageSize())
+			throw std::bad_alloc();
+		const size_t size = blockSize(bytes);
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			auto found = cache.find(size);
+			if (found != cache.end() && !found->second.empty()) {
+				void *block = found->second.back();
+				found->second.pop_back();
+				numbers.cachedBytes -= size;
+				numbers.liveBytes += size;
+				++numbers.hits;
+				return block;
+			}
+		}
+
+		bool isLocked = false;
+		void *block = this->map(size, isLocked);
+		std::lock_guard<std::mutex> lock(mutex);
+		try {
+			if (isLocked)
+				locked.insert(block);
+		}
+		catch (...) {
+			this->unmap(block, size, isLocked);
+			throw;
+		}
+		numbers.liveBytes += size;
+		if (isLocked)
+			numbers.lockedBytes += size;
+		++numbers.misses;
+		return block;
+	}
+
+	void SecurePool::deallocate(void *block, size_t bytes) noexcept {
+		if (!block)
+			return;
+		const size_t size = blockSize(bytes);
+		PNGStego::zeroMemory(block, size);
+
+		bool cached = false, isLocked = false;
+		std::vector<Dropped> dropped;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			numbers.liveBytes -= size;
+			if (size <= SECURE_POOL_MAX_CACHED_BLOCK && size <= cacheLimit) {
+				try {
+					// Older blocks make room, the one that's just been used is the likeliest to be wanted again
+					std::vector<void*> &blocks = cache[size];
+					blocks.reserve(blocks.size() + 1);
+					shrinkCache(cacheLimit - size, dropped);
+					blocks.push_back(block);
+					numbers.cachedBytes += size;
+					cached = true;
+				}
+				catch (...) {
+					// No memory for the list, the block goes back to the system
+				}
+			}
+			if (!cached && locked.erase(block)) {
+				isLocked = true;
+				numbers.lockedBytes -= size;
+			}
+		}
+		if (!cached)
+			this->unmap(block, size, isLocked);
+		this->unmap(dropped);
+	}
+
+	void SecurePool::shrinkCache(size_t limit, std::vector<Dropped> &dropped) noexcept {
+		// Largest blocks go first, there are the fewest jobs to reuse them
+		for (auto it = cache.rbegin(); numbers.cachedBytes > limit && it != cache.rend(); ++it) {
+			while (numbers.cachedBytes > limit && !it->second.empty()) {
+				try {
+					dropped.reserve(dropped.size() + 1);
+				}
+				catch (...) {
+					return;
+				}
+				Dropped block = { it->second.back(), it->first, false };
+				it->second.pop_back();
+				numbers.cachedBytes -= block.size;
+				if (locked.erase(block.block)) {
+					block.isLocked = true;
+					numbers.lockedBytes -= block.size;
+				}
+				dropped.push_back(block);
+			}
+		}
+	}
+
+	void SecurePool::setCacheLimit(size_t bytes) noexcept {
+		std::vector<Dropped> dropped;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			cacheLimit = bytes;
+			shrinkCache(bytes, dropped);
+		}
+		this->unmap(dropped);
+	}
+
+	void SecurePool::trim() noexcept {
+		std::vector<Dropped> dropped;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			shrinkCache(0, dropped);
+		}
+		this->unmap(dropped);
+	}
+
+	SecurePoolStatistics SecurePool::statistics() const {
+		std::lock_guard<std::mutex> lock(mutex);
+		return numbers;
+	}
+
+	void* SecurePool::map(size_t size, bool &isLocked) {
+		const size_t page = pageSize();
+#ifdef _WIN32
+		uint8_t *base = static_cast<uint8_t*>(VirtualAlloc(nullptr, size + 2 * page, MEM_RESERVE | MEM_COMMIT, PAGE_NOACCESS));
+		if (!base)
+			throw std::bad_alloc();
+		uint8_t *block = base + page;
+		DWORD previous;
+		if (!VirtualProtect(block, size, PAGE_READWRITE, &previous)) {
+			VirtualFree(base, 0, MEM_RELEASE);
+			throw std::bad_alloc();
+		}
+		isLocked = VirtualLock(block, size) != 0;
+#else
+		void *mapped = mmap(nullptr, size + 2 * page, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (mapped == MAP_FAILED)
+			throw std::bad_alloc();
+		uint8_t *block = static_cast<uint8_t*>(mapped) + page;
+		if (mprotect(block, size, PROT_READ | PROT_WRITE)) {
+			munmap(mapped, size + 2 * page);
+			throw std::bad_alloc();
+		}
+#ifdef MADV_DONTDUMP
+		madvise(block, size, MADV_DONTDUMP);
+#endif
+		isLocked = mlock(block, size) == 0;
+#endif
+		return block;
+	}
+
+	void SecurePool::unmap(const std::vector<Dropped> &dropped) noexcept {
+		for (const Dropped &block : dropped)
+			this->unmap(block.block, block.size, block.isLocked);
+	}
+
+	void SecurePool::unmap(void *block, size_t size, bool isLocked) noexcept {
+		const size_t page = pageSize();
+		uint8_t *base = static_cast<uint8_t*>(block) - page;
+#ifdef _WIN32
+		if (isLocked)
+			VirtualUnlock(block, size);
+		VirtualFree(base, 0, MEM_RELEASE);
+#else
+		if (isLocked)
+			munlock(block, size);
+		munmap(base, size + 2 * page);
+#endif
+	}
+
+} // namespace PNGStego
\ No newline at end of file
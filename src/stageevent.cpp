@@ -0,0 +1,72 @@
+//
+// Copyright (C) 2015-2016 Zireael (zireael dot nk at gmail dot com)
+//  Distributed under the Boost Software License, Version 1.0.
+//       (See accompanying file LICENSE.md or copy at
+//           http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "stageevent.h"
+#include "metrics.h"
+
+namespace PNGStego {
+
+	const char* stageName(Stage stage) noexcept {
+		switch (stage) {
+		case Stage::Load:       return "load";
+		case Stage::KDFSeed:    return "kdf-seed";
+		case Stage::KDFKey:     return "kdf-key";
+		case Stage::Compress:   return "compress";
+		case Stage::Encrypt:    return "encrypt";
+		case Stage::Embed:      return "embed";
+		case Stage::Extract:    return "extract";
+		case Stage::Decrypt:    return "decrypt";
+		case Stage::Decompress: return "decompress";
+		case Stage::Write:      return "write";
+		case Stage::Save:       return "save";
+		}
+		return "unknown";
+	}
+
+	EventFn describeStages(const std::function<void(const std::string&)> &outputFn) {
+		if (!outputFn)
+			return EventFn();
+		return [outputFn](const StageEvent &event) {
+			if (event.finished)
+				return;
+			switch (event.stage) {
+			case Stage::KDFKey:     outputFn("Deriving a key..."); break;
+			case Stage::Compress:   outputFn("Compressing data..."); break;
+			case Stage::Encrypt:    outputFn("Encrypting data..."); break;
+			case Stage::Embed:      outputFn("Embedding data..."); break;
+			case Stage::Extract:    outputFn("Extracting data..."); break;
+			case Stage::Decrypt:    outputFn("Decrypting data..."); break;
+			case Stage::Decompress: outputFn("Decompressing data..."); break;
+			case Stage::Write:      outputFn("Writing data..."); break;
+			default:                break; // callers print their own messages around loading & saving
+			}
+		};
+	}
+
+	StageTimer::StageTimer(const EventFn &fn, Stage stage) : fn(fn), event() {
+		event.stage = stage;
+		event.finished = false;
+		event.start = StageEvent::Clock::now();
+		if (!fn)
+			return;
+		event.thread = std::this_thread::get_id();
+		fn(event);
+	}
+
+	void StageTimer::finish(uint64_t inputBytes, uint64_t outputBytes) {
+		event.finished = true;
+		event.end = StageEvent::Clock::now();
+		event.inputBytes = inputBytes;
+		event.outputBytes = outputBytes;
+		Metrics::global().recordStage(event.stage, static_cast<uint64_t>(
+			std::chrono::duration_cast<std::chrono::nanoseconds>(event.end - event.start).count()), inputBytes, outputBytes);
+		if (!fn)
+			return;
+		fn(event);
+	}
+
+} // namespace PNGStego
\ No newline at end of file
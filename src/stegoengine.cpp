@@ -0,0 +1,555 @@
+//
+// Copyright (C) 2015-2016 Zireael (zireael dot nk at gmail dot com)
+//  Distributed under the Boost Software License, Version 1.0.
+//       (See accompanying file LICENSE.md or copy at
+//           http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "stegoengine.h"
+#include "compression.h"
+#include "encryption.h"
+#include "helpers.h"
+#include "payloadbuffer.h"
+#include "securepool.h"
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <stdexcept>
+
+#ifdef _MSC_VER
+#pragma warning(push)
+#pragma warning(disable:4297)
+#endif
+/*
+  Access to:
+  /dev/random & /dev/urandom on Linux;
+  /dev/srandom & /dev/urandom on BSD;
+  CryptGenRandom() on Windows;
+  On OS X /dev/random and /dev/urandom is the same thing.
+
+  Used for generating IV and Salt.
+*/
+#include <cryptopp/osrng.h>
+#ifdef _MSC_VER
+#pragma warning(pop)
+#endif
+
+/*
+  While Mersenne Twister is a specific algorithm and C++11 standart
+  implementation, in my experience, returns the same results on Linux, Windows
+  and OS X, std::uniform_int_distribution tends to vary, thus I chose to use
+  boost::random since I need to get the same values if the same seed is used.
+
+  Used for generating offsets.
+*/
+#include <boost/random/mersenne_twister.hpp>
+#include <boost/random/uniform_int_distribution.hpp>
+
+const int MIN_OFFSET = 1;
+const int MAX_OFFSET = 3;
+const int EXTENSION_BYTES = 1; // 8 bits
+const int SIZE_BYTES = 4;      // 32 bits
+const int FLAGS_BYTES = 1;     // 8 bits, extended header only
+const int SIZE64_BYTES = 8;    // 64 bits, extended header only
+const int HEADER_BYTES = EXTENSION_BYTES + SIZE_BYTES;
+const int EXTENDED_HEADER_BYTES = HEADER_BYTES + FLAGS_BYTES + SIZE64_BYTES;
+const uint32_t EXTENDED_HEADER = 0;        // in the 32-bit size, flags and a 64-bit size follow it; a payload's never empty
+const uint8_t MAX_EXTENSION_LENGTH = 0xFF;
+const uint8_t HEADER_FLAG_SIZE64 = 0x01;   // the payload's size is a 64-bit field
+const uint8_t HEADER_PROFILE_MASK = 0x06;  // the EmbeddingProfile of the payload
+const int HEADER_PROFILE_SHIFT = 1;
+const int IV_BYTES = 12;       // 96 bits
+const int SALT_BYTES = 16;     // 128 bits
+const uint64_t CHECK_INTERVAL_BITS = 1 << 20; // bits embedded/extracted between checks of a cancellation token
+
+namespace PNGStego {
+
+	// Channels whose LSBs hold the payload, the salt and the IV
+	const Channel PAYLOAD_CHANNEL = Channel::Blue;
+	const Channel SALT_CHANNEL    = Channel::Green;
+	const Channel IV_CHANNEL      = Channel::Red;
+
+	/**
+	 ** Returns the number of pixels the offset walk goes through.
+	 ** In gray layouts the payload, salt and IV share one sample,
+	 ** so the walk leaves out the pixels that hold salt and IV.
+	 **/
+	uint64_t walkLength(const PixelStore &store) noexcept {
+		uint64_t count = store.size();
+		if (!isGray(store.format()))
+			return count;
+		const uint64_t reserved = 8 * (SALT_BYTES + IV_BYTES);
+		return count > reserved ? count - reserved : 0;
+	}
+
+	/** Converts a position of the offset walk into an index of a pixel */
+	uint64_t walkToPixel(const PixelStore &store, uint64_t pos) noexcept {
+		if (!isGray(store.format()))
+			return pos;
+		pos += 8 * SALT_BYTES;
+		if (pos >= store.size() / 2 - (8 * IV_BYTES / 2))
+			pos += 8 * IV_BYTES;
+		return pos;
+	}
+
+	/**
+	 ** Samples of a selected pixel that hold the payload, and how many bits of each.
+	 ** Samples of color images that hold salt (the first pixels' green) or IV (red in the middle) are skipped,
+	 ** in gray layouts the walk leaves those pixels out already.
+	 **/
+	struct PayloadSlots {
+		Channel channels[3];
+		size_t count;
+		int bits;
+		uint64_t saltEnd, ivBegin, ivEnd;
+
+		bool reserved(uint64_t pixel, Channel channel) const noexcept {
+			return (channel == SALT_CHANNEL && pixel < saltEnd) || (channel == IV_CHANNEL && pixel >= ivBegin && pixel < ivEnd);
+		}
+	};
+
+	PayloadSlots payloadSlots(const PixelStore &store, EmbeddingProfile profile) noexcept {
+		PayloadSlots slots = { { PAYLOAD_CHANNEL, PAYLOAD_CHANNEL, PAYLOAD_CHANNEL }, 1, 1, 0, 0, 0 };
+		if (profile == EmbeddingProfile::Sparse)
+			return slots;
+		slots.bits = profile == EmbeddingProfile::Dense2 ? 2 : 1;
+		if (!isGray(store.format())) {
+			slots.channels[0] = Channel::Red;
+			slots.channels[1] = Channel::Green;
+			slots.channels[2] = Channel::Blue;
+			slots.count = 3;
+			slots.saltEnd = 8 * SALT_BYTES;
+			slots.ivBegin = store.size() / 2 - std::min<uint64_t>(store.size() / 2, 8 * IV_BYTES / 2);
+			slots.ivEnd = slots.ivBegin + 8 * IV_BYTES;
+		}
+		return slots;
+	}
+
+	/** Derives the seed of the offset walk from the key and IV */
+	uint32_t offsetSeed(const std::string &key, const std::vector<uint8_t> &iv, const CancellationToken &token,
+	                    const EventFn &eventFn) {
+		StageTimer timer(eventFn, Stage::KDFSeed);
+		std::array<uint8_t, 4> t = PNGStego::Encryption::hashKey<4, 150000>(key, iv, token);
+		uint32_t seed = 0;
+		for (int i = 0; i < 4; ++i) {
+			seed <<= 8;
+			seed += t[i];
+		}
+		PNGStego::zeroMemory(t.data(), t.size());
+		timer.finish(key.size() + iv.size(), sizeof(seed));
+		return seed;
+	}
+
+	EmbeddingProfile embeddingProfileFromName(const std::string &name) {
+		if (name == "sparse")
+			return EmbeddingProfile::Sparse;
+		if (name == "dense")
+			return EmbeddingProfile::Dense;
+		if (name == "dense2")
+			return EmbeddingProfile::Dense2;
+		throw std::invalid_argument("Unknown embedding profile: " + name);
+	}
+
+	StegoEngine::StegoEngine() : salt(), iv(), profile(EmbeddingProfile::Sparse), eventFn(),
+		CSPRNG(std::bind(CryptoPP::OS_GenerateRandomBlock, true, std::placeholders::_1, std::placeholders::_2))
+	{ }
+
+	StegoEngine::~StegoEngine() {
+		// Wipe memory
+		PNGStego::zeroMemory(iv.data(), iv.capacity());
+		PNGStego::zeroMemory(salt.data(), salt.capacity());
+	}
+
+	void StegoEngine::load(PixelStore &store) {
+		this->readIV(store);
+		this->readSalt(store);
+	}
+
+	uint64_t StegoEngine::capacity(const PixelStore &store, uint32_t seed) const noexcept {
+		return this->capacity(store, seed, profile);
+	}
+
+	void StegoEngine::setProfile(EmbeddingProfile profile) noexcept {
+		this->profile = profile;
+	}
+
+	EmbeddingProfile StegoEngine::getProfile() const noexcept {
+		return profile;
+	}
+
+	uint64_t StegoEngine::capacity(const PixelStore &store, uint32_t seed, EmbeddingProfile profile) const noexcept {
+		/*
+		  Images past 2^32 pixels aren't unheard of (satellite
+		  imagery, medical scans), so everything here is 64-bit.
+		  Payloads larger than 4 GiB need an extended header.
+		*/
+
+		boost::random::mt19937 gen(seed);
+		boost::random::uniform_int_distribution<uint16_t> offset(MIN_OFFSET, MAX_OFFSET);
+		PNGStego::zeroMemory(&seed, sizeof(seed));
+
+		uint64_t capacity = 0;
+		uint64_t pos = 0;
+		uint64_t size = walkLength(store);
+		if (profile != EmbeddingProfile::Sparse) {
+			// The header's always sparse and extended, the flags tell the profile
+			const PayloadSlots slots = payloadSlots(store, profile);
+			uint64_t headerBits = 8 * EXTENDED_HEADER_BYTES;
+			for (; pos < size; pos += offset(gen)) {
+				if (headerBits) {
+					--headerBits;
+					continue;
+				}
+				const uint64_t pixel = walkToPixel(store, pos);
+				for (size_t k = 0; k < slots.count; ++k) {
+					if (!slots.reserved(pixel, slots.channels[k]))
+						capacity += slots.bits;
+				}
+			}
+			return headerBits ? 0U : capacity / 8;
+		}
+		while(pos < size) {
+			++capacity;
+			pos += offset(gen);
+		}
+
+		capacity /= 8;
+		if (capacity <= HEADER_BYTES)
+			return 0U;
+
+		// Whatever doesn't fit into a 32-bit size requires the extended header
+		uint64_t result = std::min<uint64_t>(capacity - HEADER_BYTES, UINT32_MAX);
+		if (capacity > EXTENDED_HEADER_BYTES)
+			result = std::max<uint64_t>(result, capacity - EXTENDED_HEADER_BYTES);
+		return result;
+	}
+
+	void StegoEngine::embed(PixelStore &store, const std::vector<uint8_t> &data, const std::string &extension, const std::string &key,
+	                        const CancellationToken &token, UndoLog *undo) {
+		if (key.empty()) {
+			throw std::invalid_argument("An empty key was given");
+		}
+		if (!CSPRNG) {
+			throw std::runtime_error("CSPRNG is not set.");
+		}
+		if (extension.length() > MAX_EXTENSION_LENGTH) {
+			throw std::invalid_argument("The file's extension is too long");
+		}
+		// Work that's waited in a queue past its deadline doesn't even start
+		token.check();
+
+		uint8_t extensionSize = static_cast<uint8_t>(extension.length());
+		/*
+		  The only copy of the payload there is: the extension and the data get compressed into it
+		  straight from where they are, then both ciphers encrypt it in place.
+		  It's sized for all of that up front, so it never moves and wipes itself whichever way this ends.
+		*/
+		PayloadBuffer binaryData;
+		iv.resize(IV_BYTES);
+		CSPRNG(iv.data(), iv.size());
+
+		uint32_t seed = offsetSeed(key, iv, token, eventFn);
+
+		StageTimer compressTimer(eventFn, Stage::Compress);
+		binaryData.reserve(PNGStego::bzip2::compressBound(extensionSize + data.size()) + TAG_SIZE * 2);
+		PNGStego::bzip2::compress({ { reinterpret_cast<const uint8_t*>(extension.data()), extensionSize },
+		                            { data.data(), data.size() } }, binaryData, token);
+		compressTimer.finish(extensionSize + data.size(), binaryData.size());
+		uint64_t dataSize = binaryData.size();
+		dataSize += (TAG_SIZE * 2);
+
+		if (dataSize <= capacity(store, seed, profile)) {
+			boost::random::mt19937 gen(seed);
+			boost::random::uniform_int_distribution<uint16_t> offset(MIN_OFFSET, MAX_OFFSET);
+			PNGStego::zeroMemory(&seed, sizeof(seed));
+
+			salt.resize(SALT_BYTES);
+			CSPRNG(salt.data(), salt.size());
+
+			StageTimer kdfTimer(eventFn, Stage::KDFKey);
+			SecureObject<Encryption::DerivedKey> derivedKey;
+			Encryption::deriveKey(key, salt, *derivedKey, token);
+			kdfTimer.finish(key.size() + salt.size(), derivedKey->size());
+
+			StageTimer encryptTimer(eventFn, Stage::Encrypt);
+			size_t compressedSize = binaryData.size();
+			Encryption::encrypt(binaryData, *derivedKey, iv, token);
+			encryptTimer.finish(compressedSize, binaryData.size());
+			dataSize = binaryData.size();
+
+			StageTimer embedTimer(eventFn, Stage::Embed);
+			this->writeSalt(store, undo);
+			this->writeIV(store, undo);
+			ChannelCursor image(store, PAYLOAD_CHANNEL);
+			const PayloadSlots slots = payloadSlots(store, profile);
+			ChannelCursor cursors[3] = {
+				ChannelCursor(store, slots.channels[0]), ChannelCursor(store, slots.channels[1]), ChannelCursor(store, slots.channels[2])
+			};
+			uint64_t PixelPos = 0;
+			auto embed = [&](uint64_t value, int bits) {
+				for (int i = 0; i < bits; ++i) {
+					image.setLowBit(walkToPixel(store, PixelPos), (value >> i) & 1, undo);
+					PixelPos += offset(gen);
+				}
+			};
+
+			// Sizes past 32 bits and profiles other than Sparse go into an extended header, flagged by an empty 32-bit size
+			if (dataSize > UINT32_MAX || profile != EmbeddingProfile::Sparse) {
+				embed(extensionSize, 8 * EXTENSION_BYTES);
+				embed(EXTENDED_HEADER, 8 * SIZE_BYTES);
+				embed(HEADER_FLAG_SIZE64 | static_cast<uint8_t>(profile) << HEADER_PROFILE_SHIFT, 8 * FLAGS_BYTES);
+				embed(dataSize, 8 * SIZE64_BYTES);
+			}
+			else {
+				embed(extensionSize, 8 * EXTENSION_BYTES);
+				embed(dataSize, 8 * SIZE_BYTES);
+			}
+			const uint8_t *bytes = binaryData.data();
+			const uint64_t bits = dataSize * 8;
+			for (uint64_t i = 0; i < bits; PixelPos += offset(gen)) {
+				const uint64_t pixel = walkToPixel(store, PixelPos);
+				for (size_t k = 0; k < slots.count && i < bits; ++k) {
+					if (slots.reserved(pixel, slots.channels[k]))
+						continue;
+					for (int b = 0; b < slots.bits && i < bits; ++b, ++i) {
+						if (i % CHECK_INTERVAL_BITS == 0)
+							token.check();
+						cursors[k].setBit(pixel, b, (bytes[i / 8] >> (i % 8)) & 1, undo);
+					}
+				}
+			}
+			embedTimer.finish(dataSize, dataSize);
+		}
+		else {
+			throw CapacityError("The image can't contain data that large");
+		}
+	}
+
+	void StegoEngine::extract(PixelStore &store, std::vector<uint8_t> &data, std::string &extension, const std::string &key,
+	                          const CancellationToken &token) const {
+		if (key.empty()) {
+			throw std::runtime_error("An empty key was given");
+		}
+		token.check();
+
+		uint64_t dataSize = 0;
+		uint8_t extensionSize = 0;
+
+		uint32_t seed = offsetSeed(key, iv, token, eventFn);
+		boost::random::mt19937 gen(seed);
+		boost::random::uniform_int_distribution<uint16_t> offset(MIN_OFFSET, MAX_OFFSET);
+		EmbeddingProfile dataProfile = EmbeddingProfile::Sparse;
+
+		ChannelReader image(store, PAYLOAD_CHANNEL);
+		const uint64_t length = walkLength(store);
+		uint64_t PixelPos = 0;
+		auto extract = [&](int bits) -> uint64_t {
+			uint64_t value = 0;
+			for (int i = 0; i < bits; ++i) {
+				// A wrong key may send the walk past the image before the header ends
+				if (PixelPos >= length)
+					throw KeyError("Corrupted header");
+				value |= static_cast<uint64_t>(image[walkToPixel(store, PixelPos)] & 1) << i;
+				PixelPos += offset(gen);
+			}
+			return value;
+		};
+
+		extensionSize = static_cast<uint8_t>(extract(8 * EXTENSION_BYTES));
+		dataSize = extract(8 * SIZE_BYTES);
+		if (dataSize == EXTENDED_HEADER) {
+			uint8_t flags = static_cast<uint8_t>(extract(8 * FLAGS_BYTES));
+			dataProfile = static_cast<EmbeddingProfile>((flags & HEADER_PROFILE_MASK) >> HEADER_PROFILE_SHIFT);
+			if ((flags & ~HEADER_PROFILE_MASK) != HEADER_FLAG_SIZE64 || dataProfile > EmbeddingProfile::Dense2)
+				throw KeyError("Corrupted header");
+			dataSize = extract(8 * SIZE64_BYTES);
+			if (dataSize == 0)
+				throw KeyError("Corrupted header");
+		}
+		uint64_t available = capacity(store, seed, dataProfile);
+		PNGStego::zeroMemory(&seed, sizeof(seed));
+
+		if (dataSize <= available && dataSize <= SIZE_MAX) {
+
+			// Decrypted in place, then decompressed into the other buffer, which is handed over to the caller as it is
+			PayloadBuffer binaryData;
+			binaryData.resize(static_cast<size_t>(dataSize));
+			PayloadBuffer decompressed;
+			StageTimer extractTimer(eventFn, Stage::Extract);
+			const PayloadSlots slots = payloadSlots(store, dataProfile);
+			ChannelReader cursors[3] = {
+				ChannelReader(store, slots.channels[0]), ChannelReader(store, slots.channels[1]), ChannelReader(store, slots.channels[2])
+			};
+			uint8_t *bytes = binaryData.data();
+			const uint64_t bits = dataSize * 8;
+			memset(bytes, 0, binaryData.size());
+			for (uint64_t i = 0; i < bits; PixelPos += offset(gen)) {
+				const uint64_t pixel = walkToPixel(store, PixelPos);
+				for (size_t k = 0; k < slots.count && i < bits; ++k) {
+					if (slots.reserved(pixel, slots.channels[k]))
+						continue;
+					const uint8_t sample = cursors[k][pixel];
+					for (int b = 0; b < slots.bits && i < bits; ++b, ++i) {
+						if (i % CHECK_INTERVAL_BITS == 0)
+							token.check();
+						bytes[i / 8] |= static_cast<uint8_t>(((sample >> b) & 1) << (i % 8));
+					}
+				}
+			}
+			extractTimer.finish(dataSize, dataSize);
+
+			StageTimer kdfTimer(eventFn, Stage::KDFKey);
+			SecureObject<Encryption::DerivedKey> derivedKey;
+			Encryption::deriveKey(key, salt, *derivedKey, token);
+			kdfTimer.finish(key.size() + salt.size(), derivedKey->size());
+
+			StageTimer decryptTimer(eventFn, Stage::Decrypt);
+			size_t encryptedSize = binaryData.size();
+			try {
+				Encryption::decrypt(binaryData, *derivedKey, iv, token);
+			}
+			catch (const Cancelled&) {
+				throw;
+			}
+			catch (const std::runtime_error &e) {
+				// The tag didn't match, whatever got extracted isn't what's been embedded with this key
+				throw KeyError(e.what());
+			}
+			decryptTimer.finish(encryptedSize, binaryData.size());
+
+			StageTimer decompressTimer(eventFn, Stage::Decompress);
+			PNGStego::bzip2::decompress(binaryData.data(), binaryData.size(), decompressed, token);
+			decompressTimer.finish(binaryData.size(), decompressed.size());
+			binaryData.release();
+			if (decompressed.size() < extensionSize)
+				throw std::runtime_error("The data's corrupted.");
+
+			extension.assign(reinterpret_cast<const char*>(decompressed.data()), extensionSize);
+			decompressed.consume(extensionSize);
+			decompressed.moveTo(data);
+		}
+		else {
+			// Basically, if dataSize happens to be larger than the result of capacity()
+			// then something's not right, so we throw an exception.
+			throw KeyError("Corrupted header");
+		}
+	}
+
+	/**
+	 ** Reads IV
+	 ** Gets data from 8 * IV_BYTES pixels that are in the middle of the image, using LSB of the red channel.
+	 **/
+	void StegoEngine::readIV(PixelStore &store) {
+		iv.resize(IV_BYTES);
+		ChannelReader image(store, IV_CHANNEL);
+		uint64_t pos = store.size() / 2;
+		if (pos < (8 * IV_BYTES / 2) + (isGray(store.format()) ? 8 * SALT_BYTES : 0))
+			throw std::runtime_error("The image's too small");
+		pos -= (8 * IV_BYTES / 2);
+		for (size_t i = 0; i < 8 * IV_BYTES; ++i) {
+			if (image[pos + i] & 1)
+				iv[i / 8] |= (1 << (i % 8));
+			else
+				iv[i / 8] &= ~(1 << (i % 8));
+		}
+	}
+
+	/**
+	 ** Writes IV
+	 ** Writes data to (8 * IV_BYTES) pixels that are in the middle of the image, using LSB of the red channel.
+	 **/
+	void StegoEngine::writeIV(PixelStore &store, UndoLog *undo) const {
+		size_t bits = iv.size() * 8;
+		ChannelCursor image(store, IV_CHANNEL);
+		uint64_t pos = store.size() / 2;
+		if (pos < (bits / 2) + (isGray(store.format()) ? 8 * SALT_BYTES : 0))
+			throw std::runtime_error("The image's too small");
+		pos -= (bits / 2);
+		for (size_t i = 0; i < bits; ++i)
+			image.setLowBit(pos + i, (iv[i / 8] >> (i % 8)) & 1, undo);
+	}
+
+	/**
+	 ** Reads salt
+	 ** Gets data from first (8 * SALT_BYTES) pixels, using LSB of the green channel.
+	 **/
+	void StegoEngine::readSalt(PixelStore &store) {
+		salt.resize(SALT_BYTES);
+		ChannelReader image(store, SALT_CHANNEL);
+		if (store.size() < SALT_BYTES * 8)
+			throw std::runtime_error("The image's too small");
+		for (size_t i = 0; i < 8 * SALT_BYTES; ++i) {
+			if (image[i] & 1)
+				salt[i / 8] |= (1 << (i % 8));
+
+			else
+				salt[i / 8] &= ~(1 << (i % 8));
+		}
+	}
+
+	/**
+	 ** Writes salt
+	 ** Writes data to first (8 * SALT_BYTES) pixels, using LSB of the green channel.
+	 **/
+	void StegoEngine::writeSalt(PixelStore &store, UndoLog *undo) const {
+		size_t bits = salt.size() * 8;
+		ChannelCursor image(store, SALT_CHANNEL);
+		if (store.size() < bits)
+			throw std::runtime_error("The image's too small");
+		for (size_t i = 0; i < bits; ++i)
+			image.setLowBit(i, (salt[i / 8] >> (i % 8)) & 1, undo);
+	}
+
+	void StegoEngine::embed(PixelStore &store, const std::string &filename, const std::string &key, UndoLog *undo) {
+		std::vector<uint8_t> binaryData = readFile(filename);
+		std::string extension = getExtension(filename);
+
+		this->embed(store, binaryData, extension, key, CancellationToken::none(), undo);
+	}
+
+	void StegoEngine::extract(PixelStore &store, std::string filename, const std::string &key, std::vector<uint8_t> *backup) const {
+		std::vector<uint8_t> data;
+		std::string extension;
+		this->extract(store, data, extension, key);
+		if (!extension.empty() && !PNGStego::endsWith(filename, "." + extension))
+			filename += "." + extension;
+		StageTimer writeTimer(eventFn, Stage::Write);
+		try {
+			writeFile(filename, data.data(), data.size());
+			writeTimer.finish(data.size(), data.size());
+		}
+		catch (...) {
+			if (backup) {
+				std::swap(*backup, data);
+			}
+			PNGStego::zeroMemory(data.data(), data.capacity());
+			throw;
+		}
+		PNGStego::zeroMemory(data.data(), data.capacity());
+	}
+
+	void StegoEngine::setOutputFn(const std::function<void(const std::string&)> &fn) {
+		eventFn = describeStages(fn);
+	}
+
+	void StegoEngine::setOutputFn(std::function<void(const std::string&)> &&fn) {
+		eventFn = describeStages(fn);
+	}
+
+	void StegoEngine::setEventFn(const EventFn &fn) {
+		eventFn = fn;
+	}
+
+	const EventFn& StegoEngine::getEventFn() const noexcept {
+		return eventFn;
+	}
+
+	void StegoEngine::setCSPRNG(const std::function<void(uint8_t *, size_t)> &fn) {
+		CSPRNG = fn;
+	}
+
+	void StegoEngine::setCSPRNG(std::function<void(uint8_t *, size_t)> &&fn) {
+		CSPRNG = fn;
+	}
+
+} // namespace PNGStego
\ No newline at end of file
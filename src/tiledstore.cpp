@@ -0,0 +1,217 @@
+//
+// Copyright (C) 2015-2016 Zireael (zireael dot nk at gmail dot com)
+//  Distributed under the Boost Software License, Version 1.0.
+//       (See accompanying file LICENSE.md or copy at
+//           http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "tiledstore.h"
+#include "helpers.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace PNGStego {
+
+	// Tiles never get smaller than this many allocation units per sample
+	const uint64_t MAX_UNITS_PER_TILE = 1024;
+	// A budget is split into roughly this many tiles
+	const uint64_t TILES_PER_BUDGET = 8;
+
+	/** Returns the granularity of offsets files can be mapped at */
+	uint64_t mappingGranularity() noexcept {
+#ifdef _WIN32
+		SYSTEM_INFO info;
+		GetSystemInfo(&info);
+		return info.dwAllocationGranularity;
+#else
+		long size = sysconf(_SC_PAGESIZE);
+		return size > 0 ? static_cast<uint64_t>(size) : 4096;
+#endif
+	}
+
+	TiledStore::TiledStore(uint64_t count, PixelFormat format, uint64_t budget, const std::string &directory, size_t sampleBytes)
+		: count(count), pixelFormat(format), bytesPerSample(sampleBytes), budget(budget), directory(directory),
+		  useCounter(0), tiles()
+	{
+		/*
+		  A tile is a whole number of pixels as well as of mapping units,
+		  so a channel run never crosses a tile boundary.
+		*/
+		const uint64_t channels = bytesPerPixel(format, sampleBytes);
+		const uint64_t unit = mappingGranularity() * channels;
+		if (count > UINT64_MAX / channels - unit) {
+			throw std::runtime_error("The image's too large");
+		}
+		tileBytes = unit * std::min(std::max<uint64_t>(budget / (TILES_PER_BUDGET * unit), 1), MAX_UNITS_PER_TILE);
+		maxTiles = static_cast<size_t>(std::max<uint64_t>(budget / tileBytes, 2));
+		fileBytes = (count * channels + tileBytes - 1) / tileBytes * tileBytes;
+
+#ifdef _WIN32
+		char path[MAX_PATH];
+		if (directory.empty()) {
+			if (!GetTempPathA(MAX_PATH, path))
+				throw std::runtime_error("Cannot find a temporary directory");
+		}
+		else {
+			strncpy(path, directory.c_str(), MAX_PATH - 1);
+			path[MAX_PATH - 1] = '\0';
+		}
+		char filename[MAX_PATH];
+		if (!GetTempFileNameA(path, "png", 0, filename))
+			throw std::runtime_error("Cannot create a scratch file");
+		HANDLE File = CreateFileA(filename, GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS,
+		                          FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, nullptr);
+		if (File == INVALID_HANDLE_VALUE)
+			throw std::runtime_error("Cannot create a scratch file");
+		HANDLE Mapping = CreateFileMappingA(File, nullptr, PAGE_READWRITE,
+		                                    static_cast<DWORD>(fileBytes >> 32), static_cast<DWORD>(fileBytes), nullptr);
+		if (!Mapping) {
+			CloseHandle(File);
+			throw std::runtime_error("Cannot map a scratch file");
+		}
+		file = File;
+		mapping = Mapping;
+#else
+		std::string path = directory;
+		if (path.empty()) {
+			const char *tmp = std::getenv("TMPDIR");
+			path = tmp && *tmp ? tmp : "/tmp";
+		}
+		path += "/pngstego-XXXXXX";
+		file = mkstemp(&path[0]);
+		if (file == -1)
+			throw std::runtime_error("Cannot create a scratch file in " + path.substr(0, path.size() - 16));
+		// Nobody else needs to see the file, it goes away once it's closed
+		unlink(path.c_str());
+		if (ftruncate(file, static_cast<off_t>(fileBytes)) != 0) {
+			close(file);
+			throw std::runtime_error("Cannot allocate a scratch file");
+		}
+#endif
+	}
+
+	TiledStore::~TiledStore() {
+		for (Tile &t : tiles)
+			unmap(t);
+#ifdef _WIN32
+		CloseHandle(static_cast<HANDLE>(mapping));
+		CloseHandle(static_cast<HANDLE>(file));
+#else
+		close(file);
+#endif
+	}
+
+	uint64_t TiledStore::size() const noexcept {
+		return count;
+	}
+
+	PixelFormat TiledStore::format() const noexcept {
+		return pixelFormat;
+	}
+
+	size_t TiledStore::sampleBytes() const noexcept {
+		return bytesPerSample;
+	}
+
+	ChannelRun TiledStore::channel(uint64_t pixel, Channel channel) {
+		const uint64_t channels = bytesPerPixel(pixelFormat, bytesPerSample);
+		const uint64_t offset = pixel * channels;
+		const uint64_t within = offset % tileBytes;
+
+		ChannelRun run;
+		run.data = this->tile(offset / tileBytes) + within + lowByteOffset(pixelFormat, channel, bytesPerSample);
+		run.stride = static_cast<size_t>(channels);
+		run.count = std::min((tileBytes - within) / channels, count - pixel);
+		return run;
+	}
+
+	std::unique_ptr<PixelStore> TiledStore::clone() const {
+		std::unique_ptr<TiledStore> copy(new TiledStore(count, pixelFormat, budget, directory, bytesPerSample));
+		// Mapping tiles doesn't change the pixels, only what's currently resident
+		TiledStore &self = const_cast<TiledStore&>(*this);
+		for (uint64_t i = 0; i < fileBytes / tileBytes; ++i)
+			memcpy(copy->tile(i), self.tile(i), static_cast<size_t>(tileBytes));
+		return std::unique_ptr<PixelStore>(copy.release());
+	}
+
+	void TiledStore::read(uint64_t offset, uint8_t *destination, size_t length) {
+		while (length) {
+			const uint64_t within = offset % tileBytes;
+			const size_t part = static_cast<size_t>(std::min<uint64_t>(length, tileBytes - within));
+			memcpy(destination, this->tile(offset / tileBytes) + within, part);
+			destination += part;
+			offset += part;
+			length -= part;
+		}
+	}
+
+	void TiledStore::write(uint64_t offset, const uint8_t *source, size_t length) {
+		while (length) {
+			const uint64_t within = offset % tileBytes;
+			const size_t part = static_cast<size_t>(std::min<uint64_t>(length, tileBytes - within));
+			memcpy(this->tile(offset / tileBytes) + within, source, part);
+			source += part;
+			offset += part;
+			length -= part;
+		}
+	}
+
+	uint8_t* TiledStore::tile(uint64_t index) {
+		++useCounter;
+		for (Tile &t : tiles) {
+			if (t.index == index) {
+				t.lastUse = useCounter;
+				return t.data;
+			}
+		}
+
+		Tile *slot = nullptr;
+		if (tiles.size() < maxTiles) {
+			tiles.push_back(Tile());
+			slot = &tiles.back();
+		}
+		else {
+			slot = &*std::min_element(tiles.begin(), tiles.end(), [](const Tile &a, const Tile &b) {
+				return a.lastUse < b.lastUse;
+			});
+			this->unmap(*slot);
+		}
+
+		const uint64_t offset = index * tileBytes;
+#ifdef _WIN32
+		void *data = MapViewOfFile(static_cast<HANDLE>(mapping), FILE_MAP_ALL_ACCESS,
+		                           static_cast<DWORD>(offset >> 32), static_cast<DWORD>(offset),
+		                           static_cast<SIZE_T>(tileBytes));
+		if (!data) {
+#else
+		void *data = mmap(nullptr, static_cast<size_t>(tileBytes), PROT_READ | PROT_WRITE, MAP_SHARED,
+		                  file, static_cast<off_t>(offset));
+		if (data == MAP_FAILED) {
+#endif
+			tiles.erase(tiles.begin() + (slot - tiles.data()));
+			throw std::runtime_error("Cannot map a tile of the scratch file");
+		}
+
+		slot->index = index;
+		slot->data = static_cast<uint8_t*>(data);
+		slot->lastUse = useCounter;
+		return slot->data;
+	}
+
+	void TiledStore::unmap(Tile &tile) noexcept {
+#ifdef _WIN32
+		UnmapViewOfFile(tile.data);
+#else
+		munmap(tile.data, static_cast<size_t>(tileBytes));
+#endif
+		tile.data = nullptr;
+	}
+
+} // namespace PNGStego
\ No newline at end of file
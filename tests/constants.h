@@ -35,11 +35,36 @@ bool testBaseFilenameNoExtension();
 bool testRemoveLineEndings();
 bool testEndsWith();
 bool testStringToVector();
+bool testFileIO();
+
+bool testInterleave();
 
 bool initStego();
 bool testEncode();
 bool testDecode();
 bool testDecodeSelf();
+bool testMemoryIO();
+bool testGrayscale();
+bool testPlanarEncode();
+bool testTiledEncode();
+bool testBitmapEncode();
+bool testStegoEngine();
+bool testHeaders();
+bool testBatch();
+bool testBatchPipeline();
+bool testDaemon();
+bool testCAPI();
+bool testAsync();
+bool testCancellation();
+bool testStageEvents();
+bool testMetrics();
+bool testPayloadBuffer();
+bool testSecurePool();
+bool testUndo();
+bool testEmbeddingProfiles();
+bool testSixteenBit();
+bool testColorReduction();
+bool testFastCodec();
 
 const std::string password = "StrongPasswordNotReally";
 
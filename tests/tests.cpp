@@ -12,12 +12,34 @@
 #include <array>
 #include <tuple>
 #include <cstring>
+#include <cstdio>
+#include <sstream>
+#include <thread>
+#include <chrono>
+#include <iterator>
+#include <algorithm>
 #include "pngwrapper.h"
+#include "bitmapfile.h"
+#include "stegoengine.h"
+#include "batch.h"
+#include "daemon.h"
+#include "pngstego.h"
+#include "bitmap.h"
 #include "compression.h"
 #include "encryption.h"
+#include "fastpng.h"
 #include "helpers.h"
+#include "metrics.h"
+#include "planar.h"
+#include "securepool.h"
 #include "constants.h"
 
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
 #define TEST(name, fn)  std::cout << name;             \
                         ++tests;                       \
                         if (fn()) {                    \
@@ -56,6 +78,9 @@ int main() {
 	TEST("Testing removeLineEndings()...: ", testRemoveLineEndings)
 	TEST("Testing endsWith()...: ", testEndsWith)
 	TEST("Testing stringToVector()...: ", testStringToVector)
+	TEST("Testing readFiles() & writeFile()...: ", testFileIO)
+
+	TEST("\nTesting (de)interleave() with random data...: ", testInterleave)
 
 
 	std::cout << "\nI/O Initialization: ";
@@ -65,9 +90,31 @@ int main() {
 		TEST("Testing encode() with precomputed data...: ", testEncode)
 		TEST("Testing decode() with precomputed data...: ", testDecode)
 		TEST("Testing decode() with data previously calculated with encode()...: ", testDecodeSelf)
+		TEST("Testing save() & load() with memory buffers...: ", testMemoryIO)
+		TEST("Testing encode() & decode() with a grayscale container...: ", testGrayscale)
+		TEST("Testing encode() & save() with planar samples...: ", testPlanarEncode)
+		TEST("Testing encode() & save() with a scratch file...: ", testTiledEncode)
+		TEST("Testing encode() & decode() with a mapped BMP file...: ", testBitmapEncode)
+		TEST("Testing StegoEngine on its own pixel store...: ", testStegoEngine)
+		TEST("Testing legacy & extended payload headers...: ", testHeaders)
+		TEST("Testing runBatch() with a manifest...: ", testBatch)
+		TEST("Testing encodeBatch() & decodeBatch()...: ", testBatchPipeline)
+		TEST("Testing requests to a daemon...: ", testDaemon)
+		TEST("Testing the C interface...: ", testCAPI)
+		TEST("Testing encodeAsync() & decodeAsync() on a pool...: ", testAsync)
+		TEST("Testing cancellation tokens & deadlines...: ", testCancellation)
+		TEST("Testing stage events...: ", testStageEvents)
+		TEST("Testing the metrics registry...: ", testMetrics)
+		TEST("Testing payload buffers...: ", testPayloadBuffer)
+		TEST("Testing the secure pool...: ", testSecurePool)
+		TEST("Testing restore() & snapshot()...: ", testUndo)
+		TEST("Testing embedding profiles...: ", testEmbeddingProfiles)
+		TEST("Testing encode() & save() with a 16-bit container...: ", testSixteenBit)
+		TEST("Testing save() with a palette container...: ", testColorReduction)
+		TEST("Testing load() & save() with the fast codec...: ", testFastCodec)
 	} else {
 		std::cout << "Missing files, can't do the final tests.\n";
-		tests += 3;
+		tests += 25;
 	}
 
 	std::cout << "\nTESTS: " << tests;
@@ -357,9 +404,64 @@ bool testStringToVector() {
 	return true;
 }
 
+bool testFileIO() {
+	// Larger than one of the ring's 256 KiB buffers, so it's read in chunks that finish in any order
+	std::vector<uint8_t> large(1024 * 1024 + 17), small(100, 's');
+	std::mt19937 gen(11);
+	for (uint8_t &byte : large)
+		byte = static_cast<uint8_t>(gen());
+	writeFile("io-test-large.bin", large.data(), large.size());
+	writeFile("io-test-small.bin", small.data(), small.size());
+
+	std::vector<std::string> errors;
+	const std::vector<std::vector<uint8_t>> contents = readFiles({ "io-test-large.bin", "io-test-missing.bin", "io-test-small.bin" }, errors);
+	const bool read = contents.size() == 3 && errors.size() == 3 &&
+	                  contents[0] == large && errors[0].empty() &&
+	                  contents[1].empty() && !errors[1].empty() &&
+	                  contents[2] == small && errors[2].empty() &&
+	                  readFile("io-test-large.bin") == large;
+	std::remove("io-test-large.bin");
+	std::remove("io-test-small.bin");
+	return read;
+}
+
+bool testInterleave() {
+	std::random_device rd;
+	std::mt19937 mt(rd());
+	std::uniform_int_distribution<size_t> randomSize(1, 200);
+	std::uniform_int_distribution<uint16_t> randomData(0, 0xFF);
+
+	for (size_t channels = 1; channels <= 4; ++channels) {
+		size_t count = randomSize(mt);
+		std::vector<uint8_t> interleaved(count * channels);
+		for (uint8_t &sample : interleaved)
+			sample = static_cast<uint8_t>(randomData(mt));
+
+		std::vector<uint8_t> planar(interleaved.size());
+		uint8_t *planes[4];
+		for (size_t k = 0; k < channels; ++k)
+			planes[k] = planar.data() + k * count;
+		Planar::deinterleave(interleaved.data(), count, channels, planes);
+		for (size_t i = 0; i < count; ++i)
+			for (size_t k = 0; k < channels; ++k)
+				if (planes[k][i] != interleaved[i * channels + k])
+					return false;
+
+		std::vector<uint8_t> merged(interleaved.size());
+		const uint8_t *sources[4] = { planes[0], planes[1], planes[2], planes[3] };
+		Planar::interleave(sources, count, channels, merged.data());
+		if (merged != interleaved)
+			return false;
+	}
+	return true;
+}
+
 PNGFile original;
 PNGFile precalculatedContainer;
 PNGFile container;
+PNGFile grayscale;
+PNGFile deep;
+PNGFile palette;
 
 #if defined(_WIN32)
 #define TESTDIR ".\\tests\\"
@@ -384,6 +486,30 @@ bool initStego() {
 		return false;
 	}
 
+	if (fileExists(TESTDIR "grayscale.png")) {
+		grayscale.load(TESTDIR "grayscale.png");
+	} else if (fileExists("grayscale.png")) {
+		grayscale.load("grayscale.png");
+	} else {
+		return false;
+	}
+
+	if (fileExists(TESTDIR "deep.png")) {
+		deep.load(TESTDIR "deep.png");
+	} else if (fileExists("deep.png")) {
+		deep.load("deep.png");
+	} else {
+		return false;
+	}
+
+	if (fileExists(TESTDIR "palette.png")) {
+		palette.load(TESTDIR "palette.png");
+	} else if (fileExists("palette.png")) {
+		palette.load("palette.png");
+	} else {
+		return false;
+	}
+
 	return true;
 }
 
@@ -414,4 +540,776 @@ bool testDecodeSelf() {
 	container.decode(temp1, temp2, password);
 	return temp1 == encodedData &&
 	       temp2 == encodedExtension;
+}
+
+bool testMemoryIO() {
+	std::vector<uint8_t> buffer = container.save();
+	PNGFile loaded(buffer.data(), buffer.size());
+
+	std::vector<uint8_t> temp1;
+	std::string temp2;
+	loaded.decode(temp1, temp2, password);
+	return loaded.getPixels() == container.getPixels() &&
+	       temp1 == encodedData &&
+	       temp2 == encodedExtension;
+}
+
+bool testGrayscale() {
+	PNGFile copy(grayscale);
+	copy.encode(encodedData, encodedExtension, password);
+	std::vector<uint8_t> buffer = copy.save();
+	PNGFile loaded(buffer.data(), buffer.size());
+
+	std::vector<uint8_t> temp1;
+	std::string temp2;
+	loaded.decode(temp1, temp2, password);
+	return loaded.getFormat() == PixelFormat::Gray &&
+	       loaded.getPixels().size() == loaded.getWidth() * loaded.getHeight() &&
+	       temp1 == encodedData &&
+	       temp2 == encodedExtension;
+}
+
+bool testPlanarEncode() {
+	PNGFile copy(original);
+	copy.setSampleLayout(SampleLayout::Planar);
+	copy.setCSPRNG(std::bind(memset, std::placeholders::_1,
+	                           0x7F, std::placeholders::_2));
+	copy.encode(encodedData, encodedExtension, password);
+
+	std::vector<uint8_t> buffer = copy.save();
+	PNGFile loaded(buffer.data(), buffer.size());
+	copy.setSampleLayout(SampleLayout::Interleaved);
+	return copy.getPixels() == container.getPixels() &&
+	       loaded.getPixels() == container.getPixels();
+}
+
+bool testTiledEncode() {
+	// Any budget smaller than the image makes it go into a scratch file
+	PNGFile tiled;
+	tiled.setMemoryBudget(1);
+	tiled.load(original.save());
+	tiled.setCSPRNG(std::bind(memset, std::placeholders::_1,
+	                            0x7F, std::placeholders::_2));
+	tiled.encode(encodedData, encodedExtension, password);
+
+	std::vector<uint8_t> buffer = tiled.save();
+	PNGFile loaded(buffer.data(), buffer.size());
+
+	std::vector<uint8_t> temp1;
+	std::string temp2;
+	PNGFile(tiled).decode(temp1, temp2, password);
+
+	// A file cut short doesn't leave its scratch file open
+	bool closed = true;
+#ifndef _WIN32
+	std::vector<uint8_t> truncated = original.save();
+	truncated.resize(truncated.size() / 2);
+	const int before = dup(STDOUT_FILENO);
+	close(before);
+	for (int i = 0; i < 5; ++i) {
+		PNGFile damaged;
+		damaged.setMemoryBudget(4096);
+		damaged.setFastCodec(false);
+		try {
+			damaged.load(truncated);
+			closed = false;
+		}
+		catch (...) { }
+	}
+	const int after = dup(STDOUT_FILENO);
+	close(after);
+	closed = closed && after == before;
+#endif
+	return closed && tiled.isTiled() && !loaded.isTiled() &&
+	       loaded.getPixels() == container.getPixels() &&
+	       temp1 == encodedData &&
+	       temp2 == encodedExtension;
+}
+
+bool testBitmapEncode() {
+	// Store the original image as a 24-bit BMP, pixels go in the same order
+	const std::string filename = "bitmap-test.bmp";
+	const uint32_t width = original.getWidth(), height = original.getHeight();
+	const uint32_t rowBytes = (width * 3 + 3) / 4 * 4;
+	BITMAPFILEHEADER fileHeader = { 0x4D42, 0, 0, 0, sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER) };
+	BITMAPINFOHEADER infoHeader = { sizeof(BITMAPINFOHEADER), static_cast<int32_t>(width), static_cast<int32_t>(height),
+	                                1, 24, BI_RGB, rowBytes * height, 0, 0, 0, 0 };
+	fileHeader.bfSize = fileHeader.bfOffBits + infoHeader.biSizeImage;
+
+	std::vector<uint8_t> rows(infoHeader.biSizeImage);
+	for (uint32_t i = 0; i < width * height; ++i) {
+		PNGFile::Pixel pixel = original.getPixel(i);
+		uint8_t *bgr = &rows[i / width * rowBytes + i % width * 3];
+		bgr[0] = pixel.blue;
+		bgr[1] = pixel.green;
+		bgr[2] = pixel.red;
+	}
+	{
+		std::ofstream file(filename, std::ios::binary | std::ios::trunc);
+		file.write(reinterpret_cast<const char*>(&fileHeader), sizeof(fileHeader));
+		file.write(reinterpret_cast<const char*>(&infoHeader), sizeof(infoHeader));
+		file.write(reinterpret_cast<const char*>(rows.data()), rows.size());
+	}
+
+	// LSBs have to end up exactly where they are in a PNG container
+	bool result = true;
+	{
+		BitmapFile bitmap(filename);
+		bitmap.setCSPRNG(std::bind(memset, std::placeholders::_1,
+		                             0x7F, std::placeholders::_2));
+		bitmap.encode(encodedData, encodedExtension, password);
+	}
+	{
+		std::ifstream file(filename, std::ios::binary);
+		file.seekg(fileHeader.bfOffBits);
+		file.read(reinterpret_cast<char*>(rows.data()), rows.size());
+		for (uint32_t i = 0; i < width * height && result; ++i) {
+			PNGFile::Pixel pixel = container.getPixel(i);
+			const uint8_t *bgr = &rows[i / width * rowBytes + i % width * 3];
+			result = bgr[0] == pixel.blue && bgr[1] == pixel.green && bgr[2] == pixel.red;
+		}
+	}
+
+	std::vector<uint8_t> temp1;
+	std::string temp2;
+	BitmapFile(filename, false).decode(temp1, temp2, password);
+	std::remove(filename.c_str());
+	return result &&
+	       temp1 == encodedData &&
+	       temp2 == encodedExtension;
+}
+
+bool testStegoEngine() {
+	MemoryStore store(static_cast<uint64_t>(original.getWidth()) * original.getHeight(),
+	                  original.getFormat(), SampleLayout::Interleaved);
+	store.samples() = original.getPixels();
+
+	StegoEngine engine;
+	engine.setCSPRNG(std::bind(memset, std::placeholders::_1,
+	                             0x7F, std::placeholders::_2));
+	engine.embed(store, encodedData, encodedExtension, password);
+
+	std::vector<uint8_t> temp1;
+	std::string temp2;
+	StegoEngine other;
+	other.load(store);
+	other.extract(store, temp1, temp2, password);
+	return store.samples() == container.getPixels() &&
+	       temp1 == encodedData &&
+	       temp2 == encodedExtension;
+}
+
+bool testHeaders() {
+	std::vector<uint8_t> data;
+	std::string extension;
+	// Extensions of 128 characters and more fit into the 5-byte header all containers used to have
+	const std::string longExtension(200, 'x');
+	for (EmbeddingProfile profile : { EmbeddingProfile::Sparse, EmbeddingProfile::Dense }) {
+		PNGFile image(original);
+		image.setEmbeddingProfile(profile);
+		image.encode(encodedData, longExtension, password);
+		image.decode(data, extension, password);
+		if (data != encodedData || extension != longExtension)
+			return false;
+	}
+	// Profiles other than Sparse go with the extended header and its 64-bit size
+	PNGFile extended(original);
+	extended.setEmbeddingProfile(EmbeddingProfile::Dense);
+	extended.encode(encodedData, std::string(255, 'y'), password);
+	const std::vector<uint8_t> buffer = extended.save();
+	PNGFile loaded(buffer.data(), buffer.size());
+	loaded.decode(data, extension, password);
+	if (data != encodedData || extension != std::string(255, 'y'))
+		return false;
+	try {
+		extended.encode(encodedData, std::string(256, 'z'), password);
+		return false;
+	}
+	catch (const std::invalid_argument&) { }
+
+	// A wrong key gives a header that makes no sense, or one that runs past an image too small for it
+	bool rejected = false;
+	try {
+		loaded.decode(data, extension, "wrong");
+	}
+	catch (const KeyError &e) {
+		rejected = std::string(e.what()) == "Corrupted header";
+	}
+	if (!rejected)
+		return false;
+	MemoryStore tiny(16, PixelFormat::RGB, SampleLayout::Interleaved);
+	try {
+		StegoEngine().extract(tiny, data, extension, password);
+	}
+	catch (const KeyError &e) {
+		return std::string(e.what()) == "Corrupted header";
+	}
+	return false;
+}
+
+bool testBatch() {
+	container.save("batch-test.png");
+	std::istringstream manifest("# A broken job mustn't stop the others\n"
+	                            "batch-test.png\tbatch-test-1\t" + password + "\n"
+	                            "\n"
+	                            "batch-test-missing.png\tbatch-test-2\t" + password + "\n"
+	                            "{\"container\": \"batch-test.png\", \"file\": \"batch-test-3\", \"key\": \"" + password + "\"}\n");
+	std::vector<BatchJob> jobs = readManifest(manifest);
+
+	JobOptions options = { false, 0, EmbeddingProfile::Sparse };
+	size_t reports = 0;
+	std::string failedContainer;
+	size_t failed = runBatch(jobs, 2, [&options](BatchJob &job) {
+		decodeJob(job, options);
+	}, [&](const BatchJob &job, const std::string &error) {
+		++reports;
+		if (!error.empty())
+			failedContainer = job.container;
+	});
+
+	bool result = jobs.size() == 3 && jobs[1].line == 4 && failed == 1 && reports == 3 &&
+	              failedContainer == "batch-test-missing.png" && jobs[0].key.find_first_not_of('\0') == std::string::npos;
+	for (const std::string filename : { "batch-test-1.txt", "batch-test-3.txt" }) {
+		std::ifstream file(filename, std::ios::binary);
+		std::vector<uint8_t> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+		result = result && data == encodedData;
+		file.close();
+		std::remove(filename.c_str());
+	}
+	std::remove("batch-test.png");
+	return result;
+}
+
+bool testBatchPipeline() {
+	original.save("pipeline-test.png");
+	writeFile("pipeline-test.txt", encodedData.data(), encodedData.size());
+
+	// One queued job at a time, so the failed one has to make its way through the stages too
+	std::vector<BatchJob> jobs = {
+		{ 1, "pipeline-test.png", "pipeline-test-missing.txt", password },
+		{ 2, "pipeline-test.png", "pipeline-test.txt", password }
+	};
+	JobOptions options = { false, 0, EmbeddingProfile::Sparse };
+	PipelineLimits limits = pipelineLimits(2, 1, 1);
+	size_t failed = encodeBatch(jobs, options, limits, nullptr);
+
+	jobs = { { 1, "pipeline-test (copy).png", "pipeline-test-out", password } };
+	failed += decodeBatch(jobs, options, limits, nullptr);
+
+	std::vector<uint8_t> data = readFile("pipeline-test-out.txt");
+	std::remove("pipeline-test.png");
+	std::remove("pipeline-test.txt");
+	std::remove("pipeline-test (copy).png");
+	std::remove("pipeline-test-out.txt");
+	return failed == 1 && data == encodedData;
+}
+
+bool testDaemon() {
+#ifdef _WIN32
+	return true;
+#else
+	const std::string socketPath = "daemon-test.sock";
+	original.save("daemon-test.png");
+	writeFile("daemon-test.txt", encodedData.data(), encodedData.size());
+	// Too much for the daemon's sparse profile, not for a dense one
+	std::vector<uint8_t> denseData(original.capacity(1) * 3 / 2);
+	std::mt19937 gen(11);
+	for (uint8_t &byte : denseData)
+		byte = static_cast<uint8_t>(gen());
+	writeFile("daemon-dense.txt", denseData.data(), denseData.size());
+
+	sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	memcpy(address.sun_path, socketPath.c_str(), socketPath.size());
+	// A socket left behind by a daemon that's gone gets replaced
+	const int stale = socket(AF_UNIX, SOCK_STREAM, 0);
+	bind(stale, reinterpret_cast<sockaddr*>(&address), sizeof(address));
+	close(stale);
+
+	JobOptions options = { false, 0, EmbeddingProfile::Sparse };
+	Daemon daemon(socketPath, 2, options);
+	daemon.setIdleTimeout(1000);
+	std::thread server([&daemon]() {
+		daemon.serve();
+	});
+	// Clients that connect and never send anything
+	auto idleClient = [&address]() {
+		int connection = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (connect(connection, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+			close(connection);
+			return -1;
+		}
+		return connection;
+	};
+	// Both workers get one, they're let go once it's been idle for too long
+	const int idle[2] = { idleClient(), idleClient() };
+
+	// Neither a file that isn't a socket nor a running daemon's socket gets taken over
+	bool refused = true;
+	for (const std::string &path : { std::string("daemon-test.txt"), socketPath }) {
+		try {
+			Daemon other(path, 1, options);
+			refused = false;
+		}
+		catch (const std::runtime_error&) { }
+	}
+	refused = refused && readFile("daemon-test.txt") == encodedData;
+
+	DaemonRequest probe = { DaemonOp::Probe, false, "daemon-test.png", "", "", false, EmbeddingProfile::Sparse };
+	DaemonRequest encode = { DaemonOp::Encode, false, "daemon-test.png", "daemon-test.txt", password, false, EmbeddingProfile::Sparse };
+	DaemonRequest decode = { DaemonOp::Decode, false, "daemon-test (copy).png", "daemon-test-out", password, false, EmbeddingProfile::Sparse };
+	DaemonRequest missing = { DaemonOp::Decode, false, "daemon-test-missing.png", "daemon-test-out", password, false, EmbeddingProfile::Sparse };
+	DaemonRequest sparse = { DaemonOp::Encode, false, "daemon-test.png", "daemon-dense.txt", password, false, EmbeddingProfile::Dense };
+	DaemonRequest dense = { DaemonOp::Encode, false, "daemon-test.png", "daemon-dense.txt", password, true, EmbeddingProfile::Dense };
+	DaemonRequest denseDecode = { DaemonOp::Decode, false, "daemon-test (copy).png", "daemon-dense-out", password, false, EmbeddingProfile::Sparse };
+	DaemonReply probed = Daemon::request(socketPath, probe);
+	DaemonReply encoded = Daemon::request(socketPath, encode);
+	DaemonReply decoded = Daemon::request(socketPath, decode);
+	DaemonReply failed = Daemon::request(socketPath, missing);
+	// The request's profile is used over the daemon's only when it's been set
+	DaemonReply tooLarge = Daemon::request(socketPath, sparse);
+	DaemonReply denseEncoded = Daemon::request(socketPath, dense);
+	DaemonReply denseDecoded = Daemon::request(socketPath, denseDecode);
+
+	// A connection waiting for its next request doesn't hold up stopping
+	const int waiting = idleClient();
+	std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	const auto stopped = std::chrono::steady_clock::now();
+	daemon.stop();
+	server.join();
+	const bool promptly = std::chrono::steady_clock::now() - stopped < std::chrono::milliseconds(900);
+	for (int connection : { idle[0], idle[1], waiting })
+		close(connection);
+
+	std::vector<uint8_t> data = readFile("daemon-test-out.txt");
+	std::vector<uint8_t> denseOut = denseDecoded.ok ? readFile("daemon-dense-out.txt") : std::vector<uint8_t>();
+	std::remove("daemon-test.png");
+	std::remove("daemon-test.txt");
+	std::remove("daemon-test (copy).png");
+	std::remove("daemon-test-out.txt");
+	std::remove("daemon-dense.txt");
+	std::remove("daemon-dense-out.txt");
+	return probed.ok && probed.message == "png " + std::to_string(original.getWidth()) + "x" +
+	                                      std::to_string(original.getHeight()) + " " + std::to_string(channelCount(original.getFormat())) &&
+	       encoded.ok && encoded.message == "daemon-test (copy).png" &&
+	       decoded.ok && data == encodedData &&
+	       !failed.ok && !failed.message.empty() &&
+	       !tooLarge.ok && denseEncoded.ok && denseDecoded.ok && denseOut == denseData &&
+	       idle[0] != -1 && idle[1] != -1 && waiting != -1 && promptly && refused;
+#endif
+}
+
+bool testCAPI() {
+	std::vector<uint8_t> png = original.save();
+	pngstego_info probed, info;
+	pngstego_image *image = nullptr;
+	uint8_t *encoded = nullptr, *data = nullptr, *wrongData = nullptr;
+	size_t encodedSize = 0, size = 0, wrongSize = 0;
+	char *extension = nullptr;
+
+	bool result = pngstego_probe(png.data(), png.size(), &probed) == PNGSTEGO_OK &&
+	              pngstego_create(&image) == PNGSTEGO_OK &&
+	              pngstego_load(image, png.data(), png.size()) == PNGSTEGO_OK &&
+	              pngstego_encode(image, encodedData.data(), encodedData.size(), encodedExtension.c_str(),
+	                              password.c_str(), password.size()) == PNGSTEGO_OK &&
+	              pngstego_save(image, &encoded, &encodedSize) == PNGSTEGO_OK &&
+	              pngstego_load(image, encoded, encodedSize) == PNGSTEGO_OK &&
+	              pngstego_get_info(image, &info) == PNGSTEGO_OK &&
+	              pngstego_decode(image, password.c_str(), password.size(), &data, &size, &extension) == PNGSTEGO_OK &&
+	              std::vector<uint8_t>(data, data + size) == encodedData && extension == encodedExtension &&
+	              probed.width == original.getWidth() && probed.height == original.getHeight() &&
+	              info.channels == channelCount(original.getFormat()) &&
+	              pngstego_decode(image, "wrong", 5, &wrongData, &wrongSize, nullptr) == PNGSTEGO_ERROR_KEY && !wrongData &&
+	              pngstego_load(image, encodedData.data(), encodedData.size()) == PNGSTEGO_ERROR_FORMAT &&
+	              *pngstego_last_error() != '\0';
+
+	// A palette with transparency is RGBA once it's decoded, its header only says it's a palette
+	const std::vector<uint8_t> colors = { 0, 0, 0, 255, 255, 255 }, alphas = { 0 };
+	const FastPNG::Image transparent = { 16, 16, 8, 3, &colors, &alphas };
+	std::vector<uint8_t> indices(16), palettePNG;
+	for (size_t i = 0; i < indices.size(); ++i)
+		indices[i] = i % 2;
+	FastPNG::encode(transparent, [&indices](uint32_t) { return indices.data(); },
+	                [&palettePNG](const uint8_t *bytes, size_t length) { palettePNG.insert(palettePNG.end(), bytes, bytes + length); });
+	result = result && pngstego_probe(palettePNG.data(), palettePNG.size(), &probed) == PNGSTEGO_OK && probed.channels == 3 &&
+	         pngstego_load(image, palettePNG.data(), palettePNG.size()) == PNGSTEGO_OK &&
+	         pngstego_get_info(image, &info) == PNGSTEGO_OK && info.channels == 4 && info.bit_depth == 8;
+
+	pngstego_free(extension, extension ? strlen(extension) : 0);
+	pngstego_free(data, size);
+	pngstego_free(encoded, encodedSize);
+	pngstego_destroy(image);
+	return result;
+}
+
+bool testAsync() {
+	WorkStealingPool pool(2);
+	PNGFile image(original);
+	image.encodeAsync(encodedData, encodedExtension, password, pool).get();
+
+	// Decodes of the same image may overlap, one of them with a wrong key
+	std::vector<std::future<Payload>> decoded;
+	for (int k = 0; k < 4; ++k)
+		decoded.push_back(image.decodeAsync(k == 3 ? "wrong" : password, k % 2 ? WorkStealingPool::shared() : pool));
+
+	bool result = true;
+	for (int k = 0; k < 3; ++k) {
+		Payload payload = decoded[k].get();
+		result = result && payload.data == encodedData && payload.extension == encodedExtension;
+	}
+	try {
+		decoded[3].get();
+		result = false;
+	}
+	catch (const std::exception&) { }
+	return result;
+}
+
+bool testCancellation() {
+	PNGFile image(original);
+	image.encode(encodedData, encodedExtension, password);
+
+	// Cancelled halfway through key derivation, from another thread
+	CancellationToken token;
+	std::thread canceller([&token]() {
+		std::this_thread::sleep_for(std::chrono::milliseconds(20));
+		token.cancel();
+	});
+	bool cancelled = false;
+	try {
+		Encryption::hashKey<64>(password, salt, token);
+	}
+	catch (const Cancelled&) {
+		cancelled = true;
+	}
+	canceller.join();
+
+	// A deadline that's passed while the work's been waiting
+	CancellationToken expired(CancellationToken::Clock::now());
+	bool timedOut = false;
+	try {
+		image.decodeAsync(password, WorkStealingPool::shared(), expired).get();
+	}
+	catch (const Cancelled&) {
+		timedOut = true;
+	}
+
+	std::vector<uint8_t> data;
+	std::string extension;
+	image.decode(data, extension, password, CancellationToken(std::chrono::hours(1)));
+	return cancelled && timedOut && token.isCancelled() && !CancellationToken::none().isCancelled() &&
+	       data == encodedData && extension == encodedExtension;
+}
+
+bool testStageEvents() {
+	std::vector<StageEvent> events;
+	size_t started = 0;
+	PNGFile image(original);
+	image.setEventFn([&](const StageEvent &event) {
+		if (event.finished)
+			events.push_back(event);
+		else
+			++started;
+	});
+	image.encode(encodedData, encodedExtension, password);
+	image.load(image.save());
+	std::vector<uint8_t> data;
+	std::string extension;
+	image.decode(data, extension, password);
+
+	const std::vector<Stage> expected = { Stage::KDFSeed, Stage::Compress, Stage::KDFKey, Stage::Encrypt, Stage::Embed,
+	                                      Stage::Save, Stage::Load,
+	                                      Stage::KDFSeed, Stage::Extract, Stage::KDFKey, Stage::Decrypt, Stage::Decompress };
+	bool result = events.size() == expected.size() && started == expected.size();
+	for (size_t k = 0; result && k < events.size(); ++k) {
+		result = events[k].stage == expected[k] && events[k].end >= events[k].start &&
+		         events[k].thread == std::this_thread::get_id();
+	}
+	return result && events[1].inputBytes == encodedData.size() + encodedExtension.size() &&
+	       events[6].outputBytes == events[5].inputBytes &&
+	       events.back().outputBytes == encodedData.size() + encodedExtension.size() &&
+	       std::string(stageName(Stage::KDFSeed)) == "kdf-seed";
+}
+
+bool testMetrics() {
+	Metrics &metrics = Metrics::global();
+	const MetricsSnapshot before = metrics.snapshot();
+	std::vector<uint8_t> data;
+	std::string extension;
+	{
+		PNGFile image(original);
+		image.encode(encodedData, encodedExtension, password);
+		image.decode(data, extension, password);
+		try {
+			image.decode(data, extension, "wrong");
+		}
+		catch (const KeyError&) { }
+	}
+	{
+		// Bitmaps get counted the same way, here as a binary PPM
+		const std::string filename = "metrics-test.ppm";
+		const uint32_t width = original.getWidth(), height = original.getHeight();
+		{
+			std::ofstream file(filename, std::ios::binary | std::ios::trunc);
+			file << "P6\n" << width << " " << height << "\n255\n";
+			for (uint32_t i = 0; i < width * height; ++i) {
+				PNGFile::Pixel pixel = original.getPixel(i);
+				file.put(static_cast<char>(pixel.red)).put(static_cast<char>(pixel.green)).put(static_cast<char>(pixel.blue));
+			}
+		}
+		BitmapFile bitmap(filename);
+		bitmap.encode(encodedData, encodedExtension, password);
+		bitmap.decode(data, extension, password);
+		try {
+			bitmap.decode(data, extension, "wrong");
+		}
+		catch (const KeyError&) { }
+		std::remove(filename.c_str());
+	}
+	// A shard of another thread has to be added up too
+	std::thread([&metrics]() { metrics.recordStage(Stage::Write, 1500, 1, 1); }).join();
+	const MetricsSnapshot after = metrics.snapshot();
+
+	const size_t encode = static_cast<size_t>(Operation::Encode), decode = static_cast<size_t>(Operation::Decode);
+	const size_t embed = static_cast<size_t>(Stage::Embed), write = static_cast<size_t>(Stage::Write);
+	std::ostringstream prometheus, json;
+	after.write(prometheus, MetricsFormat::Prometheus);
+	after.write(json, MetricsFormat::JSON);
+	return after.operations[encode] == before.operations[encode] + 2 &&
+	       after.operations[decode] == before.operations[decode] + 4 &&
+	       after.failures[decode][static_cast<size_t>(FailureCause::CorruptedHeader)] ==
+	       before.failures[decode][static_cast<size_t>(FailureCause::CorruptedHeader)] + 2 &&
+	       after.stages[embed].count == before.stages[embed].count + 2 &&
+	       after.embeddedBytes() > before.embeddedBytes() &&
+	       after.stages[write].buckets[Histogram::bucket(1500)] == before.stages[write].buckets[Histogram::bucket(1500)] + 1 &&
+	       Histogram::bucketLimit(Histogram::bucket(1500)) >= 1500 && Histogram::bucketLimit(Histogram::bucket(1500)) < 1600 &&
+	       after.peakPixelBytes >= after.pixelBytes && after.pixelBytes == before.pixelBytes &&
+	       prometheus.str().find("pngstego_stage_duration_seconds_count{stage=\"embed\"}") != std::string::npos &&
+	       json.str().find("\"corrupted-header\"") != std::string::npos &&
+	       metricsFormatFor("metrics.json") == MetricsFormat::JSON;
+}
+
+bool testPayloadBuffer() {
+	const MetricsSnapshot before = Metrics::global().snapshot();
+	const std::string extension = "txt";
+	std::vector<uint8_t> data;
+	{
+		PayloadBuffer buffer;
+		buffer.reserve(bzip2::compressBound(extension.size() + encodedData.size()));
+		const uint8_t *start = buffer.data();
+		bzip2::compress({ { reinterpret_cast<const uint8_t*>(extension.data()), extension.size() },
+		                  { encodedData.data(), encodedData.size() } }, buffer);
+		// Compressing within the bound never moves the buffer
+		if (buffer.data() != start)
+			return false;
+		PayloadBuffer decompressed;
+		bzip2::decompress(buffer.data(), buffer.size(), decompressed);
+		buffer.release();
+		if (decompressed.size() != extension.size() + encodedData.size() ||
+		    memcmp(decompressed.data(), extension.data(), extension.size()))
+			return false;
+		decompressed.consume(extension.size());
+		decompressed.moveTo(data);
+	}
+	// Encrypting in place gives what the vector functions give
+	const Encryption::DerivedKey key = Encryption::deriveKey(password, std::vector<uint8_t>(32, 1));
+	const std::vector<uint8_t> iv(16, 2);
+	PayloadBuffer inPlace;
+	inPlace.append(data.data(), data.size());
+	Encryption::encrypt(inPlace, key, iv);
+	const std::vector<uint8_t> encrypted = Encryption::encrypt(data, key, iv);
+	if (inPlace.size() != encrypted.size() || memcmp(inPlace.data(), encrypted.data(), encrypted.size()))
+		return false;
+	Encryption::decrypt(inPlace, key, iv);
+	inPlace.release();
+
+	const MetricsSnapshot after = Metrics::global().snapshot();
+	return data == encodedData && after.payloadBytes == before.payloadBytes &&
+	       after.peakPayloadBytes >= bzip2::compressBound(extension.size() + encodedData.size()) &&
+	       after.peakWorkingBytes >= after.peakPayloadBytes;
+}
+
+bool testSecurePool() {
+	SecurePool &pool = SecurePool::global();
+	const SecurePoolStatistics before = pool.statistics();
+	const size_t size = SecurePool::blockSize(100000);
+	if (size < 100000 || (size & (size - 1)) || SecurePool::blockSize(size) != size)
+		return false;
+
+	// A released block is wiped and handed to the next allocation of its size
+	uint8_t *block = static_cast<uint8_t*>(pool.allocate(100000));
+	memset(block, 0xAB, size);
+	pool.deallocate(block, 100000);
+	uint8_t *reused = static_cast<uint8_t*>(pool.allocate(size));
+	const bool wiped = reused == block && std::all_of(reused, reused + size, [](uint8_t b) { return b == 0; });
+	pool.deallocate(reused, size);
+
+	bool contents;
+	{
+		SecureBytes bytes(encodedData.begin(), encodedData.end());
+		SecureString key(password.begin(), password.end());
+		SecureObject<Encryption::DerivedKey> derived;
+		contents = std::equal(bytes.begin(), bytes.end(), encodedData.begin()) && key == password.c_str() &&
+		           std::all_of(derived->begin(), derived->end(), [](uint8_t b) { return b == 0; });
+	}
+	const SecurePoolStatistics used = pool.statistics();
+	pool.trim();
+	const SecurePoolStatistics after = pool.statistics();
+	return wiped && contents && used.hits > before.hits && used.liveBytes == before.liveBytes &&
+	       after.cachedBytes == 0 && after.lockedBytes <= after.liveBytes;
+}
+
+bool testUndo() {
+	PNGFile cover(original);
+	const std::vector<uint8_t> pristine = cover.save();
+	std::vector<uint8_t> data;
+	std::string extension;
+
+	// Encodes in turn into one cover, each one undone before the next
+	cover.recordChanges();
+	for (int i = 0; i < 2; ++i) {
+		cover.encode(encodedData, encodedExtension, password);
+		cover.decode(data, extension, password);
+		if (data != encodedData || extension != encodedExtension)
+			return false;
+		cover.restore();
+		if (cover.save() != pristine)
+			return false;
+	}
+	cover.recordChanges(false);
+
+	// Snapshots share pixels with the cover until they're encoded into
+	PNGFile first = cover.snapshot(), second = first.snapshot();
+	first.encode(encodedData, encodedExtension, password);
+	second.encode(encodedData, "bin", password);
+	first.decode(data, extension, password);
+	bool snapshots = data == encodedData && extension == encodedExtension;
+	second.decode(data, extension, password);
+	snapshots = snapshots && data == encodedData && extension == "bin";
+
+	// Decoding a snapshot reads tiles it shares where they are, none gets copied
+	PNGFile encoded(original);
+	encoded.encode(encodedData, encodedExtension, password);
+	PNGFile reader = encoded.snapshot();
+	const uint64_t pixelBytes = Metrics::global().snapshot().pixelBytes;
+	reader.decode(data, extension, password);
+	snapshots = snapshots && data == encodedData && Metrics::global().snapshot().pixelBytes == pixelBytes;
+	return snapshots && cover.save() == pristine && first.save() != pristine;
+}
+
+bool testEmbeddingProfiles() {
+	std::vector<uint8_t> payload(4096);
+	std::mt19937 gen(7);
+	for (uint8_t &byte : payload)
+		byte = static_cast<uint8_t>(gen());
+	const uint64_t sparse = original.capacity(1);
+
+	for (EmbeddingProfile profile : { EmbeddingProfile::Dense, EmbeddingProfile::Dense2 }) {
+		PNGFile image(original);
+		image.setEmbeddingProfile(profile);
+		const uint64_t dense = image.capacity(1);
+		if (dense < sparse * (profile == EmbeddingProfile::Dense ? 2 : 5))
+			return false;
+		image.encode(payload, "bin", password);
+		// The profile comes from the header, a decoder doesn't have to be told
+		const std::vector<uint8_t> saved = image.save();
+		PNGFile decoded(saved.data(), saved.size());
+		std::vector<uint8_t> data;
+		std::string extension;
+		decoded.decode(data, extension, password);
+		if (data != payload || extension != "bin")
+			return false;
+	}
+	return embeddingProfileFromName("dense2") == EmbeddingProfile::Dense2;
+}
+
+bool testSixteenBit() {
+	if (deep.getBitDepth() != 16)
+		return false;
+	// Saving an image that hasn't been encoded into gives back the very same samples
+	std::vector<uint8_t> untouched = PNGFile(deep).save();
+	PNGFile reloaded(untouched.data(), untouched.size());
+	if (reloaded.getBitDepth() != 16 || reloaded.getPixels() != deep.getPixels())
+		return false;
+
+	for (SampleLayout layout : { SampleLayout::Interleaved, SampleLayout::Planar }) {
+		PNGFile copy(deep);
+		copy.setSampleLayout(layout);
+		copy.encode(encodedData, encodedExtension, password);
+		std::vector<uint8_t> buffer = copy.save();
+		PNGFile loaded(buffer.data(), buffer.size());
+		const std::vector<uint8_t> &before = deep.getPixels(), &after = loaded.getPixels();
+		if (before.size() != after.size())
+			return false;
+		// Samples are big-endian, high bytes come first and never change
+		for (size_t i = 0; i < before.size(); i += 2)
+			if (before[i] != after[i])
+				return false;
+		std::vector<uint8_t> data;
+		std::string extension;
+		loaded.decode(data, extension, password);
+		if (data != encodedData || extension != encodedExtension)
+			return false;
+	}
+	return true;
+}
+
+bool testColorReduction() {
+	// Bytes 24 and 25 of a PNG file are the bit depth and the color type of its IHDR chunk
+	const uint8_t PALETTE_COLOR_TYPE = 3;
+	PNGFile copy(palette);
+	std::vector<uint8_t> untouched = copy.save();
+	if (untouched.size() < 26 || untouched[24] != 4 || untouched[25] != PALETTE_COLOR_TYPE)
+		return false;
+
+	// Flipped bits add colors, a palette still has room for them
+	std::vector<uint8_t> payload(64, 'p');
+	copy.encode(payload, "txt", password);
+	std::vector<uint8_t> buffer = copy.save();
+	if (buffer[25] != PALETTE_COLOR_TYPE)
+		return false;
+	PNGFile loaded(buffer.data(), buffer.size());
+	std::vector<uint8_t> data;
+	std::string extension;
+	loaded.decode(data, extension, password);
+	if (loaded.getPixels() != copy.getPixels() || data != payload || extension != "txt")
+		return false;
+
+	// Too many colors for a palette, the image stays RGB
+	buffer = PNGFile(original).save();
+	return buffer[25] == 2;
+}
+
+bool testFastCodec() {
+	for (const PNGFile *image : { &original, &grayscale, &palette }) {
+		PNGFile slow(*image);
+		slow.setFastCodec(false);
+		const std::vector<uint8_t> reference = slow.save(), fast = PNGFile(*image).save();
+
+		// Either way of reading either file gives back the same pixels
+		for (const std::vector<uint8_t> *buffer : { &reference, &fast }) {
+			for (SampleLayout layout : { SampleLayout::Interleaved, SampleLayout::Planar }) {
+				PNGFile withLibpng, withZlib;
+				withLibpng.setFastCodec(false);
+				withLibpng.setSampleLayout(layout);
+				withZlib.setSampleLayout(layout);
+				withLibpng.load(*buffer);
+				withZlib.load(*buffer);
+				if (withZlib.getPixels() != withLibpng.getPixels() || withZlib.getFormat() != withLibpng.getFormat())
+					return false;
+			}
+		}
+	}
+
+	// A damaged file still gets turned down
+	std::vector<uint8_t> buffer = container.save();
+	buffer[buffer.size() / 2] ^= 0x55;
+	try {
+		PNGFile damaged(buffer.data(), buffer.size());
+	}
+	catch (...) {
+		return true;
+	}
+	return false;
 }
\ No newline at end of file